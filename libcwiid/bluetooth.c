@@ -24,142 +24,185 @@
 #include <bluetooth/hci_lib.h>
 #include "cwiid_internal.h"
 
+static int hci_backend_get_route(void);
+static int hci_backend_inquiry(int dev_id, unsigned int timeout,
+                               int max_bdinfo, struct cwiid_bdinfo *bdinfo);
+
+static const struct cwiid_hci_backend hci_backend_default = {
+	hci_backend_get_route,
+	hci_backend_inquiry
+};
+
+static const struct cwiid_hci_backend *hci_backend = &hci_backend_default;
+
+int cwiid_set_hci_backend(const struct cwiid_hci_backend *backend)
+{
+	if (backend == NULL) {
+		backend = &hci_backend_default;
+	}
+	/* Inquiry threads may be reading it */
+	__atomic_store_n(&hci_backend, backend, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int hci_backend_get_route(void)
+{
+	return hci_get_route(NULL);
+}
+
+/* timeout in 1.28 second units */
+static int hci_backend_inquiry(int dev_id, unsigned int timeout,
+                               int max_bdinfo, struct cwiid_bdinfo *bdinfo)
+{
+	inquiry_info *dev_list = NULL;
+	int sock;
+	int dev_count;
+	int i;
+
+	/* Open connection to Bluetooth Interface */
+	sock = hci_open_dev(dev_id);
+	if (sock < 0) {
+		cwiid_err(NULL, "Bluetooth interface open error: %s", strerror(errno));
+		return -1;
+	}
+
+	/* Get Bluetooth Device List */
+	dev_count = hci_inquiry(dev_id, timeout, max_bdinfo, NULL, &dev_list,
+	                        IREQ_CACHE_FLUSH);
+	if (dev_count < 0) {
+		cwiid_err(NULL, "Bluetooth device inquiry error: %s", strerror(errno));
+	}
+
+	for (i=0; i < dev_count && i < max_bdinfo; i++) {
+		memset(&bdinfo[i], 0, sizeof bdinfo[i]);
+		bacpy(&bdinfo[i].bdaddr, &dev_list[i].bdaddr);
+		memcpy(bdinfo[i].btclass, dev_list[i].dev_class,
+		       sizeof bdinfo[i].btclass);
+	}
+
+	bt_free(dev_list);
+	hci_close_dev(sock);
+
+	return (dev_count < 0) ? -1 : i;
+}
+
+int bdinfo_is_wiimote(const struct cwiid_bdinfo *bdinfo)
+{
+	return (bdinfo->btclass[0] == WIIMOTE_CLASS_0) &&
+	       (bdinfo->btclass[1] == WIIMOTE_CLASS_1) &&
+	       (bdinfo->btclass[2] == WIIMOTE_CLASS_2);
+}
+
+int hci_route(int dev_id)
+{
+	/* If not given (=-1), get the first available Bluetooth interface */
+	if (dev_id == -1) {
+		dev_id = __atomic_load_n(&hci_backend, __ATOMIC_ACQUIRE)->get_route();
+		if (dev_id < 0) {
+			cwiid_err(NULL, "No Bluetooth interface found");
+			return -1;
+		}
+	}
+
+	return dev_id;
+}
+
+int hci_inquire(int dev_id, unsigned int timeout, int max_bdinfo,
+                struct cwiid_bdinfo *bdinfo)
+{
+	const struct cwiid_hci_backend *backend =
+	  __atomic_load_n(&hci_backend, __ATOMIC_ACQUIRE);
+
+	return backend->inquiry(dev_id, timeout, max_bdinfo, bdinfo);
+}
+
 /* When filtering wiimotes, in order to avoid having to store the
  * remote names before the blue_dev array is malloced (because we don't
  * yet know how many wiimotes there are, we'll assume there are no more
  * than dev_count, and realloc to the actual number afterwards, since
  * reallocing to a smaller chunk should be fast. */
-#define BT_MAX_INQUIRY 128
 /* timeout in 2 second units */
 int cwiid_get_bdinfo_array(int dev_id, unsigned int timeout, int max_bdinfo,
                            struct cwiid_bdinfo **bdinfo, uint8_t flags)
 {
-	inquiry_info *dev_list = NULL;
+	struct cwiid_bdinfo dev_list[BT_MAX_INQUIRY];
 	int max_inquiry;
 	int dev_count;
-	int sock = -1;
 	int bdinfo_count;
-	int i, j;
-	int err = 0;
-	int ret;
+	int i;
 
 	/* NULLify for the benefit of error handling */
 	*bdinfo = NULL;
 
-	/* If not given (=-1), get the first available Bluetooth interface */
-	if (dev_id == -1) {
-      dev_id = hci_get_route( NULL );
-      if (dev_id < 0) {
-			cwiid_err(NULL, "No Bluetooth interface found");
-			return -1;
-		}
-	}
-
-	/* Open connection to Bluetooth Interface */
-   sock = hci_open_dev( dev_id );
-   if (sock < 0) {
-		cwiid_err(NULL, "Bluetooth interface open error: %s", strerror(errno));
-		err = 1;
-		goto CODA;
+	if ((dev_id = hci_route(dev_id)) == -1) {
+		return -1;
 	}
 
 	/* Get Bluetooth Device List */
-	if ((flags & BT_NO_WIIMOTE_FILTER) && (max_bdinfo != -1)) {
+	if ((flags & BT_NO_WIIMOTE_FILTER) && (max_bdinfo != -1) &&
+	  (max_bdinfo < BT_MAX_INQUIRY)) {
 		max_inquiry = max_bdinfo;
 	}
 	else {
 		max_inquiry = BT_MAX_INQUIRY;
 	}
-   dev_count = hci_inquiry( dev_id, timeout, max_inquiry, NULL, &dev_list, IREQ_CACHE_FLUSH );
-   if (dev_count < 0) {
-		cwiid_err(NULL, "Bluetooth device inquiry error: %s", strerror(errno));
-		err = 1;
-		goto CODA;
+	if ((dev_count = hci_inquire(dev_id, timeout, max_inquiry, dev_list))
+	  == -1) {
+		/* Raises its own error */
+		return -1;
 	}
 
 	if (dev_count == 0) {
-		bdinfo_count = 0;
-		goto CODA;
+		return 0;
 	}
 
 	/* Allocate info list */
 	if (max_bdinfo == -1) {
 		max_bdinfo = dev_count;
 	}
-   *bdinfo = malloc( max_bdinfo * sizeof(**bdinfo) );
-   if (*bdinfo == NULL) {
+	*bdinfo = malloc(max_bdinfo * sizeof(**bdinfo));
+	if (*bdinfo == NULL) {
 		cwiid_err(NULL, "Memory allocation error (bdinfo array)");
-		err = 1;
-		goto CODA;
+		return -1;
 	}
 
 	/* Copy dev_list to bdinfo */
 	for (bdinfo_count=i=0; (i < dev_count) && (bdinfo_count < max_bdinfo); i++) {
-
 		/* Filter by class */
-		if (!(flags & BT_NO_WIIMOTE_FILTER) &&
-		  ((dev_list[i].dev_class[0] != WIIMOTE_CLASS_0) ||
-		   (dev_list[i].dev_class[1] != WIIMOTE_CLASS_1) ||
-		   (dev_list[i].dev_class[2] != WIIMOTE_CLASS_2))) {
-			continue;
-		}
-
-		/* timeout (10000) in milliseconds */
-#if 0
-		if (hci_read_remote_name(sock, &dev_list[i].bdaddr, BT_NAME_LEN,
-		                         (*bdinfo)[bdinfo_count].name, 10000)) {
-			cwiid_err(NULL, "Bluetooth name read error: %s", strerror(errno));
-			err = 1;
-			goto CODA;
-		}
-
-		/* Filter by name */
-		if (!(flags & BT_NO_WIIMOTE_FILTER) &&
-		  (strncmp((*bdinfo)[bdinfo_count].name, WIIMOTE_NAME, BT_NAME_LEN) &&
-		  strncmp((*bdinfo)[bdinfo_count].name, strcat(WIIMOTE_NAME, "-TR"), BT_NAME_LEN)) &&
-		  strncmp((*bdinfo)[bdinfo_count].name, WIIBALANCE_NAME, BT_NAME_LEN)) {
+		if (!(flags & BT_NO_WIIMOTE_FILTER) && !bdinfo_is_wiimote(&dev_list[i])) {
 			continue;
 		}
-#endif
 
 		/* Passed filter, add to bdinfo */
-		bacpy( &(*bdinfo)[bdinfo_count].bdaddr, &dev_list[i].bdaddr );
-		for (j=0; j<3; j++) {
-			(*bdinfo)[bdinfo_count].btclass[j] = dev_list[i].dev_class[j];
-		}
+		memcpy(&(*bdinfo)[bdinfo_count], &dev_list[i], sizeof dev_list[i]);
 		bdinfo_count++;
 	}
 
 	if (bdinfo_count == 0) {
 		free(*bdinfo);
+		*bdinfo = NULL;
 	}
 	else if (bdinfo_count < max_bdinfo) {
-      *bdinfo = realloc(*bdinfo, bdinfo_count * sizeof(**bdinfo) );
-      if (*bdinfo == NULL) {
+		*bdinfo = realloc(*bdinfo, bdinfo_count * sizeof(**bdinfo));
+		if (*bdinfo == NULL) {
 			cwiid_err(NULL, "Memory reallocation error (bdinfo array)");
-			err = 1;
-			goto CODA;
+			return -1;
 		}
 	}
 
-CODA:
-	bt_free(dev_list);
-	if (sock != -1)
-      hci_close_dev(sock);
-	if (err) {
-		if (*bdinfo) free(*bdinfo);
-		ret = -1;
-	}
-	else {
-		ret = bdinfo_count;
-	}
-	return ret;
+	return bdinfo_count;
 }
 
 int cwiid_find_wiimote(bdaddr_t *bdaddr, int timeout)
 {
 	struct cwiid_bdinfo *bdinfo;
 	int bdinfo_count;
+	int ret;
+
+	/* Use the cached table of a running inquiry service, if there is one */
+	if ((ret = inquiry_find_wiimote(bdaddr, timeout)) != 1) {
+		return ret;
+	}
 
 	if (timeout == -1) {
 		while ((bdinfo_count = cwiid_get_bdinfo_array(-1, 2, 1, &bdinfo, 0)) == 0);
@@ -0,0 +1,570 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include "cwiid_internal.h"
+
+/* Calibrated message stream.  Scale factors are worked out once per device
+ * (or extension) by the status thread, which is free to read calibration
+ * memory, so the router thread only does a multiply-add per axis.  The
+ * router owns wiimote->scale: new factors are staged in scale_next under
+ * state_mutex and taken over by the router between reports. */
+
+/* Accelerometer calibration is stored at 8 bits, reports are 10 bits */
+#define ACC_CAL_SHIFT		2
+#define ACC_NOMINAL_ZERO	(0x80 << ACC_CAL_SHIFT)
+#define ACC_NOMINAL_ONE		(0x9A << ACC_CAL_SHIFT)
+
+#define STICK_NOMINAL_CENTER	0x80
+#define STICK_NOMINAL_RANGE		0x64
+
+/* MotionPlus: ~20 counts per deg/s in slow mode, fast mode covers
+ * 2000 deg/s instead of 440 */
+#define GYRO_NOMINAL_ZERO	8192
+#define GYRO_SLOW_GAIN		(1.0f / 20.0f)
+#define GYRO_FAST_GAIN		(GYRO_SLOW_GAIN * 2000.0f / 440.0f)
+
+/* At rest: window variance below these (in raw counts squared), i.e.
+ * roughly 0.5 deg/s and 0.02 g rms.  Once found, the zero point follows
+ * the window mean slowly to track temperature drift. */
+#define GYRO_STILL_RATE_VAR	100
+#define GYRO_STILL_ACC_VAR	4
+#define GYRO_BIAS_RATE		0.01f
+
+/* Balance board calibration points are 0, 17 and 34 kg.  Sensors sit at
+ * the corners of a 433 x 238 mm rectangle. */
+#define BALANCE_REF_KG		17.0f
+#define BALANCE_HALF_WIDTH	216.5f
+#define BALANCE_HALF_LENGTH	119.0f
+#define BALANCE_MIN_WEIGHT	1.0f	/* kg, below this there is no CoP */
+
+static void set_acc_scale(struct acc_scale *scale, const struct acc_cal *cal)
+{
+	int i;
+
+	for (i=0; i < 3; i++) {
+		scale->zero[i] = cal->zero[i] << ACC_CAL_SHIFT;
+		if (cal->one[i] != cal->zero[i]) {
+			scale->gain[i] = 1.0f /
+			  ((cal->one[i] - cal->zero[i]) * (1 << ACC_CAL_SHIFT));
+		}
+		else {
+			scale->gain[i] = 1.0f / (ACC_NOMINAL_ONE - ACC_NOMINAL_ZERO);
+		}
+	}
+}
+
+static void set_stick_scale(struct cal_scale *scale, int axis,
+                            uint8_t max, uint8_t min, uint8_t center)
+{
+	/* Some third party nunchuks report garbage here */
+	if ((min >= center) || (max <= center)) {
+		center = STICK_NOMINAL_CENTER;
+		min = center - STICK_NOMINAL_RANGE;
+		max = center + STICK_NOMINAL_RANGE;
+	}
+
+	scale->stick_center[axis] = center;
+	scale->stick_gain[axis][0] = 1.0f / (center - min);
+	scale->stick_gain[axis][1] = 1.0f / (max - center);
+}
+
+/* Two line segments per sensor, through the 0/17 and 17/34 kg points,
+ * stored as gain and offset so a sample is one multiply-add */
+static void set_balance_scale(struct cal_scale *scale, int sensor,
+                              const uint16_t *cal)
+{
+	float *gain = scale->balance_gain[sensor];
+	float *offset = scale->balance_offset[sensor];
+
+	scale->balance_knee[sensor] = cal[1];
+	gain[0] = (cal[1] > cal[0]) ? BALANCE_REF_KG / (cal[1] - cal[0]) : 0.0f;
+	gain[1] = (cal[2] > cal[1]) ? BALANCE_REF_KG / (cal[2] - cal[1]) : 0.0f;
+	offset[0] = -cal[0] * gain[0];
+	offset[1] = BALANCE_REF_KG - cal[1] * gain[1];
+}
+
+void init_cal_scale(struct wiimote *wiimote)
+{
+	struct acc_cal nominal;
+	int i;
+
+	for (i=0; i < 3; i++) {
+		nominal.zero[i] = ACC_NOMINAL_ZERO >> ACC_CAL_SHIFT;
+		nominal.one[i] = ACC_NOMINAL_ONE >> ACC_CAL_SHIFT;
+		wiimote->scale.gyro_zero[i] = GYRO_NOMINAL_ZERO;
+	}
+	set_acc_scale(&wiimote->scale.acc, &nominal);
+	set_acc_scale(&wiimote->scale.nunchuk, &nominal);
+	for (i=0; i < 2; i++) {
+		set_stick_scale(&wiimote->scale, i, 0, 0, 0);
+	}
+	wiimote->scale.gyro_gain[0] = GYRO_FAST_GAIN;
+	wiimote->scale.gyro_gain[1] = GYRO_SLOW_GAIN;
+	memset(&wiimote->gyro_bias, 0, sizeof wiimote->gyro_bias);
+	wiimote->gyro_cal_valid = 0;
+	memset(wiimote->scale.balance_knee, 0, sizeof wiimote->scale.balance_knee);
+	memset(wiimote->scale.balance_gain, 0,
+	       sizeof wiimote->scale.balance_gain);
+	memset(wiimote->scale.balance_offset, 0,
+	       sizeof wiimote->scale.balance_offset);
+	memset(wiimote->scale.balance_tare, 0,
+	       sizeof wiimote->scale.balance_tare);
+	memset(&wiimote->balance_tare, 0, sizeof wiimote->balance_tare);
+	wiimote->balance_tare.count = -1;
+
+	wiimote->scale_next = wiimote->scale;
+	wiimote->scale_valid = 0;
+	wiimote->scale_pending = 0;
+	wiimote->scale_active = 0;
+}
+
+static void copy_cal_scale(struct cal_scale *dst, const struct cal_scale *src,
+                           uint8_t flags)
+{
+	if (flags & CAL_ACC) {
+		dst->acc = src->acc;
+	}
+	if (flags & CAL_NUNCHUK) {
+		dst->nunchuk = src->nunchuk;
+		memcpy(dst->stick_center, src->stick_center, sizeof dst->stick_center);
+		memcpy(dst->stick_gain, src->stick_gain, sizeof dst->stick_gain);
+	}
+	if (flags & CAL_BALANCE) {
+		memcpy(dst->balance_knee, src->balance_knee,
+		       sizeof dst->balance_knee);
+		memcpy(dst->balance_gain, src->balance_gain,
+		       sizeof dst->balance_gain);
+		memcpy(dst->balance_offset, src->balance_offset,
+		       sizeof dst->balance_offset);
+	}
+}
+
+/* Hand sections of next to the router, unless the extension they were
+ * read from has been unplugged meanwhile */
+static void stage_cal_scale(struct wiimote *wiimote,
+                            const struct cal_scale *next, uint8_t flags,
+                            enum cwiid_ext_type ext_type)
+{
+	pthread_mutex_lock(&wiimote->state_mutex);
+	if (!(flags & CAL_EXT_MASK) || (wiimote->state.ext_type == ext_type)) {
+		copy_cal_scale(&wiimote->scale_next, next, flags);
+		wiimote->scale_valid |= flags;
+		__atomic_or_fetch(&wiimote->scale_pending, flags, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&wiimote->state_mutex);
+}
+
+/* Not on the router thread: reads calibration from the device */
+int update_cal_scale(struct wiimote *wiimote)
+{
+	struct acc_cal acc_cal;
+	struct balance_cal balance_cal;
+	struct cal_scale next;
+	unsigned char buf[6];
+	enum cwiid_ext_type ext_type;
+	uint8_t valid;
+
+	pthread_mutex_lock(&wiimote->state_mutex);
+	valid = wiimote->scale_valid;
+	ext_type = wiimote->state.ext_type;
+	pthread_mutex_unlock(&wiimote->state_mutex);
+
+	if (!(valid & CAL_ACC)) {
+		if (cwiid_get_acc_cal(wiimote, CWIID_EXT_NONE, &acc_cal)) {
+			return -1;
+		}
+		set_acc_scale(&next.acc, &acc_cal);
+		stage_cal_scale(wiimote, &next, CAL_ACC, ext_type);
+	}
+
+	switch (ext_type) {
+	case CWIID_EXT_NUNCHUK:
+		if (!(valid & CAL_NUNCHUK)) {
+			if (cwiid_get_acc_cal(wiimote, CWIID_EXT_NUNCHUK, &acc_cal)) {
+				return -1;
+			}
+			/* Stick max, min, center for x, then y */
+			if (cwiid_read(wiimote, CWIID_RW_REG, 0xA40028, 6, buf)) {
+				cwiid_err(wiimote, "Read error (nunchuk stick cal)");
+				return -1;
+			}
+			set_acc_scale(&next.nunchuk, &acc_cal);
+			set_stick_scale(&next, CWIID_X, buf[0], buf[1], buf[2]);
+			set_stick_scale(&next, CWIID_Y, buf[3], buf[4], buf[5]);
+			stage_cal_scale(wiimote, &next, CAL_NUNCHUK, ext_type);
+		}
+		break;
+	case CWIID_EXT_BALANCE:
+		if (!(valid & CAL_BALANCE)) {
+			if (cwiid_get_balance_cal(wiimote, &balance_cal)) {
+				return -1;
+			}
+			set_balance_scale(&next, 0, balance_cal.right_top);
+			set_balance_scale(&next, 1, balance_cal.right_bottom);
+			set_balance_scale(&next, 2, balance_cal.left_top);
+			set_balance_scale(&next, 3, balance_cal.left_bottom);
+			stage_cal_scale(wiimote, &next, CAL_BALANCE, ext_type);
+		}
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/* Router thread: switch to a staged balance scale.  The tare belongs to
+ * the board, so a calibration refresh of the same board keeps it and a
+ * different board starts from none. */
+static void apply_balance_scale(struct wiimote *wiimote)
+{
+	struct cal_scale *scale = &wiimote->scale;
+	const struct cal_scale *next = &wiimote->scale_next;
+	int i, j;
+
+	if (memcmp(scale->balance_knee, next->balance_knee,
+	           sizeof scale->balance_knee) ||
+	  memcmp(scale->balance_gain, next->balance_gain,
+	         sizeof scale->balance_gain)) {
+		memset(scale->balance_tare, 0, sizeof scale->balance_tare);
+		wiimote->balance_tare.count = -1;
+	}
+	copy_cal_scale(scale, next, CAL_BALANCE);
+	for (i=0; i < 4; i++) {
+		for (j=0; j < 2; j++) {
+			scale->balance_offset[i][j] -= scale->balance_tare[i];
+		}
+	}
+}
+
+/* Router thread: take over staged sections, and retire the ones whose
+ * extension has gone */
+void apply_cal_scale(struct wiimote *wiimote)
+{
+	uint8_t pending, valid;
+
+	if (!__atomic_load_n(&wiimote->scale_pending, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	pthread_mutex_lock(&wiimote->state_mutex);
+	pending = __atomic_exchange_n(&wiimote->scale_pending, 0,
+	                              __ATOMIC_RELAXED);
+	valid = pending & wiimote->scale_valid;
+	copy_cal_scale(&wiimote->scale, &wiimote->scale_next,
+	               valid & ~CAL_BALANCE);
+	if (valid & CAL_BALANCE) {
+		apply_balance_scale(wiimote);
+	}
+	wiimote->scale_active = (wiimote->scale_active & ~pending) | valid;
+	pthread_mutex_unlock(&wiimote->state_mutex);
+}
+
+static float scale_balance(const struct cal_scale *scale, int sensor,
+                           uint16_t raw)
+{
+	int seg = (raw >= scale->balance_knee[sensor]);
+
+	return raw * scale->balance_gain[sensor][seg] +
+	       scale->balance_offset[sensor][seg];
+}
+
+int cwiid_set_balance_tare(cwiid_wiimote_t *wiimote, int tare)
+{
+	if (!(wiimote->flags & CWIID_FLAG_CALIBRATED)) {
+		cwiid_err(wiimote, "Balance tare requires CWIID_FLAG_CALIBRATED");
+		return -1;
+	}
+
+	__atomic_store_n(&wiimote->balance_tare.request,
+	                 tare ? BALANCE_TARE_START : BALANCE_TARE_CLEAR,
+	                 __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* Router thread: act on a tare request before the next sample is scaled */
+static void update_balance_tare(struct wiimote *wiimote)
+{
+	struct balance_tare *tare = &wiimote->balance_tare;
+	struct cal_scale *scale = &wiimote->scale;
+	int i;
+
+	switch (__atomic_exchange_n(&tare->request, BALANCE_TARE_NONE,
+	                            __ATOMIC_ACQUIRE)) {
+	case BALANCE_TARE_START:
+		memset(tare->sum, 0, sizeof tare->sum);
+		tare->count = 0;
+		break;
+	case BALANCE_TARE_CLEAR:
+		for (i=0; i < 4; i++) {
+			scale->balance_offset[i][0] += scale->balance_tare[i];
+			scale->balance_offset[i][1] += scale->balance_tare[i];
+			scale->balance_tare[i] = 0.0f;
+		}
+		tare->count = -1;
+		break;
+	default:
+		break;
+	}
+}
+
+/* Router thread: average samples into a pending tare, folding it into the
+ * offsets once complete */
+static void add_balance_tare(struct wiimote *wiimote, const float *kg)
+{
+	struct balance_tare *tare = &wiimote->balance_tare;
+	struct cal_scale *scale = &wiimote->scale;
+	float delta;
+	int i;
+
+	for (i=0; i < 4; i++) {
+		tare->sum[i] += kg[i];
+	}
+	if (++tare->count == BALANCE_TARE_COUNT) {
+		for (i=0; i < 4; i++) {
+			delta = tare->sum[i] / BALANCE_TARE_COUNT;
+			scale->balance_offset[i][0] -= delta;
+			scale->balance_offset[i][1] -= delta;
+			scale->balance_tare[i] += delta;
+		}
+		tare->count = -1;
+	}
+}
+
+static float scale_stick(const struct cal_scale *scale, int axis, uint8_t raw)
+{
+	float value;
+
+	value = raw - scale->stick_center[axis];
+	value *= scale->stick_gain[axis][value > 0];
+	if (value > 1.0f) {
+		value = 1.0f;
+	}
+	else if (value < -1.0f) {
+		value = -1.0f;
+	}
+
+	return value;
+}
+
+static void add_gyro_sample(struct gyro_bias *bias,
+                            const struct cwiid_motionplus_mesg *mesg)
+{
+	struct gyro_sample *sample = &bias->sample[bias->index];
+	int i;
+
+	if (bias->count == GYRO_BIAS_WINDOW) {
+		for (i=0; i < 3; i++) {
+			bias->sum[i] -= sample->angle_rate[i];
+			bias->sum_sq[i] -= (int64_t)sample->angle_rate[i] *
+			                   sample->angle_rate[i];
+			bias->sum[3+i] -= sample->acc[i];
+			bias->sum_sq[3+i] -= (int64_t)sample->acc[i] * sample->acc[i];
+		}
+		bias->fast_count -= sample->fast;
+	}
+	else {
+		bias->count++;
+	}
+
+	sample->fast = 0;
+	for (i=0; i < 3; i++) {
+		sample->angle_rate[i] = mesg->angle_rate[i];
+		sample->acc[i] = bias->acc[i];
+		if (!mesg->low_speed[i]) {
+			sample->fast = 1;
+		}
+		bias->sum[i] += sample->angle_rate[i];
+		bias->sum_sq[i] += (int64_t)sample->angle_rate[i] *
+		                   sample->angle_rate[i];
+		bias->sum[3+i] += sample->acc[i];
+		bias->sum_sq[3+i] += (int64_t)sample->acc[i] * sample->acc[i];
+	}
+	bias->fast_count += sample->fast;
+
+	bias->index = (bias->index + 1) % GYRO_BIAS_WINDOW;
+}
+
+static int gyro_still(const struct gyro_bias *bias)
+{
+	int64_t var;
+	int i;
+
+	if ((bias->count < GYRO_BIAS_WINDOW) || bias->fast_count) {
+		return 0;
+	}
+
+	/* N^2 * variance, in integers */
+	for (i=0; i < 6; i++) {
+		var = bias->sum_sq[i] * GYRO_BIAS_WINDOW - bias->sum[i] * bias->sum[i];
+		if (var > (int64_t)GYRO_BIAS_WINDOW * GYRO_BIAS_WINDOW *
+		          ((i < 3) ? GYRO_STILL_RATE_VAR : GYRO_STILL_ACC_VAR)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Router thread: update the MotionPlus zero points while at rest.  Reports
+ * without accelerometer data reuse the last reading, so stillness falls
+ * back to the gyro alone when acc reporting is off.  Updated zero points
+ * are published under state_mutex for cwiid_get_gyro_cal. */
+int process_gyro_bias(struct wiimote *wiimote, struct mesg_array *ma)
+{
+	struct gyro_bias *bias = &wiimote->gyro_bias;
+	float mean;
+	int updated = 0;
+	int i, j;
+
+	for (i=0; i < ma->count; i++) {
+		switch (ma->array[i].type) {
+		case CWIID_MESG_ACC:
+			memcpy(bias->acc, ma->array[i].acc_mesg.acc, sizeof bias->acc);
+			break;
+		case CWIID_MESG_MOTIONPLUS:
+			add_gyro_sample(bias, &ma->array[i].motionplus_mesg);
+			if (gyro_still(bias)) {
+				for (j=0; j < 3; j++) {
+					mean = (float)bias->sum[j] / GYRO_BIAS_WINDOW;
+					if (bias->valid) {
+						wiimote->scale.gyro_zero[j] += GYRO_BIAS_RATE *
+						  (mean - wiimote->scale.gyro_zero[j]);
+					}
+					else {
+						wiimote->scale.gyro_zero[j] = mean;
+					}
+				}
+				bias->valid = 1;
+				updated = 1;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (updated) {
+		pthread_mutex_lock(&wiimote->state_mutex);
+		for (i=0; i < 3; i++) {
+			wiimote->gyro_cal.zero[i] = wiimote->scale.gyro_zero[i] + 0.5f;
+		}
+		wiimote->gyro_cal_valid = 1;
+		pthread_mutex_unlock(&wiimote->state_mutex);
+	}
+
+	return 0;
+}
+
+void scale_acc(const struct acc_scale *scale, const uint16_t *raw, float *acc)
+{
+	int i;
+
+	for (i=0; i < 3; i++) {
+		acc[i] = (raw[i] - scale->zero[i]) * scale->gain[i];
+	}
+}
+
+void scale_angle_rate(const struct cal_scale *scale,
+                      const struct cwiid_motionplus_mesg *mesg,
+                      float *angle_rate)
+{
+	int i;
+
+	for (i=0; i < 3; i++) {
+		angle_rate[i] = (mesg->angle_rate[i] - scale->gyro_zero[i]) *
+		                scale->gyro_gain[mesg->low_speed[i] ? 1 : 0];
+	}
+}
+
+/* Append a calibrated message for each raw message in ma */
+int process_cal(struct wiimote *wiimote, struct mesg_array *ma)
+{
+	const struct cal_scale *scale = &wiimote->scale;
+	union cwiid_mesg *mesg, *cal_mesg;
+	struct cwiid_balance_cal_mesg *balance;
+	float kg[4];
+	int count = ma->count;
+	int i, j;
+
+	for (i=0; (i < count) && (ma->count < CWIID_MAX_MESG_COUNT); i++) {
+		mesg = &ma->array[i];
+		cal_mesg = &ma->array[ma->count];
+
+		switch (mesg->type) {
+		case CWIID_MESG_ACC:
+			cal_mesg->acc_cal_mesg.type = CWIID_MESG_ACC_CAL;
+			scale_acc(&scale->acc, mesg->acc_mesg.acc,
+			          cal_mesg->acc_cal_mesg.acc);
+			break;
+		case CWIID_MESG_NUNCHUK:
+			cal_mesg->nunchuk_cal_mesg.type = CWIID_MESG_NUNCHUK_CAL;
+			for (j=0; j < 2; j++) {
+				cal_mesg->nunchuk_cal_mesg.stick[j] =
+				  scale_stick(scale, j, mesg->nunchuk_mesg.stick[j]);
+			}
+			scale_acc(&scale->nunchuk, mesg->nunchuk_mesg.acc,
+			          cal_mesg->nunchuk_cal_mesg.acc);
+			cal_mesg->nunchuk_cal_mesg.buttons = mesg->nunchuk_mesg.buttons;
+			break;
+		case CWIID_MESG_BALANCE:
+			if (!(wiimote->scale_active & CAL_BALANCE)) {
+				continue;
+			}
+			update_balance_tare(wiimote);
+			kg[0] = scale_balance(scale, 0, mesg->balance_mesg.right_top);
+			kg[1] = scale_balance(scale, 1, mesg->balance_mesg.right_bottom);
+			kg[2] = scale_balance(scale, 2, mesg->balance_mesg.left_top);
+			kg[3] = scale_balance(scale, 3, mesg->balance_mesg.left_bottom);
+			if (wiimote->balance_tare.count != -1) {
+				add_balance_tare(wiimote, kg);
+			}
+
+			balance = &cal_mesg->balance_cal_mesg;
+			balance->type = CWIID_MESG_BALANCE_CAL;
+			balance->right_top = kg[0];
+			balance->right_bottom = kg[1];
+			balance->left_top = kg[2];
+			balance->left_bottom = kg[3];
+			balance->weight = kg[0] + kg[1] + kg[2] + kg[3];
+			if (balance->weight >= BALANCE_MIN_WEIGHT) {
+				balance->cop[CWIID_X] = BALANCE_HALF_WIDTH *
+				  ((kg[0] + kg[1]) - (kg[2] + kg[3])) / balance->weight;
+				balance->cop[CWIID_Y] = BALANCE_HALF_LENGTH *
+				  ((kg[0] + kg[2]) - (kg[1] + kg[3])) / balance->weight;
+			}
+			else {
+				balance->cop[CWIID_X] = balance->cop[CWIID_Y] = 0.0f;
+			}
+			break;
+		case CWIID_MESG_MOTIONPLUS:
+			cal_mesg->motionplus_cal_mesg.type = CWIID_MESG_MOTIONPLUS_CAL;
+			scale_angle_rate(scale, &mesg->motionplus_mesg,
+			                 cal_mesg->motionplus_cal_mesg.angle_rate);
+			break;
+		default:
+			continue;
+		}
+
+		ma->count++;
+	}
+
+	return 0;
+}
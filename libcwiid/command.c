@@ -53,6 +53,7 @@ int cwiid_send_rpt(cwiid_wiimote_t *wiimote, uint8_t flags, uint8_t report,
                    size_t len, const void *data)
 {
 	unsigned char buf[32];
+	int ret = 0;
 
 	if (wiimote == NULL) {
 		cwiid_err( wiimote, "cwiid_send_prt: wiimote is null" );
@@ -77,287 +78,248 @@ int cwiid_send_rpt(cwiid_wiimote_t *wiimote, uint8_t flags, uint8_t report,
 		buf[2] |= wiimote->state.rumble;
 	}
 
+	/* One report and its handshake at a time across all senders */
+	pthread_mutex_lock(&wiimote->tx_mutex);
 	if (write(wiimote->ctl_socket, buf, len+2) != (ssize_t)(len+2)) {
 		cwiid_err(wiimote, "cwiid_send_rpt: write: %s", strerror(errno));
-      return -1;
+		ret = -1;
 	}
 	else if (verify_handshake(wiimote)) {
-      return -1;
+		ret = -1;
 	}
+	pthread_mutex_unlock(&wiimote->tx_mutex);
 
-	return 0;
+	return ret;
 }
 
-int cwiid_request_status(cwiid_wiimote_t *wiimote)
+/* Output stage for the LED/rumble and status request reports.  Callers
+ * record what they want in wiimote->state and post a request; whichever
+ * caller finds the stage idle becomes the sender and keeps sending rounds
+ * until nothing is pending, at most one round per OUT_MIN_INTERVAL.  A
+ * round sends one LED/rumble report carrying the latest LED and rumble
+ * bits and one status request, covering every request posted before it
+ * started.  LED/rumble requests that match what the wiimote already has
+ * are dropped, but only while the stage is idle: out->led and out->rumble
+ * hold the last completed round, and a round in flight may be changing
+ * them. */
+#define OUT_MIN_INTERVAL	5000000	/* ns between rounds */
+
+static void out_wait_slot(struct wiimote *wiimote)
 {
-	unsigned char data;
-
-	data = 0;
-	if (cwiid_send_rpt(wiimote, 0, RPT_STATUS_REQ, 1, &data)) {
-		cwiid_err(wiimote, "Status request error");
-		return -1;
+	struct timespec now, slot;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	slot = wiimote->out.last;
+	slot.tv_nsec += OUT_MIN_INTERVAL;
+	if (slot.tv_nsec >= 1000000000) {
+		slot.tv_sec++;
+		slot.tv_nsec -= 1000000000;
 	}
-
-	return 0;
-}
-
-int cwiid_set_led(cwiid_wiimote_t *wiimote, uint8_t led)
-{
-	unsigned char data;
-
-	/* TODO: assumption: char assignments are atomic, no mutex lock needed */
-	wiimote->state.led = led & 0x0F;
-	data = wiimote->state.led << 4;
-	if (cwiid_send_rpt(wiimote, 0, RPT_LED_RUMBLE, 1, &data)) {
-		cwiid_err(wiimote, "Report send error (led)");
-		return -1;
+	if ((now.tv_sec < slot.tv_sec) ||
+	  ((now.tv_sec == slot.tv_sec) && (now.tv_nsec < slot.tv_nsec))) {
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &slot, NULL);
 	}
-
-	return 0;
 }
 
-int cwiid_set_rumble(cwiid_wiimote_t *wiimote, uint8_t rumble)
+/* Called with out_mutex held; returns with it held */
+static void out_send_rounds(struct wiimote *wiimote)
 {
+	struct out_queue *out = &wiimote->out;
 	unsigned char data;
+	uint8_t pending, led, rumble;
+	unsigned int round, sent;
+	int ret;
 
-	/* TODO: assumption: char assignments are atomic, no mutex lock needed */
-	wiimote->state.rumble = rumble ? 1 : 0;
-	data = wiimote->state.led << 4;
-	if (cwiid_send_rpt(wiimote, 0, RPT_LED_RUMBLE, 1, &data)) {
-		cwiid_err(wiimote, "Report send error (led)");
-		return -1;
+	out->busy = 1;
+	while (out->pending) {
+		/* Requests arriving while we wait join this round */
+		pthread_mutex_unlock(&wiimote->out_mutex);
+		out_wait_slot(wiimote);
+		pthread_mutex_lock(&wiimote->out_mutex);
+
+		pending = out->pending;
+		out->pending = 0;
+		led = wiimote->state.led;
+		rumble = wiimote->state.rumble;
+		round = ++out->started;
+		pthread_mutex_unlock(&wiimote->out_mutex);
+
+		ret = 0;
+		sent = 0;
+		if (pending & OUT_LED_RUMBLE) {
+			data = led << 4 | rumble;
+			if (cwiid_send_rpt(wiimote, CWIID_SEND_RPT_NO_RUMBLE,
+			                   RPT_LED_RUMBLE, 1, &data)) {
+				cwiid_err(wiimote, "Report send error (led)");
+				ret = -1;
+			}
+			else {
+				sent++;
+			}
+		}
+		if (pending & OUT_STATUS) {
+			data = 0;
+			if (cwiid_send_rpt(wiimote, 0, RPT_STATUS_REQ, 1, &data)) {
+				cwiid_err(wiimote, "Status request error");
+				ret = -1;
+			}
+			else {
+				sent++;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &out->last);
+
+		pthread_mutex_lock(&wiimote->out_mutex);
+		out->stats.reports += sent;
+		if ((pending & OUT_LED_RUMBLE) && !ret) {
+			out->led = led;
+			out->rumble = rumble;
+			out->valid = 1;
+		}
+		else if (pending & OUT_LED_RUMBLE) {
+			out->valid = 0;
+		}
+		out->result[round % OUT_RESULTS] = ret;
+		out->finished = round;
+		pthread_cond_broadcast(&wiimote->out_cond);
 	}
-
-	return 0;
-}
-
-int cwiid_set_rpt_mode(cwiid_wiimote_t *wiimote, uint16_t rpt_mode)
-{
-	return update_rpt_mode(wiimote, rpt_mode);
+	out->busy = 0;
 }
 
-#define RPT_READ_REQ_LEN 6
-int cwiid_read(cwiid_wiimote_t *wiimote, uint8_t flags, uint32_t offset,
-               uint16_t len, void *data)
+static int out_request(struct wiimote *wiimote, uint8_t request,
+                       uint8_t *led, uint8_t *rumble)
 {
-	unsigned char buf[RPT_READ_REQ_LEN];
-	struct rw_mesg mesg;
-	unsigned char *cursor;
-	int ret = 0;
-	int err;
-
-	/* Compose read request packet */
-	buf[0]=flags & (CWIID_RW_EEPROM | CWIID_RW_REG);
-	buf[1]=(unsigned char)((offset>>16) & 0xFF);
-	buf[2]=(unsigned char)((offset>>8) & 0xFF);
-	buf[3]=(unsigned char)(offset & 0xFF);
-	buf[4]=(unsigned char)((len>>8) & 0xFF);
-	buf[5]=(unsigned char)(len & 0xFF);
-
-	/* Lock wiimote rw access */
-	err = pthread_mutex_lock(&wiimote->rw_mutex);
-	if (err) {
-		cwiid_err(wiimote, "Mutex lock error (rw_mutex): %s", strerror(err));
-		return -1;
-	}
+	struct out_queue *out = &wiimote->out;
+	unsigned int round;
+	int ret;
 
-	/* Setup read info */
-	wiimote->rw_status = RW_READ;
+	pthread_mutex_lock(&wiimote->out_mutex);
 
-	/* TODO: Document: user is responsible for ensuring that read/write
-	 * operations are not in flight while disconnecting.  Nothing serious,
-	 * just accesses to freed memory */
-	/* Send read request packet */
-	if (cwiid_send_rpt(wiimote, 0, RPT_READ_REQ, RPT_READ_REQ_LEN, buf)) {
-		cwiid_err(wiimote, "Report send error (read)");
-		ret = -1;
-		goto CODA;
+	if (led) {
+		wiimote->state.led = *led;
+	}
+	if (rumble) {
+		wiimote->state.rumble = *rumble;
 	}
 
-	/* TODO:Better sanity checks (offset) */
-	/* Read packets */
-	for (cursor = data; cursor - (unsigned char *)data < len;
-	     cursor += mesg.len) {
-		if (full_read(wiimote->rw_pipe[0], &mesg, sizeof mesg)) {
-			cwiid_err(wiimote, "Pipe read error (rw pipe): %s", strerror(errno));
-			ret = -1;
-			goto CODA;
-		}
-
-		if (mesg.type == RW_CANCEL) {
-			ret = -1;
-			goto CODA;
-		}
-		else if (mesg.type != RW_READ) {
-			cwiid_err(wiimote, "Unexpected write message");
-			ret = -1;
-			goto CODA;
-		}
+	if ((request == OUT_LED_RUMBLE) && !out->busy && out->valid &&
+	  (out->led == wiimote->state.led) &&
+	  (out->rumble == wiimote->state.rumble)) {
+		out->stats.dropped++;
+		pthread_mutex_unlock(&wiimote->out_mutex);
+		return 0;
+	}
+	if (out->pending & request) {
+		out->stats.merged++;
+	}
+	out->pending |= request;
+	round = out->started + 1;
 
-		if (mesg.error) {
-			cwiid_err(wiimote, "Wiimote read error");
-			ret = -1;
-			goto CODA;
+	if (!out->busy) {
+		out_send_rounds(wiimote);
+	}
+	else {
+		while ((int)(out->finished - round) < 0) {
+			pthread_cond_wait(&wiimote->out_cond, &wiimote->out_mutex);
 		}
-
-		memcpy(cursor, &mesg.data, mesg.len);
 	}
+	ret = out->result[round % OUT_RESULTS];
 
-CODA:
-	/* Clear rw_status */
-	wiimote->rw_status = RW_IDLE;
-
-	/* Unlock rw_mutex */
-	err = pthread_mutex_unlock(&wiimote->rw_mutex);
-	if (err) {
-		cwiid_err(wiimote, "Mutex unlock error (rw_mutex) - deadlock warning: %s", strerror(err));
-	}
+	pthread_mutex_unlock(&wiimote->out_mutex);
 
 	return ret;
 }
 
-#define RPT_WRITE_LEN 21
-int cwiid_write(cwiid_wiimote_t *wiimote, uint8_t flags, uint32_t offset,
-                  uint16_t len, const void *data)
+int cwiid_request_status(cwiid_wiimote_t *wiimote)
 {
-	unsigned char buf[RPT_WRITE_LEN];
-	uint16_t sent=0;
-	struct rw_mesg mesg;
-	int ret = 0;
-	int err;
+	return out_request(wiimote, OUT_STATUS, NULL, NULL);
+}
 
-	/* Compose write packet header */
-	buf[0]=flags;
+int cwiid_set_led(cwiid_wiimote_t *wiimote, uint8_t led)
+{
+	led &= 0x0F;
+	return out_request(wiimote, OUT_LED_RUMBLE, &led, NULL);
+}
 
-	/* Lock wiimote rw access */
-	err = pthread_mutex_lock(&wiimote->rw_mutex);
-	if (err) {
-		cwiid_err(wiimote, "Mutex lock error (rw mutex): %s", strerror(err));
-		return -1;
-	}
+int cwiid_set_rumble(cwiid_wiimote_t *wiimote, uint8_t rumble)
+{
+	rumble = rumble ? 1 : 0;
+	return out_request(wiimote, OUT_LED_RUMBLE, NULL, &rumble);
+}
 
-	/* Send packets */
-	wiimote->rw_status = RW_WRITE;
-	while (sent<len) {
-		/* Compose write packet */
-		buf[1]=(unsigned char)(((offset+sent)>>16) & 0xFF);
-		buf[2]=(unsigned char)(((offset+sent)>>8) & 0xFF);
-		buf[3]=(unsigned char)((offset+sent) & 0xFF);
-		if (len-sent >= 0x10) {
-			buf[4]=(unsigned char)0x10;
-		}
-		else {
-			buf[4]=(unsigned char)(len-sent);
-		}
-		memcpy(buf+5, data+sent, buf[4]);
+int cwiid_get_out_stats(cwiid_wiimote_t *wiimote,
+                        struct cwiid_out_stats *stats)
+{
+	pthread_mutex_lock(&wiimote->out_mutex);
+	*stats = wiimote->out.stats;
+	pthread_mutex_unlock(&wiimote->out_mutex);
 
-		if (cwiid_send_rpt(wiimote, 0, RPT_WRITE, RPT_WRITE_LEN, buf)) {
-			cwiid_err(wiimote, "Report send error (write)");
-			ret = -1;
-			goto CODA;
-		}
+	return 0;
+}
 
-		/* Read packets from pipe */
-		if (read(wiimote->rw_pipe[0], &mesg, sizeof mesg) != sizeof mesg) {
-			cwiid_err(wiimote, "Pipe read error (rw pipe): %s", strerror(errno));
-			ret = -1;
-			goto CODA;
-		}
+int cwiid_set_rpt_mode(cwiid_wiimote_t *wiimote, uint16_t rpt_mode)
+{
+	return update_rpt_mode(wiimote, rpt_mode);
+}
 
-		if (mesg.type == RW_CANCEL) {
-			ret = -1;
-			goto CODA;
-		}
-		else if (mesg.type != RW_WRITE) {
-			cwiid_err(wiimote, "Unexpected read message");
-			ret = -1;
-			goto CODA;
-		}
+int cwiid_read(cwiid_wiimote_t *wiimote, uint8_t flags, uint32_t offset,
+               uint16_t len, void *data)
+{
+	uint16_t received;
+
+	return read_mem(wiimote, flags, offset, len, data, &received, NULL, NULL);
+}
 
-		if (mesg.error) {
-			cwiid_err(wiimote, "Wiimote write error");
-			ret = -1;
-			goto CODA;
-		};
+/* One read request.  received counts the bytes copied to data, also on
+ * failure, and progress (if set) is called as reply packets arrive. */
+int read_mem(struct wiimote *wiimote, uint8_t flags, uint32_t offset,
+             uint16_t len, void *data, uint16_t *received,
+             read_progress_t *progress, void *progress_data)
+{
+	struct cwiid_rw_req req;
+	int ret;
 
-		sent+=buf[4];
+	*received = 0;
+	if (!len) {
+		return 0;
 	}
 
-CODA:
-	/* Clear rw_status */
-	wiimote->rw_status = RW_IDLE;
+	memset(&req, 0, sizeof req);
+	req.op = CWIID_RW_OP_READ;
+	req.flags = flags;
+	req.offset = offset;
+	req.len = len;
+	req.data = data;
 
-	/* Unlock rw_mutex */
-	err = pthread_mutex_unlock(&wiimote->rw_mutex);
-	if (err) {
-		cwiid_err(wiimote, "Mutex unlock error (rw_mutex) - deadlock warning: %s", strerror(err));
+	if (cwiid_rw_submit(wiimote, &req)) {
+		return -1;
 	}
+	ret = rw_wait(wiimote, &req, progress, progress_data);
+	*received = req.done;
 
 	return ret;
 }
 
-
-struct write_seq speaker_enable_seq[] = {
-	{WRITE_SEQ_RPT, RPT_SPEAKER_ENABLE, (const void *)"\x04", 1, 0},
-	{WRITE_SEQ_RPT,   RPT_SPEAKER_MUTE, (const void *)"\x04", 1, 0},
-	{WRITE_SEQ_MEM, 0xA20009, (const void *)"\x01", 1, CWIID_RW_REG},
-	{WRITE_SEQ_MEM, 0xA20001, (const void *)"\x08", 1, CWIID_RW_REG},
-	{WRITE_SEQ_MEM, 0xA20001, (const void *)"\x00\x00\x00\x0C\x40\x00\x00",
-	                          7, CWIID_RW_REG},
-	{WRITE_SEQ_MEM, 0xA20008, (const void *)"\x01", 1, CWIID_RW_REG},
-	{WRITE_SEQ_RPT,   RPT_SPEAKER_MUTE, (const void *)"\x00", 1, 0}
-};
-
-struct write_seq speaker_disable_seq[] = {
-	{WRITE_SEQ_RPT,   RPT_SPEAKER_MUTE, (const void *)"\x04", 1, 0},
-	{WRITE_SEQ_RPT, RPT_SPEAKER_ENABLE, (const void *)"\x00", 1, 0}
-};
-
-#define SOUND_BUF_LEN	21
-int cwiid_beep(cwiid_wiimote_t *wiimote)
+int cwiid_write(cwiid_wiimote_t *wiimote, uint8_t flags, uint32_t offset,
+                  uint16_t len, const void *data)
 {
-	/* unsigned char buf[SOUND_BUF_LEN] = { 0xA0, 0xCC, 0x33, 0xCC, 0x33,
-	    0xCC, 0x33, 0xCC, 0x33, 0xCC, 0x33, 0xCC, 0x33, 0xCC, 0x33, 0xCC, 0x33,
-	    0xCC, 0x33, 0xCC, 0x33}; */
-	unsigned char buf[SOUND_BUF_LEN] = { 0xA0, 0xC3, 0xC3, 0xC3, 0xC3,
-	    0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3,
-	    0xC3, 0xC3, 0xC3, 0xC3};
-	int i;
-	int ret = 0;
-	pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
-	pthread_cond_t timer_cond = PTHREAD_COND_INITIALIZER;
-	struct timespec t;
-
-	if (exec_write_seq(wiimote, SEQ_LEN(speaker_enable_seq),
-	                   speaker_enable_seq)) {
-		cwiid_err(wiimote, "Speaker enable error");
-		ret = -1;
-	}
+	struct cwiid_rw_req req;
 
-	pthread_mutex_lock(&timer_mutex);
-
-	for (i=0; i<100; i++) {
-		clock_gettime(CLOCK_REALTIME, &t);
-		t.tv_nsec += 10204081;
-		/* t.tv_nsec += 7000000; */
-		if (cwiid_send_rpt(wiimote, 0, RPT_SPEAKER_DATA, SOUND_BUF_LEN, buf)) {
-		 	printf("%d\n", i);
-			cwiid_err(wiimote, "Report send error (speaker data)");
-			ret = -1;
-			break;
-		}
-		/* TODO: I should be shot for this, but hey, it works.
-		 * longterm - find a better wait */
-		pthread_cond_timedwait(&timer_cond, &timer_mutex, &t);
+	if (!len) {
+		return 0;
 	}
 
-	pthread_mutex_unlock(&timer_mutex);
+	memset(&req, 0, sizeof req);
+	req.op = CWIID_RW_OP_WRITE;
+	req.flags = flags;
+	req.offset = offset;
+	req.len = len;
+	/* only read from */
+	req.data = (void *)data;
 
-	if (exec_write_seq(wiimote, SEQ_LEN(speaker_disable_seq),
-	                   speaker_disable_seq)) {
-		cwiid_err(wiimote, "Speaker disable error");
-		ret = -1;
+	if (cwiid_rw_submit(wiimote, &req)) {
+		return -1;
 	}
 
-	return ret;
+	return rw_wait(wiimote, &req, NULL, NULL);
 }
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -112,109 +113,146 @@ ERR_HND:
 
 cwiid_wiimote_t *cwiid_listen(int flags)
 {
-	struct sockaddr_l2 local_addr;
-	struct sockaddr_l2 remote_addr;
-	socklen_t socklen;
-	int ctl_server_socket = -1, int_server_socket = -1,
-	    ctl_socket = -1, int_socket = -1;
-	struct wiimote *wiimote = NULL;
+	cwiid_listener_t *listener;
+	struct wiimote *wiimote;
 
-	/* Connect to Wiimote */
-	/* Control Channel */
-	memset(&local_addr, 0, sizeof local_addr);
-	local_addr.l2_family = AF_BLUETOOTH;
-	local_addr.l2_bdaddr = *BDADDR_ANY;
-	local_addr.l2_psm = htobs(CTL_PSM);
-	if ((ctl_server_socket =
-	  socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP)) == -1) {
-		cwiid_err(NULL, "Socket creation error (control socket): %s", strerror(errno));
-		goto ERR_HND;
-	}
-	if (bind(ctl_server_socket, (struct sockaddr *)&local_addr,
-	         sizeof local_addr)) {
-		cwiid_err(NULL, "Socket bind error (control socket): %s", strerror(errno));
-		goto ERR_HND;
-	}
-	if (listen(ctl_server_socket, 1)) {
-		cwiid_err(NULL, "Socket listen error (control socket): %s", strerror(errno));
-		goto ERR_HND;
+	if ((listener = cwiid_listener_open(flags, NULL, NULL)) == NULL) {
+		/* Raises its own error */
+		return NULL;
 	}
 
-	/* Interrupt Channel */
-	local_addr.l2_psm = htobs(INT_PSM);
-	if ((int_server_socket =
-	  socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP)) == -1) {
-		cwiid_err(NULL, "Socket creation error (interrupt socket): %s", strerror(errno));
-		goto ERR_HND;
-	}
-	if (bind(int_server_socket, (struct sockaddr *)&local_addr,
-	         sizeof local_addr)) {
-		cwiid_err(NULL, "Socket bind error (interrupt socket): %s", strerror(errno));
-		goto ERR_HND;
-	}
-	if (listen(int_server_socket, 1)) {
-		cwiid_err(NULL, "Socket listen error (interrupt socket): %s", strerror(errno));
-		goto ERR_HND;
-	}
+	wiimote = cwiid_listener_accept(listener, -1);
 
-	/* Block for Connections */
-	if ((ctl_socket = accept(ctl_server_socket, (struct sockaddr *)&remote_addr, &socklen)) < 0) {
-		cwiid_err(NULL, "Socket accept error (control socket): %s", strerror(errno));
-		goto ERR_HND;
+	if (cwiid_listener_close(listener)) {
+		/* Raises its own error */
 	}
-	if ((int_socket = accept(int_server_socket, (struct sockaddr *)&remote_addr, &socklen)) < 0) {
-		cwiid_err(NULL, "Socket accept error (interrupt socket): %s", strerror(errno));
-		goto ERR_HND;
+
+	return wiimote;
+}
+
+static void close_socket(void *sock)
+{
+	if (*(int *)sock != -1) {
+		close(*(int *)sock);
 	}
+}
+
+static int reconnect_sockets(struct wiimote *wiimote)
+{
+	struct sockaddr_l2 remote_addr;
+	int ctl_socket = -1, int_socket = -1;
+	/* volatile: pthread_cleanup_push may be setjmp based */
+	volatile int ret = -1;
+
+	/* Sockets are local until they replace the dead ones, so close them if
+	 * cwiid_close cancels us mid-connect */
+	pthread_cleanup_push(close_socket, &ctl_socket);
+	pthread_cleanup_push(close_socket, &int_socket);
 
-	/* Close server sockets */
-	if (close(ctl_server_socket)) {
-		cwiid_err(NULL, "Socket close error (control socket): %s", strerror(errno));
+	memset(&remote_addr, 0, sizeof remote_addr);
+	remote_addr.l2_family = AF_BLUETOOTH;
+	bacpy(&remote_addr.l2_bdaddr, &wiimote->bdaddr);
+	remote_addr.l2_psm = htobs(CTL_PSM);
+	if (((ctl_socket =
+	    socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP)) == -1) ||
+	  connect(ctl_socket, (struct sockaddr *)&remote_addr,
+	          sizeof remote_addr)) {
+		goto CODA;
 	}
-	if (close(int_server_socket)) {
-		cwiid_err(NULL, "Socket close error (interrupt socket): %s", strerror(errno));
+	remote_addr.l2_psm = htobs(INT_PSM);
+	if (((int_socket =
+	    socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP)) == -1) ||
+	  connect(int_socket, (struct sockaddr *)&remote_addr,
+	          sizeof remote_addr)) {
+		goto CODA;
 	}
 
-	if ((wiimote = cwiid_new(ctl_socket, int_socket, flags)) == NULL) {
-		/* Raises its own error */
-		goto ERR_HND;
+	/* Swap the new connections in under the old descriptors, so other
+	 * threads never see an invalid (or reused) socket */
+	if ((dup2(ctl_socket, wiimote->ctl_socket) == -1) ||
+	  (dup2(int_socket, wiimote->int_socket) == -1)) {
+		cwiid_err(wiimote, "Socket dup error (reconnect): %s", strerror(errno));
+		goto CODA;
 	}
 
-	return wiimote;
+	ret = 0;
 
-ERR_HND:
-	/* Close Sockets */
-	if (ctl_server_socket != -1) {
-		if (close(ctl_server_socket)) {
-			cwiid_err(NULL, "Socket close error (control server socket): %s", strerror(errno));
-		}
+CODA:
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+
+	return ret;
+}
+
+static void write_link_mesg(struct wiimote *wiimote,
+                            enum cwiid_link_status status)
+{
+	struct mesg_array ma;
+
+	ma.count = 1;
+	clock_gettime(CLOCK_REALTIME, &ma.timestamp);
+	ma.array[0].link_mesg.type = CWIID_MESG_LINK;
+	ma.array[0].link_mesg.status = status;
+	if (write_mesg_array(wiimote, &ma)) {
+		/* prints its own errors */
 	}
-	if (int_server_socket != -1) {
-		if (close(int_server_socket)) {
-			cwiid_err(NULL, "Socket close error (interrupt server socket): %s", strerror(errno));
-		}
+	deliver_mesg_array(wiimote, &ma);
+}
+
+/* Called by the router thread when the interrupt channel drops, with
+ * CWIID_FLAG_RECONNECT set.  Blocks until the wiimote is back (or the
+ * wiimote is closed); the status thread restores the rest of the state. */
+int reconnect(struct wiimote *wiimote)
+{
+	struct timespec delay;
+	unsigned int delay_ms = RECONNECT_MIN_DELAY;
+
+	if (!bacmp(&wiimote->bdaddr, BDADDR_ANY)) {
+		cwiid_err(wiimote, "Reconnect error: remote address unknown");
+		return -1;
 	}
-	if (ctl_socket != -1) {
-		if (close(ctl_socket)) {
-			cwiid_err(NULL, "Socket close error (control socket): %s", strerror(errno));
-		}
+
+	/* Fail any read or write waiting on the old link */
+	if (cancel_rw(wiimote)) {
+		cwiid_err(wiimote, "RW cancel error");
 	}
-	if (int_socket != -1) {
-		if (close(int_socket)) {
-			cwiid_err(NULL, "Socket close error (interrupt socket): %s", strerror(errno));
+
+	write_link_mesg(wiimote, CWIID_LINK_DISCONNECTED);
+
+	/* The wiimote only accepts connections while discoverable, so this
+	 * may take a while */
+	do {
+		delay.tv_sec = delay_ms / 1000;
+		delay.tv_nsec = (delay_ms % 1000) * 1000000;
+		nanosleep(&delay, NULL);
+		if (delay_ms < RECONNECT_MAX_DELAY) {
+			delay_ms *= 2;
 		}
-	}
+	} while (reconnect_sockets(wiimote));
 
-	return NULL;
+	/* A fresh connection starts with LEDs and rumble off */
+	pthread_mutex_lock(&wiimote->out_mutex);
+	wiimote->out.valid = 0;
+	pthread_mutex_unlock(&wiimote->out_mutex);
+
+	wiimote->restore = 1;
+	write_link_mesg(wiimote, CWIID_LINK_RECONNECTED);
+
+	return 0;
 }
 
 cwiid_wiimote_t *cwiid_new(int ctl_socket, int int_socket, int flags)
 {
+	struct sockaddr_l2 remote_addr;
+	socklen_t socklen = sizeof remote_addr;
 	struct wiimote *wiimote = NULL;
-	char mesg_pipe_init = 0, status_pipe_init = 0, rw_pipe_init = 0,
-	     state_mutex_init = 0, rw_mutex_init = 0, rpt_mutex_init = 0,
-	     router_thread_init = 0, status_thread_init = 0;
+	char mesg_pipe_init = 0, status_pipe_init = 0,
+	     state_mutex_init = 0, rw_mutex_init = 0, rw_cond_init = 0,
+	     rpt_mutex_init = 0,
+	     tx_mutex_init = 0, out_mutex_init = 0, out_cond_init = 0,
+	     sub_mutex_init = 0, router_thread_init = 0, status_thread_init = 0;
 	void *pthread_ret;
+	pthread_attr_t attr;
 	int err;
 
 	/* Allocate wiimote */
@@ -227,6 +265,36 @@ cwiid_wiimote_t *cwiid_new(int ctl_socket, int int_socket, int flags)
 	wiimote->ctl_socket = ctl_socket;
 	wiimote->int_socket = int_socket;
 	wiimote->flags = flags;
+	wiimote->restore = 0;
+	wiimote->sched_valid = 0;
+	/* Everything the router and status threads read is set before they
+	 * start */
+	memset(&wiimote->state, 0, sizeof wiimote->state);
+	set_ext_type(wiimote, CWIID_EXT_NONE);
+	wiimote->mesg_callback = NULL;
+	wiimote->data = NULL;
+	wiimote->speaker = NULL;
+	wiimote->rumble = NULL;
+	wiimote->shm = NULL;			/* read by update_state */
+	wiimote->subs = NULL;			/* read by the router */
+	wiimote->sub_mask = 0;
+	wiimote->resampler = NULL;
+	wiimote->fd_sub = NULL;
+	wiimote->raw.pending = 0;
+	memset(&wiimote->deadband, 0, sizeof wiimote->deadband);
+	wiimote->cal_valid = 0;
+	init_cal_scale(wiimote);
+	init_fusion(wiimote);
+	init_ir_tracker(wiimote);
+
+	/* Remember the remote address for reconnects */
+	if (!getpeername(ctl_socket, (struct sockaddr *)&remote_addr, &socklen) &&
+	  (remote_addr.l2_family == AF_BLUETOOTH)) {
+		bacpy(&wiimote->bdaddr, &remote_addr.l2_bdaddr);
+	}
+	else {
+		bacpy(&wiimote->bdaddr, BDADDR_ANY);
+	}
 
 	/* Global Lock, Store and Increment wiimote_id */
 	err = pthread_mutex_lock(&global_mutex);
@@ -253,11 +321,6 @@ cwiid_wiimote_t *cwiid_new(int ctl_socket, int int_socket, int flags)
 		goto ERR_HND;
 	}
 	status_pipe_init = 1;
-	if (pipe(wiimote->rw_pipe)) {
-		cwiid_err(wiimote, "Pipe creation error (rw pipe): %s", strerror(errno));
-		goto ERR_HND;
-	}
-	rw_pipe_init = 1;
 
 	/* Setup blocking */
 	if (fcntl(wiimote->mesg_pipe[1], F_SETFL, O_NONBLOCK)) {
@@ -284,19 +347,54 @@ cwiid_wiimote_t *cwiid_new(int ctl_socket, int int_socket, int flags)
 		goto ERR_HND;
 	}
 	rw_mutex_init = 1;
+	err = pthread_cond_init(&wiimote->rw_cond, NULL);
+	if (err) {
+		cwiid_err(wiimote, "Condition initialization error (rw cond): %s", strerror(err));
+		goto ERR_HND;
+	}
+	rw_cond_init = 1;
 	err = pthread_mutex_init(&wiimote->rpt_mutex, NULL);
 	if (err) {
 		cwiid_err(wiimote, "Mutex initialization error (rpt mutex): %s", strerror(err));
 		goto ERR_HND;
 	}
 	rpt_mutex_init = 1;
+	err = pthread_mutex_init(&wiimote->tx_mutex, NULL);
+	if (err) {
+		cwiid_err(wiimote, "Mutex initialization error (tx mutex): %s", strerror(err));
+		goto ERR_HND;
+	}
+	tx_mutex_init = 1;
+	err = pthread_mutex_init(&wiimote->out_mutex, NULL);
+	if (err) {
+		cwiid_err(wiimote, "Mutex initialization error (out mutex): %s", strerror(err));
+		goto ERR_HND;
+	}
+	out_mutex_init = 1;
+	err = pthread_cond_init(&wiimote->out_cond, NULL);
+	if (err) {
+		cwiid_err(wiimote, "Condition initialization error (out cond): %s", strerror(err));
+		goto ERR_HND;
+	}
+	out_cond_init = 1;
+	memset(&wiimote->out, 0, sizeof wiimote->out);
+	err = pthread_mutex_init(&wiimote->sub_mutex, NULL);
+	if (err) {
+		cwiid_err(wiimote, "Mutex initialization error (sub mutex): %s", strerror(err));
+		goto ERR_HND;
+	}
+	sub_mutex_init = 1;
 
-	/* Set rw_status before starting router thread */
-	wiimote->rw_status = RW_IDLE;
+	/* Empty rw queue before starting router thread */
+	memset(&wiimote->rw, 0, sizeof wiimote->rw);
 
 	/* Launch interrupt socket listener and dispatch threads */
-	err = pthread_create(&wiimote->router_thread, NULL,
+	if (init_rt_thread_attr(wiimote, &attr, 0)) {
+		goto ERR_HND;
+	}
+	err = pthread_create(&wiimote->router_thread, &attr,
 	                   (void *(*)(void *))&router_thread, wiimote);
+	pthread_attr_destroy(&attr);
 	if (err) {
 		cwiid_err(wiimote, "Thread creation error (router thread): %s", strerror(err));
 		goto ERR_HND;
@@ -319,8 +417,6 @@ cwiid_wiimote_t *cwiid_new(int ctl_socket, int int_socket, int flags)
 	status_thread_init = 1;
 
 	/* Success!  Update state */
-	memset(&wiimote->state, 0, sizeof wiimote->state);
-	wiimote->mesg_callback = NULL;
 	cwiid_set_led(wiimote, 0);
 	cwiid_request_status(wiimote);
 
@@ -349,11 +445,6 @@ ERR_HND:
 				cwiid_err(wiimote, "Pipe close error (status pipe): %s", strerror(errno));
 			}
 		}
-		if (rw_pipe_init) {
-			if (close(wiimote->rw_pipe[0]) || close(wiimote->rw_pipe[1])) {
-				cwiid_err(wiimote, "Pipe close error (rw pipe): %s", strerror(errno));
-			}
-		}
 		/* Destroy Mutexes */
 		if (state_mutex_init) {
 			err = pthread_mutex_destroy(&wiimote->state_mutex);
@@ -367,12 +458,42 @@ ERR_HND:
 				cwiid_err(wiimote, "Mutex destroy error (rw mutex): %s", strerror(err));
 			}
 		}
+		if (rw_cond_init) {
+			err = pthread_cond_destroy(&wiimote->rw_cond);
+			if (err) {
+				cwiid_err(wiimote, "Condition destroy error (rw cond): %s", strerror(err));
+			}
+		}
 		if (rpt_mutex_init) {
 			err = pthread_mutex_destroy(&wiimote->rpt_mutex);
 			if (err) {
 				cwiid_err(wiimote, "Mutex destroy error (rpt mutex): %s", strerror(err));
 			}
 		}
+		if (tx_mutex_init) {
+			err = pthread_mutex_destroy(&wiimote->tx_mutex);
+			if (err) {
+				cwiid_err(wiimote, "Mutex destroy error (tx mutex): %s", strerror(err));
+			}
+		}
+		if (out_mutex_init) {
+			err = pthread_mutex_destroy(&wiimote->out_mutex);
+			if (err) {
+				cwiid_err(wiimote, "Mutex destroy error (out mutex): %s", strerror(err));
+			}
+		}
+		if (out_cond_init) {
+			err = pthread_cond_destroy(&wiimote->out_cond);
+			if (err) {
+				cwiid_err(wiimote, "Condition destroy error (out cond): %s", strerror(err));
+			}
+		}
+		if (sub_mutex_init) {
+			err = pthread_mutex_destroy(&wiimote->sub_mutex);
+			if (err) {
+				cwiid_err(wiimote, "Mutex destroy error (sub mutex): %s", strerror(err));
+			}
+		}
 		free(wiimote);
 	}
 	return NULL;
@@ -383,6 +504,8 @@ int cwiid_close(cwiid_wiimote_t *wiimote)
 	void *pthread_ret;
 	int err;
 
+	close_rumble(wiimote);
+
 	/* Stop rumbling, otherwise wiimote continues to rumble for
 	   few seconds after closing the connection! There should be no
 	   need to check if stopping fails: we are closing the connection
@@ -391,6 +514,30 @@ int cwiid_close(cwiid_wiimote_t *wiimote)
 		cwiid_set_rumble(wiimote, 0);
 	}
 
+	/* Drain and stop the speaker while the router can still ack writes */
+	if (wiimote->speaker) {
+		cwiid_audio_close(wiimote);
+	}
+
+	if (wiimote->shm) {
+		cwiid_unexport_shm(wiimote);
+	}
+
+	/* Queued reads and writes fail, with their callbacks run from here;
+	 * nothing signals the connection fd after this */
+	if (cancel_rw(wiimote)) {
+		/* prints it's own errors */
+	}
+	rw_drain(wiimote);
+	__atomic_store_n(&wiimote->fd_sub, NULL, __ATOMIC_RELEASE);
+
+	/* Subscribers go while the router is still running, as it may hold
+	 * sub_mutex */
+	while (wiimote->subs) {
+		cwiid_unsubscribe(wiimote->subs);
+	}
+	close_resampler(wiimote);
+
 	/* Cancel router_thread and status_thread */
 	if (pthread_cancel(wiimote->router_thread)) {
 		/* if thread quit abnormally, would have printed it's own error */
@@ -406,10 +553,6 @@ int cwiid_close(cwiid_wiimote_t *wiimote)
 		}
 	}
 
-	if (cancel_rw(wiimote)) {
-		/* prints it's own errors */
-	}
-
 	/* Close sockets */
 	if (close(wiimote->int_socket)) {
 		cwiid_err(wiimote, "Socket close error (interrupt socket): %s", strerror(errno));
@@ -424,9 +567,6 @@ int cwiid_close(cwiid_wiimote_t *wiimote)
 	if (close(wiimote->status_pipe[0]) || close(wiimote->status_pipe[1])) {
 		cwiid_err(wiimote, "Pipe close error (status pipe): %s", strerror(errno));
 	}
-	if (close(wiimote->rw_pipe[0]) || close(wiimote->rw_pipe[1])) {
-		cwiid_err(wiimote, "Pipe close error (rw pipe): %s", strerror(errno));
-	}
 	/* Destroy mutexes */
 	err = pthread_mutex_destroy(&wiimote->state_mutex);
 	if (err) {
@@ -436,10 +576,30 @@ int cwiid_close(cwiid_wiimote_t *wiimote)
 	if (err) {
 		cwiid_err(wiimote, "Mutex destroy error (rw): %s", strerror(err));
 	}
+	err = pthread_cond_destroy(&wiimote->rw_cond);
+	if (err) {
+		cwiid_err(wiimote, "Condition destroy error (rw): %s", strerror(err));
+	}
 	err = pthread_mutex_destroy(&wiimote->rpt_mutex);
 	if (err) {
 		cwiid_err(wiimote, "Mutex destroy error (rpt): %s", strerror(err));
 	}
+	err = pthread_mutex_destroy(&wiimote->tx_mutex);
+	if (err) {
+		cwiid_err(wiimote, "Mutex destroy error (tx): %s", strerror(err));
+	}
+	err = pthread_mutex_destroy(&wiimote->out_mutex);
+	if (err) {
+		cwiid_err(wiimote, "Mutex destroy error (out): %s", strerror(err));
+	}
+	err = pthread_cond_destroy(&wiimote->out_cond);
+	if (err) {
+		cwiid_err(wiimote, "Condition destroy error (out): %s", strerror(err));
+	}
+	err = pthread_mutex_destroy(&wiimote->sub_mutex);
+	if (err) {
+		cwiid_err(wiimote, "Mutex destroy error (sub): %s", strerror(err));
+	}
 
 	free(wiimote);
 
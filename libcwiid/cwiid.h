@@ -22,6 +22,7 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <time.h>
+#include <sys/types.h>				/* mode_t */
 #include <bluetooth/bluetooth.h>	/* bdaddr_t */
 
 /* Flags */
@@ -30,6 +31,10 @@
 #define CWIID_FLAG_REPEAT_BTN	0x04
 #define CWIID_FLAG_NONBLOCK	0x08
 #define CWIID_FLAG_MOTIONPLUS	0x10
+#define CWIID_FLAG_RECONNECT	0x20
+#define CWIID_FLAG_CALIBRATED	0x40
+#define CWIID_FLAG_ORIENTATION	0x80
+#define CWIID_FLAG_IR_TRACK	0x100
 
 /* Report Mode Flags */
 #define CWIID_RPT_STATUS		0x01
@@ -186,7 +191,7 @@
 #define WIIMOTE_BDADDR	"WIIMOTE_BDADDR"
 
 /* Callback Maximum Message Count */
-#define CWIID_MAX_MESG_COUNT	5
+#define CWIID_MAX_MESG_COUNT	10
 
 /* Enumerations */
 enum cwiid_command {
@@ -208,6 +213,13 @@ enum cwiid_mesg_type {
 	CWIID_MESG_GUITAR,
 	CWIID_MESG_DRUMS,
 	CWIID_MESG_TURNTABLES,
+	CWIID_MESG_LINK,
+	CWIID_MESG_ACC_CAL,
+	CWIID_MESG_NUNCHUK_CAL,
+	CWIID_MESG_BALANCE_CAL,
+	CWIID_MESG_MOTIONPLUS_CAL,
+	CWIID_MESG_ORIENTATION,
+	CWIID_MESG_CURSOR,
 	CWIID_MESG_ERROR,
 	CWIID_MESG_UNKNOWN
 };
@@ -230,6 +242,11 @@ enum cwiid_error {
 	CWIID_ERROR_COMM
 };
 
+enum cwiid_link_status {
+	CWIID_LINK_DISCONNECTED,
+	CWIID_LINK_RECONNECTED
+};
+
 enum cwiid_guitar_touchbar_states {
 	CWIID_GUITAR_TOUCHBAR_NONE,
 	CWIID_GUITAR_TOUCHBAR_1ST,
@@ -354,6 +371,66 @@ struct cwiid_turntables_mesg {
 	uint16_t buttons;
 };
 
+/* Calibrated messages (CWIID_FLAG_CALIBRATED), sent after the raw
+ * message they are derived from */
+struct cwiid_acc_cal_mesg {
+	enum cwiid_mesg_type type;
+	float acc[3];				/* g */
+};
+
+struct cwiid_nunchuk_cal_mesg {
+	enum cwiid_mesg_type type;
+	float stick[2];				/* -1.0 to 1.0 */
+	float acc[3];				/* g */
+	uint8_t buttons;
+};
+
+/* Center of pressure is relative to the board center, x toward the right
+ * sensors and y toward the top (front) ones; 0 when the board is empty */
+struct cwiid_balance_cal_mesg {
+	enum cwiid_mesg_type type;
+	float right_top;			/* kg, less tare */
+	float right_bottom;
+	float left_top;
+	float left_bottom;
+	float weight;				/* kg, sum of the four */
+	float cop[2];				/* mm */
+};
+
+struct cwiid_motionplus_cal_mesg {
+	enum cwiid_mesg_type type;
+	float angle_rate[3];		/* deg/s */
+};
+
+/* Orientation (CWIID_FLAG_ORIENTATION): unit quaternion rotating the
+ * accelerometer frame into a gravity-aligned (z up) frame */
+struct cwiid_orientation_mesg {
+	enum cwiid_mesg_type type;
+	float q[4];					/* w, x, y, z */
+};
+
+/* IR tracking (CWIID_FLAG_IR_TRACK): sources keep their id across reports
+ * (0 = empty slot, ids wrap), and the sensor bar is reduced to a cursor.
+ * Positions are IR camera pixels, roll is in radians. */
+struct cwiid_ir_track {
+	uint8_t id;
+	uint16_t pos[2];
+};
+
+struct cwiid_cursor_mesg {
+	enum cwiid_mesg_type type;
+	struct cwiid_ir_track track[CWIID_IR_SRC_COUNT];
+	char valid;					/* sensor bar found */
+	float pos[2];				/* smoothed bar midpoint */
+	float distance;				/* bar length on the sensor */
+	float roll;
+};
+
+struct cwiid_link_mesg {
+	enum cwiid_mesg_type type;
+	enum cwiid_link_status status;
+};
+
 struct cwiid_error_mesg {
 	enum cwiid_mesg_type type;
 	enum cwiid_error error;
@@ -372,6 +449,13 @@ union cwiid_mesg {
 	struct cwiid_guitar_mesg guitar_mesg;
 	struct cwiid_drums_mesg drums_mesg;
 	struct cwiid_turntables_mesg turntables_mesg;
+	struct cwiid_link_mesg link_mesg;
+	struct cwiid_acc_cal_mesg acc_cal_mesg;
+	struct cwiid_nunchuk_cal_mesg nunchuk_cal_mesg;
+	struct cwiid_balance_cal_mesg balance_cal_mesg;
+	struct cwiid_motionplus_cal_mesg motionplus_cal_mesg;
+	struct cwiid_orientation_mesg orientation_mesg;
+	struct cwiid_cursor_mesg cursor_mesg;
 	struct cwiid_error_mesg error_mesg;
 };
 
@@ -457,6 +541,10 @@ typedef void cwiid_mesg_callback_t(cwiid_wiimote_t *, int,
                                    union cwiid_mesg [], struct timespec *);
 typedef void cwiid_err_t(cwiid_wiimote_t *, const char *, va_list ap);
 
+typedef struct cwiid_listener cwiid_listener_t;
+typedef void cwiid_listen_callback_t(cwiid_listener_t *, cwiid_wiimote_t *,
+                                     const void *);
+
 /* get_bdinfo */
 #define BT_NO_WIIMOTE_FILTER 0x01
 #define BT_NAME_LEN 32
@@ -467,6 +555,132 @@ struct cwiid_bdinfo {
 	char name[BT_NAME_LEN];
 };
 
+/* HCI backend, replaceable so inquiry code can run without an adapter */
+struct cwiid_hci_backend {
+	int (*get_route)(void);
+	int (*inquiry)(int dev_id, unsigned int timeout, int max_bdinfo,
+	               struct cwiid_bdinfo *bdinfo);
+};
+
+/* inquiry service */
+typedef struct cwiid_inquiry cwiid_inquiry_t;
+
+struct cwiid_inquiry_entry {
+	struct cwiid_bdinfo bdinfo;
+	time_t age;
+	unsigned int serial;
+};
+
+/* speaker */
+#define CWIID_SPEAKER_RATE	3906	/* Hz (3906.25), signed 16 bit mono */
+
+struct cwiid_audio_stats {
+	unsigned long reports;		/* speaker data reports sent */
+	unsigned long underruns;	/* reports padded with silence */
+	unsigned long late;			/* timer ticks missed by the sender */
+	unsigned int queued;		/* samples waiting */
+};
+
+/* output report counters */
+struct cwiid_out_stats {
+	unsigned long reports;		/* LED/rumble and status reports sent */
+	unsigned long merged;		/* requests folded into a pending report */
+	unsigned long dropped;		/* LED/rumble requests already in effect */
+};
+
+/* rumble patterns */
+#define CWIID_RUMBLE_QUEUE	0x01	/* append rather than replace */
+
+struct cwiid_rumble_step {
+	uint16_t duration;			/* ms */
+	uint8_t level;				/* 0 off, 255 full, between is PWM */
+};
+
+/* thread scheduling: flags request mlockall(), the same bits report
+ * which settings could not be applied.  Callback threads started after a
+ * realtime policy or mlock was requested run on a 256 KB stack. */
+#define CWIID_SCHED_POLICY		0x01
+#define CWIID_SCHED_AFFINITY	0x02
+#define CWIID_SCHED_MLOCK		0x04
+
+struct cwiid_sched {
+	int policy;					/* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+	int priority;				/* ignored for SCHED_OTHER */
+	uint64_t cpu_mask;			/* bit n = cpu n, 0 leaves affinity alone */
+	uint8_t flags;				/* CWIID_SCHED_MLOCK */
+};
+
+/* memory dump */
+#define CWIID_DUMP_RETRIES	3	/* per chunk, without progress */
+
+typedef void cwiid_dump_callback_t(cwiid_wiimote_t *, uint32_t done,
+                                   uint32_t len, const void *);
+
+struct cwiid_dump_stats {
+	uint32_t bytes;
+	unsigned int requests;		/* read requests sent */
+	unsigned int retries;
+	float seconds;
+	float rate;					/* bytes/s */
+};
+
+/* queued memory reads and writes */
+#define CWIID_RW_PENDING	1
+
+enum cwiid_rw_op {
+	CWIID_RW_OP_READ,
+	CWIID_RW_OP_WRITE
+};
+
+struct cwiid_rw_req;
+typedef void cwiid_rw_callback_t(cwiid_wiimote_t *, struct cwiid_rw_req *);
+
+/* Owned by the library from cwiid_rw_submit until the callback runs */
+struct cwiid_rw_req {
+	enum cwiid_rw_op op;
+	uint8_t flags;				/* CWIID_RW_EEPROM or CWIID_RW_REG */
+	uint32_t offset;
+	uint16_t len;
+	void *data;
+	cwiid_rw_callback_t *callback;	/* run by cwiid_drain */
+	void *user;
+	/* set by the library */
+	int result;					/* CWIID_RW_PENDING, then 0 or -1 */
+	uint16_t done;				/* bytes transferred */
+	struct cwiid_rw_req *next;
+};
+
+/* shared memory export */
+typedef struct cwiid_shm cwiid_shm_t;
+
+/* subscriptions */
+#define CWIID_MESG_BIT(type)	(1U << (type))
+#define CWIID_MESG_ALL			0xFFFFFFFFU
+#define CWIID_SUB_MAX_DEPTH		4096	/* message arrays */
+#define CWIID_SUB_MAX_RATE		1000	/* Hz */
+
+enum cwiid_sub_mode {
+	CWIID_SUB_CALLBACK,			/* called from a thread per subscriber */
+	CWIID_SUB_FD,				/* readable fd, drained with get_mesg */
+	CWIID_SUB_RING				/* polled with get_mesg */
+};
+
+struct cwiid_sub_stats {
+	unsigned int delivered;		/* message arrays queued */
+	unsigned int dropped;		/* arrays lost to a full queue */
+};
+
+/* how a resampled subscriber folds a period's samples into one message;
+ * IR, orientation and cursor messages only take CWIID_REDUCE_LAST */
+enum cwiid_reduce {
+	CWIID_REDUCE_MEAN,
+	CWIID_REDUCE_LAST,
+	CWIID_REDUCE_MIN,
+	CWIID_REDUCE_MAX
+};
+
+typedef struct cwiid_sub cwiid_sub_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -481,6 +695,12 @@ void cwiid_err_default(struct wiimote *wiimote, const char *str, va_list ap);
 cwiid_wiimote_t *cwiid_open(bdaddr_t *bdaddr, int flags);
 cwiid_wiimote_t *cwiid_open_timeout(bdaddr_t *bdaddr, int flags, int timeout);
 cwiid_wiimote_t *cwiid_listen(int flags);
+cwiid_listener_t *cwiid_listener_open(int flags,
+                                      cwiid_listen_callback_t *callback,
+                                      const void *data);
+cwiid_wiimote_t *cwiid_listener_accept(cwiid_listener_t *listener,
+                                       int timeout);
+int cwiid_listener_close(cwiid_listener_t *listener);
 int cwiid_close(cwiid_wiimote_t *wiimote);
 
 int cwiid_get_id(cwiid_wiimote_t *wiimote);
@@ -492,15 +712,22 @@ int cwiid_disable(cwiid_wiimote_t *wiimote, int flags);
 /* Interfaces */
 int cwiid_set_mesg_callback(cwiid_wiimote_t *wiimote,
                        cwiid_mesg_callback_t *callback);
+int cwiid_set_sched(cwiid_wiimote_t *wiimote, const struct cwiid_sched *sched);
 int cwiid_get_mesg(cwiid_wiimote_t *wiimote, int *mesg_count,
                    union cwiid_mesg *mesg[], struct timespec *timestamp);
+int cwiid_get_fd(cwiid_wiimote_t *wiimote);
+int cwiid_drain(cwiid_wiimote_t *wiimote, cwiid_mesg_callback_t *callback);
 int cwiid_get_state(cwiid_wiimote_t *wiimote, struct cwiid_state *state);
 int cwiid_get_acc_cal(struct wiimote *wiimote, enum cwiid_ext_type ext_type,
                       struct acc_cal *acc_cal);
-int cwiid_get_gyro_cal(struct wiimote *wiimote, enum cwiid_ext_type ext_type,
-                      struct acc_cal *acc_cal);
+int cwiid_get_gyro_cal(struct wiimote *wiimote,
+                       struct motionplus_cal *gyro_cal);
 int cwiid_get_balance_cal(struct wiimote *wiimote,
                           struct balance_cal *balance_cal);
+int cwiid_set_orientation_gain(cwiid_wiimote_t *wiimote, float gain);
+int cwiid_set_balance_tare(cwiid_wiimote_t *wiimote, int tare);
+int cwiid_set_deadband(cwiid_wiimote_t *wiimote, enum cwiid_mesg_type type,
+                       int deadband);
 
 /* Operations */
 int cwiid_command(cwiid_wiimote_t *wiimote, enum cwiid_command command,
@@ -508,6 +735,8 @@ int cwiid_command(cwiid_wiimote_t *wiimote, enum cwiid_command command,
 int cwiid_send_rpt(cwiid_wiimote_t *wiimote, uint8_t flags, uint8_t report,
                    size_t len, const void *data);
 int cwiid_request_status(cwiid_wiimote_t *wiimote);
+int cwiid_get_out_stats(cwiid_wiimote_t *wiimote,
+                        struct cwiid_out_stats *stats);
 int cwiid_set_led(cwiid_wiimote_t *wiimote, uint8_t led);
 int cwiid_set_rumble(cwiid_wiimote_t *wiimote, uint8_t rumble);
 int cwiid_set_rpt_mode(cwiid_wiimote_t *wiimote, uint16_t rpt_mode);
@@ -515,12 +744,68 @@ int cwiid_read(cwiid_wiimote_t *wiimote, uint8_t flags, uint32_t offset,
                uint16_t len, void *data);
 int cwiid_write(cwiid_wiimote_t *wiimote, uint8_t flags, uint32_t offset,
                 uint16_t len, const void *data);
-/* int cwiid_beep(cwiid_wiimote_t *wiimote); */
+int cwiid_rw_submit(cwiid_wiimote_t *wiimote, struct cwiid_rw_req *req);
+int cwiid_dump(cwiid_wiimote_t *wiimote, uint8_t flags, uint32_t offset,
+               uint32_t len, void *data, cwiid_dump_callback_t *callback,
+               const void *cb_data, struct cwiid_dump_stats *stats);
+int cwiid_dump_fd(cwiid_wiimote_t *wiimote, uint8_t flags, uint32_t offset,
+                  uint32_t len, int fd, cwiid_dump_callback_t *callback,
+                  const void *cb_data, struct cwiid_dump_stats *stats);
+int cwiid_beep(cwiid_wiimote_t *wiimote);
+int cwiid_rumble_play(cwiid_wiimote_t *wiimote,
+                      const struct cwiid_rumble_step *steps, int count,
+                      int repeat, uint8_t flags);
+int cwiid_rumble_stop(cwiid_wiimote_t *wiimote);
+
+/* Speaker streaming */
+int cwiid_audio_open(cwiid_wiimote_t *wiimote);
+int cwiid_audio_write(cwiid_wiimote_t *wiimote, const int16_t *pcm,
+                      unsigned int count);
+int cwiid_audio_get_stats(cwiid_wiimote_t *wiimote,
+                          struct cwiid_audio_stats *stats);
+int cwiid_audio_close(cwiid_wiimote_t *wiimote);
+
+/* Subscriptions */
+cwiid_sub_t *cwiid_subscribe(cwiid_wiimote_t *wiimote, uint32_t mask,
+                             enum cwiid_sub_mode mode, unsigned int depth,
+                             cwiid_mesg_callback_t *callback);
+int cwiid_unsubscribe(cwiid_sub_t *sub);
+int cwiid_sub_set_mask(cwiid_sub_t *sub, uint32_t mask);
+int cwiid_sub_get_fd(cwiid_sub_t *sub);
+int cwiid_sub_get_mesg(cwiid_sub_t *sub, int *mesg_count,
+                       union cwiid_mesg mesg[], struct timespec *timestamp);
+int cwiid_sub_get_stats(cwiid_sub_t *sub, struct cwiid_sub_stats *stats);
+int cwiid_sub_set_rate(cwiid_sub_t *sub, float rate);
+int cwiid_sub_set_reduce(cwiid_sub_t *sub, enum cwiid_mesg_type type,
+                         enum cwiid_reduce reduce);
+
+/* Shared memory export */
+int cwiid_export_shm(cwiid_wiimote_t *wiimote, const char *name);
+int cwiid_export_shm_mode(cwiid_wiimote_t *wiimote, const char *name,
+                          mode_t mode);
+int cwiid_unexport_shm(cwiid_wiimote_t *wiimote);
+cwiid_shm_t *cwiid_attach_shm(const char *name);
+int cwiid_detach_shm(cwiid_shm_t *shm);
+int cwiid_shm_get_state(cwiid_shm_t *shm, struct cwiid_state *state,
+                        unsigned int *serial);
+int cwiid_shm_get_mesg(cwiid_shm_t *shm, unsigned int *serial,
+                       int *mesg_count, union cwiid_mesg mesg[],
+                       struct timespec *timestamp, int timeout);
 
 /* HCI functions */
 int cwiid_get_bdinfo_array(int dev_id, unsigned int timeout, int max_bdinfo,
                            struct cwiid_bdinfo **bdinfo, uint8_t flags);
 int cwiid_find_wiimote(bdaddr_t *bdaddr, int timeout);
+int cwiid_set_hci_backend(const struct cwiid_hci_backend *backend);
+
+/* Inquiry service */
+cwiid_inquiry_t *cwiid_inquiry_start(int dev_id, unsigned int period,
+                                     uint8_t flags);
+int cwiid_inquiry_stop(cwiid_inquiry_t *inquiry);
+int cwiid_inquiry_lookup(cwiid_inquiry_t *inquiry, int max_age,
+                         int max_entries, struct cwiid_inquiry_entry *entries);
+int cwiid_inquiry_wait(cwiid_inquiry_t *inquiry, unsigned int *serial,
+                       struct cwiid_inquiry_entry *entry, int timeout);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,517 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* C++ interface (C++20), header only.  Connections and subscriptions are
+ * move-only handles that close themselves; message arrays are passed as
+ * std::span over the library's own buffers; and cwiid::visit dispatches a
+ * message to whichever overload of a visitor takes its struct, through a
+ * plain switch on the type (no virtual calls, no allocation).  Types the
+ * visitor has no overload for are skipped.  Everything not wrapped here
+ * is reachable through get() and the C API.
+ *
+ * Coroutines: inside a cwiid::task, co_await wm.read(...), wm.write(...)
+ * and wm.next<cwiid_ir_mesg>() suspend until the reply or message comes
+ * in.  They are resumed from wm.drain(), so any number of them, across
+ * any number of connections, run on the thread that polls the fds. */
+
+#ifndef CWIID_HPP
+#define CWIID_HPP
+
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "cwiid.h"
+
+namespace cwiid {
+
+using mesg_span = std::span<union cwiid_mesg>;
+
+/* Thrown when a call fails; the library has already reported why through
+ * the cwiid_set_err handler */
+class error : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+namespace detail {
+
+inline void check(int ret, const char *what)
+{
+	if (ret) {
+		throw error(what);
+	}
+}
+
+/* Message struct for each type, and back */
+template <enum cwiid_mesg_type Type> struct mesg_traits;
+template <class Mesg> struct mesg_type_of;
+
+#define CWIID_MESG_TRAITS(TYPE, MEMBER) \
+	template <> struct mesg_traits<TYPE> { \
+		using type = decltype(cwiid_mesg::MEMBER); \
+		static type &get(union cwiid_mesg &mesg) { return mesg.MEMBER; } \
+	}; \
+	template <> struct mesg_type_of<decltype(cwiid_mesg::MEMBER)> { \
+		static constexpr enum cwiid_mesg_type value = TYPE; \
+	}
+
+CWIID_MESG_TRAITS(CWIID_MESG_STATUS, status_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_BTN, btn_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_ACC, acc_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_IR, ir_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_NUNCHUK, nunchuk_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_CLASSIC, classic_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_BALANCE, balance_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_MOTIONPLUS, motionplus_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_GUITAR, guitar_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_DRUMS, drums_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_TURNTABLES, turntables_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_LINK, link_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_ACC_CAL, acc_cal_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_NUNCHUK_CAL, nunchuk_cal_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_BALANCE_CAL, balance_cal_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_MOTIONPLUS_CAL, motionplus_cal_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_ORIENTATION, orientation_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_CURSOR, cursor_mesg);
+CWIID_MESG_TRAITS(CWIID_MESG_ERROR, error_mesg);
+
+#undef CWIID_MESG_TRAITS
+
+template <enum cwiid_mesg_type Type, class Visitor>
+inline void visit_as(union cwiid_mesg &mesg, Visitor &visitor)
+{
+	using type = typename mesg_traits<Type>::type;
+
+	if constexpr (std::is_invocable_v<Visitor &, type &>) {
+		visitor(mesg_traits<Type>::get(mesg));
+	}
+}
+
+/* The C callbacks carry no user pointer; drain runs them on the calling
+ * thread, so the visitor can be handed over in a thread local */
+template <class Visitor>
+inline thread_local Visitor *drain_visitor = nullptr;
+
+/* A coroutine suspended in wiimote::next, linked into the wiimote */
+struct mesg_waiter {
+	enum cwiid_mesg_type type;
+	union cwiid_mesg mesg;
+	std::coroutine_handle<> handle;
+	mesg_waiter *next;
+};
+
+/* A coroutine suspended on a read or write */
+class rw_awaiter {
+public:
+	rw_awaiter(cwiid_wiimote_t *wiimote, enum cwiid_rw_op op, uint8_t flags,
+	           uint32_t offset, void *data, std::size_t len)
+	  : wiimote_(wiimote), req_()
+	{
+		if (len > UINT16_MAX) {
+			throw error("cwiid::wiimote: rw length");
+		}
+		req_.op = op;
+		req_.flags = flags;
+		req_.offset = offset;
+		req_.len = static_cast<uint16_t>(len);
+		req_.data = data;
+		req_.callback = &complete;
+		req_.user = this;
+	}
+	rw_awaiter(const rw_awaiter &) = delete;
+	rw_awaiter &operator=(const rw_awaiter &) = delete;
+
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> handle)
+	{
+		handle_ = handle;
+		if (cwiid_rw_submit(wiimote_, &req_)) {
+			/* resume at once, and throw */
+			req_.result = -1;
+			return false;
+		}
+		return true;
+	}
+	/* Bytes transferred */
+	std::size_t await_resume() const
+	{
+		if (req_.result) {
+			throw error(req_.op == CWIID_RW_OP_READ ? "cwiid_read"
+			                                        : "cwiid_write");
+		}
+		return req_.done;
+	}
+
+private:
+	static void complete(cwiid_wiimote_t *, struct cwiid_rw_req *req)
+	{
+		static_cast<rw_awaiter *>(req->user)->handle_.resume();
+	}
+
+	cwiid_wiimote_t *wiimote_;
+	struct cwiid_rw_req req_;
+	std::coroutine_handle<> handle_;
+};
+
+} /* namespace detail */
+
+/* Fire and forget coroutine: runs until its first co_await at once, and
+ * frees itself when it returns.  An escaping exception terminates. */
+struct task {
+	struct promise_type {
+		task get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+/* Overload set from lambdas:
+ * cwiid::visit(mesg, cwiid::overload{[](cwiid_btn_mesg &m) {...}, ...}) */
+template <class... Fn>
+struct overload : Fn... {
+	using Fn::operator()...;
+};
+template <class... Fn> overload(Fn...) -> overload<Fn...>;
+
+template <class Visitor>
+inline void visit(union cwiid_mesg &mesg, Visitor &&visitor)
+{
+	switch (mesg.type) {
+#define CWIID_VISIT_CASE(TYPE) \
+	case TYPE: \
+		detail::visit_as<TYPE>(mesg, visitor); \
+		break
+	CWIID_VISIT_CASE(CWIID_MESG_STATUS);
+	CWIID_VISIT_CASE(CWIID_MESG_BTN);
+	CWIID_VISIT_CASE(CWIID_MESG_ACC);
+	CWIID_VISIT_CASE(CWIID_MESG_IR);
+	CWIID_VISIT_CASE(CWIID_MESG_NUNCHUK);
+	CWIID_VISIT_CASE(CWIID_MESG_CLASSIC);
+	CWIID_VISIT_CASE(CWIID_MESG_BALANCE);
+	CWIID_VISIT_CASE(CWIID_MESG_MOTIONPLUS);
+	CWIID_VISIT_CASE(CWIID_MESG_GUITAR);
+	CWIID_VISIT_CASE(CWIID_MESG_DRUMS);
+	CWIID_VISIT_CASE(CWIID_MESG_TURNTABLES);
+	CWIID_VISIT_CASE(CWIID_MESG_LINK);
+	CWIID_VISIT_CASE(CWIID_MESG_ACC_CAL);
+	CWIID_VISIT_CASE(CWIID_MESG_NUNCHUK_CAL);
+	CWIID_VISIT_CASE(CWIID_MESG_BALANCE_CAL);
+	CWIID_VISIT_CASE(CWIID_MESG_MOTIONPLUS_CAL);
+	CWIID_VISIT_CASE(CWIID_MESG_ORIENTATION);
+	CWIID_VISIT_CASE(CWIID_MESG_CURSOR);
+	CWIID_VISIT_CASE(CWIID_MESG_ERROR);
+#undef CWIID_VISIT_CASE
+	default:
+		break;
+	}
+}
+
+template <class Visitor>
+inline void visit(mesg_span mesgs, Visitor &&visitor)
+{
+	for (union cwiid_mesg &mesg : mesgs) {
+		visit(mesg, visitor);
+	}
+}
+
+/* Subscription (cwiid_subscribe), in fd or ring mode */
+class subscription {
+public:
+	subscription() noexcept = default;
+	explicit subscription(cwiid_sub_t *sub) noexcept : sub_(sub) {}
+	subscription(subscription &&other) noexcept
+	  : sub_(std::exchange(other.sub_, nullptr)) {}
+	subscription &operator=(subscription &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			sub_ = std::exchange(other.sub_, nullptr);
+		}
+		return *this;
+	}
+	subscription(const subscription &) = delete;
+	subscription &operator=(const subscription &) = delete;
+	~subscription() { reset(); }
+
+	cwiid_sub_t *get() const noexcept { return sub_; }
+	explicit operator bool() const noexcept { return sub_ != nullptr; }
+	cwiid_sub_t *release() noexcept { return std::exchange(sub_, nullptr); }
+	void reset() noexcept
+	{
+		if (sub_) {
+			cwiid_unsubscribe(std::exchange(sub_, nullptr));
+		}
+	}
+
+	int fd() const { return cwiid_sub_get_fd(sub_); }
+	void set_mask(uint32_t mask)
+	{
+		detail::check(cwiid_sub_set_mask(sub_, mask), "cwiid_sub_set_mask");
+	}
+	void set_rate(float rate)
+	{
+		detail::check(cwiid_sub_set_rate(sub_, rate), "cwiid_sub_set_rate");
+	}
+
+	/* Next queued array, as a view into buf; empty if the queue is */
+	mesg_span get_mesg(union cwiid_mesg (&buf)[CWIID_MAX_MESG_COUNT],
+	                   struct timespec *timestamp = nullptr)
+	{
+		int count;
+
+		switch (cwiid_sub_get_mesg(sub_, &count, buf, timestamp)) {
+		case 0:
+			return mesg_span(buf, count);
+		case 1:
+			return mesg_span();
+		default:
+			throw error("cwiid_sub_get_mesg");
+		}
+	}
+
+private:
+	cwiid_sub_t *sub_ = nullptr;
+};
+
+/* Connection */
+class wiimote {
+public:
+	wiimote() noexcept = default;
+	/* Takes ownership of an open connection */
+	explicit wiimote(cwiid_wiimote_t *wiimote) noexcept : wiimote_(wiimote) {}
+	wiimote(bdaddr_t bdaddr, int flags = 0, int timeout = -1)
+	{
+		if (!(wiimote_ = cwiid_open_timeout(&bdaddr, flags, timeout))) {
+			throw error("cwiid_open");
+		}
+	}
+	wiimote(wiimote &&other) noexcept
+	  : wiimote_(std::exchange(other.wiimote_, nullptr)),
+	    waiters_(std::exchange(other.waiters_, nullptr)) {}
+	wiimote &operator=(wiimote &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			wiimote_ = std::exchange(other.wiimote_, nullptr);
+			waiters_ = std::exchange(other.waiters_, nullptr);
+		}
+		return *this;
+	}
+	wiimote(const wiimote &) = delete;
+	wiimote &operator=(const wiimote &) = delete;
+	~wiimote() { reset(); }
+
+	cwiid_wiimote_t *get() const noexcept { return wiimote_; }
+	explicit operator bool() const noexcept { return wiimote_ != nullptr; }
+	cwiid_wiimote_t *release() noexcept
+	{
+		return std::exchange(wiimote_, nullptr);
+	}
+	/* Subscriptions must be gone first: cwiid_close frees them.  Queued
+	 * reads and writes resume (and throw) from here, so the handle stays
+	 * set until the close returns; coroutines waiting on next() are left
+	 * suspended. */
+	void reset() noexcept
+	{
+		if (wiimote_) {
+			cwiid_close(wiimote_);
+			wiimote_ = nullptr;
+		}
+		waiters_ = nullptr;
+	}
+
+	int id() const { return cwiid_get_id(wiimote_); }
+	void enable(int flags)
+	{
+		detail::check(cwiid_enable(wiimote_, flags), "cwiid_enable");
+	}
+	void disable(int flags)
+	{
+		detail::check(cwiid_disable(wiimote_, flags), "cwiid_disable");
+	}
+	void set_rpt_mode(uint16_t rpt_mode)
+	{
+		detail::check(cwiid_set_rpt_mode(wiimote_, rpt_mode),
+		              "cwiid_set_rpt_mode");
+	}
+	void set_led(uint8_t led)
+	{
+		detail::check(cwiid_set_led(wiimote_, led), "cwiid_set_led");
+	}
+	void set_rumble(uint8_t rumble)
+	{
+		detail::check(cwiid_set_rumble(wiimote_, rumble), "cwiid_set_rumble");
+	}
+	void request_status()
+	{
+		detail::check(cwiid_request_status(wiimote_), "cwiid_request_status");
+	}
+	struct cwiid_state state() const
+	{
+		struct cwiid_state state;
+
+		detail::check(cwiid_get_state(wiimote_, &state), "cwiid_get_state");
+		return state;
+	}
+	subscription subscribe(uint32_t mask, enum cwiid_sub_mode mode,
+	                       unsigned int depth)
+	{
+		cwiid_sub_t *sub;
+
+		if (mode == CWIID_SUB_CALLBACK) {
+			throw error("cwiid::wiimote::subscribe: callback mode");
+		}
+		if (!(sub = cwiid_subscribe(wiimote_, mask, mode, depth, nullptr))) {
+			throw error("cwiid_subscribe");
+		}
+		return subscription(sub);
+	}
+
+	/* Awaitables, for use in a cwiid::task.  The buffer must outlive the
+	 * co_await; each resumes from drain() with the bytes transferred. */
+	detail::rw_awaiter read(uint8_t flags, uint32_t offset,
+	                        std::span<unsigned char> data)
+	{
+		return detail::rw_awaiter(wiimote_, CWIID_RW_OP_READ, flags, offset,
+		                          data.data(), data.size());
+	}
+	detail::rw_awaiter write(uint8_t flags, uint32_t offset,
+	                         std::span<const unsigned char> data)
+	{
+		/* only read from */
+		return detail::rw_awaiter(wiimote_, CWIID_RW_OP_WRITE, flags, offset,
+		                          const_cast<unsigned char *>(data.data()),
+		                          data.size());
+	}
+
+	/* co_await wm.next<cwiid_btn_mesg>() gives the next message of that
+	 * type seen by drain() */
+	template <class Mesg>
+	auto next()
+	{
+		struct awaiter {
+			wiimote &wm;
+			detail::mesg_waiter waiter;
+
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> handle) noexcept
+			{
+				waiter.type = detail::mesg_type_of<Mesg>::value;
+				waiter.handle = handle;
+				waiter.next = wm.waiters_;
+				wm.waiters_ = &waiter;
+			}
+			Mesg await_resume() noexcept
+			{
+				return detail::mesg_traits<detail::mesg_type_of<Mesg>::value>::
+				  get(waiter.mesg);
+			}
+		};
+
+		return awaiter{*this, {}};
+	}
+
+	/* cwiid_get_fd / cwiid_drain, with the visitor called for every
+	 * message and coroutines resumed.  Returns the number of arrays and
+	 * rw completions drained. */
+	int fd()
+	{
+		int fd;
+
+		if ((fd = cwiid_get_fd(wiimote_)) == -1) {
+			throw error("cwiid_get_fd");
+		}
+		return fd;
+	}
+	template <class Visitor>
+	int drain(Visitor &&visitor)
+	{
+		using visitor_type = std::remove_reference_t<Visitor>;
+		/* a resumed coroutine may drain again, with the same visitor type */
+		visitor_type *saved_visitor = detail::drain_visitor<visitor_type>;
+		wiimote *saved_wiimote = drain_wiimote<visitor_type>;
+		int ret;
+
+		detail::drain_visitor<visitor_type> = &visitor;
+		drain_wiimote<visitor_type> = this;
+		ret = cwiid_drain(wiimote_,
+		                  [](cwiid_wiimote_t *, int count, union cwiid_mesg mesg[],
+		                     struct timespec *) {
+			wiimote *wm = drain_wiimote<visitor_type>;
+
+			for (int i = 0; i < count; i++) {
+				if (wm->waiters_) {
+					wm->wake(mesg[i]);
+				}
+				visit(mesg[i], *detail::drain_visitor<visitor_type>);
+			}
+		});
+		detail::drain_visitor<visitor_type> = saved_visitor;
+		drain_wiimote<visitor_type> = saved_wiimote;
+		if (ret == -1) {
+			throw error("cwiid_drain");
+		}
+		return ret;
+	}
+
+	/* Only resumes coroutines */
+	int drain()
+	{
+		return drain([](auto &) {});
+	}
+
+private:
+	template <class Visitor>
+	static inline thread_local wiimote *drain_wiimote = nullptr;
+
+	/* Resume the waiters for mesg's type.  They are unlinked first, as a
+	 * resumed coroutine may wait again straight away. */
+	void wake(const union cwiid_mesg &mesg)
+	{
+		detail::mesg_waiter **prev = &waiters_, *waiter, *woken = nullptr;
+
+		while ((waiter = *prev)) {
+			if (waiter->type == mesg.type) {
+				*prev = waiter->next;
+				waiter->mesg = mesg;
+				waiter->next = woken;
+				woken = waiter;
+			}
+			else {
+				prev = &waiter->next;
+			}
+		}
+		while ((waiter = woken)) {
+			woken = waiter->next;
+			waiter->handle.resume();
+		}
+	}
+
+	cwiid_wiimote_t *wiimote_ = nullptr;
+	detail::mesg_waiter *waiters_ = nullptr;
+};
+
+} /* namespace cwiid */
+
+#endif
@@ -26,6 +26,18 @@
 
 #define DEFAULT_TIMEOUT	5
 
+/* Reconnect backoff, milliseconds */
+#define RECONNECT_MIN_DELAY	500
+#define RECONNECT_MAX_DELAY	8000
+
+#define BT_MAX_INQUIRY 128
+
+/* The router thread runs on a small fixed stack, so mlockall() pins
+ * 256 KB for it rather than the default 8 MB.  Threads running user
+ * callbacks only get it once cwiid_set_sched asked for a realtime policy
+ * or mlock; otherwise they keep the default stack. */
+#define RT_THREAD_STACK	(256 * 1024)
+
 /* Bluetooth magic numbers */
 #define BT_TRANS_MASK		0xF0
 #define BT_TRANS_HANDSHAKE	0x00
@@ -105,6 +117,48 @@
 #define MPLUS_EXT_UNKNOWN	0xFF
 //#define MPLUS_EXT_CLASSIC
 
+/* Extension descriptors (ext.c).  Each message layout is decoded by a
+ * function generated from its field list. */
+#define EXT_MAX_IDS		2
+#define EXT_MAX_MESGS	2
+
+/* (data[byte] & mask) == value; a zero mask always matches */
+struct ext_match {
+	uint8_t byte;
+	uint8_t mask;
+	uint8_t value;
+};
+
+/* Value ranges for MAP(), first match wins; the last entry
+ * should cover 0 to 0xFF */
+struct ext_range {
+	uint8_t lo;
+	uint8_t hi;
+	int value;
+};
+
+struct ext_mesg_desc {
+	enum cwiid_mesg_type type;
+	uint16_t rpt_flag;
+	struct ext_match select;	/* which report layout this is */
+	void (*decode)(const unsigned char *data, union cwiid_mesg *mesg);
+};
+
+/* ID bytes at 0xA400FE, and for instruments the byte at 0xA400FA */
+struct ext_id {
+	uint16_t id;
+	int16_t sub;				/* -1: any */
+};
+
+struct ext_desc {
+	struct ext_id id[EXT_MAX_IDS];
+	int id_count;
+	uint16_t rpt_flag;
+	uint8_t rpt_type;			/* fixed report type, 0 for any */
+	struct ext_mesg_desc mesg[EXT_MAX_MESGS];
+	int mesg_count;
+};
+
 /* IR Enable blocks */
 #define MARCAN_IR_BLOCK_1			"\x00\x00\x00\x00\x00\x00\x90\x00\xC0"
 #define MARCAN_IR_BLOCK_2			"\x40\x00"
@@ -139,27 +193,269 @@ struct write_seq {
 
 #define SEQ_LEN(seq) (sizeof(seq)/sizeof(struct write_seq))
 
+/* Calibration cache flags */
+#define CAL_ACC			0x01
+#define CAL_NUNCHUK		0x02
+#define CAL_BALANCE		0x04
+#define CAL_EXT_MASK	(CAL_NUNCHUK | CAL_BALANCE)
+
+/* Calibration scale factors, applied by the router thread */
+struct acc_scale {
+	float zero[3];
+	float gain[3];
+};
+
+struct cal_scale {
+	struct acc_scale acc;
+	struct acc_scale nunchuk;
+	float stick_center[2];
+	float stick_gain[2][2];		/* [axis][below center, above center] */
+	float gyro_zero[3];
+	float gyro_gain[2];			/* [fast, slow], indexed by low_speed */
+	float balance_knee[4];		/* reading at 17 kg */
+	float balance_gain[4][2];	/* [sensor][below knee, above knee] */
+	float balance_offset[4][2];	/* kg = raw * gain + offset, tare included */
+	float balance_tare[4];		/* kg */
+};
+
+/* Balance board tare: requested by the application, averaged over the
+ * next BALANCE_TARE_COUNT reports by the router thread */
+#define BALANCE_TARE_COUNT	64
+
+enum balance_tare_request {
+	BALANCE_TARE_NONE,
+	BALANCE_TARE_START,
+	BALANCE_TARE_CLEAR
+};
+
+struct balance_tare {
+	int request;				/* enum balance_tare_request */
+	int count;					/* reports averaged, -1 when idle */
+	float sum[4];
+};
+
+/* MotionPlus bias estimation: zero points are re-estimated from a sliding
+ * window of raw samples whenever the remote is at rest */
+#define GYRO_BIAS_WINDOW	64
+
+struct gyro_sample {
+	uint16_t angle_rate[3];
+	uint16_t acc[3];
+	uint8_t fast;
+};
+
+struct gyro_bias {
+	struct gyro_sample sample[GYRO_BIAS_WINDOW];
+	int64_t sum[6];				/* angle_rate[3], acc[3] */
+	int64_t sum_sq[6];
+	int fast_count;
+	int index;
+	int count;
+	uint16_t acc[3];			/* last accelerometer reading */
+	char valid;
+};
+
+/* IR tracker state, owned by the router thread */
+struct ir_track {
+	uint8_t id;					/* 0 = free */
+	uint8_t missed;				/* reports since last matched */
+	int8_t size;
+	float pos[2];
+	float vel[2];				/* pixels per report */
+};
+
+struct ir_tracker {
+	struct ir_track track[CWIID_IR_SRC_COUNT];
+	uint8_t next_id;
+	uint8_t bar_id[2];			/* tracks forming the sensor bar */
+	float bar_offset[2];		/* bar_id[1] - bar_id[0] when last seen */
+	float cursor[2];
+	char cursor_valid;
+};
+
+/* Orientation filter state, owned by the router thread */
+struct fusion {
+	float q[4];					/* w, x, y, z */
+	float gain;
+	struct timespec last;
+	char valid;
+};
+
+/* Deadband filter (deadband.c).  band and enabled are set by the
+ * application, the rest belongs to the router. */
+struct deadband {
+	uint32_t enabled;			/* CWIID_MESG_BIT mask */
+	int band[CWIID_MESG_UNKNOWN];
+	uint32_t valid;				/* types with a message in last */
+	union cwiid_mesg last[CWIID_MESG_UNKNOWN];	/* last passed on */
+};
+
+/* Speaker stream: PCM ring filled by the application, drained by the
+ * speaker thread.  head is written only by the producer, tail only by the
+ * speaker thread. */
+#define SPEAKER_RING_LEN	4096	/* samples, power of 2 */
+
+struct speaker {
+	pthread_t thread;
+	int timer_fd;
+	int16_t ring[SPEAKER_RING_LEN];
+	unsigned int head;
+	unsigned int tail;
+	char closing;
+	int predictor;				/* ADPCM encoder state */
+	int step;
+	struct cwiid_audio_stats stats;
+};
+
+/* Rumble pattern queue, shared between callers and the rumble thread
+ * under mutex */
+#define RUMBLE_QUEUE_LEN	64	/* steps */
+
+struct rumble {
+	struct wiimote *wiimote;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	int timer_fd;
+	struct cwiid_rumble_step step[RUMBLE_QUEUE_LEN];
+	int head;
+	int count;
+	int64_t start;				/* CLOCK_MONOTONIC ns, step[head] start */
+	char closing;
+};
+
+/* Output stage (command.c), under out_mutex */
+#define OUT_LED_RUMBLE	0x01
+#define OUT_STATUS		0x02
+#define OUT_RESULTS		8		/* rounds whose result is kept */
+
+struct out_queue {
+	uint8_t pending;			/* OUT_* requests for the next round */
+	char busy;					/* a caller is sending rounds */
+	unsigned int started;		/* rounds */
+	unsigned int finished;
+	int result[OUT_RESULTS];
+	uint8_t led;				/* last LED/rumble the wiimote acked */
+	uint8_t rumble;
+	char valid;
+	struct timespec last;		/* end of the last round */
+	struct cwiid_out_stats stats;
+};
+
 /* Message arrays */
+#define RAW_ACC			0
+#define RAW_IR			1
+#define RAW_EXT			2
+#define RAW_FIELDS		3
+#define RAW_BIT(field)	(1 << (field))
+#define RAW_MAX_LEN		21
+
 struct mesg_array {
 	uint8_t count;
 	struct timespec timestamp;
 	union cwiid_mesg array[CWIID_MAX_MESG_COUNT];
+	/* Decode on demand (router side, never sent down mesg_pipe): report
+	 * fields whose message type is not in decode are left packed, and
+	 * raw points into the report for update_state to keep */
+	uint32_t decode;
+	struct timespec mono;		/* CLOCK_MONOTONIC, for intervals */
+	uint8_t raw_valid;			/* RAW_BIT mask */
+	const unsigned char *raw[RAW_FIELDS];
+	uint8_t raw_len[RAW_FIELDS];
 };
 
-/* RW State/Mesg */
-enum rw_status {
-	RW_IDLE,
-	RW_READ,
-	RW_WRITE,
-	RW_CANCEL
+/* Report fields newer than the state, under state_mutex.  Unpacked by
+ * whoever next reads the state. */
+struct raw_state {
+	uint8_t pending;			/* RAW_BIT mask */
+	unsigned char data[RAW_FIELDS][RAW_MAX_LEN];
+	uint8_t len[RAW_FIELDS];
 };
 
-struct rw_mesg {
-	enum rw_status type;
-	uint8_t error;
-	uint32_t offset;
-	uint8_t len;
-	char data[16];
+/* Shared memory segment (shm.c).  Written only by the exporting process,
+ * under state_mutex; each seq is odd while its record is being written. */
+#define SHM_MAGIC		0x43574944	/* "CWID" */
+#define SHM_VERSION		1
+#define SHM_RING_LEN	64			/* message arrays, power of 2 */
+
+struct shm_slot {
+	unsigned int seq;
+	unsigned int serial;
+	uint8_t count;
+	struct timespec timestamp;
+	union cwiid_mesg array[CWIID_MAX_MESG_COUNT];
+};
+
+struct shm_segment {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;				/* sizeof(struct shm_segment) */
+	unsigned int alive;			/* cleared when the export is withdrawn */
+	unsigned int head;			/* serial of the newest slot, futex */
+	unsigned int state_seq;
+	unsigned int state_serial;	/* last array folded into state */
+	struct cwiid_state state;
+	struct shm_slot slot[SHM_RING_LEN];
+};
+
+/* Subscriber (subscribe.c).  The ring is filled only by the router and
+ * status threads under sub_mutex, and drained only by the subscriber.
+ * waiting is set by a subscriber about to sleep (or report an empty
+ * ring), and tells the producer to signal fd. */
+#define SUB_CLOSE_JOIN	1			/* unsubscriber joins the thread */
+#define SUB_CLOSE_SELF	2			/* thread cleans up after itself */
+#define FD_SUB_DEPTH	256			/* queue behind cwiid_get_fd */
+
+struct cwiid_sub {
+	struct wiimote *wiimote;
+	uint32_t mask;
+	enum cwiid_sub_mode mode;
+	cwiid_mesg_callback_t *callback;
+	pthread_t thread;
+	int fd;						/* eventfd, -1 in ring mode */
+	char waiting;
+	char closing;
+	unsigned int len;			/* power of 2 */
+	unsigned int head;
+	unsigned int tail;
+	struct mesg_array *ring;
+	struct cwiid_sub_stats stats;
+	uint8_t reduce[CWIID_MESG_UNKNOWN];	/* enum cwiid_reduce */
+	struct resample *resample;	/* NULL unless a rate is set */
+	struct cwiid_sub *next;
+};
+
+/* Resampling (resample.c), under sub_mutex.  next is the end of the
+ * current period on CLOCK_MONOTONIC (0 until the resampler has seen the
+ * subscriber); value holds the running sum, minimum or maximum of each
+ * numeric field, in field table order. */
+#define RESAMPLE_MAX_VALUES	8
+
+struct resample_accum {
+	unsigned int count;
+	union cwiid_mesg last;
+	double value[RESAMPLE_MAX_VALUES];
+};
+
+struct resample {
+	int64_t period;				/* ns */
+	int64_t next;
+	struct resample_accum accum[CWIID_MESG_UNKNOWN];
+};
+
+/* One per connection, started by the first cwiid_sub_set_rate */
+struct resampler {
+	pthread_t thread;
+	int timer_fd;
+	char closing;
+};
+
+/* Memory read/write queue (rw.c), under rw_mutex.  head is on the wire;
+ * done holds finished requests with a callback, for cwiid_drain. */
+struct rw_queue {
+	struct cwiid_rw_req *head;
+	struct cwiid_rw_req *tail;
+	struct cwiid_rw_req *done;
+	struct cwiid_rw_req *done_tail;
 };
 
 /* Wiimote struct */
@@ -172,19 +468,112 @@ struct wiimote {
 	pthread_t mesg_callback_thread;
 	int mesg_pipe[2];
 	int status_pipe[2];
-	int rw_pipe[2];
 	struct cwiid_state state;
-	enum rw_status rw_status;
+	const struct ext_desc *ext;	/* state.ext_type's, set with it */
+	struct raw_state raw;
+	struct rw_queue rw;
 	cwiid_mesg_callback_t *mesg_callback;
 	pthread_mutex_t state_mutex;
 	pthread_mutex_t rw_mutex;
+	pthread_cond_t rw_cond;
 	pthread_mutex_t rpt_mutex;
+	pthread_mutex_t tx_mutex;
+	pthread_mutex_t out_mutex;
+	pthread_cond_t out_cond;
+	struct out_queue out;
 	int id;
 	const void *data;
+	bdaddr_t bdaddr;
+	char restore;
+	char sched_valid;
+	struct cwiid_sched sched;	/* applied to router and callback threads */
+	uint8_t cal_valid;
+	struct acc_cal acc_cal;
+	struct acc_cal nunchuk_cal;
+	struct balance_cal balance_cal;
+	uint8_t scale_valid;		/* sections current in scale_next */
+	uint8_t scale_pending;		/* sections for the router to take or drop */
+	uint8_t scale_active;		/* router thread: sections live in scale */
+	struct cal_scale scale_next;	/* under state_mutex */
+	struct cal_scale scale;		/* router thread only */
+	struct gyro_bias gyro_bias;
+	char gyro_cal_valid;		/* under state_mutex */
+	struct motionplus_cal gyro_cal;	/* scale.gyro_zero, published */
+	struct balance_tare balance_tare;
+	struct fusion fusion;
+	struct ir_tracker ir_tracker;
+	struct deadband deadband;
+	struct speaker *speaker;
+	struct rumble *rumble;
+	struct shm_export *shm;
+	pthread_mutex_t sub_mutex;
+	struct cwiid_sub *subs;
+	uint32_t sub_mask;			/* union of subscriber masks */
+	struct resampler *resampler;
+	struct cwiid_sub *fd_sub;	/* cwiid_get_fd, NULL until asked for */
 };
 
 /* prototypes */
 cwiid_wiimote_t *cwiid_new(int ctl_socket, int int_socket, int flags);
+int reconnect(struct wiimote *wiimote);
+
+/* command.c */
+typedef void read_progress_t(void *data, uint16_t received);
+int read_mem(struct wiimote *wiimote, uint8_t flags, uint32_t offset,
+             uint16_t len, void *data, uint16_t *received,
+             read_progress_t *progress, void *progress_data);
+
+/* bluetooth.c */
+int bdinfo_is_wiimote(const struct cwiid_bdinfo *bdinfo);
+int hci_route(int dev_id);
+int hci_inquire(int dev_id, unsigned int timeout, int max_bdinfo,
+                struct cwiid_bdinfo *bdinfo);
+
+/* calibrate.c */
+void init_cal_scale(struct wiimote *wiimote);
+int update_cal_scale(struct wiimote *wiimote);
+void apply_cal_scale(struct wiimote *wiimote);
+void scale_acc(const struct acc_scale *scale, const uint16_t *raw, float *acc);
+void scale_angle_rate(const struct cal_scale *scale,
+                      const struct cwiid_motionplus_mesg *mesg,
+                      float *angle_rate);
+int process_gyro_bias(struct wiimote *wiimote, struct mesg_array *ma);
+int process_cal(struct wiimote *wiimote, struct mesg_array *ma);
+
+/* deadband.c */
+int process_deadband(struct wiimote *wiimote, struct mesg_array *ma);
+
+/* ext.c */
+const struct ext_desc *find_ext(enum cwiid_ext_type ext_type);
+enum cwiid_ext_type ext_from_id(const unsigned char *id);
+void set_ext_type(struct wiimote *wiimote, enum cwiid_ext_type ext_type);
+uint32_t ext_mesg_bits(const struct ext_desc *desc);
+const struct ext_mesg_desc *ext_select(const struct ext_desc *desc,
+                                       const unsigned char *data);
+int ext_copy_state(union ext_state *ext, const union cwiid_mesg *mesg);
+
+/* fusion.c */
+void init_fusion(struct wiimote *wiimote);
+int process_fusion(struct wiimote *wiimote, struct mesg_array *ma);
+
+/* interface.c */
+int apply_sched(struct wiimote *wiimote, pthread_t thread, const char *name);
+
+/* irtrack.c */
+void init_ir_tracker(struct wiimote *wiimote);
+int process_ir_track(struct wiimote *wiimote, struct mesg_array *ma);
+
+/* rumble.c */
+int close_rumble(struct wiimote *wiimote);
+
+/* shm.c */
+void publish_shm(struct wiimote *wiimote, const struct mesg_array *ma);
+
+/* speaker.c */
+uint8_t adpcm_encode(struct speaker *speaker, int16_t sample);
+
+/* inquiry.c */
+int inquiry_find_wiimote(bdaddr_t *bdaddr, int timeout);
 
 /* thread.c */
 void *router_thread(struct wiimote *wiimote);
@@ -199,8 +588,9 @@ int exec_write_seq(struct wiimote *wiimote, unsigned int len,
 int full_read(int fd, void *buf, size_t len);
 int write_mesg_array(struct wiimote *wiimote, struct mesg_array *ma);
 int read_mesg_array(int fd, struct mesg_array *ma);
-int cancel_rw(struct wiimote *wiimote);
 int cancel_mesg_callback(struct wiimote *wiimote);
+int init_rt_thread_attr(struct wiimote *wiimote, pthread_attr_t *attr,
+                        int callbacks);
 
 /* process.c */
 int process_error(struct wiimote *, ssize_t, struct mesg_array *);
@@ -212,11 +602,29 @@ int process_ir10(struct wiimote *, const unsigned char *, struct mesg_array *);
 int process_ir12(struct wiimote *, const unsigned char *, struct mesg_array *);
 int process_ext(struct wiimote *, unsigned char *, unsigned char,
                 struct mesg_array *);
+
+/* resample.c */
+int resample_mesg(struct cwiid_sub *sub, const union cwiid_mesg *mesg);
+int close_resampler(struct wiimote *wiimote);
+
+/* rw.c */
+int rw_wait(struct wiimote *wiimote, struct cwiid_rw_req *req,
+            read_progress_t *progress, void *progress_data);
 int process_read(struct wiimote *, unsigned char *);
 int process_write(struct wiimote *, unsigned char *);
+int cancel_rw(struct wiimote *wiimote);
+int rw_drain(struct wiimote *wiimote);
+int rw_done_pending(struct wiimote *wiimote);
+
+/* subscribe.c */
+struct mesg_array *sub_slot(struct cwiid_sub *sub);
+void sub_commit(struct cwiid_sub *sub);
+void deliver_mesg_array(struct wiimote *wiimote, const struct mesg_array *ma);
+int apply_sub_sched(struct wiimote *wiimote);
 
 /* state.c */
 int update_state(struct wiimote *wiimote, struct mesg_array *ma);
+void decode_raw_state(struct wiimote *wiimote);
 int update_rpt_mode(struct wiimote *wiimote, int8_t rpt_mode);
 
 #endif
@@ -0,0 +1,237 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "cwiid_internal.h"
+
+/* Deadband filtering.  With a deadband set for a message type, a message
+ * is passed on only once a value has moved further than the deadband
+ * from the last message passed on (comparing against the last one sent,
+ * not the last one received, so slow drift still gets through).  Button
+ * and other discrete fields count as moved on any change.  The filter
+ * runs after the state and the derived messages have seen the report, and
+ * a calibrated message is dropped along with its raw one. */
+
+#define DEADBAND_TYPES	(CWIID_MESG_BIT(CWIID_MESG_ACC) | \
+                     	 CWIID_MESG_BIT(CWIID_MESG_IR) | \
+                     	 CWIID_MESG_BIT(CWIID_MESG_NUNCHUK) | \
+                     	 CWIID_MESG_BIT(CWIID_MESG_CLASSIC) | \
+                     	 CWIID_MESG_BIT(CWIID_MESG_BALANCE) | \
+                     	 CWIID_MESG_BIT(CWIID_MESG_MOTIONPLUS) | \
+                     	 CWIID_MESG_BIT(CWIID_MESG_GUITAR) | \
+                     	 CWIID_MESG_BIT(CWIID_MESG_DRUMS) | \
+                     	 CWIID_MESG_BIT(CWIID_MESG_TURNTABLES))
+
+static int moved(int a, int b, int band)
+{
+	return abs(a - b) > band;
+}
+
+static int moved_array(const uint16_t *a, const uint16_t *b, int n, int band)
+{
+	int i;
+
+	for (i=0; i < n; i++) {
+		if (moved(a[i], b[i], band)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int moved_array8(const uint8_t *a, const uint8_t *b, int n, int band)
+{
+	int i;
+
+	for (i=0; i < n; i++) {
+		if (moved(a[i], b[i], band)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int mesg_moved(const union cwiid_mesg *mesg,
+                      const union cwiid_mesg *last, int band)
+{
+	int i;
+
+	switch (mesg->type) {
+	case CWIID_MESG_ACC:
+		return moved_array(mesg->acc_mesg.acc, last->acc_mesg.acc, 3, band);
+	case CWIID_MESG_IR:
+		for (i=0; i < CWIID_IR_SRC_COUNT; i++) {
+			if (mesg->ir_mesg.src[i].valid != last->ir_mesg.src[i].valid) {
+				return 1;
+			}
+			if (mesg->ir_mesg.src[i].valid &&
+			  moved_array(mesg->ir_mesg.src[i].pos,
+			              last->ir_mesg.src[i].pos, 2, band)) {
+				return 1;
+			}
+		}
+		return 0;
+	case CWIID_MESG_NUNCHUK:
+		return (mesg->nunchuk_mesg.buttons != last->nunchuk_mesg.buttons) ||
+		       moved_array8(mesg->nunchuk_mesg.stick,
+		                    last->nunchuk_mesg.stick, 2, band) ||
+		       moved_array(mesg->nunchuk_mesg.acc,
+		                   last->nunchuk_mesg.acc, 3, band);
+	case CWIID_MESG_CLASSIC:
+		return (mesg->classic_mesg.buttons != last->classic_mesg.buttons) ||
+		       moved_array8(mesg->classic_mesg.l_stick,
+		                    last->classic_mesg.l_stick, 2, band) ||
+		       moved_array8(mesg->classic_mesg.r_stick,
+		                    last->classic_mesg.r_stick, 2, band) ||
+		       moved(mesg->classic_mesg.l, last->classic_mesg.l, band) ||
+		       moved(mesg->classic_mesg.r, last->classic_mesg.r, band);
+	case CWIID_MESG_BALANCE:
+		return moved(mesg->balance_mesg.right_top,
+		             last->balance_mesg.right_top, band) ||
+		       moved(mesg->balance_mesg.right_bottom,
+		             last->balance_mesg.right_bottom, band) ||
+		       moved(mesg->balance_mesg.left_top,
+		             last->balance_mesg.left_top, band) ||
+		       moved(mesg->balance_mesg.left_bottom,
+		             last->balance_mesg.left_bottom, band);
+	case CWIID_MESG_MOTIONPLUS:
+		return memcmp(mesg->motionplus_mesg.low_speed,
+		              last->motionplus_mesg.low_speed,
+		              sizeof mesg->motionplus_mesg.low_speed) ||
+		       (mesg->motionplus_mesg.extension !=
+		        last->motionplus_mesg.extension) ||
+		       moved_array(mesg->motionplus_mesg.angle_rate,
+		                   last->motionplus_mesg.angle_rate, 3, band);
+	case CWIID_MESG_GUITAR:
+		return (mesg->guitar_mesg.buttons != last->guitar_mesg.buttons) ||
+		       (mesg->guitar_mesg.touch_bar != last->guitar_mesg.touch_bar) ||
+		       moved_array8(mesg->guitar_mesg.stick,
+		                    last->guitar_mesg.stick, 2, band) ||
+		       moved(mesg->guitar_mesg.whammy, last->guitar_mesg.whammy, band);
+	case CWIID_MESG_DRUMS:
+		/* a hit is an event, whatever its size */
+		return (mesg->drums_mesg.buttons != last->drums_mesg.buttons) ||
+		       (mesg->drums_mesg.velocity_source !=
+		        last->drums_mesg.velocity_source) ||
+		       (mesg->drums_mesg.velocity != last->drums_mesg.velocity) ||
+		       moved_array8(mesg->drums_mesg.stick,
+		                    last->drums_mesg.stick, 2, band);
+	case CWIID_MESG_TURNTABLES:
+		return (mesg->turntables_mesg.buttons !=
+		        last->turntables_mesg.buttons) ||
+		       moved_array8(mesg->turntables_mesg.stick,
+		                    last->turntables_mesg.stick, 2, band) ||
+		       moved(mesg->turntables_mesg.crossfader,
+		             last->turntables_mesg.crossfader, band) ||
+		       moved(mesg->turntables_mesg.effect_dial,
+		             last->turntables_mesg.effect_dial, band) ||
+		       moved(mesg->turntables_mesg.left_turntable,
+		             last->turntables_mesg.left_turntable, band) ||
+		       moved(mesg->turntables_mesg.right_turntable,
+		             last->turntables_mesg.right_turntable, band);
+	default:
+		return 1;
+	}
+}
+
+/* Calibrated message derived from a raw type */
+static enum cwiid_mesg_type cal_type(enum cwiid_mesg_type type)
+{
+	switch (type) {
+	case CWIID_MESG_ACC:
+		return CWIID_MESG_ACC_CAL;
+	case CWIID_MESG_NUNCHUK:
+		return CWIID_MESG_NUNCHUK_CAL;
+	case CWIID_MESG_BALANCE:
+		return CWIID_MESG_BALANCE_CAL;
+	case CWIID_MESG_MOTIONPLUS:
+		return CWIID_MESG_MOTIONPLUS_CAL;
+	default:
+		return CWIID_MESG_UNKNOWN;
+	}
+}
+
+int process_deadband(struct wiimote *wiimote, struct mesg_array *ma)
+{
+	struct deadband *deadband = &wiimote->deadband;
+	uint32_t enabled, dropped = 0;
+	enum cwiid_mesg_type type;
+	int i, j;
+
+	enabled = __atomic_load_n(&deadband->enabled, __ATOMIC_ACQUIRE);
+	/* a type switched off and on again starts afresh */
+	deadband->valid &= enabled;
+	if (!enabled) {
+		return 0;
+	}
+
+	for (i=0, j=0; i < ma->count; i++) {
+		type = ma->array[i].type;
+
+		if (type < CWIID_MESG_UNKNOWN) {
+			if (enabled & CWIID_MESG_BIT(type)) {
+				if ((deadband->valid & CWIID_MESG_BIT(type)) &&
+				  !mesg_moved(&ma->array[i], &deadband->last[type],
+				              deadband->band[type])) {
+					dropped |= CWIID_MESG_BIT(cal_type(type));
+					continue;
+				}
+				deadband->last[type] = ma->array[i];
+				deadband->valid |= CWIID_MESG_BIT(type);
+			}
+			else if (dropped & CWIID_MESG_BIT(type)) {
+				continue;
+			}
+		}
+
+		if (i != j) {
+			ma->array[j] = ma->array[i];
+		}
+		j++;
+	}
+	ma->count = j;
+
+	return 0;
+}
+
+/* deadband in raw units (LSB, IR pixels), 0 to drop only repeats, -1
+ * to pass every message */
+int cwiid_set_deadband(cwiid_wiimote_t *wiimote, enum cwiid_mesg_type type,
+                       int deadband)
+{
+	if ((type >= CWIID_MESG_UNKNOWN) ||
+	  !(DEADBAND_TYPES & CWIID_MESG_BIT(type))) {
+		cwiid_err(wiimote, "Deadband not supported for this message type");
+		return -1;
+	}
+
+	if (deadband < 0) {
+		__atomic_and_fetch(&wiimote->deadband.enabled, ~CWIID_MESG_BIT(type),
+		                   __ATOMIC_RELEASE);
+	}
+	else {
+		wiimote->deadband.band[type] = deadband;
+		__atomic_or_fetch(&wiimote->deadband.enabled, CWIID_MESG_BIT(type),
+		                  __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
@@ -0,0 +1,159 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cwiid_internal.h"
+
+/* Bulk reads.  A range is read in as few requests as the report format
+ * allows (CWIID_MAX_READ_LEN each); the wiimote streams 16 byte replies
+ * back to back, so the per-request round trip is paid once per 64 KB.  A
+ * request that fails part way resumes after the last byte received. */
+
+struct dump {
+	struct wiimote *wiimote;
+	cwiid_dump_callback_t *callback;
+	const void *cb_data;
+	uint32_t done;				/* before the current request */
+	uint32_t len;
+};
+
+static void dump_progress(void *data, uint16_t received)
+{
+	struct dump *dump = data;
+
+	dump->callback(dump->wiimote, dump->done + received, dump->len,
+	               dump->cb_data);
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		if ((ret = write(fd, buf, len)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* With fd == -1, data receives the whole range; otherwise data is a
+ * CWIID_MAX_READ_LEN buffer and each request is written to fd */
+static int dump_mem(struct wiimote *wiimote, uint8_t flags, uint32_t offset,
+                    uint32_t len, unsigned char *data, int fd,
+                    cwiid_dump_callback_t *callback, const void *cb_data,
+                    struct cwiid_dump_stats *stats)
+{
+	struct dump dump;
+	struct timespec start, end;
+	unsigned char *dest;
+	uint16_t chunk, received;
+	int tries = 0;
+	int ret = 0;
+
+	dump.wiimote = wiimote;
+	dump.callback = callback;
+	dump.cb_data = cb_data;
+	dump.done = 0;
+	dump.len = len;
+
+	memset(stats, 0, sizeof *stats);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (dump.done < len) {
+		chunk = (len - dump.done > CWIID_MAX_READ_LEN) ?
+		        CWIID_MAX_READ_LEN : len - dump.done;
+		dest = (fd == -1) ? data + dump.done : data;
+
+		stats->requests++;
+		ret = read_mem(wiimote, flags, offset + dump.done, chunk, dest,
+		               &received, callback ? dump_progress : NULL, &dump);
+
+		if (fd != -1 && received && write_all(fd, data, received)) {
+			cwiid_err(wiimote, "File write error (dump): %s",
+			          strerror(errno));
+			ret = -1;
+			break;
+		}
+		dump.done += received;
+
+		if (ret) {
+			/* Only give up after repeated failures with no progress */
+			tries = received ? 1 : tries + 1;
+			if (tries > CWIID_DUMP_RETRIES) {
+				cwiid_err(wiimote, "Dump failed at offset 0x%06X",
+				          offset + dump.done);
+				break;
+			}
+			stats->retries++;
+			ret = 0;
+		}
+		else {
+			tries = 0;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stats->bytes = dump.done;
+	stats->seconds = (end.tv_sec - start.tv_sec) +
+	                 (end.tv_nsec - start.tv_nsec) / 1e9f;
+	stats->rate = (stats->seconds > 0.0f) ? dump.done / stats->seconds : 0.0f;
+
+	return ret;
+}
+
+int cwiid_dump(cwiid_wiimote_t *wiimote, uint8_t flags, uint32_t offset,
+               uint32_t len, void *data, cwiid_dump_callback_t *callback,
+               const void *cb_data, struct cwiid_dump_stats *stats)
+{
+	struct cwiid_dump_stats local_stats;
+
+	return dump_mem(wiimote, flags, offset, len, data, -1, callback, cb_data,
+	                stats ? stats : &local_stats);
+}
+
+int cwiid_dump_fd(cwiid_wiimote_t *wiimote, uint8_t flags, uint32_t offset,
+                  uint32_t len, int fd, cwiid_dump_callback_t *callback,
+                  const void *cb_data, struct cwiid_dump_stats *stats)
+{
+	struct cwiid_dump_stats local_stats;
+	unsigned char *buf;
+	int ret;
+
+	if ((buf = malloc(CWIID_MAX_READ_LEN)) == NULL) {
+		cwiid_err(wiimote, "Memory allocation error (dump buffer)");
+		return -1;
+	}
+
+	ret = dump_mem(wiimote, flags, offset, len, buf, fd, callback, cb_data,
+	               stats ? stats : &local_stats);
+
+	free(buf);
+
+	return ret;
+}
@@ -0,0 +1,369 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cwiid_internal.h"
+
+/* Extension descriptors.  Everything the library knows about an
+ * extension lives in ext_table: the ID bytes it answers with, its report
+ * mode flag and report type, and the layout of each of its messages.
+ * Identification (status thread), report mode selection, decoding
+ * (process_ext) and the state copy (update_state) all work from the
+ * table, so a new extension is a new layout and table entry here plus
+ * its public message and state structs.
+ *
+ * A layout lists each message field once, as the expression that
+ * assembles it from the report and the shift that keeps its high bits
+ * in the state.  The list is expanded into a straight-line decoder per
+ * layout and a state copy per message type, so decoding costs what the
+ * old hand-written switch did.  Message and state structs mirror each
+ * other field for field. */
+
+#define EXT_TABLE_LEN	(sizeof ext_table / sizeof ext_table[0])
+
+/* Report slices, shifted into place */
+#define BITS(byte, mask)			(data[byte] & (mask))
+#define BITS_L(byte, mask, n)		((data[byte] & (mask)) << (n))
+#define BITS_R(byte, mask, n)		((data[byte] & (mask)) >> (n))
+
+/* Conversions */
+#define INVERT(value)				(~(value))
+#define INVERT_MASK(value, mask)	(~(value) & (mask))
+#define SIGNED(value, sign)			(((value) ^ (sign)) - (sign))
+#define MAP(value, ranges)			ext_map(ranges, value)
+/* value only when (data[byte] & mask) == match, else 0 */
+#define GATE(byte, mask, match, value) \
+	(((data[byte] & (mask)) == (match)) ? (value) : 0)
+
+#define DECODE_FIELD(member, state_shift, value) \
+	m->member = (value);
+#define COPY_FIELD(member, state_shift, value) \
+	s->member = m->member >> (state_shift);
+
+/* decode_<name>, filling a <base>_mesg from a report */
+#define EXT_DECODER(name, base, mesg_type, LAYOUT) \
+static void decode_##name(const unsigned char *data, \
+                          union cwiid_mesg *mesg) \
+{ \
+	struct cwiid_##base##_mesg *m = &mesg->base##_mesg; \
+ \
+	m->type = mesg_type; \
+	LAYOUT(DECODE_FIELD) \
+}
+
+/* copy_<base>, from a <base>_mesg into the state */
+#define EXT_STATE_COPY(base, LAYOUT) \
+static void copy_##base(union ext_state *ext, const union cwiid_mesg *mesg) \
+{ \
+	const struct cwiid_##base##_mesg *m = &mesg->base##_mesg; \
+	struct base##_state *s = &ext->base; \
+ \
+	LAYOUT(COPY_FIELD) \
+}
+
+static int ext_map(const struct ext_range *range, int value)
+{
+	while ((value < range->lo) || (value > range->hi)) {
+		range++;
+	}
+	return range->value;
+}
+
+#define NUNCHUK_LAYOUT(F) \
+	F(stick[CWIID_X], 0, BITS(0, 0xFF)) \
+	F(stick[CWIID_Y], 0, BITS(1, 0xFF)) \
+	F(acc[CWIID_X], 2, BITS_L(2, 0xFF, 2) | BITS_R(5, 0x0C, 2)) \
+	F(acc[CWIID_Y], 2, BITS_L(3, 0xFF, 2) | BITS_R(5, 0x30, 4)) \
+	F(acc[CWIID_Z], 2, BITS_L(4, 0xFF, 2) | BITS_R(5, 0xC0, 6)) \
+	F(buttons, 0, INVERT_MASK(BITS(5, NUNCHUK_BTN_MASK), NUNCHUK_BTN_MASK))
+
+/* Nunchuk behind a MotionPlus, interleaved with the gyro reports: the
+ * lowest bit of each acc axis is given up */
+#define NUNCHUK_PASSTHROUGH_LAYOUT(F) \
+	F(stick[CWIID_X], 0, BITS(0, 0xFF)) \
+	F(stick[CWIID_Y], 0, BITS(1, 0xFF)) \
+	F(acc[CWIID_X], 2, BITS_L(2, 0xFF, 2) | BITS_R(5, 0x10, 3)) \
+	F(acc[CWIID_Y], 2, BITS_L(3, 0xFF, 2) | BITS_R(5, 0x20, 4)) \
+	F(acc[CWIID_Z], 2, BITS_L(4, 0xFE, 2) | BITS_R(5, 0xC0, 5)) \
+	F(buttons, 0, INVERT(BITS_R(5, 0x0C, 2)))
+
+#define CLASSIC_LAYOUT(F) \
+	F(l_stick[CWIID_X], 0, BITS(0, CWIID_CLASSIC_L_STICK_MAX)) \
+	F(l_stick[CWIID_Y], 0, BITS(1, CWIID_CLASSIC_L_STICK_MAX)) \
+	F(r_stick[CWIID_X], 0, \
+	  BITS_R(0, 0xC0, 3) | BITS_R(1, 0xC0, 5) | BITS_R(2, 0x80, 7)) \
+	F(r_stick[CWIID_Y], 0, BITS(2, CWIID_CLASSIC_R_STICK_MAX)) \
+	F(l, 0, BITS_R(2, 0x60, 2) | BITS_R(3, 0xE0, 5)) \
+	F(r, 0, BITS(3, 0x1F)) \
+	F(buttons, 0, INVERT(BITS_L(4, 0xFF, 8) | BITS(5, 0xFF)))
+
+#define BALANCE_LAYOUT(F) \
+	F(right_top, 0, BITS_L(0, 0xFF, 8) | BITS(1, 0xFF)) \
+	F(right_bottom, 0, BITS_L(2, 0xFF, 8) | BITS(3, 0xFF)) \
+	F(left_top, 0, BITS_L(4, 0xFF, 8) | BITS(5, 0xFF)) \
+	F(left_bottom, 0, BITS_L(6, 0xFF, 8) | BITS(7, 0xFF))
+
+#define MOTIONPLUS_LAYOUT(F) \
+	F(angle_rate[CWIID_PHI], 0, BITS_L(5, 0xFC, 6) | BITS(2, 0xFF)) \
+	F(angle_rate[CWIID_THETA], 0, BITS_L(4, 0xFC, 6) | BITS(1, 0xFF)) \
+	F(angle_rate[CWIID_PSI], 0, BITS_L(3, 0xFC, 6) | BITS(0, 0xFF)) \
+	F(low_speed[CWIID_PHI], 0, BITS(3, 0x01)) \
+	F(low_speed[CWIID_THETA], 0, BITS_R(4, 0x02, 1)) \
+	F(low_speed[CWIID_PSI], 0, BITS_R(3, 0x02, 1)) \
+	F(extension, 0, BITS(4, 0x01))
+
+static const struct ext_range guitar_touch_bar[] = {
+	{CWIID_GUITAR_TOUCHBAR_VALUE_NONE, CWIID_GUITAR_TOUCHBAR_VALUE_NONE,
+	 CWIID_GUITAR_TOUCHBAR_NONE},
+	{0, CWIID_GUITAR_TOUCHBAR_VALUE_1ST_AND_2ND - 1,
+	 CWIID_GUITAR_TOUCHBAR_1ST},
+	{CWIID_GUITAR_TOUCHBAR_VALUE_1ST_AND_2ND,
+	 CWIID_GUITAR_TOUCHBAR_VALUE_2ND - 1,
+	 CWIID_GUITAR_TOUCHBAR_1ST_AND_2ND},
+	{CWIID_GUITAR_TOUCHBAR_VALUE_2ND,
+	 CWIID_GUITAR_TOUCHBAR_VALUE_2ND_AND_3RD - 1,
+	 CWIID_GUITAR_TOUCHBAR_2ND},
+	{CWIID_GUITAR_TOUCHBAR_VALUE_2ND_AND_3RD,
+	 CWIID_GUITAR_TOUCHBAR_VALUE_3RD - 1,
+	 CWIID_GUITAR_TOUCHBAR_2ND_AND_3RD},
+	{CWIID_GUITAR_TOUCHBAR_VALUE_3RD,
+	 CWIID_GUITAR_TOUCHBAR_VALUE_3RD_AND_4TH - 1,
+	 CWIID_GUITAR_TOUCHBAR_3RD},
+	{CWIID_GUITAR_TOUCHBAR_VALUE_3RD_AND_4TH,
+	 CWIID_GUITAR_TOUCHBAR_VALUE_4TH - 1,
+	 CWIID_GUITAR_TOUCHBAR_3RD_AND_4TH},
+	{CWIID_GUITAR_TOUCHBAR_VALUE_4TH,
+	 CWIID_GUITAR_TOUCHBAR_VALUE_4TH_AND_5TH - 1,
+	 CWIID_GUITAR_TOUCHBAR_4TH},
+	{CWIID_GUITAR_TOUCHBAR_VALUE_4TH_AND_5TH,
+	 CWIID_GUITAR_TOUCHBAR_VALUE_5TH - 1,
+	 CWIID_GUITAR_TOUCHBAR_4TH_AND_5TH},
+	{0, 0xFF, CWIID_GUITAR_TOUCHBAR_5TH}
+};
+
+#define GUITAR_LAYOUT(F) \
+	F(stick[CWIID_X], 0, BITS(0, CWIID_GUITAR_STICK_MAX)) \
+	F(stick[CWIID_Y], 0, BITS(1, CWIID_GUITAR_STICK_MAX)) \
+	F(whammy, 0, BITS(3, CWIID_GUITAR_WHAMMY_MAX)) \
+	F(touch_bar, 0, \
+	  MAP(BITS(2, CWIID_GUITAR_TOUCH_BAR_MAX), guitar_touch_bar)) \
+	F(buttons, 0, INVERT(BITS_L(4, 0xFF, 8) | BITS(5, 0xFF)))
+
+static const struct ext_range drums_velocity_source[] = {
+	{0x0E, 0x0E, CWIID_DRUMS_VELOCITY_SOURCE_ORANGE},
+	{0x0F, 0x0F, CWIID_DRUMS_VELOCITY_SOURCE_BLUE},
+	{0x11, 0x11, CWIID_DRUMS_VELOCITY_SOURCE_YELLOW},
+	{0x12, 0x12, CWIID_DRUMS_VELOCITY_SOURCE_GREEN},
+	{0x19, 0x19, CWIID_DRUMS_VELOCITY_SOURCE_RED},
+	{0x1B, 0x1B, CWIID_DRUMS_VELOCITY_SOURCE_PEDAL},
+	{0, 0xFF, CWIID_DRUMS_VELOCITY_SOURCE_NONE}
+};
+
+/* Velocity data is only there when bit 6 of byte 2 is set */
+#define DRUMS_LAYOUT(F) \
+	F(stick[CWIID_X], 0, BITS(0, CWIID_DRUMS_STICK_MAX)) \
+	F(stick[CWIID_Y], 0, BITS(1, CWIID_DRUMS_STICK_MAX)) \
+	F(velocity_source, 0, \
+	  GATE(2, 0x40, 0x40, \
+	       MAP(BITS_R(2, 0x3E, 1), drums_velocity_source))) \
+	F(velocity, 0, GATE(2, 0x40, 0x40, INVERT_MASK(BITS_R(3, 0xE0, 5), 0x07))) \
+	F(buttons, 0, INVERT(BITS_L(4, 0xFF, 8) | BITS(5, 0xFF)))
+
+#define TURNTABLES_LAYOUT(F) \
+	F(stick[CWIID_X], 0, BITS(0, CWIID_TURNTABLES_STICK_MAX)) \
+	F(stick[CWIID_Y], 0, BITS(1, CWIID_TURNTABLES_STICK_MAX)) \
+	F(crossfader, 0, BITS_R(2, 0x1E, 1)) \
+	F(effect_dial, 0, BITS_R(2, 0x60, 2) | BITS_R(3, 0xE0, 5)) \
+	F(left_turntable, 0, SIGNED(BITS(3, 0x1F) | BITS_L(4, 0x01, 5), 0x20)) \
+	F(right_turntable, 0, \
+	  SIGNED(BITS_R(0, 0xC0, 3) | BITS_R(1, 0xC0, 5) | BITS_R(2, 0x80, 7) | \
+	         BITS_L(2, 0x01, 5), 0x20)) \
+	F(buttons, 0, INVERT(BITS_L(4, 0xFE, 8) | BITS(5, 0xFF)))
+
+EXT_DECODER(nunchuk, nunchuk, CWIID_MESG_NUNCHUK, NUNCHUK_LAYOUT)
+EXT_DECODER(nunchuk_passthrough, nunchuk, CWIID_MESG_NUNCHUK,
+            NUNCHUK_PASSTHROUGH_LAYOUT)
+EXT_DECODER(classic, classic, CWIID_MESG_CLASSIC, CLASSIC_LAYOUT)
+EXT_DECODER(balance, balance, CWIID_MESG_BALANCE, BALANCE_LAYOUT)
+EXT_DECODER(motionplus, motionplus, CWIID_MESG_MOTIONPLUS, MOTIONPLUS_LAYOUT)
+EXT_DECODER(guitar, guitar, CWIID_MESG_GUITAR, GUITAR_LAYOUT)
+EXT_DECODER(drums, drums, CWIID_MESG_DRUMS, DRUMS_LAYOUT)
+EXT_DECODER(turntables, turntables, CWIID_MESG_TURNTABLES, TURNTABLES_LAYOUT)
+
+/* The passthrough nunchuk layout fills the same fields, so one copy
+ * serves both */
+EXT_STATE_COPY(nunchuk, NUNCHUK_LAYOUT)
+EXT_STATE_COPY(classic, CLASSIC_LAYOUT)
+EXT_STATE_COPY(balance, BALANCE_LAYOUT)
+EXT_STATE_COPY(motionplus, MOTIONPLUS_LAYOUT)
+EXT_STATE_COPY(guitar, GUITAR_LAYOUT)
+EXT_STATE_COPY(drums, DRUMS_LAYOUT)
+EXT_STATE_COPY(turntables, TURNTABLES_LAYOUT)
+
+static void (*const state_copy[])(union ext_state *,
+                                  const union cwiid_mesg *) = {
+	[CWIID_MESG_NUNCHUK] = copy_nunchuk,
+	[CWIID_MESG_CLASSIC] = copy_classic,
+	[CWIID_MESG_BALANCE] = copy_balance,
+	[CWIID_MESG_MOTIONPLUS] = copy_motionplus,
+	[CWIID_MESG_GUITAR] = copy_guitar,
+	[CWIID_MESG_DRUMS] = copy_drums,
+	[CWIID_MESG_TURNTABLES] = copy_turntables
+};
+
+static const struct ext_desc ext_table[] = {
+	[CWIID_EXT_NUNCHUK] = {
+		.id = {{EXT_NUNCHUK, -1}}, .id_count = 1,
+		.rpt_flag = CWIID_RPT_NUNCHUK,
+		.mesg = {{CWIID_MESG_NUNCHUK, CWIID_RPT_NUNCHUK, {0, 0, 0},
+		          decode_nunchuk}},
+		.mesg_count = 1
+	},
+	[CWIID_EXT_CLASSIC] = {
+		.id = {{EXT_CLASSIC, -1}}, .id_count = 1,
+		.rpt_flag = CWIID_RPT_CLASSIC,
+		.mesg = {{CWIID_MESG_CLASSIC, CWIID_RPT_CLASSIC, {0, 0, 0},
+		          decode_classic}},
+		.mesg_count = 1
+	},
+	[CWIID_EXT_BALANCE] = {
+		.id = {{EXT_BALANCE, -1}}, .id_count = 1,
+		.rpt_flag = CWIID_RPT_BALANCE,
+		/* all four sensors need the 8 byte extension report */
+		.rpt_type = RPT_BTN_EXT8,
+		.mesg = {{CWIID_MESG_BALANCE, CWIID_RPT_BALANCE, {0, 0, 0},
+		          decode_balance}},
+		.mesg_count = 1
+	},
+	[CWIID_EXT_MOTIONPLUS] = {
+		.id = {{EXT_MOTIONPLUS, -1}, {EXT_NUNCHUK_MPLUS, -1}}, .id_count = 2,
+		.rpt_flag = CWIID_RPT_MOTIONPLUS,
+		.mesg = {{CWIID_MESG_MOTIONPLUS, CWIID_RPT_MOTIONPLUS, {5, 0x02, 0x02},
+		          decode_motionplus},
+		         {CWIID_MESG_NUNCHUK, CWIID_RPT_NUNCHUK, {5, 0x02, 0x00},
+		          decode_nunchuk_passthrough}},
+		.mesg_count = 2
+	},
+	[CWIID_EXT_GUITAR] = {
+		.id = {{EXT_INSTRUMENT, 0x00}}, .id_count = 1,
+		.rpt_flag = CWIID_RPT_GUITAR,
+		.mesg = {{CWIID_MESG_GUITAR, CWIID_RPT_GUITAR, {0, 0, 0},
+		          decode_guitar}},
+		.mesg_count = 1
+	},
+	[CWIID_EXT_DRUMS] = {
+		.id = {{EXT_INSTRUMENT, 0x01}}, .id_count = 1,
+		.rpt_flag = CWIID_RPT_DRUMS,
+		.mesg = {{CWIID_MESG_DRUMS, CWIID_RPT_DRUMS, {0, 0, 0},
+		          decode_drums}},
+		.mesg_count = 1
+	},
+	[CWIID_EXT_TURNTABLES] = {
+		.id = {{EXT_INSTRUMENT, 0x03}}, .id_count = 1,
+		.rpt_flag = CWIID_RPT_TURNTABLES,
+		.mesg = {{CWIID_MESG_TURNTABLES, CWIID_RPT_TURNTABLES, {0, 0, 0},
+		          decode_turntables}},
+		.mesg_count = 1
+	}
+};
+
+/* NULL for CWIID_EXT_NONE, CWIID_EXT_UNKNOWN */
+const struct ext_desc *find_ext(enum cwiid_ext_type ext_type)
+{
+	if (((unsigned int)ext_type >= EXT_TABLE_LEN) ||
+	  !ext_table[ext_type].mesg_count) {
+		return NULL;
+	}
+	return &ext_table[ext_type];
+}
+
+/* id is the 6 bytes read from 0xA400FA */
+enum cwiid_ext_type ext_from_id(const unsigned char *id)
+{
+	uint16_t value = (uint16_t)id[4]<<8 | (uint16_t)id[5];
+	unsigned int i;
+	int j;
+
+	for (i=0; i < EXT_TABLE_LEN; i++) {
+		for (j=0; j < ext_table[i].id_count; j++) {
+			if ((ext_table[i].id[j].id == value) &&
+			  ((ext_table[i].id[j].sub == -1) ||
+			   (ext_table[i].id[j].sub == id[0]))) {
+				return (enum cwiid_ext_type)i;
+			}
+		}
+	}
+
+	return CWIID_EXT_UNKNOWN;
+}
+
+/* Message types an extension's reports decode to */
+uint32_t ext_mesg_bits(const struct ext_desc *desc)
+{
+	uint32_t bits = 0;
+	int i;
+
+	if (!desc) {
+		/* errors are reported by process_ext */
+		return CWIID_MESG_ALL;
+	}
+	for (i=0; i < desc->mesg_count; i++) {
+		bits |= CWIID_MESG_BIT(desc->mesg[i].type);
+	}
+
+	return bits;
+}
+
+/* Also caches the descriptor, so the router does not look it up on every
+ * report.  The status thread sets it while the router reads it. */
+void set_ext_type(struct wiimote *wiimote, enum cwiid_ext_type ext_type)
+{
+	wiimote->state.ext_type = ext_type;
+	__atomic_store_n(&wiimote->ext, find_ext(ext_type), __ATOMIC_RELEASE);
+}
+
+/* Which of the extension's messages a report carries */
+const struct ext_mesg_desc *ext_select(const struct ext_desc *desc,
+                                       const unsigned char *data)
+{
+	const struct ext_match *select;
+	int i;
+
+	for (i=0; i < desc->mesg_count; i++) {
+		select = &desc->mesg[i].select;
+		if ((data[select->byte] & select->mask) == select->value) {
+			return &desc->mesg[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Returns 0 if mesg is not an extension message */
+int ext_copy_state(union ext_state *ext, const union cwiid_mesg *mesg)
+{
+	if (((unsigned int)mesg->type >=
+	     sizeof state_copy / sizeof state_copy[0]) ||
+	  !state_copy[mesg->type]) {
+		return 0;
+	}
+
+	state_copy[mesg->type](ext, mesg);
+	return 1;
+}
@@ -0,0 +1,234 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <math.h>
+#include "cwiid_internal.h"
+
+/* Orientation fusion: Madgwick's gradient descent filter (IMU form).
+ * MotionPlus angle rates are integrated over the monotonic time between
+ * reports, and the accelerometer pulls the estimate back toward gravity.
+ * Without a MotionPlus only the tilt is tracked.  Runs on the router
+ * thread, once per report. */
+
+#define DEG2RAD				(3.14159265358979f / 180.0f)
+
+/* Correction gain (rad/s) with and without gyro data */
+#define FUSION_DEFAULT_GAIN	0.1f
+#define FUSION_TILT_GAIN	2.0f
+
+/* Longer gaps between reports restart the integration, re-seeding the tilt
+ * from the accelerometer; the heading has no other reference, so it is
+ * kept */
+#define FUSION_MAX_DT		0.1f
+
+/* Only trust the accelerometer when it reads roughly 1 g (squared) */
+#define FUSION_ACC_MIN		0.5f
+#define FUSION_ACC_MAX		1.5f
+
+void init_fusion(struct wiimote *wiimote)
+{
+	wiimote->fusion.q[0] = 1.0f;
+	wiimote->fusion.q[1] = 0.0f;
+	wiimote->fusion.q[2] = 0.0f;
+	wiimote->fusion.q[3] = 0.0f;
+	wiimote->fusion.gain = FUSION_DEFAULT_GAIN;
+	wiimote->fusion.valid = 0;
+}
+
+int cwiid_set_orientation_gain(cwiid_wiimote_t *wiimote, float gain)
+{
+	if (gain < 0.0f) {
+		cwiid_err(wiimote, "Invalid orientation gain");
+		return -1;
+	}
+
+	wiimote->fusion.gain = gain;
+
+	return 0;
+}
+
+static void normalize(float *v, int n)
+{
+	float norm = 0.0f;
+	int i;
+
+	for (i=0; i < n; i++) {
+		norm += v[i] * v[i];
+	}
+	if (norm > 0.0f) {
+		norm = 1.0f / sqrtf(norm);
+		for (i=0; i < n; i++) {
+			v[i] *= norm;
+		}
+	}
+}
+
+/* Shortest rotation taking the (normalized) measured gravity onto z */
+static void seed_fusion(float *q, const float *acc)
+{
+	if (acc[2] > -0.999f) {
+		q[0] = 1.0f + acc[2];
+		q[1] = acc[1];
+		q[2] = -acc[0];
+		q[3] = 0.0f;
+		normalize(q, 4);
+	}
+	else {
+		q[0] = 0.0f;
+		q[1] = 1.0f;
+		q[2] = 0.0f;
+		q[3] = 0.0f;
+	}
+}
+
+/* Keep the rotation about the vertical (the heading) and replace the rest
+ * with the tilt measured by the accelerometer.  q splits into twist * tilt,
+ * the twist being about z and the tilt having no z part, as seed_fusion
+ * produces; the twist is then (q0, 0, 0, q3), normalized. */
+static void reseed_tilt(float *q, const float *acc)
+{
+	float t0 = q[0], t3 = q[3], s[4];
+	float norm = t0*t0 + t3*t3;
+
+	if (norm > 1e-6f) {
+		norm = 1.0f / sqrtf(norm);
+		t0 *= norm;
+		t3 *= norm;
+	}
+	else {
+		/* upside down: the heading is undefined */
+		t0 = 1.0f;
+		t3 = 0.0f;
+	}
+
+	seed_fusion(s, acc);
+	q[0] = t0*s[0] - t3*s[3];
+	q[1] = t0*s[1] - t3*s[2];
+	q[2] = t0*s[2] + t3*s[1];
+	q[3] = t0*s[3] + t3*s[0];
+}
+
+static void update_fusion(float *q, const float *gyro, const float *acc,
+                          float gain, float dt)
+{
+	float dq[4], s[4];
+	float q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+	int i;
+
+	/* Rate of change from the gyro: 0.5 * q (x) (0, gyro) */
+	dq[0] = 0.5f * (-q1*gyro[0] - q2*gyro[1] - q3*gyro[2]);
+	dq[1] = 0.5f * ( q0*gyro[0] + q2*gyro[2] - q3*gyro[1]);
+	dq[2] = 0.5f * ( q0*gyro[1] - q1*gyro[2] + q3*gyro[0]);
+	dq[3] = 0.5f * ( q0*gyro[2] + q1*gyro[1] - q2*gyro[0]);
+
+	if (acc) {
+		/* Gradient of the error between predicted and measured gravity */
+		s[0] = 4.0f*q0*q2*q2 + 2.0f*q2*acc[0] + 4.0f*q0*q1*q1 -
+		       2.0f*q1*acc[1];
+		s[1] = 4.0f*q1*q3*q3 - 2.0f*q3*acc[0] + 4.0f*q0*q0*q1 -
+		       2.0f*q0*acc[1] - 4.0f*q1 + 8.0f*q1*q1*q1 + 8.0f*q1*q2*q2 +
+		       4.0f*q1*acc[2];
+		s[2] = 4.0f*q0*q0*q2 + 2.0f*q0*acc[0] + 4.0f*q2*q3*q3 -
+		       2.0f*q3*acc[1] - 4.0f*q2 + 8.0f*q2*q1*q1 + 8.0f*q2*q2*q2 +
+		       4.0f*q2*acc[2];
+		s[3] = 4.0f*q1*q1*q3 - 2.0f*q1*acc[0] + 4.0f*q2*q2*q3 -
+		       2.0f*q2*acc[1];
+		normalize(s, 4);
+		for (i=0; i < 4; i++) {
+			dq[i] -= gain * s[i];
+		}
+	}
+
+	for (i=0; i < 4; i++) {
+		q[i] += dq[i] * dt;
+	}
+	normalize(q, 4);
+}
+
+/* Append an orientation message for each report carrying acc or gyro data */
+int process_fusion(struct wiimote *wiimote, struct mesg_array *ma)
+{
+	struct fusion *fusion = &wiimote->fusion;
+	float acc[3], gyro[3] = {0.0f, 0.0f, 0.0f};
+	char have_acc = 0, have_gyro = 0;
+	float norm, dt;
+	int i;
+
+	for (i=0; i < ma->count; i++) {
+		switch (ma->array[i].type) {
+		case CWIID_MESG_ACC:
+			scale_acc(&wiimote->scale.acc, ma->array[i].acc_mesg.acc, acc);
+			have_acc = 1;
+			break;
+		case CWIID_MESG_MOTIONPLUS:
+			scale_angle_rate(&wiimote->scale, &ma->array[i].motionplus_mesg,
+			                 gyro);
+			have_gyro = 1;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (!have_acc && !have_gyro) {
+		return 0;
+	}
+
+	if (have_acc) {
+		norm = acc[0]*acc[0] + acc[1]*acc[1] + acc[2]*acc[2];
+		if ((norm < FUSION_ACC_MIN) || (norm > FUSION_ACC_MAX)) {
+			have_acc = 0;
+		}
+		else {
+			normalize(acc, 3);
+		}
+	}
+
+	dt = (ma->mono.tv_sec - fusion->last.tv_sec) +
+	     (ma->mono.tv_nsec - fusion->last.tv_nsec) / 1e9f;
+	fusion->last = ma->mono;
+
+	if (!fusion->valid) {
+		if (have_acc) {
+			seed_fusion(fusion->q, acc);
+		}
+		fusion->valid = 1;
+	}
+	else if ((dt <= 0.0f) || (dt > FUSION_MAX_DT)) {
+		if (have_acc) {
+			reseed_tilt(fusion->q, acc);
+		}
+	}
+	else {
+		for (i=0; i < 3; i++) {
+			gyro[i] *= DEG2RAD;
+		}
+		update_fusion(fusion->q, gyro, have_acc ? acc : NULL,
+		              have_gyro ? fusion->gain : FUSION_TILT_GAIN, dt);
+	}
+
+	if (ma->count < CWIID_MAX_MESG_COUNT) {
+		ma->array[ma->count].orientation_mesg.type = CWIID_MESG_ORIENTATION;
+		for (i=0; i < 4; i++) {
+			ma->array[ma->count].orientation_mesg.q[i] = fusion->q[i];
+		}
+		ma->count++;
+	}
+
+	return 0;
+}
@@ -0,0 +1,424 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <bluetooth/bluetooth.h>
+#include "cwiid_internal.h"
+
+/* Background inquiry service.  A thread per adapter runs back-to-back
+ * inquiries and keeps a table of every device seen, so lookups never wait
+ * on the radio.  Each new device gets a serial number, which is what
+ * cwiid_inquiry_wait uses to tell new devices from known ones. */
+
+/* seconds to back off after an inquiry error (adapter down, etc.) */
+#define INQUIRY_ERR_DELAY	1
+/* cwiid_find_wiimote only trusts devices seen this recently (seconds) */
+#define INQUIRY_FIND_MAX_AGE	10
+
+struct inquiry_entry {
+	struct cwiid_bdinfo bdinfo;
+	struct timespec last_seen;
+	unsigned int serial;
+};
+
+struct cwiid_inquiry {
+	int dev_id;
+	unsigned int period;
+	uint8_t flags;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	char running;				/* atomic; written under mutex */
+	int refs;					/* lookups in progress, under list mutex */
+	unsigned int serial;
+	int entry_count;
+	struct inquiry_entry entries[BT_MAX_INQUIRY];
+	struct cwiid_inquiry *next;
+};
+
+/* running services, searched by cwiid_find_wiimote.  A lookup holds a
+ * reference on the service it uses; cwiid_inquiry_stop waits on
+ * inquiry_refs_cond for those to be dropped before freeing it. */
+static pthread_mutex_t inquiry_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inquiry_refs_cond = PTHREAD_COND_INITIALIZER;
+static struct cwiid_inquiry *inquiry_list = NULL;
+
+static void inquiry_update(struct cwiid_inquiry *inquiry,
+                           const struct cwiid_bdinfo *bdinfo)
+{
+	struct inquiry_entry *entry = NULL;
+	int i;
+
+	for (i=0; i < inquiry->entry_count; i++) {
+		if (!bacmp(&inquiry->entries[i].bdinfo.bdaddr, &bdinfo->bdaddr)) {
+			entry = &inquiry->entries[i];
+			break;
+		}
+	}
+
+	if (!entry) {
+		if (inquiry->entry_count < BT_MAX_INQUIRY) {
+			entry = &inquiry->entries[inquiry->entry_count++];
+		}
+		else {
+			/* Table full, recycle the stalest entry */
+			entry = &inquiry->entries[0];
+			for (i=1; i < inquiry->entry_count; i++) {
+				if (inquiry->entries[i].last_seen.tv_sec <
+				  entry->last_seen.tv_sec) {
+					entry = &inquiry->entries[i];
+				}
+			}
+		}
+		memcpy(&entry->bdinfo, bdinfo, sizeof entry->bdinfo);
+		entry->serial = ++inquiry->serial;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &entry->last_seen);
+}
+
+static void *inquiry_thread(struct cwiid_inquiry *inquiry)
+{
+	struct cwiid_bdinfo dev_list[BT_MAX_INQUIRY];
+	int dev_count;
+	char print_err = 1;
+	int i;
+
+	while (__atomic_load_n(&inquiry->running, __ATOMIC_ACQUIRE)) {
+		if ((dev_count = hci_inquire(inquiry->dev_id, inquiry->period,
+		                             BT_MAX_INQUIRY, dev_list)) == -1) {
+			if (print_err) {
+				cwiid_err(NULL, "Inquiry service error, retrying");
+				print_err = 0;
+			}
+			sleep(INQUIRY_ERR_DELAY);
+			continue;
+		}
+		print_err = 1;
+
+		pthread_mutex_lock(&inquiry->mutex);
+		for (i=0; i < dev_count; i++) {
+			if ((inquiry->flags & BT_NO_WIIMOTE_FILTER) ||
+			  bdinfo_is_wiimote(&dev_list[i])) {
+				inquiry_update(inquiry, &dev_list[i]);
+			}
+		}
+		pthread_cond_broadcast(&inquiry->cond);
+		pthread_mutex_unlock(&inquiry->mutex);
+	}
+
+	return NULL;
+}
+
+/* period in 1.28 second units, as for cwiid_get_bdinfo_array */
+cwiid_inquiry_t *cwiid_inquiry_start(int dev_id, unsigned int period,
+                                     uint8_t flags)
+{
+	struct cwiid_inquiry *inquiry;
+	int err;
+
+	if ((dev_id = hci_route(dev_id)) == -1) {
+		return NULL;
+	}
+
+	if ((inquiry = malloc(sizeof *inquiry)) == NULL) {
+		cwiid_err(NULL, "Memory allocation error (cwiid_inquiry_t)");
+		return NULL;
+	}
+
+	inquiry->dev_id = dev_id;
+	inquiry->period = period ? period : 1;
+	inquiry->flags = flags;
+	inquiry->running = 1;
+	inquiry->refs = 0;
+	inquiry->serial = 0;
+	inquiry->entry_count = 0;
+
+	if ((err = pthread_mutex_init(&inquiry->mutex, NULL))) {
+		cwiid_err(NULL, "Mutex initialization error (inquiry mutex): %s", strerror(err));
+		free(inquiry);
+		return NULL;
+	}
+	if ((err = pthread_cond_init(&inquiry->cond, NULL))) {
+		cwiid_err(NULL, "Cond initialization error (inquiry cond): %s", strerror(err));
+		pthread_mutex_destroy(&inquiry->mutex);
+		free(inquiry);
+		return NULL;
+	}
+
+	err = pthread_create(&inquiry->thread, NULL,
+	                     (void *(*)(void *))&inquiry_thread, inquiry);
+	if (err) {
+		cwiid_err(NULL, "Thread creation error (inquiry thread): %s", strerror(err));
+		pthread_cond_destroy(&inquiry->cond);
+		pthread_mutex_destroy(&inquiry->mutex);
+		free(inquiry);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&inquiry_list_mutex);
+	inquiry->next = inquiry_list;
+	inquiry_list = inquiry;
+	pthread_mutex_unlock(&inquiry_list_mutex);
+
+	return inquiry;
+}
+
+/* Blocks until the inquiry in progress finishes (up to one period) */
+int cwiid_inquiry_stop(cwiid_inquiry_t *inquiry)
+{
+	struct cwiid_inquiry **cursor;
+	int err;
+
+	pthread_mutex_lock(&inquiry_list_mutex);
+	for (cursor = &inquiry_list; *cursor; cursor = &(*cursor)->next) {
+		if (*cursor == inquiry) {
+			*cursor = inquiry->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&inquiry_list_mutex);
+
+	/* Wake any waiters, they will see !running */
+	pthread_mutex_lock(&inquiry->mutex);
+	__atomic_store_n(&inquiry->running, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&inquiry->cond);
+	pthread_mutex_unlock(&inquiry->mutex);
+
+	if ((err = pthread_join(inquiry->thread, NULL))) {
+		cwiid_err(NULL, "Thread join error (inquiry thread): %s", strerror(err));
+		return -1;
+	}
+
+	/* Lookups still holding the service have been woken above */
+	pthread_mutex_lock(&inquiry_list_mutex);
+	while (inquiry->refs) {
+		pthread_cond_wait(&inquiry_refs_cond, &inquiry_list_mutex);
+	}
+	pthread_mutex_unlock(&inquiry_list_mutex);
+
+	pthread_cond_destroy(&inquiry->cond);
+	pthread_mutex_destroy(&inquiry->mutex);
+	free(inquiry);
+
+	return 0;
+}
+
+static void inquiry_copy_entry(struct cwiid_inquiry_entry *dest,
+                               const struct inquiry_entry *src,
+                               const struct timespec *now)
+{
+	memcpy(&dest->bdinfo, &src->bdinfo, sizeof dest->bdinfo);
+	dest->age = now->tv_sec - src->last_seen.tv_sec;
+	dest->serial = src->serial;
+}
+
+static void inquiry_deadline(struct timespec *deadline, int timeout)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/* Wait for the next inquiry round, with inquiry->mutex held.
+ * Returns 0 when woken, 1 on timeout, -1 on error or service stop. */
+static int inquiry_cond_wait(struct cwiid_inquiry *inquiry,
+                             const struct timespec *deadline)
+{
+	int err;
+
+	if (deadline == NULL) {
+		err = pthread_cond_wait(&inquiry->cond, &inquiry->mutex);
+	}
+	else {
+		err = pthread_cond_timedwait(&inquiry->cond, &inquiry->mutex,
+		                             deadline);
+	}
+	if (err == ETIMEDOUT) {
+		return 1;
+	}
+	else if (err) {
+		cwiid_err(NULL, "Cond wait error (inquiry cond): %s", strerror(err));
+		return -1;
+	}
+
+	return inquiry->running ? 0 : -1;
+}
+
+/* max_age in seconds, -1 for no limit.  Does not block on the radio. */
+int cwiid_inquiry_lookup(cwiid_inquiry_t *inquiry, int max_age,
+                         int max_entries, struct cwiid_inquiry_entry *entries)
+{
+	struct timespec now;
+	int count = 0;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&inquiry->mutex);
+	for (i=0; (i < inquiry->entry_count) && (count < max_entries); i++) {
+		if ((max_age != -1) &&
+		  (now.tv_sec - inquiry->entries[i].last_seen.tv_sec > max_age)) {
+			continue;
+		}
+		inquiry_copy_entry(&entries[count++], &inquiry->entries[i], &now);
+	}
+	pthread_mutex_unlock(&inquiry->mutex);
+
+	return count;
+}
+
+/* Wait for a device with a serial greater than *serial (0 to accept devices
+ * already in the table).  On success the entry is copied out and *serial is
+ * advanced, so repeated calls walk through devices in the order they were
+ * discovered.  timeout in milliseconds, -1 to wait forever.
+ * Returns 0 on success, 1 on timeout, -1 on error. */
+int cwiid_inquiry_wait(cwiid_inquiry_t *inquiry, unsigned int *serial,
+                       struct cwiid_inquiry_entry *entry, int timeout)
+{
+	struct timespec deadline, now;
+	struct inquiry_entry *next;
+	int ret = 0;
+	int i;
+
+	if (timeout != -1) {
+		inquiry_deadline(&deadline, timeout);
+	}
+
+	pthread_mutex_lock(&inquiry->mutex);
+	while (inquiry->running) {
+		next = NULL;
+		for (i=0; i < inquiry->entry_count; i++) {
+			if ((inquiry->entries[i].serial > *serial) &&
+			  (!next || (inquiry->entries[i].serial < next->serial))) {
+				next = &inquiry->entries[i];
+			}
+		}
+		if (next) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			inquiry_copy_entry(entry, next, &now);
+			*serial = next->serial;
+			break;
+		}
+
+		if ((ret = inquiry_cond_wait(inquiry,
+		                             (timeout == -1) ? NULL : &deadline))) {
+			break;
+		}
+	}
+	if (!inquiry->running) {
+		ret = -1;
+	}
+	pthread_mutex_unlock(&inquiry->mutex);
+
+	return ret;
+}
+
+/* Returns 1 if there is no running service for the default adapter, so the
+ * caller should fall back to a blocking inquiry. */
+int inquiry_find_wiimote(bdaddr_t *bdaddr, int timeout)
+{
+	struct cwiid_inquiry *inquiry;
+	struct inquiry_entry *freshest;
+	struct timespec deadline, now;
+	int dev_id;
+	int ret = 0;
+	int i;
+
+	pthread_mutex_lock(&inquiry_list_mutex);
+	if (inquiry_list == NULL) {
+		pthread_mutex_unlock(&inquiry_list_mutex);
+		return 1;
+	}
+	pthread_mutex_unlock(&inquiry_list_mutex);
+
+	if ((dev_id = hci_route(-1)) == -1) {
+		return -1;
+	}
+
+	/* Hold the service, so a concurrent cwiid_inquiry_stop waits for us */
+	pthread_mutex_lock(&inquiry_list_mutex);
+	for (inquiry = inquiry_list; inquiry; inquiry = inquiry->next) {
+		if ((inquiry->dev_id == dev_id) &&
+		  !(inquiry->flags & BT_NO_WIIMOTE_FILTER)) {
+			inquiry->refs++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&inquiry_list_mutex);
+
+	if (!inquiry) {
+		return 1;
+	}
+
+	/* timeout given in inquiry units (1.28 s) */
+	if (timeout != -1) {
+		inquiry_deadline(&deadline, timeout * 1280);
+	}
+
+	/* Take the most recently seen wiimote, waiting for the next inquiry
+	 * round if none has been seen lately */
+	pthread_mutex_lock(&inquiry->mutex);
+	while (inquiry->running) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		freshest = NULL;
+		for (i=0; i < inquiry->entry_count; i++) {
+			if ((now.tv_sec - inquiry->entries[i].last_seen.tv_sec <=
+			     INQUIRY_FIND_MAX_AGE) &&
+			  (!freshest || (inquiry->entries[i].last_seen.tv_sec >
+			                 freshest->last_seen.tv_sec))) {
+				freshest = &inquiry->entries[i];
+			}
+		}
+		if (freshest) {
+			bacpy(bdaddr, &freshest->bdinfo.bdaddr);
+			break;
+		}
+
+		if ((ret = inquiry_cond_wait(inquiry,
+		                             (timeout == -1) ? NULL : &deadline))) {
+			break;
+		}
+	}
+	if (!inquiry->running) {
+		ret = -1;
+	}
+	pthread_mutex_unlock(&inquiry->mutex);
+
+	pthread_mutex_lock(&inquiry_list_mutex);
+	if (--inquiry->refs == 0) {
+		pthread_cond_broadcast(&inquiry_refs_cond);
+	}
+	pthread_mutex_unlock(&inquiry_list_mutex);
+
+	if (ret == 1) {
+		cwiid_err(NULL, "No wiimotes found");
+		ret = -1;
+	}
+
+	return ret;
+}
@@ -16,12 +16,16 @@
  *
  */
 
+#define _GNU_SOURCE	/* pthread_setaffinity_np */
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include "cwiid_internal.h"
 
 int cwiid_get_id(cwiid_wiimote_t *wiimote)
@@ -51,6 +55,21 @@ int cwiid_enable(cwiid_wiimote_t *wiimote, int flags)
 			return -1;
 		}
 	}
+	if ((flags & (CWIID_FLAG_CALIBRATED | CWIID_FLAG_ORIENTATION)) &&
+	  !(wiimote->flags & (CWIID_FLAG_CALIBRATED | CWIID_FLAG_ORIENTATION))) {
+		if (update_cal_scale(wiimote)) {
+			cwiid_err(wiimote, "Calibration read error");
+			return -1;
+		}
+	}
+	if ((flags & CWIID_FLAG_ORIENTATION) &&
+	  !(wiimote->flags & CWIID_FLAG_ORIENTATION)) {
+		wiimote->fusion.valid = 0;
+	}
+	if ((flags & CWIID_FLAG_IR_TRACK) &&
+	  !(wiimote->flags & CWIID_FLAG_IR_TRACK)) {
+		init_ir_tracker(wiimote);
+	}
 	if (flags & CWIID_FLAG_MOTIONPLUS) {
 		data = 0x04;
 		cwiid_write(wiimote, CWIID_RW_REG, 0xA600FE, 1, &data);
@@ -82,9 +101,93 @@ int cwiid_disable(cwiid_wiimote_t *wiimote, int flags)
 	return 0;
 }
 
+/* Apply wiimote->sched to one thread.  A real-time priority above
+ * RLIMIT_RTPRIO is lowered to the limit rather than refused outright.
+ * Returns the CWIID_SCHED_* bits that could not be applied. */
+int apply_sched(struct wiimote *wiimote, pthread_t thread, const char *name)
+{
+	struct cwiid_sched *sched = &wiimote->sched;
+	struct sched_param param;
+	struct rlimit rlim;
+	cpu_set_t cpus;
+	int failed = 0;
+	int err, i;
+
+	param.sched_priority = (sched->policy == SCHED_OTHER) ?
+	                       0 : sched->priority;
+	err = pthread_setschedparam(thread, sched->policy, &param);
+	if ((err == EPERM) && (sched->policy != SCHED_OTHER) &&
+	  !getrlimit(RLIMIT_RTPRIO, &rlim) && (rlim.rlim_cur > 0) &&
+	  (rlim.rlim_cur < (rlim_t)param.sched_priority)) {
+		param.sched_priority = rlim.rlim_cur;
+		if (!(err = pthread_setschedparam(thread, sched->policy, &param))) {
+			cwiid_err(wiimote, "Priority lowered to %d (%s thread)",
+			          param.sched_priority, name);
+		}
+	}
+	if (err) {
+		cwiid_err(wiimote, "Scheduling policy not applied (%s thread): %s",
+		          name, strerror(err));
+		failed |= CWIID_SCHED_POLICY;
+	}
+
+	if (sched->cpu_mask) {
+		CPU_ZERO(&cpus);
+		for (i=0; i < 64; i++) {
+			if (sched->cpu_mask & ((uint64_t)1 << i)) {
+				CPU_SET(i, &cpus);
+			}
+		}
+		if ((err = pthread_setaffinity_np(thread, sizeof cpus, &cpus))) {
+			cwiid_err(wiimote, "CPU affinity not applied (%s thread): %s",
+			          name, strerror(err));
+			failed |= CWIID_SCHED_AFFINITY;
+		}
+	}
+
+	return failed;
+}
+
+int cwiid_set_sched(cwiid_wiimote_t *wiimote, const struct cwiid_sched *sched)
+{
+	int failed = 0;
+
+	if ((sched->policy != SCHED_OTHER) && (sched->policy != SCHED_FIFO) &&
+	  (sched->policy != SCHED_RR)) {
+		cwiid_err(wiimote, "Invalid scheduling policy");
+		return -1;
+	}
+	if ((sched->policy != SCHED_OTHER) &&
+	  ((sched->priority < sched_get_priority_min(sched->policy)) ||
+	   (sched->priority > sched_get_priority_max(sched->policy)))) {
+		cwiid_err(wiimote, "Invalid scheduling priority");
+		return -1;
+	}
+
+	wiimote->sched = *sched;
+	wiimote->sched_valid = 1;
+
+	/* Lock before raising priority, so the first faults happen now */
+	if ((sched->flags & CWIID_SCHED_MLOCK) &&
+	  mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		cwiid_err(wiimote, "Memory lock error: %s", strerror(errno));
+		failed |= CWIID_SCHED_MLOCK;
+	}
+
+	failed |= apply_sched(wiimote, wiimote->router_thread, "router");
+	if (wiimote->mesg_callback) {
+		failed |= apply_sched(wiimote, wiimote->mesg_callback_thread,
+		                      "callback");
+	}
+	failed |= apply_sub_sched(wiimote);
+
+	return failed;
+}
+
 int cwiid_set_mesg_callback(cwiid_wiimote_t *wiimote,
                             cwiid_mesg_callback_t *callback)
 {
+	pthread_attr_t attr;
 	int err;
 
 	if (wiimote->mesg_callback) {
@@ -97,8 +200,12 @@ int cwiid_set_mesg_callback(cwiid_wiimote_t *wiimote,
 	wiimote->mesg_callback = callback;
 
 	if (wiimote->mesg_callback) {
-		err = pthread_create(&wiimote->mesg_callback_thread, NULL,
+		if (init_rt_thread_attr(wiimote, &attr, 1)) {
+			return -1;
+		}
+		err = pthread_create(&wiimote->mesg_callback_thread, &attr,
 		                  (void *(*)(void *))&mesg_callback_thread, wiimote);
+		pthread_attr_destroy(&attr);
 		if (err) {
 			cwiid_err(wiimote, "Thread creation error (callback thread): %s", strerror(err));
 			return -1;
@@ -107,6 +214,10 @@ int cwiid_set_mesg_callback(cwiid_wiimote_t *wiimote,
 			cwiid_err(wiimote, "Thread detach error (callback thread)");
 			return -1;
 		}
+		if (wiimote->sched_valid) {
+			/* failures are reported, the callback runs regardless */
+			apply_sched(wiimote, wiimote->mesg_callback_thread, "callback");
+		}
 	}
 
 	return 0;
@@ -150,6 +261,7 @@ int cwiid_get_state(cwiid_wiimote_t *wiimote, struct cwiid_state *state)
 		return -1;
 	}
 
+	decode_raw_state(wiimote);
 	memcpy(state, &wiimote->state, sizeof *state);
 
 	err = pthread_mutex_unlock(&wiimote->state_mutex);
@@ -162,6 +274,8 @@ int cwiid_get_state(cwiid_wiimote_t *wiimote, struct cwiid_state *state)
 	return 0;
 }
 
+/* Calibration is cached, since it doesn't change for the life of the
+ * device (or extension), and reconnects shouldn't cost another read */
 int cwiid_get_acc_cal(cwiid_wiimote_t *wiimote, enum cwiid_ext_type ext_type,
                       struct acc_cal *acc_cal)
 {
@@ -169,22 +283,34 @@ int cwiid_get_acc_cal(cwiid_wiimote_t *wiimote, enum cwiid_ext_type ext_type,
 	uint32_t offset;
 	unsigned char buf[7];
 	char *err_str;
+	uint8_t cal_flag;
+	struct acc_cal *cache;
 
 	switch (ext_type) {
 	case CWIID_EXT_NONE:
 		flags = CWIID_RW_EEPROM;
 		offset = 0x16;
 		err_str = "";
+		cal_flag = CAL_ACC;
+		cache = &wiimote->acc_cal;
 		break;
 	case CWIID_EXT_NUNCHUK:
 		flags = CWIID_RW_REG;
 		offset = 0xA40020;
 		err_str = "nunchuk ";
+		cal_flag = CAL_NUNCHUK;
+		cache = &wiimote->nunchuk_cal;
 		break;
 	default:
 		cwiid_err(wiimote, "Unsupported calibration request");
 		return -1;
 	}
+
+	if (wiimote->cal_valid & cal_flag) {
+		*acc_cal = *cache;
+		return 0;
+	}
+
 	if (cwiid_read(wiimote, flags, offset, 7, buf)) {
 		cwiid_err(wiimote, "Read error (%scal)", err_str);
 		return -1;
@@ -197,6 +323,9 @@ int cwiid_get_acc_cal(cwiid_wiimote_t *wiimote, enum cwiid_ext_type ext_type,
 	acc_cal->one[CWIID_Y]  = buf[5];
 	acc_cal->one[CWIID_Z]  = buf[6];
 
+	*cache = *acc_cal;
+	wiimote->cal_valid |= cal_flag;
+
 	return 0;
 }
 
@@ -205,6 +334,11 @@ int cwiid_get_balance_cal(cwiid_wiimote_t *wiimote,
 {
 	unsigned char buf[24];
 
+	if (wiimote->cal_valid & CAL_BALANCE) {
+		*balance_cal = wiimote->balance_cal;
+		return 0;
+	}
+
 	if (cwiid_read(wiimote, CWIID_RW_REG, 0xa40024, 24, buf)) {
 		cwiid_err(wiimote, "Read error (balancecal)");
 		return -1;
@@ -222,5 +356,28 @@ int cwiid_get_balance_cal(cwiid_wiimote_t *wiimote,
 	balance_cal->left_top[2]     = ((uint16_t)buf[20]<<8 | (uint16_t)buf[21]);
 	balance_cal->left_bottom[2]  = ((uint16_t)buf[22]<<8 | (uint16_t)buf[23]);
 
+	wiimote->balance_cal = *balance_cal;
+	wiimote->cal_valid |= CAL_BALANCE;
+
+	return 0;
+}
+
+/* MotionPlus zero points are estimated at rest, not read from the device */
+int cwiid_get_gyro_cal(cwiid_wiimote_t *wiimote,
+                       struct motionplus_cal *gyro_cal)
+{
+	char valid;
+
+	pthread_mutex_lock(&wiimote->state_mutex);
+	if ((valid = wiimote->gyro_cal_valid)) {
+		*gyro_cal = wiimote->gyro_cal;
+	}
+	pthread_mutex_unlock(&wiimote->state_mutex);
+
+	if (!valid) {
+		cwiid_err(wiimote, "No gyro calibration (MotionPlus not yet at rest)");
+		return -1;
+	}
+
 	return 0;
 }
@@ -0,0 +1,361 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <math.h>
+#include <string.h>
+#include "cwiid_internal.h"
+
+/* IR tracking.  The camera reports up to four sources in whatever slots it
+ * likes, so sources are matched to tracks by distance to each track's
+ * constant-velocity prediction (greedy nearest neighbour over at most
+ * 4x4 pairs).  Two tracks are then held as the sensor bar; if one of its
+ * dots drops out, the last seen bar offset stands in for it, and as soon
+ * as another track is seen the bar is paired with it again. */
+
+#define IR_TRACK_GATE		100.0f	/* pixels */
+#define IR_TRACK_MAX_MISSED	4		/* reports a track coasts unmatched */
+#define IR_TRACK_VEL_GAIN	0.5f
+
+/* Cursor smoothing: steps under IR_CURSOR_RANGE pixels are damped down to
+ * IR_CURSOR_MIN_GAIN (jitter), larger ones pass straight through */
+#define IR_CURSOR_MIN_GAIN	0.15f
+#define IR_CURSOR_RANGE		24.0f
+
+#define N	CWIID_IR_SRC_COUNT
+
+void init_ir_tracker(struct wiimote *wiimote)
+{
+	memset(&wiimote->ir_tracker, 0, sizeof wiimote->ir_tracker);
+	wiimote->ir_tracker.next_id = 1;
+}
+
+static uint8_t new_track_id(struct ir_tracker *tracker)
+{
+	uint8_t id;
+	int i;
+
+	/* Skip 0 and ids still in use after wrapping; at most N collisions */
+	do {
+		id = tracker->next_id++;
+		if (tracker->next_id == 0) {
+			tracker->next_id = 1;
+		}
+		for (i=0; i < N; i++) {
+			if (tracker->track[i].id == id) {
+				break;
+			}
+		}
+	} while (i < N);
+
+	return id;
+}
+
+static void associate(struct ir_tracker *tracker,
+                      const struct cwiid_ir_mesg *ir_mesg)
+{
+	struct ir_track *track;
+	const struct cwiid_ir_src *src;
+	float pred[N][2], d2[N][N], dx, dy, best;
+	char track_matched[N], src_matched[N];
+	int i, j, n, best_i, best_j;
+
+	for (i=0; i < N; i++) {
+		track = &tracker->track[i];
+		pred[i][0] = track->pos[0] + track->vel[0];
+		pred[i][1] = track->pos[1] + track->vel[1];
+		for (j=0; j < N; j++) {
+			src = &ir_mesg->src[j];
+			if (track->id && src->valid) {
+				dx = src->pos[CWIID_X] - pred[i][0];
+				dy = src->pos[CWIID_Y] - pred[i][1];
+				d2[i][j] = dx*dx + dy*dy;
+			}
+			else {
+				d2[i][j] = -1.0f;
+			}
+		}
+		track_matched[i] = src_matched[i] = 0;
+	}
+
+	/* Greedy: closest remaining pair within the gate, at most N rounds */
+	for (n=0; n < N; n++) {
+		best = IR_TRACK_GATE * IR_TRACK_GATE;
+		best_i = best_j = -1;
+		for (i=0; i < N; i++) {
+			if (track_matched[i]) {
+				continue;
+			}
+			for (j=0; j < N; j++) {
+				if (!src_matched[j] && (d2[i][j] >= 0.0f) &&
+				  (d2[i][j] < best)) {
+					best = d2[i][j];
+					best_i = i;
+					best_j = j;
+				}
+			}
+		}
+		if (best_i == -1) {
+			break;
+		}
+
+		track = &tracker->track[best_i];
+		src = &ir_mesg->src[best_j];
+		for (i=0; i < 2; i++) {
+			track->vel[i] += IR_TRACK_VEL_GAIN *
+			                 ((src->pos[i] - track->pos[i]) - track->vel[i]);
+			track->pos[i] = src->pos[i];
+		}
+		track->size = src->size;
+		track->missed = 0;
+		track_matched[best_i] = src_matched[best_j] = 1;
+	}
+
+	/* Coast or drop unmatched tracks */
+	for (i=0; i < N; i++) {
+		track = &tracker->track[i];
+		if (track->id && !track_matched[i]) {
+			if (++track->missed > IR_TRACK_MAX_MISSED) {
+				track->id = 0;
+			}
+			else {
+				track->pos[0] = pred[i][0];
+				track->pos[1] = pred[i][1];
+			}
+		}
+	}
+
+	/* Start tracks for new sources */
+	for (j=0; j < N; j++) {
+		src = &ir_mesg->src[j];
+		if (!src->valid || src_matched[j]) {
+			continue;
+		}
+		for (i=0; (i < N) && tracker->track[i].id; i++);
+		if (i == N) {
+			break;
+		}
+		track = &tracker->track[i];
+		track->id = new_track_id(tracker);
+		track->missed = 0;
+		track->size = src->size;
+		track->pos[0] = src->pos[CWIID_X];
+		track->pos[1] = src->pos[CWIID_Y];
+		track->vel[0] = track->vel[1] = 0.0f;
+	}
+}
+
+/* Track slot with the given id, seen in this report */
+static struct ir_track *seen_track(struct ir_tracker *tracker, uint8_t id)
+{
+	int i;
+
+	if (!id) {
+		return NULL;
+	}
+	for (i=0; i < N; i++) {
+		if ((tracker->track[i].id == id) && !tracker->track[i].missed) {
+			return &tracker->track[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Seen track other than skip nearest to (x, y), or NULL */
+static struct ir_track *nearest_track(struct ir_tracker *tracker,
+                                      const struct ir_track *skip,
+                                      float x, float y)
+{
+	struct ir_track *track, *nearest = NULL;
+	float d2, best = 0.0f;
+	int i;
+
+	for (i=0; i < N; i++) {
+		track = &tracker->track[i];
+		if (!track->id || track->missed || (track == skip)) {
+			continue;
+		}
+		d2 = (track->pos[0] - x) * (track->pos[0] - x) +
+		     (track->pos[1] - y) * (track->pos[1] - y);
+		if (!nearest || (d2 < best)) {
+			nearest = track;
+			best = d2;
+		}
+	}
+
+	return nearest;
+}
+
+/* Locate the bar ends; returns 0 if the bar is not in view */
+static int find_bar(struct ir_tracker *tracker, float *left, float *right)
+{
+	struct ir_track *a, *b, *tmp;
+	int i, repaired = 0;
+
+	a = seen_track(tracker, tracker->bar_id[0]);
+	b = seen_track(tracker, tracker->bar_id[1]);
+
+	/* One bar dot is out of sight.  If it came back as a new track (or
+	 * the bar moved on to another source), pair the seen dot with the
+	 * track nearest where its partner should be, rather than coast on
+	 * the old offset indefinitely. */
+	if (a && !b) {
+		b = nearest_track(tracker, a, a->pos[0] + tracker->bar_offset[0],
+		                  a->pos[1] + tracker->bar_offset[1]);
+		repaired = (b != NULL);
+	}
+	else if (b && !a) {
+		a = nearest_track(tracker, b, b->pos[0] - tracker->bar_offset[0],
+		                  b->pos[1] - tracker->bar_offset[1]);
+		repaired = (a != NULL);
+	}
+
+	if (a && b) {
+		if (repaired) {
+			if (a->pos[0] > b->pos[0]) {
+				tmp = a;
+				a = b;
+				b = tmp;
+			}
+			tracker->bar_id[0] = a->id;
+			tracker->bar_id[1] = b->id;
+		}
+		tracker->bar_offset[0] = b->pos[0] - a->pos[0];
+		tracker->bar_offset[1] = b->pos[1] - a->pos[1];
+	}
+	else if (a) {
+		left[0] = a->pos[0];
+		left[1] = a->pos[1];
+		right[0] = left[0] + tracker->bar_offset[0];
+		right[1] = left[1] + tracker->bar_offset[1];
+		return 1;
+	}
+	else if (b) {
+		right[0] = b->pos[0];
+		right[1] = b->pos[1];
+		left[0] = right[0] - tracker->bar_offset[0];
+		left[1] = right[1] - tracker->bar_offset[1];
+		return 1;
+	}
+	else {
+		/* New bar: the two largest sources, ordered left to right */
+		for (i=0; i < N; i++) {
+			tmp = &tracker->track[i];
+			if (!tmp->id || tmp->missed) {
+				continue;
+			}
+			if (!a || (tmp->size > a->size)) {
+				b = a;
+				a = tmp;
+			}
+			else if (!b || (tmp->size > b->size)) {
+				b = tmp;
+			}
+		}
+		if (!b) {
+			tracker->bar_id[0] = tracker->bar_id[1] = 0;
+			return 0;
+		}
+		if (a->pos[0] > b->pos[0]) {
+			tmp = a;
+			a = b;
+			b = tmp;
+		}
+		tracker->bar_id[0] = a->id;
+		tracker->bar_id[1] = b->id;
+		tracker->bar_offset[0] = b->pos[0] - a->pos[0];
+		tracker->bar_offset[1] = b->pos[1] - a->pos[1];
+	}
+
+	left[0] = a->pos[0];
+	left[1] = a->pos[1];
+	right[0] = b->pos[0];
+	right[1] = b->pos[1];
+
+	return 1;
+}
+
+/* Append a cursor message after each IR message */
+int process_ir_track(struct wiimote *wiimote, struct mesg_array *ma)
+{
+	struct ir_tracker *tracker = &wiimote->ir_tracker;
+	struct cwiid_cursor_mesg *cursor_mesg;
+	struct ir_track *track;
+	float left[2], right[2], mid[2], step, gain;
+	int i, j;
+
+	for (i=0; i < ma->count; i++) {
+		if (ma->array[i].type == CWIID_MESG_IR) {
+			break;
+		}
+	}
+	if ((i == ma->count) || (ma->count >= CWIID_MAX_MESG_COUNT)) {
+		return 0;
+	}
+
+	associate(tracker, &ma->array[i].ir_mesg);
+
+	cursor_mesg = &ma->array[ma->count++].cursor_mesg;
+	cursor_mesg->type = CWIID_MESG_CURSOR;
+	for (j=0; j < N; j++) {
+		track = &tracker->track[j];
+		if (track->id && !track->missed) {
+			cursor_mesg->track[j].id = track->id;
+			cursor_mesg->track[j].pos[CWIID_X] = track->pos[0];
+			cursor_mesg->track[j].pos[CWIID_Y] = track->pos[1];
+		}
+		else {
+			cursor_mesg->track[j].id = 0;
+		}
+	}
+
+	if (!find_bar(tracker, left, right)) {
+		tracker->cursor_valid = 0;
+		cursor_mesg->valid = 0;
+		return 0;
+	}
+
+	mid[0] = (left[0] + right[0]) / 2;
+	mid[1] = (left[1] + right[1]) / 2;
+	if (tracker->cursor_valid) {
+		step = hypotf(mid[0] - tracker->cursor[0], mid[1] - tracker->cursor[1]);
+		gain = step / IR_CURSOR_RANGE;
+		if (gain < IR_CURSOR_MIN_GAIN) {
+			gain = IR_CURSOR_MIN_GAIN;
+		}
+		else if (gain > 1.0f) {
+			gain = 1.0f;
+		}
+		tracker->cursor[0] += gain * (mid[0] - tracker->cursor[0]);
+		tracker->cursor[1] += gain * (mid[1] - tracker->cursor[1]);
+	}
+	else {
+		tracker->cursor[0] = mid[0];
+		tracker->cursor[1] = mid[1];
+		tracker->cursor_valid = 1;
+	}
+
+	cursor_mesg->valid = 1;
+	cursor_mesg->pos[CWIID_X] = tracker->cursor[0];
+	cursor_mesg->pos[CWIID_Y] = tracker->cursor[1];
+	cursor_mesg->distance = hypotf(tracker->bar_offset[0],
+	                               tracker->bar_offset[1]);
+	cursor_mesg->roll = atan2f(tracker->bar_offset[1], tracker->bar_offset[0]);
+
+	return 0;
+}
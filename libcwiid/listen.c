@@ -0,0 +1,538 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/l2cap.h>
+#include "cwiid_internal.h"
+
+/* Persistent listener.  The control and interrupt server sockets stay open
+ * for the life of the listener, and a thread accepts on both.  A wiimote
+ * opens its control channel first, but with several connecting at once the
+ * two accept queues interleave, so channels are paired by remote bdaddr.
+ * Each completed pair is handed to a worker thread, which runs cwiid_new
+ * (a status round trip) and delivers the handle, so a slow or silent
+ * device does not hold up the others.  Callbacks may therefore run on
+ * several threads at once. */
+
+/* one piconet worth of devices */
+#define LISTEN_BACKLOG		7
+#define LISTEN_MAX_PENDING	LISTEN_BACKLOG
+#define LISTEN_QUEUE_LEN	16
+/* seconds to wait for the second channel of a pair */
+#define LISTEN_PAIR_TIMEOUT	DEFAULT_TIMEOUT
+
+struct listen_pending {
+	bdaddr_t bdaddr;
+	int ctl_socket;
+	int int_socket;
+	time_t accepted;
+};
+
+struct listen_work {
+	struct cwiid_listener *listener;
+	int ctl_socket;
+	int int_socket;
+	char opening;				/* in cwiid_new, under queue_mutex */
+	char abandoned;				/* shut down by cwiid_listener_close */
+	struct listen_work *next;
+};
+
+struct cwiid_listener {
+	int flags;
+	int ctl_server_socket;
+	int int_server_socket;
+	int wake_pipe[2];
+	pthread_t thread;
+	cwiid_listen_callback_t *callback;
+	const void *data;
+	struct listen_pending pending[LISTEN_MAX_PENDING];
+	/* ready queue, used when there is no callback */
+	pthread_mutex_t queue_mutex;
+	pthread_cond_t queue_cond;
+	cwiid_wiimote_t *queue[LISTEN_QUEUE_LEN];
+	int queue_head;
+	int queue_count;
+	struct listen_work *workers;	/* under queue_mutex */
+	char running;
+};
+
+static int listen_server_socket(unsigned short psm, const char *name)
+{
+	struct sockaddr_l2 local_addr;
+	int sock;
+
+	memset(&local_addr, 0, sizeof local_addr);
+	local_addr.l2_family = AF_BLUETOOTH;
+	local_addr.l2_bdaddr = *BDADDR_ANY;
+	local_addr.l2_psm = htobs(psm);
+	if ((sock = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP)) == -1) {
+		cwiid_err(NULL, "Socket creation error (%s socket): %s", name,
+		          strerror(errno));
+		return -1;
+	}
+	if (bind(sock, (struct sockaddr *)&local_addr, sizeof local_addr)) {
+		cwiid_err(NULL, "Socket bind error (%s socket): %s", name,
+		          strerror(errno));
+		close(sock);
+		return -1;
+	}
+	if (listen(sock, LISTEN_BACKLOG)) {
+		cwiid_err(NULL, "Socket listen error (%s socket): %s", name,
+		          strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+static void listen_drop_pending(struct listen_pending *pending)
+{
+	if (pending->ctl_socket != -1) {
+		close(pending->ctl_socket);
+		pending->ctl_socket = -1;
+	}
+	if (pending->int_socket != -1) {
+		close(pending->int_socket);
+		pending->int_socket = -1;
+	}
+}
+
+static void listen_deliver(struct cwiid_listener *listener,
+                           cwiid_wiimote_t *wiimote)
+{
+	int i;
+
+	if (listener->callback) {
+		listener->callback(listener, wiimote, listener->data);
+		return;
+	}
+
+	pthread_mutex_lock(&listener->queue_mutex);
+	if (listener->queue_count == LISTEN_QUEUE_LEN) {
+		pthread_mutex_unlock(&listener->queue_mutex);
+		cwiid_err(NULL, "Listener queue full, dropping connection");
+		cwiid_close(wiimote);
+		return;
+	}
+	i = (listener->queue_head + listener->queue_count) % LISTEN_QUEUE_LEN;
+	listener->queue[i] = wiimote;
+	listener->queue_count++;
+	pthread_cond_signal(&listener->queue_cond);
+	pthread_mutex_unlock(&listener->queue_mutex);
+}
+
+static void listen_worker_done(struct listen_work *work)
+{
+	struct cwiid_listener *listener = work->listener;
+	struct listen_work **cursor;
+
+	pthread_mutex_lock(&listener->queue_mutex);
+	for (cursor = &listener->workers; *cursor; cursor = &(*cursor)->next) {
+		if (*cursor == work) {
+			*cursor = work->next;
+			break;
+		}
+	}
+	pthread_cond_broadcast(&listener->queue_cond);
+	pthread_mutex_unlock(&listener->queue_mutex);
+
+	free(work);
+}
+
+static void *listen_worker(struct listen_work *work)
+{
+	struct cwiid_listener *listener = work->listener;
+	cwiid_wiimote_t *wiimote;
+
+	wiimote = cwiid_new(work->ctl_socket, work->int_socket, listener->flags);
+
+	/* Out of reach of cwiid_listener_close's shutdown from here on */
+	pthread_mutex_lock(&listener->queue_mutex);
+	work->opening = 0;
+	pthread_mutex_unlock(&listener->queue_mutex);
+
+	if (wiimote && work->abandoned) {
+		cwiid_close(wiimote);
+	}
+	else if (wiimote) {
+		/* sockets now belong to the wiimote */
+		listen_deliver(listener, wiimote);
+	}
+	else {
+		/* cwiid_new raises its own error */
+		close(work->ctl_socket);
+		close(work->int_socket);
+	}
+
+	listen_worker_done(work);
+
+	return NULL;
+}
+
+static void listen_accept(struct cwiid_listener *listener, char is_ctl)
+{
+	struct sockaddr_l2 remote_addr;
+	socklen_t socklen = sizeof remote_addr;
+	struct listen_pending *pending = NULL, *free_pending = NULL;
+	struct listen_work *work;
+	pthread_t thread;
+	int sock;
+	int err;
+	int i;
+
+	if ((sock = accept(is_ctl ? listener->ctl_server_socket
+	                          : listener->int_server_socket,
+	                   (struct sockaddr *)&remote_addr, &socklen)) < 0) {
+		cwiid_err(NULL, "Socket accept error (%s socket): %s",
+		          is_ctl ? "control" : "interrupt", strerror(errno));
+		return;
+	}
+
+	for (i=0; i < LISTEN_MAX_PENDING; i++) {
+		if ((listener->pending[i].ctl_socket == -1) &&
+		  (listener->pending[i].int_socket == -1)) {
+			if (!free_pending) {
+				free_pending = &listener->pending[i];
+			}
+		}
+		else if (!bacmp(&listener->pending[i].bdaddr, &remote_addr.l2_bdaddr)) {
+			pending = &listener->pending[i];
+			break;
+		}
+	}
+
+	if (!pending) {
+		if (!free_pending) {
+			cwiid_err(NULL, "Too many pending connections");
+			close(sock);
+			return;
+		}
+		pending = free_pending;
+		bacpy(&pending->bdaddr, &remote_addr.l2_bdaddr);
+		pending->accepted = time(NULL);
+	}
+
+	/* A repeated channel means the device gave up and started over, so
+	 * the pairing timeout starts over too */
+	if (is_ctl) {
+		if (pending->ctl_socket != -1) {
+			close(pending->ctl_socket);
+			pending->accepted = time(NULL);
+		}
+		pending->ctl_socket = sock;
+	}
+	else {
+		if (pending->int_socket != -1) {
+			close(pending->int_socket);
+			pending->accepted = time(NULL);
+		}
+		pending->int_socket = sock;
+	}
+
+	if ((pending->ctl_socket == -1) || (pending->int_socket == -1)) {
+		return;
+	}
+
+	if ((work = malloc(sizeof *work)) == NULL) {
+		cwiid_err(NULL, "Memory allocation error (listener work)");
+		listen_drop_pending(pending);
+		return;
+	}
+	work->listener = listener;
+	work->ctl_socket = pending->ctl_socket;
+	work->int_socket = pending->int_socket;
+	work->opening = 1;
+	work->abandoned = 0;
+
+	pthread_mutex_lock(&listener->queue_mutex);
+	work->next = listener->workers;
+	listener->workers = work;
+	pthread_mutex_unlock(&listener->queue_mutex);
+
+	if ((err = pthread_create(&thread, NULL,
+	                          (void *(*)(void *))&listen_worker, work))) {
+		cwiid_err(NULL, "Thread creation error (listener worker): %s",
+		          strerror(err));
+		listen_worker_done(work);
+		listen_drop_pending(pending);
+		return;
+	}
+	if ((err = pthread_detach(thread))) {
+		cwiid_err(NULL, "Thread detach error (listener worker): %s",
+		          strerror(err));
+	}
+
+	/* sockets now belong to the worker */
+	pending->ctl_socket = -1;
+	pending->int_socket = -1;
+}
+
+static void *listen_thread(struct cwiid_listener *listener)
+{
+	struct pollfd pfd[3];
+	time_t now;
+	int i;
+
+	pfd[0].fd = listener->ctl_server_socket;
+	pfd[1].fd = listener->int_server_socket;
+	pfd[2].fd = listener->wake_pipe[0];
+	for (i=0; i < 3; i++) {
+		pfd[i].events = POLLIN;
+	}
+
+	while (listener->running) {
+		if (poll(pfd, 3, 1000) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			cwiid_err(NULL, "Poll error (listener): %s", strerror(errno));
+			break;
+		}
+
+		if (pfd[2].revents) {
+			break;
+		}
+		if (pfd[0].revents & POLLIN) {
+			listen_accept(listener, 1);
+		}
+		if (pfd[1].revents & POLLIN) {
+			listen_accept(listener, 0);
+		}
+
+		/* Expire half-open pairs */
+		now = time(NULL);
+		for (i=0; i < LISTEN_MAX_PENDING; i++) {
+			if (((listener->pending[i].ctl_socket != -1) ||
+			     (listener->pending[i].int_socket != -1)) &&
+			  (now - listener->pending[i].accepted > LISTEN_PAIR_TIMEOUT)) {
+				listen_drop_pending(&listener->pending[i]);
+			}
+		}
+	}
+
+	for (i=0; i < LISTEN_MAX_PENDING; i++) {
+		listen_drop_pending(&listener->pending[i]);
+	}
+
+	/* Wake cwiid_listener_accept callers */
+	pthread_mutex_lock(&listener->queue_mutex);
+	listener->running = 0;
+	pthread_cond_broadcast(&listener->queue_cond);
+	pthread_mutex_unlock(&listener->queue_mutex);
+
+	return NULL;
+}
+
+cwiid_listener_t *cwiid_listener_open(int flags,
+                                      cwiid_listen_callback_t *callback,
+                                      const void *data)
+{
+	struct cwiid_listener *listener;
+	char wake_pipe_init = 0, queue_mutex_init = 0, queue_cond_init = 0;
+	int err;
+	int i;
+
+	if ((listener = malloc(sizeof *listener)) == NULL) {
+		cwiid_err(NULL, "Memory allocation error (cwiid_listener_t)");
+		return NULL;
+	}
+
+	listener->flags = flags;
+	listener->callback = callback;
+	listener->data = data;
+	listener->queue_head = 0;
+	listener->queue_count = 0;
+	listener->workers = NULL;
+	listener->running = 1;
+	for (i=0; i < LISTEN_MAX_PENDING; i++) {
+		listener->pending[i].ctl_socket = -1;
+		listener->pending[i].int_socket = -1;
+	}
+	listener->int_server_socket = -1;
+
+	if ((listener->ctl_server_socket =
+	  listen_server_socket(CTL_PSM, "control")) == -1) {
+		goto ERR_HND;
+	}
+	if ((listener->int_server_socket =
+	  listen_server_socket(INT_PSM, "interrupt")) == -1) {
+		goto ERR_HND;
+	}
+
+	if (pipe(listener->wake_pipe)) {
+		cwiid_err(NULL, "Pipe creation error (listener pipe): %s", strerror(errno));
+		goto ERR_HND;
+	}
+	wake_pipe_init = 1;
+
+	if ((err = pthread_mutex_init(&listener->queue_mutex, NULL))) {
+		cwiid_err(NULL, "Mutex initialization error (listener mutex): %s", strerror(err));
+		goto ERR_HND;
+	}
+	queue_mutex_init = 1;
+	if ((err = pthread_cond_init(&listener->queue_cond, NULL))) {
+		cwiid_err(NULL, "Cond initialization error (listener cond): %s", strerror(err));
+		goto ERR_HND;
+	}
+	queue_cond_init = 1;
+
+	err = pthread_create(&listener->thread, NULL,
+	                     (void *(*)(void *))&listen_thread, listener);
+	if (err) {
+		cwiid_err(NULL, "Thread creation error (listener thread): %s", strerror(err));
+		goto ERR_HND;
+	}
+
+	return listener;
+
+ERR_HND:
+	if (queue_cond_init) {
+		pthread_cond_destroy(&listener->queue_cond);
+	}
+	if (queue_mutex_init) {
+		pthread_mutex_destroy(&listener->queue_mutex);
+	}
+	if (wake_pipe_init) {
+		close(listener->wake_pipe[0]);
+		close(listener->wake_pipe[1]);
+	}
+	if (listener->int_server_socket != -1) {
+		close(listener->int_server_socket);
+	}
+	if (listener->ctl_server_socket != -1) {
+		close(listener->ctl_server_socket);
+	}
+	free(listener);
+	return NULL;
+}
+
+/* timeout in milliseconds, -1 to block.  Returns NULL on timeout, error, or
+ * when the listener is in callback mode */
+cwiid_wiimote_t *cwiid_listener_accept(cwiid_listener_t *listener,
+                                       int timeout)
+{
+	struct timespec deadline;
+	cwiid_wiimote_t *wiimote = NULL;
+	int err = 0;
+
+	if (listener->callback) {
+		cwiid_err(NULL, "Listener delivers by callback");
+		return NULL;
+	}
+
+	if (timeout != -1) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&listener->queue_mutex);
+	while (!listener->queue_count && listener->running && !err) {
+		if (timeout == -1) {
+			err = pthread_cond_wait(&listener->queue_cond,
+			                        &listener->queue_mutex);
+		}
+		else {
+			err = pthread_cond_timedwait(&listener->queue_cond,
+			                             &listener->queue_mutex, &deadline);
+		}
+	}
+	if (listener->queue_count) {
+		wiimote = listener->queue[listener->queue_head];
+		listener->queue_head = (listener->queue_head + 1) % LISTEN_QUEUE_LEN;
+		listener->queue_count--;
+	}
+	pthread_mutex_unlock(&listener->queue_mutex);
+
+	if (err && (err != ETIMEDOUT)) {
+		cwiid_err(NULL, "Cond wait error (listener cond): %s", strerror(err));
+	}
+
+	return wiimote;
+}
+
+/* Handles still being opened are abandoned, by shutting their sockets
+ * down, and handles being delivered are waited for.  Wiimotes still queued
+ * are closed; handles already delivered are not affected */
+int cwiid_listener_close(cwiid_listener_t *listener)
+{
+	struct listen_work *work;
+	int ret = 0;
+	int err;
+
+	if (write(listener->wake_pipe[1], "", 1) != 1) {
+		cwiid_err(NULL, "Pipe write error (listener pipe): %s", strerror(errno));
+		pthread_cancel(listener->thread);
+		ret = -1;
+	}
+	if ((err = pthread_join(listener->thread, NULL))) {
+		cwiid_err(NULL, "Thread join error (listener thread): %s", strerror(err));
+		ret = -1;
+	}
+
+	pthread_mutex_lock(&listener->queue_mutex);
+	for (work = listener->workers; work; work = work->next) {
+		if (work->opening) {
+			work->abandoned = 1;
+			shutdown(work->ctl_socket, SHUT_RDWR);
+			shutdown(work->int_socket, SHUT_RDWR);
+		}
+	}
+	while (listener->workers) {
+		pthread_cond_wait(&listener->queue_cond, &listener->queue_mutex);
+	}
+	pthread_mutex_unlock(&listener->queue_mutex);
+
+	while (listener->queue_count) {
+		cwiid_close(listener->queue[listener->queue_head]);
+		listener->queue_head = (listener->queue_head + 1) % LISTEN_QUEUE_LEN;
+		listener->queue_count--;
+	}
+
+	if (close(listener->ctl_server_socket)) {
+		cwiid_err(NULL, "Socket close error (control server socket): %s", strerror(errno));
+		ret = -1;
+	}
+	if (close(listener->int_server_socket)) {
+		cwiid_err(NULL, "Socket close error (interrupt server socket): %s", strerror(errno));
+		ret = -1;
+	}
+	if (close(listener->wake_pipe[0]) || close(listener->wake_pipe[1])) {
+		cwiid_err(NULL, "Pipe close error (listener pipe): %s", strerror(errno));
+		ret = -1;
+	}
+	pthread_cond_destroy(&listener->queue_cond);
+	pthread_mutex_destroy(&listener->queue_mutex);
+	free(listener);
+
+	return ret;
+}
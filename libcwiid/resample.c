@@ -0,0 +1,486 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "cwiid_internal.h"
+
+/* Fixed rate subscribers.  The router folds each sensor message into the
+ * subscriber's accumulator for its type instead of queueing it, and one
+ * thread per connection, sleeping on a timerfd armed for the earliest
+ * subscriber deadline, turns the accumulators into a message array at
+ * each subscriber's rate.  Numeric fields are reduced (mean, min, max or
+ * last); buttons and other discrete fields come from the last message.
+ * IR sources, cursors and orientations are taken whole from the last
+ * message: camera slots get reassigned, and quaternions do not average
+ * component-wise.  Event-like messages (status, buttons, link, errors)
+ * and types without a field table skip the accumulators and are queued
+ * at once. */
+
+enum field_kind {
+	FIELD_U8,
+	FIELD_I8,
+	FIELD_U16,
+	FIELD_FLOAT
+};
+
+struct field {
+	uint8_t kind;
+	uint8_t count;
+	uint16_t offset;
+};
+
+#define FIELD(kind, member, count) \
+	{kind, count, offsetof(union cwiid_mesg, member)}
+
+static const struct field acc_fields[] = {
+	FIELD(FIELD_U16, acc_mesg.acc, 3)
+};
+static const struct field nunchuk_fields[] = {
+	FIELD(FIELD_U8, nunchuk_mesg.stick, 2),
+	FIELD(FIELD_U16, nunchuk_mesg.acc, 3)
+};
+static const struct field classic_fields[] = {
+	FIELD(FIELD_U8, classic_mesg.l_stick, 2),
+	FIELD(FIELD_U8, classic_mesg.r_stick, 2),
+	FIELD(FIELD_U8, classic_mesg.l, 1),
+	FIELD(FIELD_U8, classic_mesg.r, 1)
+};
+static const struct field balance_fields[] = {
+	FIELD(FIELD_U16, balance_mesg.right_top, 1),
+	FIELD(FIELD_U16, balance_mesg.right_bottom, 1),
+	FIELD(FIELD_U16, balance_mesg.left_top, 1),
+	FIELD(FIELD_U16, balance_mesg.left_bottom, 1)
+};
+static const struct field motionplus_fields[] = {
+	FIELD(FIELD_U16, motionplus_mesg.angle_rate, 3)
+};
+static const struct field guitar_fields[] = {
+	FIELD(FIELD_U8, guitar_mesg.stick, 2),
+	FIELD(FIELD_U8, guitar_mesg.whammy, 1)
+};
+static const struct field drums_fields[] = {
+	FIELD(FIELD_U8, drums_mesg.stick, 2)
+};
+static const struct field turntables_fields[] = {
+	FIELD(FIELD_U8, turntables_mesg.stick, 2),
+	FIELD(FIELD_U8, turntables_mesg.crossfader, 1),
+	FIELD(FIELD_U8, turntables_mesg.effect_dial, 1),
+	FIELD(FIELD_I8, turntables_mesg.left_turntable, 1),
+	FIELD(FIELD_I8, turntables_mesg.right_turntable, 1)
+};
+static const struct field acc_cal_fields[] = {
+	FIELD(FIELD_FLOAT, acc_cal_mesg.acc, 3)
+};
+static const struct field nunchuk_cal_fields[] = {
+	FIELD(FIELD_FLOAT, nunchuk_cal_mesg.stick, 2),
+	FIELD(FIELD_FLOAT, nunchuk_cal_mesg.acc, 3)
+};
+static const struct field balance_cal_fields[] = {
+	FIELD(FIELD_FLOAT, balance_cal_mesg.right_top, 1),
+	FIELD(FIELD_FLOAT, balance_cal_mesg.right_bottom, 1),
+	FIELD(FIELD_FLOAT, balance_cal_mesg.left_top, 1),
+	FIELD(FIELD_FLOAT, balance_cal_mesg.left_bottom, 1),
+	FIELD(FIELD_FLOAT, balance_cal_mesg.weight, 1),
+	FIELD(FIELD_FLOAT, balance_cal_mesg.cop, 2)
+};
+static const struct field motionplus_cal_fields[] = {
+	FIELD(FIELD_FLOAT, motionplus_cal_mesg.angle_rate, 3)
+};
+
+#define REDUCE_BIT(reduce)	(1 << (reduce))
+#define REDUCE_ALL	(REDUCE_BIT(CWIID_REDUCE_MEAN) | \
+                 	 REDUCE_BIT(CWIID_REDUCE_LAST) | \
+                 	 REDUCE_BIT(CWIID_REDUCE_MIN) | \
+                 	 REDUCE_BIT(CWIID_REDUCE_MAX))
+
+#define FIELDS(table)	{table, sizeof table / sizeof table[0], REDUCE_ALL}
+#define LAST_ONLY		{NULL, 0, REDUCE_BIT(CWIID_REDUCE_LAST)}
+
+static const struct {
+	const struct field *field;
+	int count;
+	uint8_t reduce;				/* REDUCE_BIT mask, 0 if not resampled */
+} mesg_fields[CWIID_MESG_UNKNOWN] = {
+	[CWIID_MESG_ACC] = FIELDS(acc_fields),
+	[CWIID_MESG_NUNCHUK] = FIELDS(nunchuk_fields),
+	[CWIID_MESG_CLASSIC] = FIELDS(classic_fields),
+	[CWIID_MESG_BALANCE] = FIELDS(balance_fields),
+	[CWIID_MESG_MOTIONPLUS] = FIELDS(motionplus_fields),
+	[CWIID_MESG_GUITAR] = FIELDS(guitar_fields),
+	[CWIID_MESG_DRUMS] = FIELDS(drums_fields),
+	[CWIID_MESG_TURNTABLES] = FIELDS(turntables_fields),
+	[CWIID_MESG_ACC_CAL] = FIELDS(acc_cal_fields),
+	[CWIID_MESG_NUNCHUK_CAL] = FIELDS(nunchuk_cal_fields),
+	[CWIID_MESG_BALANCE_CAL] = FIELDS(balance_cal_fields),
+	[CWIID_MESG_MOTIONPLUS_CAL] = FIELDS(motionplus_cal_fields),
+	[CWIID_MESG_IR] = LAST_ONLY,
+	[CWIID_MESG_ORIENTATION] = LAST_ONLY,
+	[CWIID_MESG_CURSOR] = LAST_ONLY
+};
+
+static double get_value(const union cwiid_mesg *mesg, enum field_kind kind,
+                        uint16_t offset, int i)
+{
+	const char *p = (const char *)mesg + offset;
+
+	switch (kind) {
+	case FIELD_U8:
+		return ((const uint8_t *)p)[i];
+	case FIELD_I8:
+		return ((const int8_t *)p)[i];
+	case FIELD_U16:
+		return ((const uint16_t *)p)[i];
+	default:
+		return ((const float *)p)[i];
+	}
+}
+
+static void set_value(union cwiid_mesg *mesg, enum field_kind kind,
+                      uint16_t offset, int i, double value)
+{
+	char *p = (char *)mesg + offset;
+
+	switch (kind) {
+	case FIELD_U8:
+		((uint8_t *)p)[i] = lrint(value);
+		break;
+	case FIELD_I8:
+		((int8_t *)p)[i] = lrint(value);
+		break;
+	case FIELD_U16:
+		((uint16_t *)p)[i] = lrint(value);
+		break;
+	default:
+		((float *)p)[i] = value;
+		break;
+	}
+}
+
+/* Router side, with sub_mutex held.  Returns 1 if the message went into
+ * an accumulator, 0 if it should be queued as is. */
+int resample_mesg(struct cwiid_sub *sub, const union cwiid_mesg *mesg)
+{
+	struct resample_accum *accum;
+	const struct field *field;
+	enum cwiid_reduce reduce;
+	double value;
+	int f, i, n;
+
+	if ((mesg->type >= CWIID_MESG_UNKNOWN) ||
+	  !mesg_fields[mesg->type].reduce) {
+		return 0;
+	}
+
+	accum = &sub->resample->accum[mesg->type];
+	reduce = sub->reduce[mesg->type];
+	for (f=0, n=0; f < mesg_fields[mesg->type].count; f++) {
+		field = &mesg_fields[mesg->type].field[f];
+		for (i=0; i < field->count; i++, n++) {
+			value = get_value(mesg, field->kind, field->offset, i);
+			if (!accum->count ||
+			  ((reduce == CWIID_REDUCE_MIN) && (value < accum->value[n])) ||
+			  ((reduce == CWIID_REDUCE_MAX) && (value > accum->value[n]))) {
+				accum->value[n] = value;
+			}
+			else if (reduce == CWIID_REDUCE_MEAN) {
+				accum->value[n] += value;
+			}
+		}
+	}
+	accum->last = *mesg;
+	accum->count++;
+
+	return 1;
+}
+
+/* Queue whatever has accumulated, with sub_mutex held */
+static void resample_emit(struct cwiid_sub *sub, const struct timespec *now)
+{
+	struct resample_accum *accum;
+	const struct field *field;
+	struct mesg_array *slot = NULL;
+	union cwiid_mesg *mesg;
+	double value;
+	int type, f, i, n;
+
+	for (type=0; type < CWIID_MESG_UNKNOWN; type++) {
+		accum = &sub->resample->accum[type];
+		if (!accum->count) {
+			continue;
+		}
+
+		if (slot && (slot->count == CWIID_MAX_MESG_COUNT)) {
+			sub_commit(sub);
+			slot = NULL;
+		}
+		if (!slot) {
+			if ((slot = sub_slot(sub)) == NULL) {
+				break;
+			}
+			slot->count = 0;
+			slot->timestamp = *now;
+		}
+
+		mesg = &slot->array[slot->count++];
+		*mesg = accum->last;
+		if (sub->reduce[type] != CWIID_REDUCE_LAST) {
+			for (f=0, n=0; f < mesg_fields[type].count; f++) {
+				field = &mesg_fields[type].field[f];
+				for (i=0; i < field->count; i++, n++) {
+					value = accum->value[n];
+					if (sub->reduce[type] == CWIID_REDUCE_MEAN) {
+						value /= accum->count;
+					}
+					set_value(mesg, field->kind, field->offset, i, value);
+				}
+			}
+		}
+	}
+	if (slot) {
+		sub_commit(sub);
+	}
+
+	/* A full ring loses this period, not the next */
+	for (type=0; type < CWIID_MESG_UNKNOWN; type++) {
+		sub->resample->accum[type].count = 0;
+	}
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Call with sub_mutex held.  when is absolute; 0 disarms, -1 fires at
+ * once. */
+static int arm_resampler(struct wiimote *wiimote, int64_t when)
+{
+	struct itimerspec its;
+	int flags = TFD_TIMER_ABSTIME;
+
+	memset(&its, 0, sizeof its);
+	if (when == -1) {
+		its.it_value.tv_nsec = 1;
+		flags = 0;
+	}
+	else {
+		its.it_value.tv_sec = when / 1000000000LL;
+		its.it_value.tv_nsec = when % 1000000000LL;
+	}
+	if (timerfd_settime(wiimote->resampler->timer_fd, flags, &its, NULL)) {
+		cwiid_err(wiimote, "Timer set error (resampler): %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *resampler_thread(struct wiimote *wiimote)
+{
+	struct resampler *resampler = wiimote->resampler;
+	struct cwiid_sub *sub;
+	struct timespec stamp;
+	uint64_t expirations;
+	int64_t now, next;
+
+	while (1) {
+		if (read(resampler->timer_fd, &expirations, sizeof expirations) !=
+		  sizeof expirations) {
+			if (errno == EINTR) {
+				continue;
+			}
+			cwiid_err(wiimote, "Timer read error (resampler): %s",
+			          strerror(errno));
+			break;
+		}
+
+		pthread_mutex_lock(&wiimote->sub_mutex);
+		if (resampler->closing) {
+			pthread_mutex_unlock(&wiimote->sub_mutex);
+			break;
+		}
+		now = now_ns();
+		clock_gettime(CLOCK_REALTIME, &stamp);
+		next = 0;
+		for (sub = wiimote->subs; sub; sub = sub->next) {
+			if (!sub->resample) {
+				continue;
+			}
+			if (!sub->resample->next) {
+				/* new rate, first period starts now */
+				sub->resample->next = now + sub->resample->period;
+			}
+			else if (now >= sub->resample->next) {
+				resample_emit(sub, &stamp);
+				sub->resample->next += sub->resample->period;
+				if (sub->resample->next <= now) {
+					/* fell behind, don't burst to catch up */
+					sub->resample->next = now + sub->resample->period;
+				}
+			}
+			if (!next || (sub->resample->next < next)) {
+				next = sub->resample->next;
+			}
+		}
+		arm_resampler(wiimote, next);
+		pthread_mutex_unlock(&wiimote->sub_mutex);
+	}
+
+	return NULL;
+}
+
+/* Call with sub_mutex held */
+static int open_resampler(struct wiimote *wiimote)
+{
+	struct resampler *resampler;
+	int err;
+
+	if ((resampler = malloc(sizeof *resampler)) == NULL) {
+		cwiid_err(wiimote, "Memory allocation error (resampler)");
+		return -1;
+	}
+	resampler->closing = 0;
+
+	if ((resampler->timer_fd = timerfd_create(CLOCK_MONOTONIC, 0)) == -1) {
+		cwiid_err(wiimote, "Timer create error (resampler): %s",
+		          strerror(errno));
+		free(resampler);
+		return -1;
+	}
+
+	wiimote->resampler = resampler;
+	if ((err = pthread_create(&resampler->thread, NULL,
+	                          (void *(*)(void *))&resampler_thread, wiimote))) {
+		cwiid_err(wiimote, "Thread creation error (resampler thread): %s",
+		          strerror(err));
+		wiimote->resampler = NULL;
+		close(resampler->timer_fd);
+		free(resampler);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* rate in Hz, 0 to queue every message array as it comes */
+int cwiid_sub_set_rate(cwiid_sub_t *sub, float rate)
+{
+	struct wiimote *wiimote = sub->wiimote;
+	struct resample *resample = NULL;
+	int ret = 0;
+
+	if (!(rate >= 0.0f) || (rate > CWIID_SUB_MAX_RATE)) {
+		cwiid_err(wiimote, "Invalid subscription rate");
+		return -1;
+	}
+	if ((rate > 0.0f) && ((resample = malloc(sizeof *resample)) == NULL)) {
+		cwiid_err(wiimote, "Memory allocation error (resample)");
+		return -1;
+	}
+	if (resample) {
+		memset(resample, 0, sizeof *resample);
+		resample->period = 1e9 / rate;
+	}
+
+	pthread_mutex_lock(&wiimote->sub_mutex);
+	if (resample && !wiimote->resampler && open_resampler(wiimote)) {
+		ret = -1;
+	}
+	else {
+		/* Samples accumulated at the old rate are discarded */
+		free(sub->resample);
+		sub->resample = resample;
+		resample = NULL;
+		if (sub->resample) {
+			ret = arm_resampler(wiimote, -1);
+		}
+	}
+	pthread_mutex_unlock(&wiimote->sub_mutex);
+
+	free(resample);
+
+	return ret;
+}
+
+int cwiid_sub_set_reduce(cwiid_sub_t *sub, enum cwiid_mesg_type type,
+                         enum cwiid_reduce reduce)
+{
+	if ((type >= CWIID_MESG_UNKNOWN) || !mesg_fields[type].reduce) {
+		cwiid_err(sub->wiimote, "Message type cannot be reduced");
+		return -1;
+	}
+	if ((reduce != CWIID_REDUCE_MEAN) && (reduce != CWIID_REDUCE_LAST) &&
+	  (reduce != CWIID_REDUCE_MIN) && (reduce != CWIID_REDUCE_MAX)) {
+		cwiid_err(sub->wiimote, "Invalid reduction");
+		return -1;
+	}
+	if (!(mesg_fields[type].reduce & REDUCE_BIT(reduce))) {
+		cwiid_err(sub->wiimote, "Message type only takes CWIID_REDUCE_LAST");
+		return -1;
+	}
+
+	pthread_mutex_lock(&sub->wiimote->sub_mutex);
+	sub->reduce[type] = reduce;
+	if (sub->resample) {
+		/* don't mix reductions within a period */
+		sub->resample->accum[type].count = 0;
+	}
+	pthread_mutex_unlock(&sub->wiimote->sub_mutex);
+
+	return 0;
+}
+
+/* Stops the resampler thread, once subscribers are gone */
+int close_resampler(struct wiimote *wiimote)
+{
+	struct resampler *resampler = wiimote->resampler;
+	int ret = 0;
+
+	if (!resampler) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&wiimote->sub_mutex);
+	resampler->closing = 1;
+	arm_resampler(wiimote, -1);
+	pthread_mutex_unlock(&wiimote->sub_mutex);
+	if (pthread_join(resampler->thread, NULL)) {
+		cwiid_err(wiimote, "Thread join error (resampler thread)");
+		ret = -1;
+	}
+	wiimote->resampler = NULL;
+
+	if (close(resampler->timer_fd)) {
+		cwiid_err(wiimote, "Timer close error (resampler): %s",
+		          strerror(errno));
+		ret = -1;
+	}
+	free(resampler);
+
+	return ret;
+}
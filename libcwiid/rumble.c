@@ -0,0 +1,311 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "cwiid_internal.h"
+
+/* Rumble patterns.  The motor is only on or off, so a pattern is a queue
+ * of (duration, level) steps, with levels between off and full played as
+ * PWM.  The engine thread sleeps on a one-shot timerfd armed for the next
+ * time the motor has to change, and only sends a report when it does:
+ * adjacent steps with the same state, or a new pattern that starts where
+ * the old one left off, cost nothing.  Callers just edit the queue and
+ * kick the timer, so they never wait on the control channel.  The engine
+ * is started on first use and only published in wiimote->rumble (with
+ * release ordering) once its thread is running, so callers that find it
+ * without taking state_mutex always see it fully set up. */
+
+#define RUMBLE_PWM_PERIOD	40000000LL	/* ns */
+
+static int64_t timespec_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_ns(&ts);
+}
+
+/* Call with rumble->mutex held.  when is absolute; 0 disarms, -1 fires
+ * at once. */
+static int arm_rumble(struct rumble *rumble, int64_t when)
+{
+	struct itimerspec its;
+	int flags = TFD_TIMER_ABSTIME;
+
+	memset(&its, 0, sizeof its);
+	if (when == -1) {
+		/* as soon as possible */
+		its.it_value.tv_nsec = 1;
+		flags = 0;
+	}
+	else {
+		its.it_value.tv_sec = when / 1000000000LL;
+		its.it_value.tv_nsec = when % 1000000000LL;
+	}
+	if (timerfd_settime(rumble->timer_fd, flags, &its, NULL)) {
+		cwiid_err(rumble->wiimote, "Timer set error (rumble): %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Motor state at now, and when it next needs looking at (0 for never).
+ * Finished steps are dropped, keeping the schedule anchored to the
+ * pattern start rather than to when the thread happened to wake. */
+static uint8_t rumble_eval(struct rumble *rumble, int64_t now, int64_t *next)
+{
+	struct cwiid_rumble_step *step = NULL;
+	int64_t end = 0, phase, on_time;
+	uint8_t on;
+
+	while (rumble->count) {
+		step = &rumble->step[rumble->head];
+		end = rumble->start + step->duration * 1000000LL;
+		if (now < end) {
+			break;
+		}
+		rumble->start = end;
+		rumble->head = (rumble->head + 1) % RUMBLE_QUEUE_LEN;
+		rumble->count--;
+	}
+
+	if (!rumble->count) {
+		*next = 0;
+		return 0;
+	}
+
+	if ((step->level == 0) || (step->level == 0xFF)) {
+		*next = end;
+		return step->level ? 1 : 0;
+	}
+
+	on_time = RUMBLE_PWM_PERIOD * step->level / 0xFF;
+	phase = (now - rumble->start) % RUMBLE_PWM_PERIOD;
+	if (phase < on_time) {
+		*next = now - phase + on_time;
+		on = 1;
+	}
+	else {
+		*next = now - phase + RUMBLE_PWM_PERIOD;
+		on = 0;
+	}
+	if (*next > end) {
+		*next = end;
+	}
+
+	return on;
+}
+
+static void *rumble_thread(struct rumble *rumble)
+{
+	struct wiimote *wiimote = rumble->wiimote;
+	uint64_t expirations;
+	int64_t next;
+	uint8_t on;
+	char closing;
+
+	while (1) {
+		if (read(rumble->timer_fd, &expirations, sizeof expirations) !=
+		  sizeof expirations) {
+			if (errno == EINTR) {
+				continue;
+			}
+			cwiid_err(wiimote, "Timer read error (rumble): %s",
+			          strerror(errno));
+			break;
+		}
+
+		pthread_mutex_lock(&rumble->mutex);
+		on = rumble_eval(rumble, now_ns(), &next);
+		closing = rumble->closing;
+		if (!closing) {
+			arm_rumble(rumble, next);
+		}
+		pthread_mutex_unlock(&rumble->mutex);
+
+		if (closing) {
+			on = 0;
+		}
+		if (on != wiimote->state.rumble) {
+			cwiid_set_rumble(wiimote, on);
+		}
+		if (closing) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int open_rumble(struct wiimote *wiimote)
+{
+	struct rumble *rumble;
+	int err;
+
+	if ((rumble = malloc(sizeof *rumble)) == NULL) {
+		cwiid_err(wiimote, "Memory allocation error (rumble)");
+		return -1;
+	}
+	memset(rumble, 0, sizeof *rumble);
+	rumble->wiimote = wiimote;
+
+	if ((rumble->timer_fd = timerfd_create(CLOCK_MONOTONIC, 0)) == -1) {
+		cwiid_err(wiimote, "Timer create error (rumble): %s", strerror(errno));
+		free(rumble);
+		return -1;
+	}
+
+	if ((err = pthread_mutex_init(&rumble->mutex, NULL))) {
+		cwiid_err(wiimote, "Mutex init error (rumble): %s", strerror(err));
+		close(rumble->timer_fd);
+		free(rumble);
+		return -1;
+	}
+
+	if ((err = pthread_create(&rumble->thread, NULL,
+	                          (void *(*)(void *))&rumble_thread, rumble))) {
+		cwiid_err(wiimote, "Thread creation error (rumble thread): %s",
+		          strerror(err));
+		pthread_mutex_destroy(&rumble->mutex);
+		close(rumble->timer_fd);
+		free(rumble);
+		return -1;
+	}
+	__atomic_store_n(&wiimote->rumble, rumble, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int cwiid_rumble_play(cwiid_wiimote_t *wiimote,
+                      const struct cwiid_rumble_step *steps, int count,
+                      int repeat, uint8_t flags)
+{
+	struct rumble *rumble;
+	int i, j, tail;
+	int ret = 0;
+
+	if ((count <= 0) || (repeat <= 0) || (repeat > INT_MAX / count) ||
+	  (count * repeat > RUMBLE_QUEUE_LEN)) {
+		cwiid_err(wiimote, "Invalid rumble pattern length");
+		return -1;
+	}
+
+	/* Start the engine on first use */
+	if (!(rumble = __atomic_load_n(&wiimote->rumble, __ATOMIC_ACQUIRE))) {
+		pthread_mutex_lock(&wiimote->state_mutex);
+		if (!wiimote->rumble) {
+			ret = open_rumble(wiimote);
+		}
+		pthread_mutex_unlock(&wiimote->state_mutex);
+		if (ret) {
+			return -1;
+		}
+		rumble = __atomic_load_n(&wiimote->rumble, __ATOMIC_ACQUIRE);
+	}
+
+	pthread_mutex_lock(&rumble->mutex);
+
+	if (!(flags & CWIID_RUMBLE_QUEUE)) {
+		rumble->count = 0;
+	}
+	if (rumble->count + count * repeat > RUMBLE_QUEUE_LEN) {
+		cwiid_err(wiimote, "Rumble queue full");
+		ret = -1;
+	}
+	else {
+		if (!rumble->count) {
+			rumble->head = 0;
+			rumble->start = now_ns();
+		}
+		tail = (rumble->head + rumble->count) % RUMBLE_QUEUE_LEN;
+		for (i=0; i < repeat; i++) {
+			for (j=0; j < count; j++) {
+				rumble->step[tail] = steps[j];
+				tail = (tail + 1) % RUMBLE_QUEUE_LEN;
+			}
+		}
+		rumble->count += count * repeat;
+		ret = arm_rumble(rumble, -1);
+	}
+
+	pthread_mutex_unlock(&rumble->mutex);
+
+	return ret;
+}
+
+int cwiid_rumble_stop(cwiid_wiimote_t *wiimote)
+{
+	struct rumble *rumble = __atomic_load_n(&wiimote->rumble,
+	                                        __ATOMIC_ACQUIRE);
+	int ret;
+
+	if (!rumble) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&rumble->mutex);
+	rumble->count = 0;
+	ret = arm_rumble(rumble, -1);
+	pthread_mutex_unlock(&rumble->mutex);
+
+	return ret;
+}
+
+/* Stops the motor and the engine thread */
+int close_rumble(struct wiimote *wiimote)
+{
+	struct rumble *rumble = __atomic_load_n(&wiimote->rumble,
+	                                        __ATOMIC_ACQUIRE);
+	int ret = 0;
+
+	if (!rumble) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&rumble->mutex);
+	rumble->closing = 1;
+	arm_rumble(rumble, -1);
+	pthread_mutex_unlock(&rumble->mutex);
+
+	if (pthread_join(rumble->thread, NULL)) {
+		cwiid_err(wiimote, "Thread join error (rumble thread)");
+		ret = -1;
+	}
+	__atomic_store_n(&wiimote->rumble, NULL, __ATOMIC_RELEASE);
+
+	pthread_mutex_destroy(&rumble->mutex);
+	if (close(rumble->timer_fd)) {
+		cwiid_err(wiimote, "Timer close error (rumble): %s", strerror(errno));
+		ret = -1;
+	}
+	free(rumble);
+
+	return ret;
+}
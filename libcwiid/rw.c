@@ -0,0 +1,350 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "cwiid_internal.h"
+
+/* Memory reads and writes.  The wiimote handles one read or write at a
+ * time, so requests wait in a queue and only the head is on the wire.
+ * Nobody blocks on the queue: the router moves the head along as the
+ * read replies and write acks come in, sending the next write packet or
+ * starting the next request itself, and whoever puts a request at the
+ * head of an idle queue sends its first packet.  A request with a
+ * callback is finished onto a done list, the connection fd is signalled,
+ * and cwiid_drain runs the callback on the application's thread; without
+ * one, the submitter is waiting in rw_wait (cwiid_read, cwiid_write). */
+
+#define RPT_READ_REQ_LEN	6
+#define RPT_WRITE_LEN		21
+#define RW_WRITE_CHUNK		0x10
+
+static int rw_send_packet(struct wiimote *wiimote, struct cwiid_rw_req *req)
+{
+	unsigned char buf[RPT_WRITE_LEN];
+	uint32_t offset;
+
+	if (req->op == CWIID_RW_OP_READ) {
+		buf[0] = req->flags & (CWIID_RW_EEPROM | CWIID_RW_REG);
+		buf[1] = (unsigned char)((req->offset>>16) & 0xFF);
+		buf[2] = (unsigned char)((req->offset>>8) & 0xFF);
+		buf[3] = (unsigned char)(req->offset & 0xFF);
+		buf[4] = (unsigned char)((req->len>>8) & 0xFF);
+		buf[5] = (unsigned char)(req->len & 0xFF);
+
+		if (cwiid_send_rpt(wiimote, 0, RPT_READ_REQ, RPT_READ_REQ_LEN, buf)) {
+			cwiid_err(wiimote, "Report send error (read)");
+			return -1;
+		}
+	}
+	else {
+		offset = req->offset + req->done;
+		buf[0] = req->flags;
+		buf[1] = (unsigned char)((offset>>16) & 0xFF);
+		buf[2] = (unsigned char)((offset>>8) & 0xFF);
+		buf[3] = (unsigned char)(offset & 0xFF);
+		if (req->len - req->done >= RW_WRITE_CHUNK) {
+			buf[4] = RW_WRITE_CHUNK;
+		}
+		else {
+			buf[4] = (unsigned char)(req->len - req->done);
+		}
+		memcpy(buf+5, (unsigned char *)req->data + req->done, buf[4]);
+
+		if (cwiid_send_rpt(wiimote, 0, RPT_WRITE, RPT_WRITE_LEN, buf)) {
+			cwiid_err(wiimote, "Report send error (write)");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* With rw_mutex held.  Takes req, the head, off the queue.  Returns 1 if
+ * it went to the done list, and the fd wants signalling. */
+static int rw_finish(struct wiimote *wiimote, struct cwiid_rw_req *req,
+                     int result)
+{
+	struct rw_queue *rw = &wiimote->rw;
+
+	if ((rw->head = req->next) == NULL) {
+		rw->tail = NULL;
+	}
+	req->next = NULL;
+	req->result = result;
+
+	if (!req->callback) {
+		pthread_cond_broadcast(&wiimote->rw_cond);
+		return 0;
+	}
+
+	if (rw->done_tail) {
+		rw->done_tail->next = req;
+	}
+	else {
+		__atomic_store_n(&rw->done, req, __ATOMIC_RELEASE);
+	}
+	rw->done_tail = req;
+
+	return 1;
+}
+
+static void rw_signal(struct wiimote *wiimote)
+{
+	struct cwiid_sub *sub;
+	uint64_t one = 1;
+
+	if ((sub = __atomic_load_n(&wiimote->fd_sub, __ATOMIC_ACQUIRE)) &&
+	  (write(sub->fd, &one, sizeof one) != sizeof one)) {
+		cwiid_err(wiimote, "Event write error (rw): %s", strerror(errno));
+	}
+}
+
+/* Send the next packet of the head request, without rw_mutex held.  The
+ * caller must own the send, having just made the head or moved it on.
+ * Requests that cannot be sent are failed and the next one tried. */
+static void rw_kick(struct wiimote *wiimote)
+{
+	struct cwiid_rw_req *req;
+	int signal = 0;
+
+	while (1) {
+		pthread_mutex_lock(&wiimote->rw_mutex);
+		req = wiimote->rw.head;
+		pthread_mutex_unlock(&wiimote->rw_mutex);
+
+		if (!req || !rw_send_packet(wiimote, req)) {
+			break;
+		}
+
+		pthread_mutex_lock(&wiimote->rw_mutex);
+		/* unless cancel_rw got there first */
+		if (wiimote->rw.head == req) {
+			signal |= rw_finish(wiimote, req, -1);
+		}
+		pthread_mutex_unlock(&wiimote->rw_mutex);
+	}
+
+	if (signal) {
+		rw_signal(wiimote);
+	}
+}
+
+int cwiid_rw_submit(cwiid_wiimote_t *wiimote, struct cwiid_rw_req *req)
+{
+	char first;
+
+	if ((req->op != CWIID_RW_OP_READ) && (req->op != CWIID_RW_OP_WRITE)) {
+		cwiid_err(wiimote, "Invalid rw operation");
+		return -1;
+	}
+	if (!req->len || !req->data) {
+		cwiid_err(wiimote, "Invalid rw buffer");
+		return -1;
+	}
+	/* Completions are announced on the connection fd */
+	if (req->callback && (cwiid_get_fd(wiimote) == -1)) {
+		return -1;
+	}
+
+	req->result = CWIID_RW_PENDING;
+	req->done = 0;
+	req->next = NULL;
+
+	pthread_mutex_lock(&wiimote->rw_mutex);
+	if (wiimote->rw.tail) {
+		wiimote->rw.tail->next = req;
+	}
+	else {
+		wiimote->rw.head = req;
+	}
+	wiimote->rw.tail = req;
+	first = (wiimote->rw.head == req);
+	pthread_mutex_unlock(&wiimote->rw_mutex);
+
+	if (first) {
+		rw_kick(wiimote);
+	}
+
+	return 0;
+}
+
+/* Blocking side.  progress (if set) is called, without rw_mutex held,
+ * each time more data has come in. */
+int rw_wait(struct wiimote *wiimote, struct cwiid_rw_req *req,
+            read_progress_t *progress, void *progress_data)
+{
+	uint16_t reported = 0, done;
+	int result;
+
+	pthread_mutex_lock(&wiimote->rw_mutex);
+	while (1) {
+		while ((req->result == CWIID_RW_PENDING) &&
+		  (!progress || (req->done == reported))) {
+			pthread_cond_wait(&wiimote->rw_cond, &wiimote->rw_mutex);
+		}
+		done = req->done;
+		result = req->result;
+		pthread_mutex_unlock(&wiimote->rw_mutex);
+
+		if (progress && (done != reported)) {
+			progress(progress_data, done);
+			reported = done;
+		}
+		if (result != CWIID_RW_PENDING) {
+			break;
+		}
+		pthread_mutex_lock(&wiimote->rw_mutex);
+	}
+
+	return result;
+}
+
+/* Router side: read reply and write ack reports */
+int process_read(struct wiimote *wiimote, unsigned char *data)
+{
+	struct cwiid_rw_req *req;
+	uint16_t len;
+	int ret = 0, signal = 0, kick = 0;
+
+	pthread_mutex_lock(&wiimote->rw_mutex);
+	req = wiimote->rw.head;
+	if (!req || (req->op != CWIID_RW_OP_READ)) {
+		cwiid_err(wiimote, "Received unexpected read report");
+		ret = -1;
+	}
+	else if (data[0] & 0x0F) {
+		cwiid_err(wiimote, "Wiimote read error");
+		signal = rw_finish(wiimote, req, -1);
+		kick = 1;
+	}
+	else {
+		len = (data[0]>>4)+1;
+		if (len > req->len - req->done) {
+			len = req->len - req->done;
+		}
+		memcpy((unsigned char *)req->data + req->done, data+3, len);
+		req->done += len;
+		if (req->done == req->len) {
+			signal = rw_finish(wiimote, req, 0);
+			kick = 1;
+		}
+		else if (!req->callback) {
+			/* for read progress */
+			pthread_cond_broadcast(&wiimote->rw_cond);
+		}
+	}
+	pthread_mutex_unlock(&wiimote->rw_mutex);
+
+	if (signal) {
+		rw_signal(wiimote);
+	}
+	if (kick) {
+		rw_kick(wiimote);
+	}
+
+	return ret;
+}
+
+int process_write(struct wiimote *wiimote, unsigned char *data)
+{
+	struct cwiid_rw_req *req;
+	int ret = 0, signal = 0;
+
+	pthread_mutex_lock(&wiimote->rw_mutex);
+	req = wiimote->rw.head;
+	if (!req || (req->op != CWIID_RW_OP_WRITE)) {
+		cwiid_err(wiimote, "Received unexpected write report");
+		pthread_mutex_unlock(&wiimote->rw_mutex);
+		return -1;
+	}
+	if (data[0]) {
+		cwiid_err(wiimote, "Wiimote write error");
+		signal = rw_finish(wiimote, req, -1);
+	}
+	else {
+		if (req->len - req->done > RW_WRITE_CHUNK) {
+			req->done += RW_WRITE_CHUNK;
+		}
+		else {
+			req->done = req->len;
+			signal = rw_finish(wiimote, req, 0);
+		}
+	}
+	pthread_mutex_unlock(&wiimote->rw_mutex);
+
+	if (signal) {
+		rw_signal(wiimote);
+	}
+	/* next packet of this write, or the next request */
+	rw_kick(wiimote);
+
+	return ret;
+}
+
+/* Fail everything queued: the link is gone, or the connection closing */
+int cancel_rw(struct wiimote *wiimote)
+{
+	int signal = 0;
+
+	pthread_mutex_lock(&wiimote->rw_mutex);
+	while (wiimote->rw.head) {
+		signal |= rw_finish(wiimote, wiimote->rw.head, -1);
+	}
+	pthread_mutex_unlock(&wiimote->rw_mutex);
+
+	if (signal) {
+		rw_signal(wiimote);
+	}
+
+	return 0;
+}
+
+/* Run the callbacks of finished requests, on the calling thread.
+ * Returns how many ran. */
+int rw_drain(struct wiimote *wiimote)
+{
+	struct cwiid_rw_req *req, *next;
+	int count = 0;
+
+	if (!__atomic_load_n(&wiimote->rw.done, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&wiimote->rw_mutex);
+	req = wiimote->rw.done;
+	wiimote->rw.done = NULL;
+	wiimote->rw.done_tail = NULL;
+	pthread_mutex_unlock(&wiimote->rw_mutex);
+
+	/* a callback may submit again, and reuse req */
+	for (; req; req = next, count++) {
+		next = req->next;
+		req->next = NULL;
+		req->callback(wiimote, req);
+	}
+
+	return count;
+}
+
+int rw_done_pending(struct wiimote *wiimote)
+{
+	return __atomic_load_n(&wiimote->rw.done, __ATOMIC_ACQUIRE) != NULL;
+}
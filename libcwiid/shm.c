@@ -0,0 +1,403 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "cwiid_internal.h"
+
+/* Shared memory export.  The process that owns the connection publishes
+ * the current state and a ring of recent message arrays in a POSIX shared
+ * memory segment; other processes map it read-only.  Each record is
+ * guarded by a sequence count (odd while being written), so readers never
+ * block the publisher, and retry if it was rewritten under them.  head
+ * holds the serial of the newest message array and doubles as a futex for
+ * readers waiting on new data. */
+
+/* reads retried this many times against a busy record before giving up
+ * (a publisher that died mid-write leaves its count odd) */
+#define SHM_SPIN_MAX	1000
+
+/* The segment carries live input, so by default only its owner may map
+ * it */
+#define SHM_DEFAULT_MODE	(S_IRUSR | S_IWUSR)
+
+struct shm_export {
+	struct shm_segment *seg;
+	char *name;
+};
+
+struct cwiid_shm {
+	const struct shm_segment *seg;
+};
+
+static void futex_wake(unsigned int *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static int futex_wait(const unsigned int *addr, unsigned int val,
+                      const struct timespec *timeout)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static void seq_write_begin(unsigned int *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void seq_write_end(unsigned int *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Called from update_state, with state_mutex held, for every message
+ * array the router or status thread folds into the state */
+void publish_shm(struct wiimote *wiimote, const struct mesg_array *ma)
+{
+	struct shm_segment *seg = wiimote->shm->seg;
+	struct shm_slot *slot;
+	unsigned int serial;
+
+	serial = seg->head + 1;
+	slot = &seg->slot[serial % SHM_RING_LEN];
+	seq_write_begin(&slot->seq);
+	slot->serial = serial;
+	slot->count = ma->count;
+	slot->timestamp = ma->timestamp;
+	memcpy(slot->array, ma->array, ma->count * sizeof ma->array[0]);
+	seq_write_end(&slot->seq);
+
+	seq_write_begin(&seg->state_seq);
+	seg->state = wiimote->state;
+	seg->state_serial = serial;
+	seq_write_end(&seg->state_seq);
+
+	__atomic_store_n(&seg->head, serial, __ATOMIC_RELEASE);
+	futex_wake(&seg->head);
+}
+
+/* Publishes under name (which must start with '/'), replacing any stale
+ * segment of the same name, readable by its owner only */
+int cwiid_export_shm(cwiid_wiimote_t *wiimote, const char *name)
+{
+	return cwiid_export_shm_mode(wiimote, name, SHM_DEFAULT_MODE);
+}
+
+/* mode sets who else may read the segment (umask aside).  Only the owner
+ * may write it. */
+int cwiid_export_shm_mode(cwiid_wiimote_t *wiimote, const char *name,
+                          mode_t mode)
+{
+	struct shm_export *shm;
+	int fd;
+
+	if (!name || (name[0] != '/')) {
+		cwiid_err(wiimote, "Invalid shared memory name");
+		return -1;
+	}
+	if (mode & ~(S_IRWXU | S_IRGRP | S_IROTH)) {
+		cwiid_err(wiimote, "Invalid shared memory mode");
+		return -1;
+	}
+	if (wiimote->shm) {
+		cwiid_err(wiimote, "Shared memory already exported");
+		return -1;
+	}
+
+	if ((shm = malloc(sizeof *shm)) == NULL) {
+		cwiid_err(wiimote, "Memory allocation error (shm)");
+		return -1;
+	}
+	if ((shm->name = strdup(name)) == NULL) {
+		cwiid_err(wiimote, "Memory allocation error (shm name)");
+		free(shm);
+		return -1;
+	}
+
+	/* Readers of an old segment keep their (dead) mapping */
+	shm_unlink(name);
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, mode)) == -1) {
+		cwiid_err(wiimote, "Shared memory open error: %s", strerror(errno));
+		goto ERR_HND;
+	}
+	if (ftruncate(fd, sizeof *shm->seg)) {
+		cwiid_err(wiimote, "Shared memory size error: %s", strerror(errno));
+		close(fd);
+		goto ERR_UNLINK;
+	}
+	shm->seg = mmap(NULL, sizeof *shm->seg, PROT_READ | PROT_WRITE,
+	                MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm->seg == MAP_FAILED) {
+		cwiid_err(wiimote, "Shared memory map error: %s", strerror(errno));
+		goto ERR_UNLINK;
+	}
+
+	/* ftruncate zero fills, so the ring starts empty */
+	shm->seg->magic = SHM_MAGIC;
+	shm->seg->version = SHM_VERSION;
+	shm->seg->size = sizeof *shm->seg;
+
+	pthread_mutex_lock(&wiimote->state_mutex);
+	shm->seg->state = wiimote->state;
+	__atomic_store_n(&shm->seg->alive, 1, __ATOMIC_RELEASE);
+	wiimote->shm = shm;
+	pthread_mutex_unlock(&wiimote->state_mutex);
+
+	return 0;
+
+ERR_UNLINK:
+	shm_unlink(name);
+ERR_HND:
+	free(shm->name);
+	free(shm);
+	return -1;
+}
+
+/* Readers see the segment as closed; their mappings stay valid */
+int cwiid_unexport_shm(cwiid_wiimote_t *wiimote)
+{
+	struct shm_export *shm;
+	int ret = 0;
+
+	pthread_mutex_lock(&wiimote->state_mutex);
+	shm = wiimote->shm;
+	wiimote->shm = NULL;
+	pthread_mutex_unlock(&wiimote->state_mutex);
+
+	if (!shm) {
+		cwiid_err(wiimote, "Shared memory not exported");
+		return -1;
+	}
+
+	__atomic_store_n(&shm->seg->alive, 0, __ATOMIC_RELEASE);
+	futex_wake(&shm->seg->head);
+
+	if (munmap(shm->seg, sizeof *shm->seg)) {
+		cwiid_err(wiimote, "Shared memory unmap error: %s", strerror(errno));
+		ret = -1;
+	}
+	if (shm_unlink(shm->name)) {
+		cwiid_err(wiimote, "Shared memory unlink error: %s", strerror(errno));
+		ret = -1;
+	}
+	free(shm->name);
+	free(shm);
+
+	return ret;
+}
+
+cwiid_shm_t *cwiid_attach_shm(const char *name)
+{
+	struct cwiid_shm *shm;
+	const struct shm_segment *seg;
+	struct stat st;
+	int fd;
+
+	if ((fd = shm_open(name, O_RDONLY, 0)) == -1) {
+		cwiid_err(NULL, "Shared memory open error: %s", strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st)) {
+		cwiid_err(NULL, "Shared memory stat error: %s", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < (off_t)sizeof *seg) {
+		cwiid_err(NULL, "Shared memory segment too small");
+		close(fd);
+		return NULL;
+	}
+	seg = mmap(NULL, sizeof *seg, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED) {
+		cwiid_err(NULL, "Shared memory map error: %s", strerror(errno));
+		return NULL;
+	}
+
+	if ((seg->magic != SHM_MAGIC) || (seg->version != SHM_VERSION) ||
+	  (seg->size != sizeof *seg)) {
+		cwiid_err(NULL, "Shared memory segment version mismatch");
+		munmap((void *)seg, sizeof *seg);
+		return NULL;
+	}
+
+	if ((shm = malloc(sizeof *shm)) == NULL) {
+		cwiid_err(NULL, "Memory allocation error (shm)");
+		munmap((void *)seg, sizeof *seg);
+		return NULL;
+	}
+	shm->seg = seg;
+
+	return shm;
+}
+
+int cwiid_detach_shm(cwiid_shm_t *shm)
+{
+	int ret = 0;
+
+	if (munmap((void *)shm->seg, sizeof *shm->seg)) {
+		cwiid_err(NULL, "Shared memory unmap error: %s", strerror(errno));
+		ret = -1;
+	}
+	free(shm);
+
+	return ret;
+}
+
+/* Latest state, and the serial of the last message array folded into it
+ * (pass that to cwiid_shm_get_mesg to continue from the snapshot).  The
+ * state is kept after the publisher goes away. */
+int cwiid_shm_get_state(cwiid_shm_t *shm, struct cwiid_state *state,
+                        unsigned int *serial)
+{
+	const struct shm_segment *seg = shm->seg;
+	unsigned int seq, state_serial;
+	int i;
+
+	for (i=0; i < SHM_SPIN_MAX; i++) {
+		seq = __atomic_load_n(&seg->state_seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		*state = seg->state;
+		state_serial = seg->state_serial;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&seg->state_seq, __ATOMIC_RELAXED) == seq) {
+			if (serial) {
+				*serial = state_serial;
+			}
+			return 0;
+		}
+	}
+
+	cwiid_err(NULL, "Shared memory state busy");
+	return -1;
+}
+
+static void shm_deadline(struct timespec *deadline, int timeout)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/* Copies out the message array following *serial (0 for the oldest one
+ * still in the ring), and advances *serial to it.  If the reader has
+ * fallen more than SHM_RING_LEN arrays behind, the oldest are skipped and
+ * the jump in *serial shows how many.  timeout in milliseconds, 0 to
+ * poll, -1 to wait forever.
+ * Returns 0 on success, 1 on timeout, -1 once the publisher has gone and
+ * the ring is drained. */
+int cwiid_shm_get_mesg(cwiid_shm_t *shm, unsigned int *serial,
+                       int *mesg_count, union cwiid_mesg mesg[],
+                       struct timespec *timestamp, int timeout)
+{
+	const struct shm_segment *seg = shm->seg;
+	const struct shm_slot *slot;
+	struct timespec deadline, now, rel;
+	unsigned int head, want, seq, slot_serial;
+	uint8_t count;
+	int spin = 0;
+
+	if (timeout > 0) {
+		shm_deadline(&deadline, timeout);
+	}
+
+	while (1) {
+		head = __atomic_load_n(&seg->head, __ATOMIC_ACQUIRE);
+
+		if ((int)(head - *serial) > 0) {
+			want = *serial + 1;
+			if (head - want >= SHM_RING_LEN) {
+				want = head - SHM_RING_LEN + 1;
+			}
+			slot = &seg->slot[want % SHM_RING_LEN];
+
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+			if (seq & 1) {
+				if (++spin > SHM_SPIN_MAX) {
+					cwiid_err(NULL, "Shared memory ring busy");
+					return -1;
+				}
+				sched_yield();
+				continue;
+			}
+			slot_serial = slot->serial;
+			count = slot->count;
+			if (count > CWIID_MAX_MESG_COUNT) {
+				count = CWIID_MAX_MESG_COUNT;
+			}
+			memcpy(mesg, slot->array, count * sizeof slot->array[0]);
+			if (timestamp) {
+				*timestamp = slot->timestamp;
+			}
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if ((__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) ||
+			  (slot_serial != want)) {
+				/* overwritten while we looked, catch up */
+				continue;
+			}
+
+			*serial = want;
+			*mesg_count = count;
+			return 0;
+		}
+
+		if (!__atomic_load_n(&seg->alive, __ATOMIC_ACQUIRE)) {
+			return -1;
+		}
+		if (timeout == 0) {
+			return 1;
+		}
+		if (timeout > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			rel.tv_sec = deadline.tv_sec - now.tv_sec;
+			rel.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (rel.tv_nsec < 0) {
+				rel.tv_sec--;
+				rel.tv_nsec += 1000000000;
+			}
+			if (rel.tv_sec < 0) {
+				return 1;
+			}
+		}
+		if (futex_wait(&seg->head, head, (timeout > 0) ? &rel : NULL) &&
+		  (errno != EAGAIN) && (errno != EINTR) && (errno != ETIMEDOUT)) {
+			cwiid_err(NULL, "Shared memory wait error: %s", strerror(errno));
+			return -1;
+		}
+	}
+}
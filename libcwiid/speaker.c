@@ -0,0 +1,323 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "cwiid_internal.h"
+
+/* Speaker streaming.  PCM is queued by the application in a single
+ * producer / single consumer ring, and a sender thread paced by a timerfd
+ * encodes one report's worth (4-bit Yamaha ADPCM, two samples per byte)
+ * per tick.  The speaker is configured for 12 MHz / 3072 = 3906.25 Hz, so
+ * a 20 byte report lasts exactly 10.24 ms. */
+
+static struct write_seq speaker_enable_seq[] = {
+	{WRITE_SEQ_RPT, RPT_SPEAKER_ENABLE, (const void *)"\x04", 1, 0},
+	{WRITE_SEQ_RPT,   RPT_SPEAKER_MUTE, (const void *)"\x04", 1, 0},
+	{WRITE_SEQ_MEM, 0xA20009, (const void *)"\x01", 1, CWIID_RW_REG},
+	{WRITE_SEQ_MEM, 0xA20001, (const void *)"\x08", 1, CWIID_RW_REG},
+	{WRITE_SEQ_MEM, 0xA20001, (const void *)"\x00\x00\x00\x0C\x40\x00\x00",
+	                          7, CWIID_RW_REG},
+	{WRITE_SEQ_MEM, 0xA20008, (const void *)"\x01", 1, CWIID_RW_REG},
+	{WRITE_SEQ_RPT,   RPT_SPEAKER_MUTE, (const void *)"\x00", 1, 0}
+};
+
+static struct write_seq speaker_disable_seq[] = {
+	{WRITE_SEQ_RPT,   RPT_SPEAKER_MUTE, (const void *)"\x04", 1, 0},
+	{WRITE_SEQ_RPT, RPT_SPEAKER_ENABLE, (const void *)"\x00", 1, 0}
+};
+
+#define SPEAKER_DATA_LEN	20
+#define SPEAKER_SAMPLES		(SPEAKER_DATA_LEN * 2)
+#define SPEAKER_PERIOD_NS	10240000
+
+/* Yamaha ADPCM */
+static const int adpcm_diff[16] = {
+	1, 3, 5, 7, 9, 11, 13, 15, -1, -3, -5, -7, -9, -11, -13, -15
+};
+static const int adpcm_scale[8] = {
+	230, 230, 230, 230, 307, 409, 512, 614
+};
+#define ADPCM_STEP_MIN		127
+#define ADPCM_STEP_MAX		24576
+
+/* One sample to a nibble, from speaker->predictor and speaker->step
+ * (ADPCM_STEP_MIN to start) */
+uint8_t adpcm_encode(struct speaker *speaker, int16_t sample)
+{
+	int delta, nibble;
+
+	delta = sample - speaker->predictor;
+	if (delta < 0) {
+		nibble = 8;
+		delta = -delta;
+	}
+	else {
+		nibble = 0;
+	}
+	delta = (delta * 4) / speaker->step;
+	nibble |= (delta > 7) ? 7 : delta;
+
+	speaker->predictor += (speaker->step * adpcm_diff[nibble]) / 8;
+	if (speaker->predictor > 32767) {
+		speaker->predictor = 32767;
+	}
+	else if (speaker->predictor < -32768) {
+		speaker->predictor = -32768;
+	}
+
+	speaker->step = (speaker->step * adpcm_scale[nibble & 7]) >> 8;
+	if (speaker->step < ADPCM_STEP_MIN) {
+		speaker->step = ADPCM_STEP_MIN;
+	}
+	else if (speaker->step > ADPCM_STEP_MAX) {
+		speaker->step = ADPCM_STEP_MAX;
+	}
+
+	return nibble;
+}
+
+/* Sender thread: one report per timer tick.  Short or empty queues are
+ * padded with silence so the speaker never starves mid-clip. */
+static void *speaker_thread(struct wiimote *wiimote)
+{
+	struct speaker *speaker = wiimote->speaker;
+	unsigned char buf[1 + SPEAKER_DATA_LEN];
+	int16_t sample[SPEAKER_SAMPLES];
+	uint64_t expirations;
+	unsigned int head, tail, avail, i;
+
+	buf[0] = SPEAKER_DATA_LEN << 3;
+
+	while (1) {
+		if (read(speaker->timer_fd, &expirations, sizeof expirations) !=
+		  sizeof expirations) {
+			if (errno == EINTR) {
+				continue;
+			}
+			cwiid_err(wiimote, "Timer read error (speaker): %s",
+			          strerror(errno));
+			break;
+		}
+		if (expirations > 1) {
+			speaker->stats.late += expirations - 1;
+		}
+
+		tail = speaker->tail;
+		head = __atomic_load_n(&speaker->head, __ATOMIC_ACQUIRE);
+		avail = head - tail;
+		if (!avail && __atomic_load_n(&speaker->closing, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		if (avail > SPEAKER_SAMPLES) {
+			avail = SPEAKER_SAMPLES;
+		}
+
+		for (i=0; i < avail; i++) {
+			sample[i] = speaker->ring[(tail + i) & (SPEAKER_RING_LEN - 1)];
+		}
+		__atomic_store_n(&speaker->tail, tail + avail, __ATOMIC_RELEASE);
+		if (avail < SPEAKER_SAMPLES) {
+			memset(&sample[avail], 0, (SPEAKER_SAMPLES - avail) * sizeof *sample);
+			speaker->stats.underruns++;
+		}
+
+		for (i=0; i < SPEAKER_DATA_LEN; i++) {
+			buf[1+i] = adpcm_encode(speaker, sample[2*i]) << 4 |
+			           adpcm_encode(speaker, sample[2*i+1]);
+		}
+		if (cwiid_send_rpt(wiimote, 0, RPT_SPEAKER_DATA, sizeof buf, buf)) {
+			cwiid_err(wiimote, "Report send error (speaker data)");
+			break;
+		}
+		speaker->stats.reports++;
+	}
+
+	return NULL;
+}
+
+int cwiid_audio_open(cwiid_wiimote_t *wiimote)
+{
+	struct speaker *speaker;
+	struct itimerspec period;
+
+	if (wiimote->speaker) {
+		cwiid_err(wiimote, "Audio already open");
+		return -1;
+	}
+
+	if ((speaker = malloc(sizeof *speaker)) == NULL) {
+		cwiid_err(wiimote, "Memory allocation error (speaker)");
+		return -1;
+	}
+	memset(speaker, 0, sizeof *speaker);
+	speaker->step = ADPCM_STEP_MIN;
+
+	if ((speaker->timer_fd = timerfd_create(CLOCK_MONOTONIC, 0)) == -1) {
+		cwiid_err(wiimote, "Timer create error (speaker): %s", strerror(errno));
+		goto ERR_HND;
+	}
+
+	if (exec_write_seq(wiimote, SEQ_LEN(speaker_enable_seq),
+	                   speaker_enable_seq)) {
+		cwiid_err(wiimote, "Speaker enable error");
+		goto ERR_HND;
+	}
+
+	period.it_interval.tv_sec = 0;
+	period.it_interval.tv_nsec = SPEAKER_PERIOD_NS;
+	period.it_value = period.it_interval;
+	if (timerfd_settime(speaker->timer_fd, 0, &period, NULL)) {
+		cwiid_err(wiimote, "Timer set error (speaker): %s", strerror(errno));
+		goto ERR_DISABLE;
+	}
+
+	wiimote->speaker = speaker;
+	if (pthread_create(&speaker->thread, NULL,
+	                   (void *(*)(void *))&speaker_thread, wiimote)) {
+		cwiid_err(wiimote, "Thread creation error (speaker thread)");
+		wiimote->speaker = NULL;
+		goto ERR_DISABLE;
+	}
+
+	return 0;
+
+ERR_DISABLE:
+	exec_write_seq(wiimote, SEQ_LEN(speaker_disable_seq), speaker_disable_seq);
+ERR_HND:
+	if (speaker->timer_fd != -1) {
+		close(speaker->timer_fd);
+	}
+	free(speaker);
+	return -1;
+}
+
+/* Single producer: queues as many samples as fit, never blocks */
+int cwiid_audio_write(cwiid_wiimote_t *wiimote, const int16_t *pcm,
+                      unsigned int count)
+{
+	struct speaker *speaker = wiimote->speaker;
+	unsigned int head, tail, space, i;
+
+	if (!speaker) {
+		cwiid_err(wiimote, "Audio not open");
+		return -1;
+	}
+
+	head = speaker->head;
+	tail = __atomic_load_n(&speaker->tail, __ATOMIC_ACQUIRE);
+	space = SPEAKER_RING_LEN - (head - tail);
+	if (count > space) {
+		count = space;
+	}
+
+	for (i=0; i < count; i++) {
+		speaker->ring[(head + i) & (SPEAKER_RING_LEN - 1)] = pcm[i];
+	}
+	__atomic_store_n(&speaker->head, head + count, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+int cwiid_audio_get_stats(cwiid_wiimote_t *wiimote,
+                          struct cwiid_audio_stats *stats)
+{
+	if (!wiimote->speaker) {
+		cwiid_err(wiimote, "Audio not open");
+		return -1;
+	}
+
+	*stats = wiimote->speaker->stats;
+	stats->queued = wiimote->speaker->head -
+	                __atomic_load_n(&wiimote->speaker->tail, __ATOMIC_ACQUIRE);
+
+	return 0;
+}
+
+/* Plays out whatever is queued, then turns the speaker off */
+int cwiid_audio_close(cwiid_wiimote_t *wiimote)
+{
+	struct speaker *speaker = wiimote->speaker;
+	int ret = 0;
+
+	if (!speaker) {
+		cwiid_err(wiimote, "Audio not open");
+		return -1;
+	}
+
+	__atomic_store_n(&speaker->closing, 1, __ATOMIC_RELEASE);
+	if (pthread_join(speaker->thread, NULL)) {
+		cwiid_err(wiimote, "Thread join error (speaker thread)");
+		ret = -1;
+	}
+	wiimote->speaker = NULL;
+
+	if (exec_write_seq(wiimote, SEQ_LEN(speaker_disable_seq),
+	                   speaker_disable_seq)) {
+		cwiid_err(wiimote, "Speaker disable error");
+		ret = -1;
+	}
+
+	if (close(speaker->timer_fd)) {
+		cwiid_err(wiimote, "Timer close error (speaker): %s", strerror(errno));
+		ret = -1;
+	}
+	free(speaker);
+
+	return ret;
+}
+
+/* About a second of square wave at ~490 Hz */
+#define BEEP_SAMPLES	3906
+#define BEEP_HALF_PERIOD	4
+#define BEEP_AMPLITUDE	8192
+int cwiid_beep(cwiid_wiimote_t *wiimote)
+{
+	int16_t buf[BEEP_HALF_PERIOD * 2 * 16];
+	struct timespec t = {0, SPEAKER_PERIOD_NS};
+	int i, len, sent = 0, ret;
+
+	for (i=0; i < (int)(sizeof buf / sizeof buf[0]); i++) {
+		buf[i] = ((i / BEEP_HALF_PERIOD) & 1) ? -BEEP_AMPLITUDE :
+		                                        BEEP_AMPLITUDE;
+	}
+
+	if (cwiid_audio_open(wiimote)) {
+		return -1;
+	}
+
+	while (sent < BEEP_SAMPLES) {
+		len = BEEP_SAMPLES - sent;
+		if (len > (int)(sizeof buf / sizeof buf[0])) {
+			len = sizeof buf / sizeof buf[0];
+		}
+		if ((ret = cwiid_audio_write(wiimote, buf, len)) < 0) {
+			break;
+		}
+		else if (ret == 0) {
+			nanosleep(&t, NULL);
+		}
+		sent += ret;
+	}
+
+	return cwiid_audio_close(wiimote);
+}
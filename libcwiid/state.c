@@ -20,27 +20,43 @@
 #include <pthread.h>
 #include "cwiid_internal.h"
 
-int update_state(struct wiimote *wiimote, struct mesg_array *ma)
+/* Report field a message was decoded from */
+static uint8_t mesg_raw_bit(enum cwiid_mesg_type type)
 {
-	int i;
-	int err;
-	union cwiid_mesg *mesg;
-
-	err = pthread_mutex_lock(&wiimote->state_mutex);
-	if (err) {
-		cwiid_err(wiimote, "Mutex lock error (state mutex): %s", strerror(err));
-		return -1;
+	if (type == CWIID_MESG_ACC) {
+		return RAW_BIT(RAW_ACC);
+	}
+	else if (type == CWIID_MESG_IR) {
+		return RAW_BIT(RAW_IR);
 	}
+	else if ((type >= CWIID_MESG_NUNCHUK) && (type <= CWIID_MESG_TURNTABLES)) {
+		return RAW_BIT(RAW_EXT);
+	}
+	return 0;
+}
+
+/* Call with state_mutex held */
+static void apply_mesg_array(struct wiimote *wiimote,
+                             const struct mesg_array *ma)
+{
+	const union cwiid_mesg *mesg;
+	int i;
 
 	for (i=0; i < ma->count; i++) {
 		mesg = &ma->array[i];
+		wiimote->raw.pending &= ~mesg_raw_bit(mesg->type);
 
 		switch (mesg->type) {
 		case CWIID_MESG_STATUS:
 			wiimote->state.battery = mesg->status_mesg.battery;
 			if (wiimote->state.ext_type != mesg->status_mesg.ext_type) {
 				memset(&wiimote->state.ext, 0, sizeof wiimote->state.ext);
-				wiimote->state.ext_type = mesg->status_mesg.ext_type;
+				set_ext_type(wiimote, mesg->status_mesg.ext_type);
+				wiimote->cal_valid &= ~CAL_EXT_MASK;
+				wiimote->scale_valid &= ~CAL_EXT_MASK;
+				__atomic_or_fetch(&wiimote->scale_pending, CAL_EXT_MASK,
+				                  __ATOMIC_RELEASE);
+				wiimote->raw.pending &= ~RAW_BIT(RAW_EXT);
 			}
 			break;
 		case CWIID_MESG_BTN:
@@ -55,65 +71,22 @@ int update_state(struct wiimote *wiimote, struct mesg_array *ma)
 			       sizeof wiimote->state.ir_src);
 			break;
 		case CWIID_MESG_NUNCHUK:
-			memcpy(wiimote->state.ext.nunchuk.stick,
-			       mesg->nunchuk_mesg.stick,
-			       sizeof wiimote->state.ext.nunchuk.stick);
-			memcpy(wiimote->state.ext.nunchuk.acc,
-			       mesg->nunchuk_mesg.acc,
-			       sizeof wiimote->state.ext.nunchuk.acc);
-			wiimote->state.ext.nunchuk.buttons = mesg->nunchuk_mesg.buttons;
-			break;
 		case CWIID_MESG_CLASSIC:
-			memcpy(wiimote->state.ext.classic.l_stick,
-			       mesg->classic_mesg.l_stick,
-			       sizeof wiimote->state.ext.classic.l_stick);
-			memcpy(wiimote->state.ext.classic.r_stick,
-			       mesg->classic_mesg.r_stick,
-			       sizeof wiimote->state.ext.classic.r_stick);
-			wiimote->state.ext.classic.l = mesg->classic_mesg.l;
-			wiimote->state.ext.classic.r = mesg->classic_mesg.r;
-			wiimote->state.ext.classic.buttons = mesg->classic_mesg.buttons;
-			break;
 		case CWIID_MESG_BALANCE:
-			wiimote->state.ext.balance.right_top = mesg->balance_mesg.right_top;
-			wiimote->state.ext.balance.right_bottom = mesg->balance_mesg.right_bottom;
-			wiimote->state.ext.balance.left_top = mesg->balance_mesg.left_top;
-			wiimote->state.ext.balance.left_bottom = mesg->balance_mesg.left_bottom;
-			break;
 		case CWIID_MESG_MOTIONPLUS:
-			memcpy(wiimote->state.ext.motionplus.angle_rate,
-			       mesg->motionplus_mesg.angle_rate,
-			       sizeof wiimote->state.ext.motionplus.angle_rate);
-			memcpy(wiimote->state.ext.motionplus.low_speed,
-			       mesg->motionplus_mesg.low_speed,
-			       sizeof wiimote->state.ext.motionplus.low_speed);
-			wiimote->state.ext.motionplus.extension = mesg->motionplus_mesg.extension;
-			break;
 		case CWIID_MESG_GUITAR:
-			memcpy(wiimote->state.ext.guitar.stick,
-			       mesg->guitar_mesg.stick,
-			       sizeof wiimote->state.ext.guitar.stick);
-			wiimote->state.ext.guitar.whammy = mesg->guitar_mesg.whammy;
-			wiimote->state.ext.guitar.touch_bar = mesg->guitar_mesg.touch_bar;
-			wiimote->state.ext.guitar.buttons = mesg->guitar_mesg.buttons;
-			break;
 		case CWIID_MESG_DRUMS:
-			memcpy(wiimote->state.ext.drums.stick,
-			       mesg->drums_mesg.stick,
-			       sizeof wiimote->state.ext.drums.stick);
-			wiimote->state.ext.drums.velocity = mesg->drums_mesg.velocity;
-			wiimote->state.ext.drums.velocity_source = mesg->drums_mesg.velocity_source;
-			wiimote->state.ext.drums.buttons = mesg->drums_mesg.buttons;
-			break;
 		case CWIID_MESG_TURNTABLES:
-			memcpy(wiimote->state.ext.turntables.stick,
-			       mesg->turntables_mesg.stick,
-			       sizeof wiimote->state.ext.turntables.stick);
-			wiimote->state.ext.turntables.crossfader = mesg->turntables_mesg.crossfader;
-			wiimote->state.ext.turntables.effect_dial = mesg->turntables_mesg.effect_dial;
-			wiimote->state.ext.turntables.left_turntable = mesg->turntables_mesg.left_turntable;
-			wiimote->state.ext.turntables.right_turntable = mesg->turntables_mesg.right_turntable;
-			wiimote->state.ext.turntables.buttons = mesg->turntables_mesg.buttons;
+			ext_copy_state(&wiimote->state.ext, mesg);
+			break;
+		case CWIID_MESG_LINK:
+		case CWIID_MESG_ACC_CAL:
+		case CWIID_MESG_NUNCHUK_CAL:
+		case CWIID_MESG_BALANCE_CAL:
+		case CWIID_MESG_MOTIONPLUS_CAL:
+		case CWIID_MESG_ORIENTATION:
+		case CWIID_MESG_CURSOR:
+			/* no state of their own */
 			break;
 		case CWIID_MESG_ERROR:
 			wiimote->state.error = mesg->error_mesg.error;
@@ -123,6 +96,33 @@ int update_state(struct wiimote *wiimote, struct mesg_array *ma)
 			break;
 		}
 	}
+}
+
+int update_state(struct wiimote *wiimote, struct mesg_array *ma)
+{
+	int i;
+	int err;
+
+	err = pthread_mutex_lock(&wiimote->state_mutex);
+	if (err) {
+		cwiid_err(wiimote, "Mutex lock error (state mutex): %s", strerror(err));
+		return -1;
+	}
+
+	/* Fields nobody wanted decoded are kept packed until the state is
+	 * read */
+	for (i=0; i < RAW_FIELDS; i++) {
+		if (ma->raw_valid & RAW_BIT(i)) {
+			memcpy(wiimote->raw.data[i], ma->raw[i], ma->raw_len[i]);
+			wiimote->raw.len[i] = ma->raw_len[i];
+		}
+	}
+	apply_mesg_array(wiimote, ma);
+	wiimote->raw.pending |= ma->raw_valid;
+
+	if (wiimote->shm) {
+		publish_shm(wiimote, ma);
+	}
 
 	err = pthread_mutex_unlock(&wiimote->state_mutex);
 	if (err) {
@@ -134,6 +134,38 @@ int update_state(struct wiimote *wiimote, struct mesg_array *ma)
 	return 0;
 }
 
+/* Unpack fields left packed by the router.  Call with state_mutex held. */
+void decode_raw_state(struct wiimote *wiimote)
+{
+	struct raw_state *raw = &wiimote->raw;
+	struct mesg_array ma;
+
+	if (!raw->pending) {
+		return;
+	}
+
+	ma.count = 0;
+	ma.decode = CWIID_MESG_ALL;
+	ma.raw_valid = 0;
+	if (raw->pending & RAW_BIT(RAW_ACC)) {
+		process_acc(wiimote, raw->data[RAW_ACC], &ma);
+	}
+	if (raw->pending & RAW_BIT(RAW_IR)) {
+		if (raw->len[RAW_IR] == 10) {
+			process_ir10(wiimote, raw->data[RAW_IR], &ma);
+		}
+		else {
+			process_ir12(wiimote, raw->data[RAW_IR], &ma);
+		}
+	}
+	if (raw->pending & RAW_BIT(RAW_EXT)) {
+		process_ext(wiimote, raw->data[RAW_EXT], raw->len[RAW_EXT], &ma);
+	}
+	raw->pending = 0;
+
+	apply_mesg_array(wiimote, &ma);
+}
+
 /* IR Sensitivity Block */
 unsigned char ir_block1[] = MAX_SENSITIVITY_IR_BLOCK_1;
 unsigned char ir_block2[] = MAX_SENSITIVITY_IR_BLOCK_2;
@@ -165,6 +197,7 @@ struct write_seq ir_disable_seq[] = {
 int update_rpt_mode(struct wiimote *wiimote, int8_t rpt_mode)
 {
 	unsigned char buf[RPT_MODE_BUF_LEN];
+	const struct ext_desc *ext;
 	uint8_t rpt_type;
 	struct write_seq *ir_enable_seq;
 	int seq_len;
@@ -186,13 +219,11 @@ int update_rpt_mode(struct wiimote *wiimote, int8_t rpt_mode)
 	}
 
 	/* Pick a report mode based on report flags */
-	if ((rpt_mode & CWIID_RPT_EXT) &&
-	    ((wiimote->state.ext_type == CWIID_EXT_NUNCHUK) ||
-	     (wiimote->state.ext_type == CWIID_EXT_CLASSIC) ||
-	     (wiimote->state.ext_type == CWIID_EXT_MOTIONPLUS) ||
-	     (wiimote->state.ext_type == CWIID_EXT_GUITAR) ||
-	     (wiimote->state.ext_type == CWIID_EXT_DRUMS) ||
-	     (wiimote->state.ext_type == CWIID_EXT_TURNTABLES))) {
+	ext = find_ext(wiimote->state.ext_type);
+	if ((rpt_mode & CWIID_RPT_EXT) && ext && ext->rpt_type) {
+		rpt_type = ext->rpt_type;
+	}
+	else if ((rpt_mode & CWIID_RPT_EXT) && ext) {
 		if ((rpt_mode & CWIID_RPT_IR) && (rpt_mode & CWIID_RPT_ACC)) {
 			rpt_type = RPT_BTN_ACC_IR10_EXT6;
 			ir_enable_seq = ir_enable10_seq;
@@ -213,10 +244,6 @@ int update_rpt_mode(struct wiimote *wiimote, int8_t rpt_mode)
 			rpt_type = RPT_EXT21;
 		}	
 	}
-	else if ((rpt_mode & CWIID_RPT_EXT) &&
-	  wiimote->state.ext_type == CWIID_EXT_BALANCE) {
-		rpt_type = RPT_BTN_EXT8;
-	}
 	else {
 		if (rpt_mode & CWIID_RPT_IR) {
 			rpt_type = RPT_BTN_ACC_IR12;
@@ -266,32 +293,7 @@ int update_rpt_mode(struct wiimote *wiimote, int8_t rpt_mode)
 	if (CWIID_RPT_IR & ~rpt_mode & wiimote->state.rpt_mode) {
 		memset(wiimote->state.ir_src, 0, sizeof wiimote->state.ir_src);
 	}
-	if ((wiimote->state.ext_type == CWIID_EXT_NUNCHUK) &&
-	  (CWIID_RPT_NUNCHUK & ~rpt_mode & wiimote->state.rpt_mode)) {
-		memset(&wiimote->state.ext, 0, sizeof wiimote->state.ext);
-	}
-	else if ((wiimote->state.ext_type == CWIID_EXT_CLASSIC) &&
-	  (CWIID_RPT_CLASSIC & ~rpt_mode & wiimote->state.rpt_mode)) {
-		memset(&wiimote->state.ext, 0, sizeof wiimote->state.ext);
-	}
-	else if ((wiimote->state.ext_type == CWIID_EXT_BALANCE) &&
-	  (CWIID_RPT_BALANCE & ~rpt_mode & wiimote->state.rpt_mode)) {
-		memset(&wiimote->state.ext, 0, sizeof wiimote->state.ext);
-	}
-	else if ((wiimote->state.ext_type == CWIID_EXT_MOTIONPLUS) &&
-	  (CWIID_RPT_MOTIONPLUS & ~rpt_mode & wiimote->state.rpt_mode)) {
-		memset(&wiimote->state.ext, 0, sizeof wiimote->state.ext);
-	}
-	else if ((wiimote->state.ext_type == CWIID_EXT_GUITAR) &&
-	  (CWIID_RPT_GUITAR & ~rpt_mode & wiimote->state.rpt_mode)) {
-		memset(&wiimote->state.ext, 0, sizeof wiimote->state.ext);
-	}
-	else if ((wiimote->state.ext_type == CWIID_EXT_DRUMS) &&
-	  (CWIID_RPT_DRUMS & ~rpt_mode & wiimote->state.rpt_mode)) {
-		memset(&wiimote->state.ext, 0, sizeof wiimote->state.ext);
-	}
-	else if ((wiimote->state.ext_type == CWIID_EXT_TURNTABLES) &&
-	  (CWIID_RPT_TURNTABLES & ~rpt_mode & wiimote->state.rpt_mode)) {
+	if (ext && (ext->rpt_flag & ~rpt_mode & wiimote->state.rpt_mode)) {
 		memset(&wiimote->state.ext, 0, sizeof wiimote->state.ext);
 	}
 
@@ -0,0 +1,521 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "cwiid_internal.h"
+
+/* Subscriptions.  Any number of subscribers can share a connection, each
+ * with its own message type mask and queue.  The router copies into a
+ * subscriber's queue only the messages its mask selects, and skips it
+ * entirely if none match.  Queues are single producer / single consumer
+ * rings of message arrays; a full ring drops new arrays rather than block
+ * the router.  The fd (callback and fd modes) is only signalled when the
+ * subscriber has said it is about to wait, so a busy subscriber costs no
+ * syscalls. */
+
+static uint32_t mesg_array_types(const struct mesg_array *ma)
+{
+	uint32_t types = 0;
+	int i;
+
+	for (i=0; i < ma->count; i++) {
+		types |= CWIID_MESG_BIT(ma->array[i].type);
+	}
+
+	return types;
+}
+
+static void unlock_sub_mutex(void *arg)
+{
+	pthread_mutex_unlock(arg);
+}
+
+/* Producer side, with sub_mutex held.  sub_slot returns the next free
+ * ring slot (NULL, counted as a drop, if the ring is full), and
+ * sub_commit queues it. */
+struct mesg_array *sub_slot(struct cwiid_sub *sub)
+{
+	unsigned int head = sub->head;
+
+	if (head - __atomic_load_n(&sub->tail, __ATOMIC_ACQUIRE) >= sub->len) {
+		sub->stats.dropped++;
+		return NULL;
+	}
+
+	return &sub->ring[head & (sub->len - 1)];
+}
+
+void sub_commit(struct cwiid_sub *sub)
+{
+	uint64_t one = 1;
+
+	__atomic_store_n(&sub->head, sub->head + 1, __ATOMIC_RELEASE);
+	sub->stats.delivered++;
+
+	/* Pairs with the fence in sub_prepare_wait */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if ((sub->fd != -1) &&
+	  __atomic_exchange_n(&sub->waiting, 0, __ATOMIC_RELAXED)) {
+		if (write(sub->fd, &one, sizeof one) != sizeof one) {
+			cwiid_err(sub->wiimote, "Event write error (subscriber): %s",
+			          strerror(errno));
+		}
+	}
+}
+
+/* Called by the router and status threads after every message array */
+void deliver_mesg_array(struct wiimote *wiimote, const struct mesg_array *ma)
+{
+	struct cwiid_sub *sub;
+	struct mesg_array *slot;
+	/* volatile: pthread_cleanup_push may be setjmp based */
+	volatile uint32_t types;
+	int i;
+
+	if (!__atomic_load_n(&wiimote->subs, __ATOMIC_RELAXED)) {
+		return;
+	}
+	types = mesg_array_types(ma);
+
+	pthread_mutex_lock(&wiimote->sub_mutex);
+	/* the eventfd write is a cancellation point */
+	pthread_cleanup_push(unlock_sub_mutex, &wiimote->sub_mutex);
+
+	for (sub = wiimote->subs; sub; sub = sub->next) {
+		if (!(sub->mask & types)) {
+			continue;
+		}
+
+		slot = NULL;
+		for (i=0; i < ma->count; i++) {
+			if (!(sub->mask & CWIID_MESG_BIT(ma->array[i].type)) ||
+			  (sub->resample && resample_mesg(sub, &ma->array[i]))) {
+				continue;
+			}
+			if (!slot) {
+				if ((slot = sub_slot(sub)) == NULL) {
+					break;
+				}
+				slot->count = 0;
+				slot->timestamp = ma->timestamp;
+			}
+			slot->array[slot->count++] = ma->array[i];
+		}
+		if (slot) {
+			sub_commit(sub);
+		}
+	}
+
+	pthread_cleanup_pop(1);
+}
+
+/* Consumer side */
+static int sub_pop(struct cwiid_sub *sub, struct mesg_array *ma)
+{
+	struct mesg_array *slot;
+	unsigned int tail = sub->tail;
+
+	if (__atomic_load_n(&sub->head, __ATOMIC_ACQUIRE) == tail) {
+		return -1;
+	}
+
+	slot = &sub->ring[tail & (sub->len - 1)];
+	ma->count = slot->count;
+	ma->timestamp = slot->timestamp;
+	memcpy(ma->array, slot->array, slot->count * sizeof slot->array[0]);
+	__atomic_store_n(&sub->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* Announce that the ring looked empty.  Returns nonzero if something
+ * arrived meanwhile, in which case the caller should not sleep. */
+static int sub_prepare_wait(struct cwiid_sub *sub)
+{
+	__atomic_store_n(&sub->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&sub->head, __ATOMIC_ACQUIRE) != sub->tail;
+}
+
+static void *sub_thread(struct cwiid_sub *sub)
+{
+	struct mesg_array ma;
+	uint64_t count;
+	char closing = 0;
+
+	while (1) {
+		while (!sub_pop(sub, &ma)) {
+			sub->callback(sub->wiimote, ma.count, ma.array, &ma.timestamp);
+		}
+
+		if ((closing = __atomic_load_n(&sub->closing, __ATOMIC_ACQUIRE))) {
+			break;
+		}
+		if (sub_prepare_wait(sub)) {
+			continue;
+		}
+		if (read(sub->fd, &count, sizeof count) != sizeof count) {
+			if (errno == EINTR) {
+				continue;
+			}
+			cwiid_err(sub->wiimote, "Event read error (subscriber): %s",
+			          strerror(errno));
+			break;
+		}
+	}
+
+	/* Unsubscribed from its own callback */
+	if (closing == SUB_CLOSE_SELF) {
+		close(sub->fd);
+		free(sub->resample);
+		free(sub->ring);
+		free(sub);
+	}
+
+	return NULL;
+}
+
+static void update_sub_mask(struct wiimote *wiimote)
+{
+	struct cwiid_sub *sub;
+	uint32_t mask = 0;
+
+	for (sub = wiimote->subs; sub; sub = sub->next) {
+		mask |= sub->mask;
+	}
+	wiimote->sub_mask = mask;
+}
+
+cwiid_sub_t *cwiid_subscribe(cwiid_wiimote_t *wiimote, uint32_t mask,
+                             enum cwiid_sub_mode mode, unsigned int depth,
+                             cwiid_mesg_callback_t *callback)
+{
+	struct cwiid_sub *sub;
+	pthread_attr_t attr;
+	int err;
+
+	if ((mode != CWIID_SUB_CALLBACK) && (mode != CWIID_SUB_FD) &&
+	  (mode != CWIID_SUB_RING)) {
+		cwiid_err(wiimote, "Invalid subscription mode");
+		return NULL;
+	}
+	if ((mode == CWIID_SUB_CALLBACK) && !callback) {
+		cwiid_err(wiimote, "Subscription callback missing");
+		return NULL;
+	}
+	if ((depth == 0) || (depth > CWIID_SUB_MAX_DEPTH)) {
+		cwiid_err(wiimote, "Invalid subscription queue depth");
+		return NULL;
+	}
+
+	if ((sub = malloc(sizeof *sub)) == NULL) {
+		cwiid_err(wiimote, "Memory allocation error (subscriber)");
+		return NULL;
+	}
+	memset(sub, 0, sizeof *sub);
+	sub->wiimote = wiimote;
+	sub->mask = mask;
+	sub->mode = mode;
+	sub->callback = callback;
+	sub->fd = -1;
+	sub->waiting = 1;
+
+	for (sub->len = 1; sub->len < depth; sub->len <<= 1);
+	if ((sub->ring = malloc(sub->len * sizeof *sub->ring)) == NULL) {
+		cwiid_err(wiimote, "Memory allocation error (subscriber queue)");
+		goto ERR_HND;
+	}
+
+	if (mode != CWIID_SUB_RING) {
+		if ((sub->fd = eventfd(0, (mode == CWIID_SUB_FD) ?
+		                          EFD_NONBLOCK : 0)) == -1) {
+			cwiid_err(wiimote, "Event fd error (subscriber): %s",
+			          strerror(errno));
+			goto ERR_HND;
+		}
+	}
+
+	if (mode == CWIID_SUB_CALLBACK) {
+		if (init_rt_thread_attr(wiimote, &attr, 1)) {
+			goto ERR_HND;
+		}
+		err = pthread_create(&sub->thread, &attr,
+		                     (void *(*)(void *))&sub_thread, sub);
+		pthread_attr_destroy(&attr);
+		if (err) {
+			cwiid_err(wiimote, "Thread creation error (subscriber thread): %s",
+			          strerror(err));
+			goto ERR_HND;
+		}
+		if (wiimote->sched_valid) {
+			/* failures are reported, the callback runs regardless */
+			apply_sched(wiimote, sub->thread, "subscriber");
+		}
+	}
+
+	pthread_mutex_lock(&wiimote->sub_mutex);
+	sub->next = wiimote->subs;
+	__atomic_store_n(&wiimote->subs, sub, __ATOMIC_RELAXED);
+	update_sub_mask(wiimote);
+	pthread_mutex_unlock(&wiimote->sub_mutex);
+
+	return sub;
+
+ERR_HND:
+	if (sub->fd != -1) {
+		close(sub->fd);
+	}
+	free(sub->ring);
+	free(sub);
+	return NULL;
+}
+
+int cwiid_unsubscribe(cwiid_sub_t *sub)
+{
+	struct wiimote *wiimote = sub->wiimote;
+	struct cwiid_sub **prev;
+	uint64_t one = 1;
+	char found = 0;
+	int ret = 0;
+
+	pthread_mutex_lock(&wiimote->sub_mutex);
+	for (prev = &wiimote->subs; *prev; prev = &(*prev)->next) {
+		if (*prev == sub) {
+			__atomic_store_n(prev, sub->next, __ATOMIC_RELAXED);
+			update_sub_mask(wiimote);
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&wiimote->sub_mutex);
+
+	if (!found) {
+		cwiid_err(wiimote, "Unknown subscriber");
+		return -1;
+	}
+
+	if (sub->mode == CWIID_SUB_CALLBACK) {
+		if (pthread_equal(pthread_self(), sub->thread)) {
+			/* The thread frees sub once the callback returns */
+			__atomic_store_n(&sub->closing, SUB_CLOSE_SELF, __ATOMIC_RELEASE);
+			if (pthread_detach(sub->thread)) {
+				cwiid_err(wiimote, "Thread detach error (subscriber thread)");
+				ret = -1;
+			}
+			return ret;
+		}
+
+		/* Queued arrays are still delivered before the thread exits */
+		__atomic_store_n(&sub->closing, SUB_CLOSE_JOIN, __ATOMIC_RELEASE);
+		if (write(sub->fd, &one, sizeof one) != sizeof one) {
+			cwiid_err(wiimote, "Event write error (subscriber): %s",
+			          strerror(errno));
+		}
+		if (pthread_join(sub->thread, NULL)) {
+			cwiid_err(wiimote, "Thread join error (subscriber thread)");
+			ret = -1;
+		}
+	}
+
+	if ((sub->fd != -1) && close(sub->fd)) {
+		cwiid_err(wiimote, "Event fd close error (subscriber): %s",
+		          strerror(errno));
+		ret = -1;
+	}
+	free(sub->resample);
+	free(sub->ring);
+	free(sub);
+
+	return ret;
+}
+
+int cwiid_sub_set_mask(cwiid_sub_t *sub, uint32_t mask)
+{
+	pthread_mutex_lock(&sub->wiimote->sub_mutex);
+	sub->mask = mask;
+	update_sub_mask(sub->wiimote);
+	pthread_mutex_unlock(&sub->wiimote->sub_mutex);
+
+	return 0;
+}
+
+/* Readable whenever get_mesg has something to return.  Read until it
+ * reports the queue empty before polling again. */
+int cwiid_sub_get_fd(cwiid_sub_t *sub)
+{
+	if (sub->mode != CWIID_SUB_FD) {
+		cwiid_err(sub->wiimote, "Subscriber has no fd");
+		return -1;
+	}
+
+	return sub->fd;
+}
+
+/* Fd and ring modes.  Never blocks.
+ * Returns 0 on success, 1 if the queue is empty, -1 on error. */
+int cwiid_sub_get_mesg(cwiid_sub_t *sub, int *mesg_count,
+                       union cwiid_mesg mesg[], struct timespec *timestamp)
+{
+	struct mesg_array ma;
+	uint64_t count;
+
+	if (sub->mode == CWIID_SUB_CALLBACK) {
+		cwiid_err(sub->wiimote, "Subscriber uses a callback");
+		return -1;
+	}
+
+	if (sub_pop(sub, &ma)) {
+		if (sub->fd == -1) {
+			return 1;
+		}
+		/* Clear the fd before announcing the wait, so a signal sent
+		 * after the announcement is not lost */
+		if ((read(sub->fd, &count, sizeof count) == -1) &&
+		  (errno != EAGAIN)) {
+			cwiid_err(sub->wiimote, "Event read error (subscriber): %s",
+			          strerror(errno));
+			return -1;
+		}
+		if (!sub_prepare_wait(sub) || sub_pop(sub, &ma)) {
+			return 1;
+		}
+	}
+
+	*mesg_count = ma.count;
+	memcpy(mesg, ma.array, ma.count * sizeof ma.array[0]);
+	if (timestamp) {
+		*timestamp = ma.timestamp;
+	}
+
+	return 0;
+}
+
+int cwiid_sub_get_stats(cwiid_sub_t *sub, struct cwiid_sub_stats *stats)
+{
+	pthread_mutex_lock(&sub->wiimote->sub_mutex);
+	*stats = sub->stats;
+	pthread_mutex_unlock(&sub->wiimote->sub_mutex);
+
+	return 0;
+}
+
+/* Reapply the connection's scheduling to subscriber threads */
+int apply_sub_sched(struct wiimote *wiimote)
+{
+	struct cwiid_sub *sub;
+	int failed = 0;
+
+	pthread_mutex_lock(&wiimote->sub_mutex);
+	for (sub = wiimote->subs; sub; sub = sub->next) {
+		if (sub->mode == CWIID_SUB_CALLBACK) {
+			failed |= apply_sched(wiimote, sub->thread, "subscriber");
+		}
+	}
+	pthread_mutex_unlock(&wiimote->sub_mutex);
+
+	return failed;
+}
+
+/* Connection fd.  cwiid_get_fd hands out the eventfd of a subscriber to
+ * every message, created on first use, so an application's own poll,
+ * epoll or GLib loop can service the connection without a callback
+ * thread.  The fd becomes readable when an array is queued to an empty
+ * queue (or one drained down to empty), or a read or write submitted
+ * with a callback finishes, which makes it safe to watch edge triggered;
+ * cwiid_drain empties the queue and runs the rw callbacks in the
+ * caller's thread. */
+int cwiid_get_fd(cwiid_wiimote_t *wiimote)
+{
+	struct cwiid_sub *sub;
+
+	if (!(sub = __atomic_load_n(&wiimote->fd_sub, __ATOMIC_ACQUIRE))) {
+		pthread_mutex_lock(&wiimote->state_mutex);
+		if (!(sub = wiimote->fd_sub)) {
+			sub = cwiid_subscribe(wiimote, CWIID_MESG_ALL, CWIID_SUB_FD,
+			                      FD_SUB_DEPTH, NULL);
+			__atomic_store_n(&wiimote->fd_sub, sub, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&wiimote->state_mutex);
+		if (!sub) {
+			return -1;
+		}
+	}
+
+	return sub->fd;
+}
+
+/* Calls callback for each queued message array, straight from the queue,
+ * and the callbacks of finished reads and writes.  At most one queue's
+ * worth of arrays is handled per call; if more remains the fd is
+ * signalled again, so a loop that stops watching an edge triggered fd
+ * until the next edge does not stall.  Returns the number of arrays and
+ * rw callbacks handled, or -1 on error. */
+int cwiid_drain(cwiid_wiimote_t *wiimote, cwiid_mesg_callback_t *callback)
+{
+	struct cwiid_sub *sub;
+	struct mesg_array *slot;
+	unsigned int tail, arrays = 0;
+	uint64_t count;
+	int drained = 0;
+
+	if (!(sub = __atomic_load_n(&wiimote->fd_sub, __ATOMIC_ACQUIRE))) {
+		cwiid_err(wiimote, "Connection fd not open");
+		return -1;
+	}
+
+	while (1) {
+		drained += rw_drain(wiimote);
+
+		tail = sub->tail;
+		if (__atomic_load_n(&sub->head, __ATOMIC_ACQUIRE) == tail) {
+			/* As in cwiid_sub_get_mesg, clear before announcing */
+			if ((read(sub->fd, &count, sizeof count) == -1) &&
+			  (errno != EAGAIN)) {
+				cwiid_err(wiimote, "Event read error (subscriber): %s",
+				          strerror(errno));
+				return -1;
+			}
+			if (!sub_prepare_wait(sub) && !rw_done_pending(wiimote)) {
+				break;
+			}
+			continue;
+		}
+		if (arrays == sub->len) {
+			count = 1;
+			if (write(sub->fd, &count, sizeof count) != sizeof count) {
+				cwiid_err(wiimote, "Event write error (subscriber): %s",
+				          strerror(errno));
+				return -1;
+			}
+			break;
+		}
+
+		/* The router never writes a slot between tail and head */
+		slot = &sub->ring[tail & (sub->len - 1)];
+		callback(wiimote, slot->count, slot->array, &slot->timestamp);
+		__atomic_store_n(&sub->tail, tail + 1, __ATOMIC_RELEASE);
+		arrays++;
+		drained++;
+	}
+
+	return drained;
+}
@@ -16,6 +16,8 @@
  *
  */
 
+#define _GNU_SOURCE	/* recvmmsg */
+
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -24,6 +26,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <poll.h>
+#include <sys/socket.h>
 #include "cwiid_internal.h"
 
 #define DEBUG
@@ -33,114 +36,286 @@
   #define printd(...)
 #endif
 
+/* Message types somebody will see.  The mesg pipe, the callback and the
+ * shm export take everything; subscribers name theirs, and derived
+ * messages need the raw types they are computed from. */
+static uint32_t decode_mask(struct wiimote *wiimote)
+{
+	uint32_t mask;
+
+	if ((wiimote->flags & CWIID_FLAG_MESG_IFC) || wiimote->mesg_callback ||
+	  wiimote->shm) {
+		return CWIID_MESG_ALL;
+	}
+
+	mask = __atomic_load_n(&wiimote->sub_mask, __ATOMIC_RELAXED);
+	if (mask & (CWIID_MESG_BIT(CWIID_MESG_ACC_CAL) |
+	            CWIID_MESG_BIT(CWIID_MESG_MOTIONPLUS_CAL) |
+	            CWIID_MESG_BIT(CWIID_MESG_ORIENTATION))) {
+		/* gyro bias detects stillness from the accelerometer */
+		mask |= CWIID_MESG_BIT(CWIID_MESG_ACC);
+	}
+	if (mask & (CWIID_MESG_BIT(CWIID_MESG_MOTIONPLUS_CAL) |
+	            CWIID_MESG_BIT(CWIID_MESG_ORIENTATION))) {
+		mask |= CWIID_MESG_BIT(CWIID_MESG_MOTIONPLUS);
+	}
+	if (mask & CWIID_MESG_BIT(CWIID_MESG_NUNCHUK_CAL)) {
+		mask |= CWIID_MESG_BIT(CWIID_MESG_NUNCHUK);
+	}
+	if (mask & CWIID_MESG_BIT(CWIID_MESG_BALANCE_CAL)) {
+		mask |= CWIID_MESG_BIT(CWIID_MESG_BALANCE);
+	}
+	if (mask & CWIID_MESG_BIT(CWIID_MESG_CURSOR)) {
+		mask |= CWIID_MESG_BIT(CWIID_MESG_IR);
+	}
+	if (wiimote->flags & CWIID_FLAG_MOTIONPLUS) {
+		/* status_thread watches the passthrough bit in the state */
+		mask |= CWIID_MESG_BIT(CWIID_MESG_MOTIONPLUS) |
+		        CWIID_MESG_BIT(CWIID_MESG_NUNCHUK);
+	}
+
+	return mask;
+}
+
+/* Decode one input report into ma.  Returns nonzero if it was bad. */
+static int process_report(struct wiimote *wiimote, unsigned char *buf,
+                          struct mesg_array *ma)
+{
+	char err = 0;
+
+	/* Verify first byte (DATA/INPUT) */
+	if (buf[0] != (BT_TRANS_DATA | BT_PARAM_INPUT)) {
+		cwiid_err(wiimote, "Invalid packet type");
+	}
+
+	/* Main switch */
+	/* printf("%.2X %.2X %.2X %.2X  %.2X %.2X %.2X %.2X\n", buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7]);
+	printf("%.2X %.2X %.2X %.2X  %.2X %.2X %.2X %.2X\n", buf[8], buf[9], buf[10], buf[11], buf[12], buf[13], buf[14], buf[15]);
+	printf("%.2X %.2X %.2X %.2X  %.2X %.2X %.2X %.2X\n", buf[16], buf[17], buf[18], buf[19], buf[20], buf[21], buf[22], buf[23]);
+	printf("\n"); */
+	switch (buf[1]) {
+	case RPT_STATUS:
+		err = process_status(wiimote, &buf[2], ma);
+		break;
+	case RPT_BTN:
+		err = process_btn(wiimote, &buf[2], ma);
+		break;
+	case RPT_BTN_ACC:
+		err = process_btn(wiimote, &buf[2], ma) ||
+		      process_acc(wiimote, &buf[2], ma);
+		break;
+	case RPT_BTN_EXT8:
+		err = process_btn(wiimote, &buf[2], ma) ||
+		      process_ext(wiimote, &buf[4], 8, ma);
+		break;
+	case RPT_BTN_ACC_IR12:
+		err = process_btn(wiimote, &buf[2], ma) ||
+		      process_acc(wiimote, &buf[2], ma) ||
+		      process_ir12(wiimote, &buf[7], ma);
+		break;
+	case RPT_BTN_EXT19:
+		err = process_btn(wiimote, &buf[2], ma) ||
+		      process_ext(wiimote, &buf[4], 19, ma);
+		break;
+	case RPT_BTN_ACC_EXT16:
+		err = process_btn(wiimote, &buf[2], ma) ||
+		      process_acc(wiimote, &buf[2], ma) ||
+		      process_ext(wiimote, &buf[7], 16, ma);
+		break;
+	case RPT_BTN_IR10_EXT9:
+		err = process_btn(wiimote, &buf[2], ma)  ||
+		      process_ir10(wiimote, &buf[4], ma) ||
+		      process_ext(wiimote, &buf[14], 9, ma);
+		break;
+	case RPT_BTN_ACC_IR10_EXT6:
+		err = process_btn(wiimote, &buf[2], ma)  ||
+		      process_acc(wiimote, &buf[2], ma)  ||
+		      process_ir10(wiimote, &buf[7], ma) ||
+		      process_ext(wiimote, &buf[17], 6, ma);
+		break;
+	case RPT_EXT21:
+		err = process_ext(wiimote, &buf[2], 21, ma);
+		break;
+	case RPT_BTN_ACC_IR36_1:
+	case RPT_BTN_ACC_IR36_2:
+		cwiid_err(wiimote, "Unsupported report type received "
+		                   "(interleaved data)");
+		err = 1;
+		break;
+	case RPT_READ_DATA:
+		err = process_read(wiimote, &buf[4]) ||
+		      process_btn(wiimote, &buf[2], ma);
+		break;
+	case RPT_WRITE_ACK:
+		err = process_write(wiimote, &buf[2]);
+		break;
+	default:
+		cwiid_err(wiimote, "Unknown message type");
+		err = 1;
+		break;
+	}
+
+	return err;
+}
+
+/* Reports are stamped by the kernel on arrival (SO_TIMESTAMPNS), so a
+ * batch read late still carries the real spacing between its reports.
+ * The stamps are wall clock; for intervals they are carried over to the
+ * monotonic clock with the offset between the two at read time. */
+static void enable_timestamps(struct wiimote *wiimote)
+{
+	int on = 1;
+
+	if (setsockopt(wiimote->int_socket, SOL_SOCKET, SO_TIMESTAMPNS, &on,
+	               sizeof on)) {
+		cwiid_err(wiimote, "Socket option error (timestamps), "
+		          "using read time: %s", strerror(errno));
+	}
+}
+
+/* Returns 0 if the packet has no kernel timestamp */
+static int packet_timestamp(struct msghdr *hdr, struct timespec *ts)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+		if ((cmsg->cmsg_level == SOL_SOCKET) &&
+		  (cmsg->cmsg_type == SCM_TIMESTAMPNS)) {
+			memcpy(ts, CMSG_DATA(cmsg), sizeof *ts);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* mono = real - real_now + mono_now */
+static void real_to_mono(const struct timespec *real,
+                         const struct timespec *real_now,
+                         const struct timespec *mono_now,
+                         struct timespec *mono)
+{
+	mono->tv_sec = real->tv_sec - real_now->tv_sec + mono_now->tv_sec;
+	mono->tv_nsec = real->tv_nsec - real_now->tv_nsec + mono_now->tv_nsec;
+	while (mono->tv_nsec < 0) {
+		mono->tv_sec--;
+		mono->tv_nsec += 1000000000;
+	}
+	while (mono->tv_nsec >= 1000000000) {
+		mono->tv_sec++;
+		mono->tv_nsec -= 1000000000;
+	}
+}
+
+/* Reports are pulled with recvmmsg, so a router that falls behind (or a
+ * wiimote streaming at full rate) drains everything already queued on
+ * the interrupt channel in one system call instead of one read per
+ * report.  Only the first report is waited for. */
 #define READ_BUF_LEN 23
+#define READ_BATCH 16
 void *router_thread(struct wiimote *wiimote)
 {
-	unsigned char buf[READ_BUF_LEN];
+	unsigned char buf[READ_BATCH][READ_BUF_LEN];
+	union {
+		char buf[CMSG_SPACE(sizeof(struct timespec))];
+		struct cmsghdr align;
+	} ctrl[READ_BATCH];
+	struct iovec iov[READ_BATCH];
+	struct mmsghdr msg[READ_BATCH];
+	struct timespec real_now, mono_now;
 	ssize_t len;
 	struct mesg_array ma;
 	char err, print_clock_err = 1;
+	int i, count;
+
+	memset(msg, 0, sizeof msg);
+	for (i=0; i < READ_BATCH; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = READ_BUF_LEN;
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+		msg[i].msg_hdr.msg_control = ctrl[i].buf;
+	}
+
+	enable_timestamps(wiimote);
 
 	while (1) {
-		/* Read packet */
-		len = read(wiimote->int_socket, buf, READ_BUF_LEN);
-		ma.count = 0;
-		if (clock_gettime(CLOCK_REALTIME, &ma.timestamp)) {
+		/* Read packets */
+		for (i=0; i < READ_BATCH; i++) {
+			msg[i].msg_hdr.msg_controllen = sizeof ctrl[i].buf;
+		}
+		count = recvmmsg(wiimote->int_socket, msg, READ_BATCH, MSG_WAITFORONE,
+		                 NULL);
+		len = (count > 0) ? 1 : count;
+		if ((count > 0) && (clock_gettime(CLOCK_REALTIME, &real_now) ||
+		  clock_gettime(CLOCK_MONOTONIC, &mono_now))) {
 			if (print_clock_err) {
 				cwiid_err(wiimote, "clock_gettime error: %s", strerror(errno));
 				print_clock_err = 0;
 			}
 		}
-		err = 0;
-		if ((len == -1) || (len == 0)) {
-			process_error(wiimote, len, &ma);
-			write_mesg_array(wiimote, &ma);
-			/* Quit! */
-			break;
-		}
-		else {
-			/* Verify first byte (DATA/INPUT) */
-			if (buf[0] != (BT_TRANS_DATA | BT_PARAM_INPUT)) {
-				cwiid_err(wiimote, "Invalid packet type");
+		for (i=0; i < count; i++) {
+			if ((len = msg[i].msg_len) == 0) {
+				/* EOF, after the reports before it */
+				break;
 			}
 
-			/* Main switch */
-			/* printf("%.2X %.2X %.2X %.2X  %.2X %.2X %.2X %.2X\n", buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7]);
-			printf("%.2X %.2X %.2X %.2X  %.2X %.2X %.2X %.2X\n", buf[8], buf[9], buf[10], buf[11], buf[12], buf[13], buf[14], buf[15]);
-			printf("%.2X %.2X %.2X %.2X  %.2X %.2X %.2X %.2X\n", buf[16], buf[17], buf[18], buf[19], buf[20], buf[21], buf[22], buf[23]);
-			printf("\n"); */
-			switch (buf[1]) {
-			case RPT_STATUS:
-				err = process_status(wiimote, &buf[2], &ma);
-				break;
-			case RPT_BTN:
-				err = process_btn(wiimote, &buf[2], &ma);
-				break;
-			case RPT_BTN_ACC:
-				err = process_btn(wiimote, &buf[2], &ma) ||
-				      process_acc(wiimote, &buf[2], &ma);
-				break;
-			case RPT_BTN_EXT8:
-				err = process_btn(wiimote, &buf[2], &ma) ||
-				      process_ext(wiimote, &buf[4], 8, &ma);
-				break;
-			case RPT_BTN_ACC_IR12:
-				err = process_btn(wiimote, &buf[2], &ma) ||
-				      process_acc(wiimote, &buf[2], &ma) ||
-				      process_ir12(wiimote, &buf[7], &ma);
-				break;
-			case RPT_BTN_EXT19:
-				err = process_btn(wiimote, &buf[2], &ma) ||
-				      process_ext(wiimote, &buf[4], 19, &ma);
-				break;
-			case RPT_BTN_ACC_EXT16:
-				err = process_btn(wiimote, &buf[2], &ma) ||
-				      process_acc(wiimote, &buf[2], &ma) ||
-				      process_ext(wiimote, &buf[7], 16, &ma);
-				break;
-			case RPT_BTN_IR10_EXT9:
-				err = process_btn(wiimote, &buf[2], &ma)  ||
-				      process_ir10(wiimote, &buf[4], &ma) ||
-				      process_ext(wiimote, &buf[14], 9, &ma);
-				break;
-			case RPT_BTN_ACC_IR10_EXT6:
-				err = process_btn(wiimote, &buf[2], &ma)  ||
-				      process_acc(wiimote, &buf[2], &ma)  ||
-				      process_ir10(wiimote, &buf[7], &ma) ||
-				      process_ext(wiimote, &buf[17], 6, &ma);
-				break;
-			case RPT_EXT21:
-				err = process_ext(wiimote, &buf[2], 21, &ma);
-				break;
-			case RPT_BTN_ACC_IR36_1:
-			case RPT_BTN_ACC_IR36_2:
-				cwiid_err(wiimote, "Unsupported report type received "
-				                   "(interleaved data)");
-				err = 1;
-				break;
-			case RPT_READ_DATA:
-				err = process_read(wiimote, &buf[4]) ||
-				      process_btn(wiimote, &buf[2], &ma);
-				break;
-			case RPT_WRITE_ACK:
-				err = process_write(wiimote, &buf[2]);
-				break;
-			default:
-				cwiid_err(wiimote, "Unknown message type");
-				err = 1;
-				break;
+			ma.count = 0;
+			ma.decode = decode_mask(wiimote);
+			ma.raw_valid = 0;
+			if (packet_timestamp(&msg[i].msg_hdr, &ma.timestamp)) {
+				real_to_mono(&ma.timestamp, &real_now, &mono_now, &ma.mono);
+			}
+			else {
+				ma.timestamp = real_now;
+				ma.mono = mono_now;
 			}
 
+			err = process_report(wiimote, buf[i], &ma);
 			if (!err && (ma.count > 0)) {
+				apply_cal_scale(wiimote);
+				process_gyro_bias(wiimote, &ma);
+				if (wiimote->flags & CWIID_FLAG_CALIBRATED) {
+					process_cal(wiimote, &ma);
+				}
+				if (wiimote->flags & CWIID_FLAG_ORIENTATION) {
+					process_fusion(wiimote, &ma);
+				}
+				if (wiimote->flags & CWIID_FLAG_IR_TRACK) {
+					process_ir_track(wiimote, &ma);
+				}
+			}
+			/* fields left packed still have to reach the state */
+			if (!err && ((ma.count > 0) || ma.raw_valid)) {
 				if (update_state(wiimote, &ma)) {
 					cwiid_err(wiimote, "State update error");
 				}
+			}
+			if (!err && (ma.count > 0)) {
+				process_deadband(wiimote, &ma);
 				if (wiimote->flags & CWIID_FLAG_MESG_IFC) {
 					/* prints its own errors */
 					write_mesg_array(wiimote, &ma);
 				}
+				deliver_mesg_array(wiimote, &ma);
 			}
 		}
+
+		if ((len == -1) || (len == 0)) {
+			if ((wiimote->flags & CWIID_FLAG_RECONNECT) && !reconnect(wiimote)) {
+				enable_timestamps(wiimote);
+				continue;
+			}
+			ma.count = 0;
+			ma.raw_valid = 0;
+			clock_gettime(CLOCK_REALTIME, &ma.timestamp);
+			process_error(wiimote, len, &ma);
+			write_mesg_array(wiimote, &ma);
+			/* subscribers and cwiid_get_fd users wait on their own queues */
+			deliver_mesg_array(wiimote, &ma);
+			/* Quit! */
+			break;
+		}
 	}
 
 	return NULL;
@@ -185,6 +360,27 @@ static uint8_t status_motionplus(struct wiimote *wiimote, uint8_t lastext) {
 	return extval; 
 }
 
+/* Bring a reconnected wiimote back to where it was.  Report mode is
+ * restored by the status report this requests, like an extension change. */
+static void restore_state(struct wiimote *wiimote)
+{
+	unsigned char data;
+
+	/* LED report carries the rumble bit */
+	if (cwiid_set_led(wiimote, wiimote->state.led)) {
+		cwiid_err(wiimote, "LED restore error");
+	}
+	if (wiimote->flags & CWIID_FLAG_MOTIONPLUS) {
+		data = 0x04;
+		if (cwiid_write(wiimote, CWIID_RW_REG, 0xA600FE, 1, &data)) {
+			cwiid_err(wiimote, "Motionplus restore error");
+		}
+	}
+	if (cwiid_request_status(wiimote)) {
+		cwiid_err(wiimote, "Status restore error");
+	}
+}
+
 void *status_thread(struct wiimote *wiimote)
 {
 	struct mesg_array ma;
@@ -193,6 +389,7 @@ void *status_thread(struct wiimote *wiimote)
         unsigned char data[2];
 
 	ma.count = 1;
+	ma.raw_valid = 0;
 	status_mesg = &ma.array[0].status_mesg;
 
         struct pollfd pfd = { .fd = wiimote->status_pipe[0], .events = POLLIN };
@@ -201,6 +398,13 @@ void *status_thread(struct wiimote *wiimote)
 	while (1) {
 		sleep(1);  // allow time for things to sync (also stop mutex errors on close)
 
+		if (wiimote->restore) {
+			wiimote->restore = 0;
+			status_mesg->ext_type = CWIID_EXT_NONE;
+			mplus_ext_cache = MPLUS_EXT_UNKNOWN;
+			restore_state(wiimote);
+		}
+
 		// catch motionplus extension reports
 		if ( status_mesg->ext_type == CWIID_EXT_MOTIONPLUS ) {
 			mplus_ext_cache = status_motionplus(wiimote, mplus_ext_cache);
@@ -237,49 +441,6 @@ void *status_thread(struct wiimote *wiimote)
 					printd("(EXT_NONE)\n");
 					status_mesg->ext_type = CWIID_EXT_NONE;
 					break;
-				case EXT_NUNCHUK:
-					printd("(EXT_NUNCHUK)?\n");
-					data[0] = 0x05;
-					cwiid_write(wiimote, CWIID_RW_REG, 0xA600FE, 1, &data[0]);
-					cwiid_read(wiimote, CWIID_RW_REG, 0xA400FE, 1, &data[1]);
-					printd("d1 := 0x%x\n", data[1]);
-					if (data[1] == 0x05) {
-						printd("(EXT_MOTIONPLUS)\n");
-						status_mesg->ext_type = CWIID_EXT_MOTIONPLUS;
-						break;
-					}
-					printd("(EXT_NUNCHUK)\n");
-					status_mesg->ext_type = CWIID_EXT_NUNCHUK;
-					break;
-				case EXT_CLASSIC:
-					printd("(EXT_CLASSIC)\n");
-					status_mesg->ext_type = CWIID_EXT_CLASSIC;
-					break;
-				case EXT_BALANCE:
-					status_mesg->ext_type = CWIID_EXT_BALANCE;
-					break;
-				case EXT_MOTIONPLUS:
-				case EXT_NUNCHUK_MPLUS:
-					printd("(EXT_MOTIONPLUS)\n");
-					status_mesg->ext_type = CWIID_EXT_MOTIONPLUS;
-					mplus_ext_cache = MPLUS_EXT_UNKNOWN;
-					break;
-				case EXT_INSTRUMENT:
-					switch (buf[0]) {
-					case 0x00:
-						status_mesg->ext_type = CWIID_EXT_GUITAR;
-						break;
-					case 0x01:
-						status_mesg->ext_type = CWIID_EXT_DRUMS;
-						break;
-					case 0x03:
-						status_mesg->ext_type = CWIID_EXT_TURNTABLES;
-						break;
-					default:
-						status_mesg->ext_type = CWIID_EXT_UNKNOWN;
-						break;
-					}
-					break;
 				case EXT_PARTIAL:
 					/* Everything (but MotionPlus) shows up as partial until initialized */
 					data[0] = 0x55;
@@ -306,39 +467,30 @@ void *status_thread(struct wiimote *wiimote)
 							printd("(EXT_NONE)\n");
 							status_mesg->ext_type = CWIID_EXT_NONE;
 							break;
-						case EXT_NUNCHUK:
-							printd("(EXT_NUNCHUK)\n");
-							status_mesg->ext_type = CWIID_EXT_NUNCHUK;
-							break;
-						case EXT_CLASSIC:
-							printd("(EXT_CLASSIC)\n");
-							status_mesg->ext_type = CWIID_EXT_CLASSIC;
-							break;
-						case EXT_BALANCE:
-							status_mesg->ext_type = CWIID_EXT_BALANCE;
-							break;
-						case EXT_INSTRUMENT:
-							switch (buf[0]) {
-							case 0x00:
-								status_mesg->ext_type = CWIID_EXT_GUITAR;
-								break;
-							case 0x01:
-								status_mesg->ext_type = CWIID_EXT_DRUMS;
-								break;
-							case 0x03:
-								status_mesg->ext_type = CWIID_EXT_TURNTABLES;
-								break;
-							default:
-								status_mesg->ext_type = CWIID_EXT_UNKNOWN;
-								break;
-							}
-							break;
 						default:
-							status_mesg->ext_type = CWIID_EXT_UNKNOWN;
+							status_mesg->ext_type = ext_from_id(buf);
 							break;
 						}
 					}
 					break;
+				default:
+					status_mesg->ext_type = ext_from_id(buf);
+					/* May be a MotionPlus with a nunchuk behind it: try
+					 * switching it to passthrough mode */
+					if (status_mesg->ext_type == CWIID_EXT_NUNCHUK) {
+						data[0] = 0x05;
+						cwiid_write(wiimote, CWIID_RW_REG, 0xA600FE, 1, &data[0]);
+						cwiid_read(wiimote, CWIID_RW_REG, 0xA400FE, 1, &data[1]);
+						printd("d1 := 0x%x\n", data[1]);
+						if (data[1] == 0x05) {
+							status_mesg->ext_type = CWIID_EXT_MOTIONPLUS;
+						}
+					}
+					else if (status_mesg->ext_type == CWIID_EXT_MOTIONPLUS) {
+						mplus_ext_cache = MPLUS_EXT_UNKNOWN;
+					}
+					printd("(ext_type 0x%x)\n", status_mesg->ext_type);
+					break;
 				}
 			}
 		}
@@ -351,6 +503,11 @@ void *status_thread(struct wiimote *wiimote)
 		if (update_state(wiimote, &ma)) {
 			cwiid_err(wiimote, "State update error");
 		}
+		if ((wiimote->flags &
+		  (CWIID_FLAG_CALIBRATED | CWIID_FLAG_ORIENTATION)) &&
+		  update_cal_scale(wiimote)) {
+			cwiid_err(wiimote, "Calibration update error");
+		}
 		if (update_rpt_mode(wiimote, -1)) {
 			cwiid_err(wiimote, "Error reseting report mode");
 		}
@@ -360,6 +517,7 @@ void *status_thread(struct wiimote *wiimote)
 				/* prints its own errors */
 			}
 		}
+		deliver_mesg_array(wiimote, &ma);
 	}
 
 	return NULL;
@@ -167,28 +167,37 @@ int read_mesg_array(int fd, struct mesg_array *ma)
 	return 0;
 }
 
-int cancel_rw(struct wiimote *wiimote)
+int cancel_mesg_callback(struct wiimote *wiimote)
 {
-	struct rw_mesg rw_mesg;
-
-	rw_mesg.type = RW_CANCEL;
+	int err;
 
-	if (write(wiimote->rw_pipe[1], &rw_mesg, sizeof rw_mesg) !=
-	  sizeof rw_mesg) {
-		cwiid_err(wiimote, "Pipe write error (rw): %s", strerror(errno));
+	err = pthread_cancel(wiimote->mesg_callback_thread);
+	if (err) {
+		cwiid_err(wiimote, "Thread cancel error (callback thread): %s", strerror(err));
 		return -1;
 	}
 
 	return 0;
 }
 
-int cancel_mesg_callback(struct wiimote *wiimote)
+/* callbacks: the thread runs user code, whose stack needs are unknown */
+int init_rt_thread_attr(struct wiimote *wiimote, pthread_attr_t *attr,
+                        int callbacks)
 {
 	int err;
 
-	err = pthread_cancel(wiimote->mesg_callback_thread);
-	if (err) {
-		cwiid_err(wiimote, "Thread cancel error (callback thread): %s", strerror(err));
+	if ((err = pthread_attr_init(attr))) {
+		cwiid_err(wiimote, "Thread attribute init error: %s", strerror(err));
+		return -1;
+	}
+	if (callbacks && (!wiimote->sched_valid ||
+	  ((wiimote->sched.policy == SCHED_OTHER) &&
+	   !(wiimote->sched.flags & CWIID_SCHED_MLOCK)))) {
+		return 0;
+	}
+	if ((err = pthread_attr_setstacksize(attr, RT_THREAD_STACK))) {
+		cwiid_err(wiimote, "Thread stack size error: %s", strerror(err));
+		pthread_attr_destroy(attr);
 		return -1;
 	}
 
@@ -59,6 +59,7 @@ static PyObject *Wiimote_get_state(Wiimote *self, void *closure);
 static PyObject *Wiimote_get_acc_cal(Wiimote *self, PyObject *args,
                                      PyObject *kwds);
 static PyObject *Wiimote_get_balance_cal(Wiimote *self);
+static PyObject *Wiimote_get_gyro_cal(Wiimote *self);
 static PyObject *Wiimote_get_id(Wiimote *self);
 
 static PyObject *Wiimote_request_status(Wiimote *self);
@@ -93,6 +94,9 @@ static PyMethodDef Wiimote_Methods[] =
 	{"get_balance_cal", (PyCFunction)Wiimote_get_balance_cal, METH_NOARGS,
 	 "get_balance_cal() -> calibration tuple\n\n"
 	 "retrieve Balance Board calibration information"},
+	{"get_gyro_cal", (PyCFunction)Wiimote_get_gyro_cal, METH_NOARGS,
+	 "get_gyro_cal() -> calibration list\n\n"
+	 "retrieve MotionPlus zero points estimated at rest"},
 	{"request_status", (PyCFunction)Wiimote_request_status, METH_NOARGS,
 	 "request_status()\n\nrequest status message"},
 	{"read", (PyCFunction)Wiimote_read, METH_VARARGS | METH_KEYWORDS,
@@ -688,6 +692,30 @@ static PyObject *Wiimote_get_balance_cal(Wiimote *self)
 	return PyBalCal;
 }
 
+static PyObject *Wiimote_get_gyro_cal(Wiimote *self)
+{
+	struct motionplus_cal gyro_cal;
+	PyObject *PyGyroCal;
+
+	if (!self->wiimote) {
+		SET_CLOSED_ERROR;
+		return NULL;
+	}
+
+	if (cwiid_get_gyro_cal(self->wiimote, &gyro_cal)) {
+		PyErr_SetString(PyExc_RuntimeError,
+		                "Error getting MotionPlus calibration");
+		return NULL;
+	}
+
+	if (!(PyGyroCal = Py_BuildValue("[i,i,i]", gyro_cal.zero[0],
+	                                gyro_cal.zero[1], gyro_cal.zero[2]))) {
+		return NULL;
+	}
+
+	return PyGyroCal;
+}
+
 static PyObject *Wiimote_request_status(Wiimote *self)
 {
 	if (!self->wiimote) {
@@ -926,6 +954,17 @@ static void CallbackBridge(cwiid_wiimote_t *wiimote, int mesg_count,
  *                               "left_bottom":left_bottom},
  *          (cwiid.MOTIONPLUS_MESG,{"angle_rate":(psi,theta,phi),
  *                                  "low_speed":(psi,theta,phi)},
+ *          (cwiid.LINK_MESG,status),
+ *          (cwiid.ACC_CAL_MESG,(x,y,z)),
+ *          (cwiid.NUNCHUK_CAL_MESG,{"stick":(x,y),"acc":(x,y,z),
+ *                                   "buttons":buttons}),
+ *          (cwiid.BALANCE_CAL_MESG,{"right_top":right_top,...,
+ *                                   "weight":weight,"cop":(x,y)}),
+ *          (cwiid.MOTIONPLUS_CAL_MESG,{"angle_rate":(psi,theta,phi)}),
+ *          (cwiid.ORIENTATION_MESG,(w,x,y,z)),
+ *          (cwiid.CURSOR_MESG,{"tracks":[{"id":id,"pos":(x,y)}, ...],
+ *                              "valid":valid,"pos":(x,y),
+ *                              "distance":distance,"roll":roll}),
  *          (cwiid.ERROR_MESG,error)]
  */
 PyObject *ConvertMesgArray(int mesg_count, union cwiid_mesg mesg[])
@@ -1055,6 +1094,97 @@ PyObject *ConvertMesgArray(int mesg_count, union cwiid_mesg mesg[])
 			                         mesg[i].motionplus_mesg.low_speed[CWIID_PSI]);
                                     
 			break;
+		case CWIID_MESG_LINK:
+			mesgVal = Py_BuildValue("i", mesg[i].link_mesg.status);
+			break;
+		case CWIID_MESG_ACC_CAL:
+			mesgVal = Py_BuildValue("(d,d,d)",
+			                        mesg[i].acc_cal_mesg.acc[CWIID_X],
+			                        mesg[i].acc_cal_mesg.acc[CWIID_Y],
+			                        mesg[i].acc_cal_mesg.acc[CWIID_Z]);
+			break;
+		case CWIID_MESG_NUNCHUK_CAL:
+			mesgVal = Py_BuildValue("{s:(d,d),s:(d,d,d),s:I}",
+			             "stick",
+			               mesg[i].nunchuk_cal_mesg.stick[CWIID_X],
+			               mesg[i].nunchuk_cal_mesg.stick[CWIID_Y],
+			             "acc",
+			               mesg[i].nunchuk_cal_mesg.acc[CWIID_X],
+			               mesg[i].nunchuk_cal_mesg.acc[CWIID_Y],
+			               mesg[i].nunchuk_cal_mesg.acc[CWIID_Z],
+			             "buttons", mesg[i].nunchuk_cal_mesg.buttons);
+			break;
+		case CWIID_MESG_BALANCE_CAL:
+			mesgVal = Py_BuildValue("{s:d,s:d,s:d,s:d,s:d,s:(d,d)}",
+			             "right_top",
+			               mesg[i].balance_cal_mesg.right_top,
+			             "right_bottom",
+			               mesg[i].balance_cal_mesg.right_bottom,
+			             "left_top",
+			               mesg[i].balance_cal_mesg.left_top,
+			             "left_bottom",
+			               mesg[i].balance_cal_mesg.left_bottom,
+			             "weight",
+			               mesg[i].balance_cal_mesg.weight,
+			             "cop",
+			               mesg[i].balance_cal_mesg.cop[CWIID_X],
+			               mesg[i].balance_cal_mesg.cop[CWIID_Y]);
+			break;
+		case CWIID_MESG_MOTIONPLUS_CAL:
+			mesgVal = Py_BuildValue("{s:(d,d,d)}",
+			                        "angle_rate",
+			                         mesg[i].motionplus_cal_mesg.angle_rate[CWIID_PHI],
+			                         mesg[i].motionplus_cal_mesg.angle_rate[CWIID_THETA],
+			                         mesg[i].motionplus_cal_mesg.angle_rate[CWIID_PSI]);
+			break;
+		case CWIID_MESG_ORIENTATION:
+			mesgVal = Py_BuildValue("(d,d,d,d)",
+			                        mesg[i].orientation_mesg.q[0],
+			                        mesg[i].orientation_mesg.q[1],
+			                        mesg[i].orientation_mesg.q[2],
+			                        mesg[i].orientation_mesg.q[3]);
+			break;
+		case CWIID_MESG_CURSOR:
+			mesgVal = NULL;
+
+			if (!(PyIrList = PyList_New(CWIID_IR_SRC_COUNT))) {
+				break;
+			}
+
+			for (j=0; j < CWIID_IR_SRC_COUNT; j++) {
+				PyObject *PyTrack;
+
+				if (mesg[i].cursor_mesg.track[j].id) {
+					PyTrack = Py_BuildValue("{s:I,s:(I,I)}",
+					             "id", mesg[i].cursor_mesg.track[j].id,
+					             "pos",
+					               mesg[i].cursor_mesg.track[j].pos[CWIID_X],
+					               mesg[i].cursor_mesg.track[j].pos[CWIID_Y]);
+					if (!PyTrack) {
+						Py_DECREF(PyIrList);
+						PyIrList = NULL;
+						break;
+					}
+				}
+				else {
+					Py_INCREF(PyTrack = Py_None);
+				}
+				PyList_SET_ITEM(PyIrList, j, PyTrack);
+			}
+
+			if (!PyIrList) {
+				break;
+			}
+
+			mesgVal = Py_BuildValue("{s:N,s:i,s:(d,d),s:d,s:d}",
+			             "tracks", PyIrList,
+			             "valid", mesg[i].cursor_mesg.valid,
+			             "pos",
+			               mesg[i].cursor_mesg.pos[CWIID_X],
+			               mesg[i].cursor_mesg.pos[CWIID_Y],
+			             "distance", mesg[i].cursor_mesg.distance,
+			             "roll", mesg[i].cursor_mesg.roll);
+			break;
 		case CWIID_MESG_ERROR:
 			mesgVal = Py_BuildValue("i", mesg[i].error_mesg.error);
 			break;
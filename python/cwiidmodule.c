@@ -45,6 +45,10 @@ static struct {
 	CWIID_CONST_MACRO(FLAG_REPEAT_BTN),
 	CWIID_CONST_MACRO(FLAG_NONBLOCK),
 	CWIID_CONST_MACRO(FLAG_MOTIONPLUS),
+	CWIID_CONST_MACRO(FLAG_RECONNECT),
+	CWIID_CONST_MACRO(FLAG_CALIBRATED),
+	CWIID_CONST_MACRO(FLAG_ORIENTATION),
+	CWIID_CONST_MACRO(FLAG_IR_TRACK),
 	CWIID_CONST_MACRO(RPT_STATUS),
 	CWIID_CONST_MACRO(RPT_BTN),
 	CWIID_CONST_MACRO(RPT_ACC),
@@ -116,6 +120,13 @@ static struct {
 	CWIID_CONST_MACRO(MESG_CLASSIC),
 	CWIID_CONST_MACRO(MESG_BALANCE),
 	CWIID_CONST_MACRO(MESG_MOTIONPLUS),
+	CWIID_CONST_MACRO(MESG_LINK),
+	CWIID_CONST_MACRO(MESG_ACC_CAL),
+	CWIID_CONST_MACRO(MESG_NUNCHUK_CAL),
+	CWIID_CONST_MACRO(MESG_BALANCE_CAL),
+	CWIID_CONST_MACRO(MESG_MOTIONPLUS_CAL),
+	CWIID_CONST_MACRO(MESG_ORIENTATION),
+	CWIID_CONST_MACRO(MESG_CURSOR),
 	CWIID_CONST_MACRO(MESG_ERROR),
 	CWIID_CONST_MACRO(MESG_UNKNOWN),
 	CWIID_CONST_MACRO(EXT_NONE),
@@ -126,6 +137,8 @@ static struct {
 	CWIID_CONST_MACRO(EXT_UNKNOWN),
 	CWIID_CONST_MACRO(ERROR_DISCONNECT),
 	CWIID_CONST_MACRO(ERROR_COMM),
+	CWIID_CONST_MACRO(LINK_DISCONNECTED),
+	CWIID_CONST_MACRO(LINK_RECONNECTED),
 	{NULL, 0}
 };
 
@@ -0,0 +1,161 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Speaker ADPCM encoder (speaker.c): a fixed input must give the nibbles
+ * the Yamaha reference encoder gives (as in FFmpeg's adpcm_yamaha),
+ * through silence, steps, a sine and clipping at both rails.  Then tones
+ * played through the reference decoder must come back close to the
+ * input. */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "cwiid_internal.h"
+
+#define PI				3.14159265358979
+#define SAMPLE_RATE		3906.25
+#define STEP_START		127
+
+static const int16_t vector_in[] = {
+	0, 0, 0, 0,
+	8000, 8000, 8000, 8000, 8000, 8000, 8000, 8000,
+	-8000, -8000, -8000, -8000, -8000, -8000, -8000, -8000,
+	0, 6501, 9880, 8513, 3057, -3867, -8934, -9709,
+	-5821, 863, 7133, 9976, 8028, 2223, -4649, -9288,
+	32767, 32767, 32767, 32767, 32767, 32767,
+	-32768, -32768, -32768, -32768, -32768, -32768
+};
+
+static const uint8_t vector_out[] = {
+	0, 8, 0, 8,
+	7, 7, 7, 7, 2, 8, 0, 8,
+	15, 14, 0, 8, 8, 0, 0, 8,
+	4, 3, 1, 8, 11, 13, 10, 8,
+	2, 4, 3, 1, 9, 12, 12, 10,
+	7, 7, 0, 0, 0, 0,
+	15, 13, 8, 0, 8, 8
+};
+
+#define VECTOR_LEN		(sizeof vector_in / sizeof vector_in[0])
+#define VECTOR_PREDICTOR	-32768
+#define VECTOR_STEP			16011
+
+static int failed = 0;
+
+static void reset(struct speaker *speaker)
+{
+	memset(speaker, 0, sizeof *speaker);
+	speaker->step = STEP_START;
+}
+
+static void check_vector(void)
+{
+	static struct speaker speaker;
+	unsigned int i;
+	uint8_t nibble;
+
+	reset(&speaker);
+	for (i=0; i < VECTOR_LEN; i++) {
+		nibble = adpcm_encode(&speaker, vector_in[i]);
+		if (nibble != vector_out[i]) {
+			printf("vector sample %u: nibble %u, expected %u: FAIL\n", i,
+			       nibble, vector_out[i]);
+			failed = 1;
+			return;
+		}
+	}
+	if ((speaker.predictor != VECTOR_PREDICTOR) ||
+	  (speaker.step != VECTOR_STEP)) {
+		printf("vector end state: predictor %d step %d, expected %d %d: "
+		       "FAIL\n", speaker.predictor, speaker.step, VECTOR_PREDICTOR,
+		       VECTOR_STEP);
+		failed = 1;
+	}
+}
+
+/* Yamaha ADPCM decoder, as the speaker runs it */
+struct decoder {
+	int predictor;
+	int step;
+};
+
+static int16_t decode(struct decoder *dec, uint8_t nibble)
+{
+	static const int diff[16] = {
+		1, 3, 5, 7, 9, 11, 13, 15, -1, -3, -5, -7, -9, -11, -13, -15
+	};
+	static const int scale[8] = {230, 230, 230, 230, 307, 409, 512, 614};
+
+	dec->predictor += (dec->step * diff[nibble]) / 8;
+	if (dec->predictor > 32767) {
+		dec->predictor = 32767;
+	}
+	else if (dec->predictor < -32768) {
+		dec->predictor = -32768;
+	}
+	dec->step = (dec->step * scale[nibble & 7]) >> 8;
+	if (dec->step < 127) {
+		dec->step = 127;
+	}
+	else if (dec->step > 24576) {
+		dec->step = 24576;
+	}
+
+	return dec->predictor;
+}
+
+/* One second of a tone through the encoder and decoder; the first 100
+ * samples, while the step adapts, are not counted */
+static void check_tone(double freq, double amplitude, double min_snr)
+{
+	static struct speaker speaker;
+	struct decoder dec = {0, STEP_START};
+	double signal = 0.0, noise = 0.0, snr;
+	int16_t in, out;
+	int i;
+
+	reset(&speaker);
+	for (i=0; i < SAMPLE_RATE; i++) {
+		in = lrint(amplitude * sin(2.0 * PI * freq * i / SAMPLE_RATE));
+		out = decode(&dec, adpcm_encode(&speaker, in));
+		if (i >= 100) {
+			signal += (double)in * in;
+			noise += (double)(out - in) * (out - in);
+		}
+	}
+
+	snr = 10.0 * log10(signal / noise);
+	printf("tone %.0f Hz at %.0f: %.1f dB (limit %.1f)\n", freq, amplitude,
+	       snr, min_snr);
+	if (!(snr >= min_snr)) {
+		printf("tone %.0f Hz: FAIL\n", freq);
+		failed = 1;
+	}
+}
+
+int main(void)
+{
+	check_vector();
+	check_tone(220.0, 10000.0, 28.0);
+	check_tone(440.0, 10000.0, 22.0);
+	check_tone(440.0, 1000.0, 22.0);
+	check_tone(1000.0, 16000.0, 16.0);
+
+	printf("adpcm: %s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
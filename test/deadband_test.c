@@ -0,0 +1,226 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Per-type deadband filtering (deadband.c): a message is dropped until a
+ * value moves past the band from the last one passed on, so slow drift
+ * still gets through; discrete fields pass on any change; the calibrated
+ * message goes with its raw one and other types are left alone, in
+ * order; 0 drops only repeats, -1 turns the filter off and switching it
+ * back on starts afresh. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cwiid_internal.h"
+
+static struct wiimote *wiimote;
+static struct mesg_array ma;
+static int failed = 0;
+
+static void check(const char *what, int ok)
+{
+	printf("%s: %s\n", what, ok ? "ok" : "FAIL");
+	if (!ok) {
+		failed = 1;
+	}
+}
+
+static void add_acc(int x)
+{
+	union cwiid_mesg *mesg;
+
+	mesg = &ma.array[ma.count++];
+	mesg->acc_mesg.type = CWIID_MESG_ACC;
+	mesg->acc_mesg.acc[0] = x;
+	mesg->acc_mesg.acc[1] = 100;
+	mesg->acc_mesg.acc[2] = 200;
+
+	mesg = &ma.array[ma.count++];
+	mesg->acc_cal_mesg.type = CWIID_MESG_ACC_CAL;
+	mesg->acc_cal_mesg.acc[0] = x / 100.0f;
+}
+
+static void add_btn(uint16_t buttons)
+{
+	union cwiid_mesg *mesg = &ma.array[ma.count++];
+
+	mesg->btn_mesg.type = CWIID_MESG_BTN;
+	mesg->btn_mesg.buttons = buttons;
+}
+
+static void add_nunchuk(int stick_x, uint8_t buttons)
+{
+	union cwiid_mesg *mesg;
+
+	mesg = &ma.array[ma.count++];
+	mesg->nunchuk_mesg.type = CWIID_MESG_NUNCHUK;
+	mesg->nunchuk_mesg.stick[0] = stick_x;
+	mesg->nunchuk_mesg.buttons = buttons;
+
+	mesg = &ma.array[ma.count++];
+	mesg->nunchuk_cal_mesg.type = CWIID_MESG_NUNCHUK_CAL;
+}
+
+static void add_ir(char valid, int x)
+{
+	union cwiid_mesg *mesg = &ma.array[ma.count++];
+
+	mesg->ir_mesg.type = CWIID_MESG_IR;
+	mesg->ir_mesg.src[0].valid = valid;
+	mesg->ir_mesg.src[0].pos[0] = x;
+}
+
+/* Runs the filter and spells out what is left, e.g. "ACC ACC_CAL BTN" */
+static const char *run(void)
+{
+	static const char *names[] = {
+		[CWIID_MESG_BTN] = "BTN",
+		[CWIID_MESG_ACC] = "ACC",
+		[CWIID_MESG_IR] = "IR",
+		[CWIID_MESG_NUNCHUK] = "NUNCHUK",
+		[CWIID_MESG_ACC_CAL] = "ACC_CAL",
+		[CWIID_MESG_NUNCHUK_CAL] = "NUNCHUK_CAL",
+	};
+	static char out[128];
+	int i;
+
+	process_deadband(wiimote, &ma);
+
+	out[0] = '\0';
+	for (i=0; i < ma.count; i++) {
+		if (i) {
+			strcat(out, " ");
+		}
+		strcat(out, names[ma.array[i].type] ? names[ma.array[i].type] : "?");
+	}
+	memset(&ma, 0, sizeof ma);
+
+	return out;
+}
+
+static void expect(const char *what, const char *expected)
+{
+	const char *got = run();
+
+	printf("%s: [%s]", what, got);
+	if (strcmp(got, expected)) {
+		printf(", expected [%s]: FAIL\n", expected);
+		failed = 1;
+	}
+	else {
+		printf(": ok\n");
+	}
+}
+
+static void check_band(void)
+{
+	add_acc(500);
+	add_btn(1);
+	expect("off passes everything", "ACC ACC_CAL BTN");
+
+	check("set acc band", !cwiid_set_deadband(wiimote, CWIID_MESG_ACC, 5));
+	add_acc(500);
+	add_btn(1);
+	expect("first message passes", "ACC ACC_CAL BTN");
+
+	add_acc(505);
+	add_btn(2);
+	expect("inside the band drops with its calibrated message", "BTN");
+
+	add_btn(3);
+	add_acc(506);
+	expect("past the band passes", "BTN ACC ACC_CAL");
+
+	/* drift of 2 a report from the last passed on, 506 */
+	add_acc(508);
+	expect("drift 2", "");
+	add_acc(510);
+	expect("drift 4", "");
+	add_acc(512);
+	expect("drift 6 passes", "ACC ACC_CAL");
+	add_acc(507);
+	expect("back inside the band of the last passed on", "");
+}
+
+static void check_repeats(void)
+{
+	check("set acc band 0", !cwiid_set_deadband(wiimote, CWIID_MESG_ACC, 0));
+	add_acc(512);
+	expect("band 0 drops a repeat", "");
+	add_acc(513);
+	expect("band 0 passes a change", "ACC ACC_CAL");
+
+	check("switch acc off", !cwiid_set_deadband(wiimote, CWIID_MESG_ACC, -1));
+	add_acc(513);
+	expect("off passes a repeat", "ACC ACC_CAL");
+
+	check("switch acc on", !cwiid_set_deadband(wiimote, CWIID_MESG_ACC, 5));
+	add_acc(513);
+	expect("on again starts afresh", "ACC ACC_CAL");
+	add_acc(513);
+	expect("then drops", "");
+}
+
+static void check_discrete(void)
+{
+	check("set nunchuk band",
+	      !cwiid_set_deadband(wiimote, CWIID_MESG_NUNCHUK, 10));
+	add_nunchuk(128, 0);
+	expect("nunchuk first", "NUNCHUK NUNCHUK_CAL");
+	add_nunchuk(135, 0);
+	expect("nunchuk stick inside the band", "");
+	add_nunchuk(128, CWIID_NUNCHUK_BTN_Z);
+	expect("nunchuk button passes inside the band", "NUNCHUK NUNCHUK_CAL");
+
+	check("set ir band", !cwiid_set_deadband(wiimote, CWIID_MESG_IR, 3));
+	add_ir(1, 400);
+	expect("ir first", "IR");
+	add_ir(1, 402);
+	expect("ir inside the band", "");
+	add_ir(0, 402);
+	expect("ir source lost passes", "IR");
+	add_ir(0, 900);
+	expect("ir position of a lost source is ignored", "");
+}
+
+static void check_types(void)
+{
+	check("buttons cannot be filtered",
+	      cwiid_set_deadband(wiimote, CWIID_MESG_BTN, 5) == -1);
+	check("calibrated messages cannot be filtered",
+	      cwiid_set_deadband(wiimote, CWIID_MESG_ACC_CAL, 5) == -1);
+	check("unknown type", cwiid_set_deadband(wiimote, CWIID_MESG_UNKNOWN, 5)
+	      == -1);
+}
+
+int main(void)
+{
+	if ((wiimote = calloc(1, sizeof *wiimote)) == NULL) {
+		return 1;
+	}
+
+	check_band();
+	check_repeats();
+	check_discrete();
+	check_types();
+
+	free(wiimote);
+
+	printf("deadband: %s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
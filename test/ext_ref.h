@@ -0,0 +1,8 @@
+#ifndef EXT_REF_H
+#define EXT_REF_H
+
+int ref_process_ext(struct wiimote *wiimote, unsigned char *data,
+                    unsigned char len, struct mesg_array *ma);
+int ref_copy_state(union ext_state *ext, const union cwiid_mesg *mesg);
+
+#endif // EXT_REF_H
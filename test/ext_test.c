@@ -0,0 +1,213 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Table driven extension decoder (ext.c) against the hand-written one it
+ * replaced (ext_ref.c): the same messages, raw fields and state for
+ * every extension, report mode and 10M reports, each byte swept through
+ * all its values and the rest random.  Then both are timed per
+ * extension, and the table decoder fails if it falls too far behind:
+ * MAX_SLOWDOWN over all extensions, MAX_EXT_SLOWDOWN for any one. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cwiid_internal.h"
+#include "ext_ref.h"
+
+#define REPORT_COUNT	10000000
+#define BENCH_COUNT		5000000
+#define EXT_LEN			21
+#define MAX_MISMATCHES	5
+#define MAX_SLOWDOWN		2.0
+#define MAX_EXT_SLOWDOWN	3.0
+
+static const uint16_t rpt_modes[] = {
+	0x7FF, CWIID_RPT_EXT, CWIID_RPT_NUNCHUK, CWIID_RPT_MOTIONPLUS, 0x0F, 0
+};
+#define RPT_MODE_COUNT	(sizeof rpt_modes / sizeof rpt_modes[0])
+#define EXT_TYPE_COUNT	(CWIID_EXT_UNKNOWN - CWIID_EXT_NUNCHUK + 1)
+
+static void fill_report(unsigned char *data, int i)
+{
+	int j;
+
+	for (j=0; j < EXT_LEN; j++) {
+		if (i < 256 * EXT_LEN) {
+			data[j] = (j == i / 256) ? i % 256 : ((i & 1) ? 0xFF : 0);
+		}
+		else {
+			data[j] = rand();
+		}
+	}
+}
+
+static int same_arrays(const struct mesg_array *a, const struct mesg_array *b)
+{
+	int i;
+
+	if ((a->count != b->count) ||
+	  memcmp(a->array, b->array, a->count * sizeof a->array[0]) ||
+	  (a->raw_valid != b->raw_valid)) {
+		return 0;
+	}
+	if ((a->raw_valid & RAW_BIT(RAW_EXT)) &&
+	  (a->raw_len[RAW_EXT] != b->raw_len[RAW_EXT])) {
+		return 0;
+	}
+	for (i=0; i < a->count; i++) {
+		union ext_state ref_state, state;
+
+		memset(&ref_state, 0xAA, sizeof ref_state);
+		memset(&state, 0xAA, sizeof state);
+		if ((ref_copy_state(&ref_state, &a->array[i]) !=
+		     ext_copy_state(&state, &b->array[i])) ||
+		  memcmp(&ref_state, &state, sizeof state)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int check_equivalence(struct wiimote *wiimote)
+{
+	static struct mesg_array ref_ma, ma;
+	unsigned char ref_data[EXT_LEN], data[EXT_LEN];
+	int per_case = REPORT_COUNT / (int)(EXT_TYPE_COUNT * RPT_MODE_COUNT);
+	int ext_type, i, mismatches = 0;
+	unsigned int mode;
+
+	for (ext_type=CWIID_EXT_NUNCHUK; ext_type <= CWIID_EXT_UNKNOWN;
+	     ext_type++) {
+		for (mode=0; mode < RPT_MODE_COUNT; mode++) {
+			set_ext_type(wiimote, ext_type);
+			wiimote->state.rpt_mode = rpt_modes[mode];
+			for (i=0; i < per_case; i++) {
+				fill_report(ref_data, i);
+				memcpy(data, ref_data, EXT_LEN);
+
+				memset(&ref_ma, 0xAA, sizeof ref_ma);
+				memset(&ma, 0xAA, sizeof ma);
+				ref_ma.count = ma.count = 0;
+				ref_ma.raw_valid = ma.raw_valid = 0;
+				/* every 16th report goes undecoded, kept raw */
+				ref_ma.decode = ma.decode = (i % 16) ? CWIID_MESG_ALL : 0;
+
+				ref_process_ext(wiimote, ref_data, EXT_LEN, &ref_ma);
+				process_ext(wiimote, data, EXT_LEN, &ma);
+				if (!same_arrays(&ref_ma, &ma) ||
+				  memcmp(ref_data, data, EXT_LEN)) {
+					if (mismatches++ < MAX_MISMATCHES) {
+						printf("ext %d rpt_mode 0x%X report %d: mismatch\n",
+						       ext_type, rpt_modes[mode], i);
+					}
+				}
+			}
+		}
+	}
+
+	printf("equivalence: %d reports, %d mismatches\n",
+	       per_case * (int)(EXT_TYPE_COUNT * RPT_MODE_COUNT), mismatches);
+
+	return mismatches ? -1 : 0;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int bench(struct wiimote *wiimote)
+{
+	static struct mesg_array ma;
+	unsigned char data[EXT_LEN];
+	volatile int sink = 0;
+	double t0, t1, t2;
+	double ref_total = 0, total = 0;
+	int ext_type, i, ret = 0;
+
+	ma.decode = CWIID_MESG_ALL;
+	for (ext_type=CWIID_EXT_NUNCHUK; ext_type < CWIID_EXT_UNKNOWN;
+	     ext_type++) {
+		set_ext_type(wiimote, ext_type);
+		wiimote->state.rpt_mode = 0x7FF;
+		for (i=0; i < EXT_LEN; i++) {
+			data[i] = rand();
+		}
+
+		t0 = now_ns();
+		for (i=0; i < BENCH_COUNT; i++) {
+			ma.count = 0;
+			data[5] ^= i & 2;
+			ref_process_ext(wiimote, data, EXT_LEN, &ma);
+			sink += ma.count;
+		}
+		t1 = now_ns();
+		for (i=0; i < BENCH_COUNT; i++) {
+			ma.count = 0;
+			data[5] ^= i & 2;
+			process_ext(wiimote, data, EXT_LEN, &ma);
+			sink += ma.count;
+		}
+		t2 = now_ns();
+
+		printf("ext %d: switch %.1f ns, table %.1f ns per report\n", ext_type,
+		       (t1 - t0) / BENCH_COUNT, (t2 - t1) / BENCH_COUNT);
+		if (t2 - t1 > MAX_EXT_SLOWDOWN * (t1 - t0)) {
+			printf("ext %d: table decoder more than %.1fx slower\n", ext_type,
+			       MAX_EXT_SLOWDOWN);
+			ret = -1;
+		}
+		ref_total += t1 - t0;
+		total += t2 - t1;
+	}
+
+	printf("decode: table %.2fx the switch\n", total / ref_total);
+	if (total > MAX_SLOWDOWN * ref_total) {
+		printf("decode: table decoder more than %.1fx slower\n", MAX_SLOWDOWN);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+int main(void)
+{
+	struct wiimote *wiimote;
+	int ret = 0;
+
+	if ((wiimote = calloc(1, sizeof *wiimote)) == NULL) {
+		return 1;
+	}
+	srand(1);
+
+	if (check_equivalence(wiimote)) {
+		ret = 1;
+	}
+	if (bench(wiimote)) {
+		ret = 1;
+	}
+
+	free(wiimote);
+
+	return ret;
+}
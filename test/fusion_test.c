@@ -0,0 +1,250 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Orientation fusion (fusion.c): the first report seeds the tilt from
+ * the accelerometer, a wrong seed converges onto the measured gravity at
+ * the filter's gain with and without gyro data, the gyro integrates the
+ * heading, and a gap in the reports reseeds the tilt while keeping the
+ * heading. */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cwiid_internal.h"
+
+#define PI				3.14159265358979
+#define DEG				(PI / 180.0)
+
+#define ACC_ZERO		512
+#define ACC_GAIN		0.01f	/* g per count */
+#define GYRO_ZERO		8192
+#define GYRO_GAIN		0.05f	/* deg/s per count */
+
+#define REPORT_NS		10000000	/* 100 Hz */
+
+static struct timespec now;
+static int failed = 0;
+
+static void advance(long ns)
+{
+	now.tv_nsec += ns;
+	while (now.tv_nsec >= 1000000000) {
+		now.tv_sec++;
+		now.tv_nsec -= 1000000000;
+	}
+}
+
+/* The accelerometer reading for gravity tilted by angle about x, as the
+ * library will scale it */
+static void tilt_acc(double angle, uint16_t raw[3], float acc[3])
+{
+	double g[3] = {0.0, sin(angle), cos(angle)};
+	float norm;
+	int i;
+
+	for (i=0; i < 3; i++) {
+		raw[i] = ACC_ZERO + (int)lrint(g[i] / ACC_GAIN);
+		acc[i] = (raw[i] - ACC_ZERO) * ACC_GAIN;
+	}
+	norm = sqrtf(acc[0]*acc[0] + acc[1]*acc[1] + acc[2]*acc[2]);
+	for (i=0; i < 3; i++) {
+		acc[i] /= norm;
+	}
+}
+
+/* Feed one report (acc always, gyro yaw rate in deg/s unless NAN) and
+ * return the orientation the filter appends */
+static void report(struct wiimote *wiimote, const uint16_t acc[3],
+                   float yaw_rate, float q[4])
+{
+	static struct mesg_array ma;
+	struct cwiid_motionplus_mesg *mplus;
+	int i;
+
+	memset(&ma, 0, sizeof ma);
+	ma.mono = now;
+	ma.array[ma.count].acc_mesg.type = CWIID_MESG_ACC;
+	memcpy(ma.array[ma.count].acc_mesg.acc, acc, 3 * sizeof acc[0]);
+	ma.count++;
+	if (!isnan(yaw_rate)) {
+		mplus = &ma.array[ma.count++].motionplus_mesg;
+		mplus->type = CWIID_MESG_MOTIONPLUS;
+		mplus->angle_rate[0] = GYRO_ZERO;
+		mplus->angle_rate[1] = GYRO_ZERO;
+		mplus->angle_rate[2] = GYRO_ZERO + (int)lrintf(yaw_rate / GYRO_GAIN);
+	}
+
+	process_fusion(wiimote, &ma);
+	if (ma.array[ma.count-1].type != CWIID_MESG_ORIENTATION) {
+		printf("no orientation message: FAIL\n");
+		exit(1);
+	}
+	for (i=0; i < 4; i++) {
+		q[i] = ma.array[ma.count-1].orientation_mesg.q[i];
+	}
+}
+
+/* Angle between the gravity q predicts in the wiimote frame and acc */
+static double gravity_error(const float q[4], const float acc[3])
+{
+	double g[3], dot;
+
+	g[0] = 2.0 * (q[1]*q[3] - q[0]*q[2]);
+	g[1] = 2.0 * (q[0]*q[1] + q[2]*q[3]);
+	g[2] = q[0]*q[0] - q[1]*q[1] - q[2]*q[2] + q[3]*q[3];
+	dot = g[0]*acc[0] + g[1]*acc[1] + g[2]*acc[2];
+	if (dot > 1.0) {
+		dot = 1.0;
+	}
+
+	return acos(dot);
+}
+
+/* Rotation about the vertical, from the twist part of q */
+static double heading(const float q[4])
+{
+	return 2.0 * atan2(q[3], q[0]);
+}
+
+static void check(const char *what, double value, double limit)
+{
+	printf("%s: %.5f (limit %.5f)\n", what, value, limit);
+	if (!(value <= limit)) {
+		printf("%s: FAIL\n", what);
+		failed = 1;
+	}
+}
+
+static struct wiimote *new_wiimote(void)
+{
+	struct wiimote *wiimote;
+	int i;
+
+	if ((wiimote = calloc(1, sizeof *wiimote)) == NULL) {
+		exit(1);
+	}
+	for (i=0; i < 3; i++) {
+		wiimote->scale.acc.zero[i] = ACC_ZERO;
+		wiimote->scale.acc.gain[i] = ACC_GAIN;
+		wiimote->scale.gyro_zero[i] = GYRO_ZERO;
+	}
+	wiimote->scale.gyro_gain[0] = GYRO_GAIN;
+	wiimote->scale.gyro_gain[1] = GYRO_GAIN;
+	init_fusion(wiimote);
+
+	return wiimote;
+}
+
+/* Seeded level, then held at 30 degrees.  Each report moves the
+ * estimate by a fixed step of gain * dt (in the quaternion, twice that in
+ * angle), so the error must fall steadily, reach that band in 30 degrees
+ * over the step rate, and stay inside it. */
+static void check_convergence(const char *what, float yaw_rate, double gain)
+{
+	struct wiimote *wiimote = new_wiimote();
+	uint16_t level_raw[3], raw[3];
+	float level[3], acc[3], q[4];
+	double band = 2.0 * gain * REPORT_NS / 1e9;
+	double expected = 30.0 * DEG / band;	/* reports */
+	double err, last_err, worst = 0.0;
+	char name[64];
+	int i, settled = -1;
+
+	tilt_acc(0.0, level_raw, level);
+	tilt_acc(30.0 * DEG, raw, acc);
+
+	report(wiimote, level_raw, yaw_rate, q);
+	snprintf(name, sizeof name, "%s: seed error (rad)", what);
+	check(name, gravity_error(q, level), 1e-4);
+
+	last_err = gravity_error(q, acc);
+	for (i=0; i < 3 * expected; i++) {
+		advance(REPORT_NS);
+		report(wiimote, raw, yaw_rate, q);
+		err = gravity_error(q, acc);
+		if (settled < 0) {
+			if (err > last_err) {
+				printf("%s: error grew from %.5f to %.5f at report %d: FAIL\n",
+				       what, last_err, err, i);
+				failed = 1;
+				break;
+			}
+			if (err <= band) {
+				settled = i;
+			}
+		}
+		else if (err > worst) {
+			worst = err;
+		}
+		last_err = err;
+	}
+
+	snprintf(name, sizeof name, "%s: reports to settle", what);
+	check(name, settled < 0 ? 1e9 : settled, 1.1 * expected);
+	snprintf(name, sizeof name, "%s: settled error (rad)", what);
+	check(name, worst, band);
+
+	free(wiimote);
+}
+
+/* Turn 90 degrees on the gyro, then lose reports long enough to restart:
+ * the tilt comes straight from the accelerometer, the heading stays */
+static void check_reseed(void)
+{
+	struct wiimote *wiimote = new_wiimote();
+	uint16_t level_raw[3], raw[3];
+	float level[3], acc[3], q[4];
+	int i;
+
+	tilt_acc(0.0, level_raw, level);
+	tilt_acc(30.0 * DEG, raw, acc);
+
+	report(wiimote, level_raw, 0.0f, q);
+	for (i=0; i < 100; i++) {
+		advance(REPORT_NS);
+		report(wiimote, level_raw, 90.0f, q);
+	}
+	check("gyro heading error (rad)", fabs(heading(q) - 90.0 * DEG), 0.5 * DEG);
+	check("gyro tilt error (rad)", gravity_error(q, level), 0.1 * DEG);
+
+	advance(500000000);
+	report(wiimote, raw, 0.0f, q);
+	check("reseed tilt error (rad)", gravity_error(q, acc), 1e-4);
+	check("reseed heading error (rad)", fabs(heading(q) - 90.0 * DEG),
+	      0.5 * DEG);
+
+	/* and carries on from there, within one gradient step */
+	advance(REPORT_NS);
+	report(wiimote, raw, 0.0f, q);
+	check("after reseed tilt error (rad)", gravity_error(q, acc),
+	      2.0 * 0.1 * REPORT_NS / 1e9);
+
+	free(wiimote);
+}
+
+int main(void)
+{
+	/* the filter's gains with and without a MotionPlus */
+	check_convergence("gyro", 0.0f, 0.1);
+	check_convergence("tilt only", NAN, 2.0);
+	check_reseed();
+
+	printf("fusion: %s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
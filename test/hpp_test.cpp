@@ -0,0 +1,185 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* cwiid.hpp: handle ownership, visitor dispatch checked against the
+ * equivalent C switch over random message arrays, and the two timed
+ * against each other. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include "cwiid.hpp"
+
+#define MESG_COUNT		4096
+#define BENCH_ROUNDS	2000
+
+static_assert(!std::is_copy_constructible_v<cwiid::wiimote>);
+static_assert(!std::is_copy_assignable_v<cwiid::wiimote>);
+static_assert(std::is_nothrow_move_constructible_v<cwiid::wiimote>);
+static_assert(std::is_nothrow_move_assignable_v<cwiid::wiimote>);
+static_assert(!std::is_copy_constructible_v<cwiid::subscription>);
+static_assert(std::is_nothrow_move_constructible_v<cwiid::subscription>);
+
+struct totals {
+	long btn, acc, ir, nunchuk, link, other;
+
+	bool operator==(const totals &) const = default;
+};
+
+/* What a C consumer writes today */
+__attribute__((noinline))
+static void raw_switch(union cwiid_mesg *mesg, int count, struct totals *t)
+{
+	for (int i = 0; i < count; i++) {
+		switch (mesg[i].type) {
+		case CWIID_MESG_BTN:
+			t->btn += mesg[i].btn_mesg.buttons;
+			break;
+		case CWIID_MESG_ACC:
+			t->acc += mesg[i].acc_mesg.acc[CWIID_X];
+			break;
+		case CWIID_MESG_IR:
+			t->ir += mesg[i].ir_mesg.src[0].pos[CWIID_X];
+			break;
+		case CWIID_MESG_NUNCHUK:
+			t->nunchuk += mesg[i].nunchuk_mesg.stick[CWIID_Y];
+			break;
+		case CWIID_MESG_LINK:
+			t->link += mesg[i].link_mesg.status;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+__attribute__((noinline))
+static void visitor(union cwiid_mesg *mesg, int count, struct totals *t)
+{
+	cwiid::visit(cwiid::mesg_span(mesg, count), cwiid::overload{
+		[t](cwiid_btn_mesg &m) { t->btn += m.buttons; },
+		[t](cwiid_acc_mesg &m) { t->acc += m.acc[CWIID_X]; },
+		[t](cwiid_ir_mesg &m) { t->ir += m.src[0].pos[CWIID_X]; },
+		[t](cwiid_nunchuk_mesg &m) { t->nunchuk += m.stick[CWIID_Y]; },
+		[t](cwiid_link_mesg &m) { t->link += m.status; },
+	});
+}
+
+static void fill(union cwiid_mesg *mesg, int count)
+{
+	for (int i = 0; i < count; i++) {
+		unsigned char *byte = reinterpret_cast<unsigned char *>(&mesg[i]);
+
+		for (std::size_t j = 0; j < sizeof mesg[i]; j++) {
+			byte[j] = rand();
+		}
+		/* every type, plus a few the library never sends */
+		mesg[i].type = static_cast<enum cwiid_mesg_type>(
+		  rand() % (CWIID_MESG_UNKNOWN + 3));
+	}
+}
+
+static int check_handles()
+{
+	cwiid::wiimote wm;
+	cwiid::subscription sub;
+
+	cwiid::wiimote moved = std::move(wm);
+	cwiid::subscription moved_sub = std::move(sub);
+	moved = cwiid::wiimote();
+	moved_sub.reset();
+	if (wm || moved || moved.get() || moved.release() || moved_sub) {
+		printf("handles: FAIL\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int check_dispatch(union cwiid_mesg *mesg)
+{
+	struct totals raw = {}, visited = {};
+	int counted = 0;
+
+	raw_switch(mesg, MESG_COUNT, &raw);
+	visitor(mesg, MESG_COUNT, &visited);
+	if (!(raw == visited)) {
+		printf("dispatch: visitor and switch disagree: FAIL\n");
+		return -1;
+	}
+
+	/* generic lambdas see every known type, and nothing else */
+	cwiid::visit(cwiid::mesg_span(mesg, MESG_COUNT), [&](auto &) {
+		counted++;
+	});
+	for (int i = 0; i < MESG_COUNT; i++) {
+		if (mesg[i].type < CWIID_MESG_UNKNOWN) {
+			counted--;
+		}
+	}
+	if (counted) {
+		printf("dispatch: generic visitor miscounted: FAIL\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static double elapsed_ns(const struct timespec &start,
+                         const struct timespec &end)
+{
+	return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+static void bench(union cwiid_mesg *mesg)
+{
+	struct timespec t0, t1, t2;
+	struct totals raw = {}, visited = {};
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < BENCH_ROUNDS; i++) {
+		raw_switch(mesg, MESG_COUNT, &raw);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (int i = 0; i < BENCH_ROUNDS; i++) {
+		visitor(mesg, MESG_COUNT, &visited);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	printf("dispatch: switch %.2f ns, visitor %.2f ns per message\n",
+	       elapsed_ns(t0, t1) / (BENCH_ROUNDS * MESG_COUNT),
+	       elapsed_ns(t1, t2) / (BENCH_ROUNDS * MESG_COUNT));
+}
+
+int main()
+{
+	std::vector<union cwiid_mesg> mesg(MESG_COUNT);
+	int ret = 0;
+
+	srand(1);
+	fill(mesg.data(), MESG_COUNT);
+
+	if (check_handles() || check_dispatch(mesg.data())) {
+		ret = 1;
+	}
+	bench(mesg.data());
+
+	return ret;
+}
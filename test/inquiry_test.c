@@ -0,0 +1,178 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Inquiry service against a stub HCI backend: devices come out of
+ * cwiid_inquiry_wait in discovery order, non-wiimotes are filtered
+ * unless asked for, cwiid_find_wiimote uses the running service, and
+ * cwiid_inquiry_stop wakes a blocked waiter. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "cwiid.h"
+
+#define ROUND_USEC		20000
+#define WIIMOTE_A		1
+#define WIIMOTE_B		2
+#define PHONE			3
+
+static int rounds = 0;
+static pthread_t main_thread;
+static int blocking_inquiries = 0;	/* made by main, not the service */
+static int failed = 0;
+
+static int stub_get_route(void)
+{
+	return 0;
+}
+
+static void stub_device(struct cwiid_bdinfo *bdinfo, uint8_t addr,
+                        int wiimote)
+{
+	memset(bdinfo, 0, sizeof *bdinfo);
+	bdinfo->bdaddr.b[0] = addr;
+	if (wiimote) {
+		bdinfo->btclass[0] = 0x04;
+		bdinfo->btclass[1] = 0x25;
+		bdinfo->btclass[2] = 0x00;
+	}
+	else {
+		bdinfo->btclass[0] = 0x0C;
+		bdinfo->btclass[1] = 0x02;
+		bdinfo->btclass[2] = 0x5A;
+	}
+}
+
+/* Wiimote A and a phone from the start, wiimote B from the third round */
+static int stub_inquiry(int dev_id, unsigned int timeout, int max_bdinfo,
+                        struct cwiid_bdinfo *bdinfo)
+{
+	int count = 0;
+
+	(void)dev_id;
+	(void)timeout;
+	(void)max_bdinfo;
+
+	if (pthread_equal(pthread_self(), main_thread)) {
+		blocking_inquiries++;
+	}
+	usleep(ROUND_USEC);
+	if (__atomic_add_fetch(&rounds, 1, __ATOMIC_RELAXED) >= 3) {
+		stub_device(&bdinfo[count++], WIIMOTE_B, 1);
+	}
+	stub_device(&bdinfo[count++], WIIMOTE_A, 1);
+	stub_device(&bdinfo[count++], PHONE, 0);
+
+	return count;
+}
+
+static const struct cwiid_hci_backend stub_backend = {
+	stub_get_route, stub_inquiry
+};
+
+static void check(const char *what, int ok)
+{
+	if (!ok) {
+		printf("%s: FAIL\n", what);
+		failed = 1;
+	}
+}
+
+static void *blocked_wait(void *arg)
+{
+	struct cwiid_inquiry_entry entry;
+	unsigned int serial = 1000;
+	static int ret;
+
+	ret = cwiid_inquiry_wait(arg, &serial, &entry, -1);
+
+	return &ret;
+}
+
+int main(void)
+{
+	cwiid_inquiry_t *inquiry;
+	struct cwiid_inquiry_entry entry, entries[4];
+	unsigned int serial = 0;
+	pthread_t waiter;
+	bdaddr_t bdaddr;
+	void *waiter_ret;
+	int i;
+
+	main_thread = pthread_self();
+	if (cwiid_set_hci_backend(&stub_backend)) {
+		return 1;
+	}
+
+	if ((inquiry = cwiid_inquiry_start(-1, 1, 0)) == NULL) {
+		return 1;
+	}
+
+	/* Discovery order, each device once */
+	check("first wait", !cwiid_inquiry_wait(inquiry, &serial, &entry, 2000) &&
+	                    (entry.bdinfo.bdaddr.b[0] == WIIMOTE_A) &&
+	                    (serial == 1));
+	check("second wait", !cwiid_inquiry_wait(inquiry, &serial, &entry, 2000) &&
+	                     (entry.bdinfo.bdaddr.b[0] == WIIMOTE_B) &&
+	                     (serial == 2));
+	check("wait timeout", cwiid_inquiry_wait(inquiry, &serial, &entry,
+	                                         10 * ROUND_USEC / 1000) == 1);
+
+	/* The phone never makes it into the table */
+	check("lookup", cwiid_inquiry_lookup(inquiry, -1, 4, entries) == 2);
+	for (i=0; i < 2; i++) {
+		check("lookup filter", entries[i].bdinfo.bdaddr.b[0] != PHONE);
+	}
+
+	/* Served from the table, without a blocking inquiry */
+	check("find", !cwiid_find_wiimote(&bdaddr, 1) &&
+	              ((bdaddr.b[0] == WIIMOTE_A) || (bdaddr.b[0] == WIIMOTE_B)));
+	check("find from service", blocking_inquiries == 0);
+
+	/* Stop wakes a waiter that would otherwise block forever */
+	if (pthread_create(&waiter, NULL, blocked_wait, inquiry)) {
+		return 1;
+	}
+	usleep(2 * ROUND_USEC);
+	check("stop", !cwiid_inquiry_stop(inquiry));
+	pthread_join(waiter, &waiter_ret);
+	check("stop wakes waiter", *(int *)waiter_ret == -1);
+
+	/* No service left, so find falls back to a blocking inquiry */
+	check("find without service", !cwiid_find_wiimote(&bdaddr, 1) &&
+	                              (blocking_inquiries == 1));
+
+	/* Unfiltered service keeps the phone too */
+	if ((inquiry = cwiid_inquiry_start(-1, 1, BT_NO_WIIMOTE_FILTER)) == NULL) {
+		return 1;
+	}
+	serial = 0;
+	for (i=0; i < 3; i++) {
+		cwiid_inquiry_wait(inquiry, &serial, &entry, 2000);
+	}
+	check("unfiltered lookup",
+	      cwiid_inquiry_lookup(inquiry, -1, 4, entries) == 3);
+	check("unfiltered stop", !cwiid_inquiry_stop(inquiry));
+
+	if (!failed) {
+		printf("inquiry: ok\n");
+	}
+
+	return failed;
+}
@@ -0,0 +1,175 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* IR tracker (irtrack.c): the sensor bar's cursor through the camera
+ * swapping slots, one dot dropping out for a few reports, and a dot
+ * lost for good coming back as a new track. */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cwiid_internal.h"
+
+#define ABSENT	-1.0f
+
+static int failed = 0;
+
+/* Feed one IR report (up to four sources, x < 0 for an empty slot) and
+ * return the cursor message the tracker appends */
+static struct cwiid_cursor_mesg report(struct wiimote *wiimote,
+                                       const float src[CWIID_IR_SRC_COUNT][2])
+{
+	static struct mesg_array ma;
+	struct cwiid_ir_mesg *ir_mesg;
+	int i;
+
+	memset(&ma, 0, sizeof ma);
+	ma.count = 1;
+	ir_mesg = &ma.array[0].ir_mesg;
+	ir_mesg->type = CWIID_MESG_IR;
+	for (i=0; i < CWIID_IR_SRC_COUNT; i++) {
+		if (src[i][0] >= 0.0f) {
+			ir_mesg->src[i].valid = 1;
+			ir_mesg->src[i].pos[CWIID_X] = src[i][0];
+			ir_mesg->src[i].pos[CWIID_Y] = src[i][1];
+			ir_mesg->src[i].size = 3;
+		}
+	}
+
+	process_ir_track(wiimote, &ma);
+	if ((ma.count != 2) || (ma.array[1].type != CWIID_MESG_CURSOR)) {
+		printf("no cursor message: FAIL\n");
+		exit(1);
+	}
+
+	return ma.array[1].cursor_mesg;
+}
+
+static void expect(const char *what, const struct cwiid_cursor_mesg *cursor,
+                   float distance, float roll)
+{
+	if (!cursor->valid || (fabsf(cursor->distance - distance) > 0.5f) ||
+	  (fabsf(cursor->roll - roll) > 0.01f)) {
+		printf("%s: valid %d distance %.1f roll %.3f, "
+		       "expected distance %.1f roll %.3f: FAIL\n", what,
+		       cursor->valid, cursor->distance, cursor->roll, distance, roll);
+		failed = 1;
+	}
+}
+
+static int has_id(const struct cwiid_cursor_mesg *cursor, uint8_t id)
+{
+	int i;
+
+	for (i=0; i < CWIID_IR_SRC_COUNT; i++) {
+		if (cursor->track[i].id == id) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	struct wiimote *wiimote;
+	struct cwiid_cursor_mesg cursor;
+	float src[CWIID_IR_SRC_COUNT][2];
+	uint8_t right_id;
+	int i;
+
+	if ((wiimote = calloc(1, sizeof *wiimote)) == NULL) {
+		return 1;
+	}
+	init_ir_tracker(wiimote);
+
+	/* Level bar, 200 pixels long */
+	for (i=0; i < 4; i++) {
+		float bar[CWIID_IR_SRC_COUNT][2] = {
+			{400, 380}, {600, 380}, {ABSENT, 0}, {ABSENT, 0}};
+		cursor = report(wiimote, bar);
+	}
+	expect("bar", &cursor, 200.0f, 0.0f);
+	right_id = wiimote->ir_tracker.bar_id[1];
+
+	/* Camera swaps the slots: same tracks, same bar */
+	for (i=0; i < 4; i++) {
+		float bar[CWIID_IR_SRC_COUNT][2] = {
+			{ABSENT, 0}, {600, 380}, {ABSENT, 0}, {400, 380}};
+		cursor = report(wiimote, bar);
+	}
+	expect("slot swap", &cursor, 200.0f, 0.0f);
+	if (wiimote->ir_tracker.bar_id[1] != right_id) {
+		printf("slot swap: right dot changed track: FAIL\n");
+		failed = 1;
+	}
+
+	/* Right dot drops out briefly: the bar coasts on the left one */
+	for (i=0; i < 3; i++) {
+		memcpy(src, (float [CWIID_IR_SRC_COUNT][2]) {
+			{400, 380}, {ABSENT, 0}, {ABSENT, 0}, {ABSENT, 0}}, sizeof src);
+		cursor = report(wiimote, src);
+		expect("dropout", &cursor, 200.0f, 0.0f);
+	}
+	for (i=0; i < 2; i++) {
+		float bar[CWIID_IR_SRC_COUNT][2] = {
+			{400, 380}, {600, 380}, {ABSENT, 0}, {ABSENT, 0}};
+		cursor = report(wiimote, bar);
+	}
+	expect("dropout recovered", &cursor, 200.0f, 0.0f);
+	if (wiimote->ir_tracker.bar_id[1] != right_id) {
+		printf("dropout: right dot changed track: FAIL\n");
+		failed = 1;
+	}
+
+	/* Right dot lost for good; the wiimote backs off and rolls, and the
+	 * dot comes back as a new track.  The bar must pair with it. */
+	for (i=0; i < 8; i++) {
+		memcpy(src, (float [CWIID_IR_SRC_COUNT][2]) {
+			{420, 380}, {ABSENT, 0}, {ABSENT, 0}, {ABSENT, 0}}, sizeof src);
+		cursor = report(wiimote, src);
+	}
+	if (has_id(&cursor, right_id)) {
+		printf("lost dot: track not dropped: FAIL\n");
+		failed = 1;
+	}
+	for (i=0; i < 3; i++) {
+		float bar[CWIID_IR_SRC_COUNT][2] = {
+			{ABSENT, 0}, {420, 380}, {ABSENT, 0}, {540, 470}};
+		cursor = report(wiimote, bar);
+	}
+	expect("new id", &cursor, 150.0f, atan2f(90.0f, 120.0f));
+	if (wiimote->ir_tracker.bar_id[1] == right_id) {
+		printf("new id: bar kept the dropped track: FAIL\n");
+		failed = 1;
+	}
+	if (fabsf(cursor.pos[CWIID_X] - 480.0f) > 5.0f ||
+	  fabsf(cursor.pos[CWIID_Y] - 425.0f) > 5.0f) {
+		printf("new id: cursor at (%.1f, %.1f): FAIL\n",
+		       cursor.pos[CWIID_X], cursor.pos[CWIID_Y]);
+		failed = 1;
+	}
+
+	free(wiimote);
+	if (!failed) {
+		printf("irtrack: ok\n");
+	}
+
+	return failed;
+}
@@ -0,0 +1,218 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* ir_6dof pose solver: accuracy against synthetic projections of a known
+ * pose, and a timing benchmark.  Off the bar's horizontal plane each LED
+ * is ranged separately, and on the bar's centre line both ranges are
+ * equal, so the pose must come back exactly.  Elsewhere close to the
+ * plane the solver leans toward equal ranges; pitch and roll (from the
+ * up vector) stay exact, and position and yaw are held to the solver's
+ * measured error there plus about 10%, so any regression shows. */
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include "pose.h"
+
+#define BENCH_COUNT	1000000
+
+static const struct pose_geometry geometry = {200.0, 1280.0, {512.0, 384.0}};
+
+#define EXACT_POS	1e-3
+#define EXACT_ANGLE	1e-6
+#define EXACT		{EXACT_POS, EXACT_POS, EXACT_POS, EXACT_ANGLE}
+
+struct pose_case {
+	double pos[3];
+	double yaw, pitch, roll;
+	double tol[4];				/* x, y, z, yaw */
+};
+
+static const struct pose_case cases[] = {
+	{{0, 0, 2000}, 0, 0, 0, EXACT},
+	{{0, 50, 1500}, 0, 0.05, -0.2, EXACT},
+	{{0, 150, 1200}, 0.1, -0.1, 0.4, EXACT},
+	{{300, -400, 1500}, 0.2, 0.25, 0.3, EXACT},
+	{{-500, 600, 2000}, -0.3, -0.3, -0.5, EXACT},
+	{{150, -300, 900}, 0.1, 0.3, 1.2, EXACT},
+	/* measured errors 103.1, 1.15, 34.6, 0.070 */
+	{{300, -100, 1500}, 0.2, 0.1, 0.3, {114, 1.3, 38, 0.077}},
+	/* 167.4, 1.56, 46.9, 0.056 */
+	{{-500, 200, 3000}, -0.3, -0.15, -0.5, {184, 1.7, 52, 0.062}},
+	/* 50.8, 0.19, 7.5, 0.050 */
+	{{100, 50, 1000}, 0.1, 0.05, 1.2, {56, 0.21, 8.3, 0.055}}
+};
+
+static void mat_mul(double r[3][3], double a[3][3], double b[3][3])
+{
+	int i, j, k;
+
+	for (i=0; i < 3; i++) {
+		for (j=0; j < 3; j++) {
+			r[i][j] = 0;
+			for (k=0; k < 3; k++) {
+				r[i][j] += a[i][k]*b[k][j];
+			}
+		}
+	}
+}
+
+/* Camera image of both LEDs, and the accelerometer's up vector */
+static void project(const struct pose_case *c, double left[2],
+                    double right[2], double up[3])
+{
+	double ry[3][3] = {{cos(-c->yaw), 0, sin(-c->yaw)},
+	                   {0, 1, 0},
+	                   {-sin(-c->yaw), 0, cos(-c->yaw)}};
+	double rx[3][3] = {{1, 0, 0},
+	                   {0, cos(c->pitch), -sin(c->pitch)},
+	                   {0, sin(c->pitch), cos(c->pitch)}};
+	double rz[3][3] = {{cos(-c->roll), -sin(-c->roll), 0},
+	                   {sin(-c->roll), cos(-c->roll), 0},
+	                   {0, 0, 1}};
+	double t[3][3], r[3][3], x[3], v[3];
+	double *img;
+	int led, i;
+
+	mat_mul(t, ry, rx);
+	mat_mul(r, t, rz);
+
+	for (led=0; led < 2; led++) {
+		img = led ? right : left;
+		x[0] = (led ? 0.5 : -0.5) * geometry.bar_width - c->pos[0];
+		x[1] = -c->pos[1];
+		x[2] = -c->pos[2];
+		for (i=0; i < 3; i++) {
+			v[i] = r[0][i]*x[0] + r[1][i]*x[1] + r[2][i]*x[2];
+		}
+		img[0] = geometry.center[0] + geometry.focal_length * v[0] / -v[2];
+		img[1] = geometry.center[1] + geometry.focal_length * v[1] / -v[2];
+	}
+	for (i=0; i < 3; i++) {
+		up[i] = r[1][i];
+	}
+}
+
+static int check_case(const struct pose_case *c)
+{
+	struct pose pose;
+	double left[2], right[2], up[3];
+	int i, failed = 0;
+
+	project(c, left, right, up);
+	if (solve_pose(&geometry, left, right, up, &pose)) {
+		printf("pose (%g, %g, %g): solve failed\n",
+		       c->pos[0], c->pos[1], c->pos[2]);
+		return -1;
+	}
+
+	for (i=0; i < 3; i++) {
+		if (fabs(pose.pos[i] - c->pos[i]) > c->tol[i]) {
+			failed = 1;
+		}
+	}
+	if ((fabs(pose.yaw - c->yaw) > c->tol[3]) ||
+	  (fabs(pose.pitch - c->pitch) > EXACT_ANGLE) ||
+	  (fabs(pose.roll - c->roll) > EXACT_ANGLE)) {
+		failed = 1;
+	}
+
+	printf("pose (%g, %g, %g) y%.3f p%.3f r%.3f: "
+	       "got (%.1f, %.1f, %.1f) y%.3f p%.3f r%.3f%s\n",
+	       c->pos[0], c->pos[1], c->pos[2], c->yaw, c->pitch, c->roll,
+	       pose.pos[0], pose.pos[1], pose.pos[2],
+	       pose.yaw, pose.pitch, pose.roll, failed ? " FAIL" : "");
+
+	return failed ? -1 : 0;
+}
+
+/* Without an up vector, a level wiimote's roll comes from the bar image */
+static int check_level(void)
+{
+	struct pose_case c = {{0, 0, 1500}, 0, 0, 0.35, EXACT};
+	struct pose pose;
+	double left[2], right[2], up[3];
+
+	project(&c, left, right, up);
+	if (solve_pose(&geometry, left, right, NULL, &pose) ||
+	  (fabs(pose.pos[0] - c.pos[0]) > EXACT_POS) ||
+	  (fabs(pose.pos[1] - c.pos[1]) > EXACT_POS) ||
+	  (fabs(pose.pos[2] - c.pos[2]) > EXACT_POS) ||
+	  (fabs(pose.yaw - c.yaw) > EXACT_ANGLE) ||
+	  (fabs(pose.pitch - c.pitch) > EXACT_ANGLE) ||
+	  (fabs(pose.roll - c.roll) > EXACT_ANGLE)) {
+		printf("level pose: FAIL\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int check_degenerate(void)
+{
+	struct pose pose;
+	double point[2] = {512.0, 384.0};
+
+	if (!solve_pose(&geometry, point, point, NULL, &pose)) {
+		printf("coincident points: FAIL\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void bench(void)
+{
+	struct timespec start, end;
+	struct pose pose;
+	double left[2] = {400.0, 380.0}, right[2] = {600.0, 390.0};
+	double up[3] = {0.1, 1.0, 0.05};
+	volatile double sink = 0;
+	double ns;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=0; i < BENCH_COUNT; i++) {
+		left[0] += 1e-6;
+		solve_pose(&geometry, left, right, up, &pose);
+		sink += pose.pos[2];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	printf("solve_pose: %.1f ns\n", ns / BENCH_COUNT);
+}
+
+int main(void)
+{
+	unsigned int i;
+	int ret = 0;
+
+	for (i=0; i < sizeof cases / sizeof cases[0]; i++) {
+		if (check_case(&cases[i])) {
+			ret = 1;
+		}
+	}
+	if (check_level() || check_degenerate()) {
+		ret = 1;
+	}
+
+	bench();
+
+	return ret;
+}
@@ -0,0 +1,267 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Batched interrupt channel reads.  A wiimote stand-in on seqpacket
+ * socketpairs streams button reports at the router as fast as the socket
+ * takes them; every one must come out of the callback, in order.  Then a
+ * benchmark drains the same bursts with one read() per report and with
+ * one recvmmsg() per burst, and fails if batching does not pay. */
+
+#define _GNU_SOURCE	/* recvmmsg */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "cwiid_internal.h"
+
+#define STREAM_COUNT	20000
+#define BURST			16		/* the router's READ_BATCH */
+#define BENCH_ROUNDS	20000
+#define REPORT_LEN		4		/* DATA/INPUT, RPT_BTN, buttons */
+
+static int ctl[2], intr[2];
+static int received = 0;
+static int out_of_order = 0;
+
+static uint16_t seq_buttons(int seq)
+{
+	return ((seq>>8) & BTN_MASK_0)<<8 | (seq & BTN_MASK_1);
+}
+
+static void seq_report(unsigned char *buf, int seq)
+{
+	buf[0] = BT_TRANS_DATA | BT_PARAM_INPUT;
+	buf[1] = RPT_BTN;
+	buf[2] = seq>>8;
+	buf[3] = seq;
+}
+
+/* Acks every output report, and answers status and read requests with
+ * an idle wiimote and zeroed memory */
+static void *responder(void *arg)
+{
+	unsigned char buf[32], out[23];
+	unsigned int len, done, c;
+	unsigned char hs = 0;
+
+	(void)arg;
+	while (read(ctl[1], buf, sizeof buf) > 0) {
+		if (write(ctl[1], &hs, 1) != 1) {
+			break;
+		}
+		memset(out, 0, sizeof out);
+		out[0] = BT_TRANS_DATA | BT_PARAM_INPUT;
+		switch (buf[1]) {
+		case RPT_STATUS_REQ:
+			out[1] = RPT_STATUS;
+			out[7] = 0x80;
+			if (write(intr[1], out, 8) != 8) {
+				return NULL;
+			}
+			break;
+		case RPT_READ_REQ:
+			len = buf[6]<<8 | buf[7];
+			for (done=0; done < len; done += c) {
+				c = (len - done > 16) ? 16 : len - done;
+				out[1] = RPT_READ_DATA;
+				out[4] = (c - 1)<<4;
+				if (write(intr[1], out, 23) != 23) {
+					return NULL;
+				}
+			}
+			break;
+		case RPT_WRITE:
+			out[1] = RPT_WRITE_ACK;
+			if (write(intr[1], out, 6) != 6) {
+				return NULL;
+			}
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void callback(cwiid_wiimote_t *wiimote, int mesg_count,
+                     union cwiid_mesg mesg[], struct timespec *timestamp)
+{
+	int i;
+
+	(void)wiimote;
+	(void)timestamp;
+	for (i=0; i < mesg_count; i++) {
+		if (mesg[i].type != CWIID_MESG_BTN) {
+			continue;
+		}
+		if (mesg[i].btn_mesg.buttons != seq_buttons(received)) {
+			out_of_order++;
+		}
+		__atomic_add_fetch(&received, 1, __ATOMIC_RELEASE);
+	}
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int check_stream(void)
+{
+	cwiid_wiimote_t *wiimote;
+	pthread_t thread;
+	unsigned char buf[REPORT_LEN];
+	double t0, t1;
+	int i, wait, ret = 0;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, ctl) ||
+	  socketpair(AF_UNIX, SOCK_SEQPACKET, 0, intr)) {
+		perror("socketpair");
+		return -1;
+	}
+	if (pthread_create(&thread, NULL, responder, NULL)) {
+		return -1;
+	}
+	if ((wiimote = cwiid_new(ctl[0], intr[0], CWIID_FLAG_MESG_IFC |
+	                                          CWIID_FLAG_REPEAT_BTN)) == NULL) {
+		return -1;
+	}
+	if (cwiid_set_mesg_callback(wiimote, callback) ||
+	  cwiid_set_rpt_mode(wiimote, CWIID_RPT_BTN)) {
+		return -1;
+	}
+
+	t0 = now_ns();
+	for (i=0; i < STREAM_COUNT; i++) {
+		seq_report(buf, i);
+		if (write(intr[1], buf, REPORT_LEN) != REPORT_LEN) {
+			perror("write");
+			ret = -1;
+			break;
+		}
+	}
+	for (wait=0; (wait < 5000) &&
+	     (__atomic_load_n(&received, __ATOMIC_ACQUIRE) < STREAM_COUNT);
+	     wait++) {
+		usleep(1000);
+	}
+	t1 = now_ns();
+
+	printf("stream: %d of %d reports, %d out of order, %.1f ns per report\n",
+	       received, STREAM_COUNT, out_of_order, (t1 - t0) / STREAM_COUNT);
+	if ((received != STREAM_COUNT) || out_of_order) {
+		ret = -1;
+	}
+
+	cwiid_close(wiimote);
+	close(ctl[1]);
+	close(intr[1]);
+	pthread_join(thread, NULL);
+
+	return ret;
+}
+
+static void fill(int fd)
+{
+	unsigned char buf[REPORT_LEN];
+	int i;
+
+	for (i=0; i < BURST; i++) {
+		seq_report(buf, i);
+		if (write(fd, buf, REPORT_LEN) != REPORT_LEN) {
+			perror("write");
+		}
+	}
+}
+
+static int bench(void)
+{
+	int sock[2];
+	unsigned char buf[BURST][REPORT_LEN + 1];
+	struct iovec iov[BURST];
+	struct mmsghdr msg[BURST];
+	double t_read = 0, t_batch = 0, t0;
+	int round, i, ret = 0;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sock)) {
+		perror("socketpair");
+		return -1;
+	}
+	memset(msg, 0, sizeof msg);
+	for (i=0; i < BURST; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = sizeof buf[i];
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (round=0; round < BENCH_ROUNDS; round++) {
+		fill(sock[1]);
+		t0 = now_ns();
+		for (i=0; i < BURST; i++) {
+			if (read(sock[0], buf[i], sizeof buf[i]) != REPORT_LEN) {
+				ret = -1;
+			}
+		}
+		t_read += now_ns() - t0;
+
+		fill(sock[1]);
+		t0 = now_ns();
+		if (recvmmsg(sock[0], msg, BURST, MSG_WAITFORONE, NULL) != BURST) {
+			ret = -1;
+		}
+		t_batch += now_ns() - t0;
+	}
+
+	close(sock[0]);
+	close(sock[1]);
+
+	t_read /= (double)BENCH_ROUNDS * BURST;
+	t_batch /= (double)BENCH_ROUNDS * BURST;
+	printf("drain: read %.1f ns, recvmmsg %.1f ns per report\n", t_read,
+	       t_batch);
+	if (ret) {
+		printf("drain: short read\n");
+	}
+	else if (t_batch >= t_read) {
+		printf("drain: batching is no faster\n");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+	if (check_stream()) {
+		ret = 1;
+	}
+	if (bench()) {
+		ret = 1;
+	}
+
+	printf("recv: %s\n", ret ? "FAIL" : "ok");
+	return ret;
+}
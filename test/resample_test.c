@@ -0,0 +1,247 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Fixed rate subscribers (resample.c).  The resampler folds a period's
+ * samples into one message rather than interpolating between them, so
+ * each reduction must give the mean, minimum, maximum or last of what
+ * arrived in the period, rounded for integer fields, with buttons going
+ * through at once.  Fed at 1 kHz, a 100 Hz subscriber must get its
+ * arrays a period apart (by the median gap, as a stalled resampler skips
+ * periods rather than bursting to catch up), and rate 0 passes every
+ * array through again.  Bad rates and reductions are rejected. */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cwiid_internal.h"
+
+#define SLOW_RATE		10.0f		/* Hz, long enough to feed a period */
+#define RATE			100.0f
+#define FEED_US			1000
+#define RATE_SECONDS	1.0
+#define RATE_TOLERANCE	0.1
+#define MAX_ARRAYS		200
+
+static struct wiimote *wiimote;
+static int failed = 0;
+
+static void check(const char *what, int ok)
+{
+	printf("%s: %s\n", what, ok ? "ok" : "FAIL");
+	if (!ok) {
+		failed = 1;
+	}
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void feed_acc(uint16_t x)
+{
+	struct mesg_array ma;
+
+	memset(&ma, 0, sizeof ma);
+	ma.count = 2;
+	ma.array[0].acc_mesg.type = CWIID_MESG_ACC;
+	ma.array[0].acc_mesg.acc[0] = x;
+	ma.array[0].acc_mesg.acc[1] = 1000 - x;
+	ma.array[1].acc_cal_mesg.type = CWIID_MESG_ACC_CAL;
+	ma.array[1].acc_cal_mesg.acc[0] = x / 100.0f;
+	deliver_mesg_array(wiimote, &ma);
+}
+
+static void feed_btn(uint16_t buttons)
+{
+	struct mesg_array ma;
+
+	memset(&ma, 0, sizeof ma);
+	ma.count = 1;
+	ma.array[0].btn_mesg.type = CWIID_MESG_BTN;
+	ma.array[0].btn_mesg.buttons = buttons;
+	deliver_mesg_array(wiimote, &ma);
+}
+
+/* Polls for the next array, for up to a second */
+static int next_array(cwiid_sub_t *sub, int *count, union cwiid_mesg mesg[])
+{
+	int i;
+
+	for (i=0; i < 1000; i++) {
+		if (!cwiid_sub_get_mesg(sub, count, mesg, NULL)) {
+			return 0;
+		}
+		usleep(1000);
+	}
+
+	return -1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double d = *(const double *)a - *(const double *)b;
+
+	return (d > 0) - (d < 0);
+}
+
+static void drain(cwiid_sub_t *sub)
+{
+	union cwiid_mesg mesg[CWIID_MAX_MESG_COUNT];
+	int count;
+
+	while (!cwiid_sub_get_mesg(sub, &count, mesg, NULL));
+}
+
+/* Feeds x = 10, 20, 61 in one period right after an emission, with a button
+ * in between, and checks the array that ends the period */
+static void check_reduce(cwiid_sub_t *sub, const char *what,
+                         enum cwiid_reduce reduce, uint16_t x, uint16_t y,
+                         float cal)
+{
+	union cwiid_mesg mesg[CWIID_MAX_MESG_COUNT];
+	int count, ok;
+
+	check(what, !cwiid_sub_set_reduce(sub, CWIID_MESG_ACC, reduce) &&
+	      !cwiid_sub_set_reduce(sub, CWIID_MESG_ACC_CAL, reduce));
+
+	/* start at a period boundary */
+	drain(sub);
+	feed_acc(0);
+	if (next_array(sub, &count, mesg)) {
+		check("period boundary", 0);
+		return;
+	}
+
+	feed_acc(10);
+	feed_acc(20);
+	feed_btn(7);
+	feed_acc(61);
+
+	ok = !cwiid_sub_get_mesg(sub, &count, mesg, NULL) && (count == 1) &&
+	     (mesg[0].type == CWIID_MESG_BTN) && (mesg[0].btn_mesg.buttons == 7);
+	check("buttons go through at once", ok);
+
+	ok = !next_array(sub, &count, mesg) && (count == 2) &&
+	     (mesg[0].type == CWIID_MESG_ACC) &&
+	     (mesg[1].type == CWIID_MESG_ACC_CAL);
+	if (ok) {
+		printf("%s: acc %u %u, cal %.4f\n", what, mesg[0].acc_mesg.acc[0],
+		       mesg[0].acc_mesg.acc[1], mesg[1].acc_cal_mesg.acc[0]);
+		ok = (mesg[0].acc_mesg.acc[0] == x) && (mesg[0].acc_mesg.acc[1] == y) &&
+		     (fabsf(mesg[1].acc_cal_mesg.acc[0] - cal) < 1e-5f);
+	}
+	check("one reduced message for the period", ok);
+}
+
+static void check_rate(cwiid_sub_t *sub)
+{
+	union cwiid_mesg mesg[CWIID_MAX_MESG_COUNT];
+	struct timespec stamp;
+	double t, t0, elapsed, gap[MAX_ARRAYS], last = 0.0, median;
+	int count, arrays = 0, x;
+
+	check("set rate", !cwiid_sub_set_rate(sub, RATE) &&
+	      !cwiid_sub_set_reduce(sub, CWIID_MESG_ACC, CWIID_REDUCE_MEAN));
+	drain(sub);
+
+	t0 = now_s();
+	for (x=0; (elapsed = now_s() - t0) < RATE_SECONDS; x++) {
+		feed_acc(x % 1000);
+		while (!cwiid_sub_get_mesg(sub, &count, mesg, &stamp)) {
+			t = stamp.tv_sec + stamp.tv_nsec / 1e9;
+			if (last && (arrays < MAX_ARRAYS)) {
+				gap[arrays++] = t - last;
+			}
+			last = t;
+		}
+		usleep(FEED_US);
+	}
+
+	qsort(gap, arrays, sizeof gap[0], cmp_double);
+	median = arrays ? gap[arrays / 2] : 0.0;
+	printf("rate: %d gaps from %d samples in %.3f s, median %.2f ms\n",
+	       arrays, x, elapsed, median * 1e3);
+	check("arrays a period apart", (arrays >= elapsed * RATE / 2) &&
+	      (fabs(median * RATE - 1.0) <= RATE_TOLERANCE));
+
+	check("rate 0", !cwiid_sub_set_rate(sub, 0.0f));
+	drain(sub);
+	for (x=0; x < 5; x++) {
+		feed_acc(x);
+	}
+	for (count=0, x=0; !cwiid_sub_get_mesg(sub, &count, mesg, NULL); x++);
+	check("rate 0 passes every array", x == 5);
+}
+
+static void check_invalid(cwiid_sub_t *sub)
+{
+	check("negative rate", cwiid_sub_set_rate(sub, -1.0f) == -1);
+	check("rate too high",
+	      cwiid_sub_set_rate(sub, CWIID_SUB_MAX_RATE + 1.0f) == -1);
+	check("NaN rate", cwiid_sub_set_rate(sub, NAN) == -1);
+	check("buttons cannot be reduced",
+	      cwiid_sub_set_reduce(sub, CWIID_MESG_BTN, CWIID_REDUCE_LAST) == -1);
+	check("ir only takes last",
+	      cwiid_sub_set_reduce(sub, CWIID_MESG_IR, CWIID_REDUCE_MEAN) == -1 &&
+	      !cwiid_sub_set_reduce(sub, CWIID_MESG_IR, CWIID_REDUCE_LAST));
+	check("unknown reduction",
+	      cwiid_sub_set_reduce(sub, CWIID_MESG_ACC, 99) == -1);
+}
+
+int main(void)
+{
+	cwiid_sub_t *sub;
+
+	if ((wiimote = calloc(1, sizeof *wiimote)) == NULL) {
+		return 1;
+	}
+	pthread_mutex_init(&wiimote->sub_mutex, NULL);
+
+	if ((sub = cwiid_subscribe(wiimote, CWIID_MESG_BIT(CWIID_MESG_BTN) |
+	                                    CWIID_MESG_BIT(CWIID_MESG_ACC) |
+	                                    CWIID_MESG_BIT(CWIID_MESG_ACC_CAL),
+	                           CWIID_SUB_RING, 64, NULL)) == NULL) {
+		return 1;
+	}
+	check("set slow rate", !cwiid_sub_set_rate(sub, SLOW_RATE));
+
+	/* x is 10, 20, 61 and y 990, 980, 939: integers round, floats don't */
+	check_reduce(sub, "mean", CWIID_REDUCE_MEAN, 30, 970, 0.91f / 3.0f);
+	check_reduce(sub, "min", CWIID_REDUCE_MIN, 10, 939, 0.10f);
+	check_reduce(sub, "max", CWIID_REDUCE_MAX, 61, 990, 0.61f);
+	check_reduce(sub, "last", CWIID_REDUCE_LAST, 61, 939, 0.61f);
+
+	check_rate(sub);
+	check_invalid(sub);
+
+	close_resampler(wiimote);
+	cwiid_unsubscribe(sub);
+	pthread_mutex_destroy(&wiimote->sub_mutex);
+	free(wiimote);
+
+	printf("resample: %s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
@@ -0,0 +1,339 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Shared memory export (shm.c).  Readers back off with sched_yield while
+ * a record is being written, so the test supplies its own sched_yield:
+ * it counts the retries and can finish a write the test left half done.
+ * A reader must wait out an unfinished state or ring write and return
+ * the completed one, catch up when its slot was lapped, and give up on a
+ * writer that never finishes.  A timer signal then interrupts the reader
+ * with half done writes, so a reader that skips its recheck comes back
+ * torn even on one CPU, and a publisher thread and a reader race for
+ * real.  No read may come back torn.  The segment is created for
+ * its owner only. */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "cwiid_internal.h"
+
+#define STRESS_COUNT	200000
+#define TICK_COUNT		2000
+#define TICK_US			50
+
+static char name[64];
+static struct shm_segment *seg;		/* the test's own writable mapping */
+static int yields = 0;
+static void (*on_yield)(void) = NULL;
+static int failed = 0;
+
+/* Stands in for libc's for the library's readers */
+int sched_yield(void)
+{
+	yields++;
+	if (on_yield) {
+		on_yield();
+	}
+	else {
+		syscall(SYS_sched_yield);
+	}
+	return 0;
+}
+
+static void check(const char *what, int ok)
+{
+	printf("%s: %s\n", what, ok ? "ok" : "FAIL");
+	if (!ok) {
+		failed = 1;
+	}
+}
+
+/* Publishes one array holding a button message, as the router would.
+ * The state's first and last fields are set to match the buttons, so a
+ * torn copy shows. */
+static void publish(struct wiimote *wiimote, uint16_t buttons)
+{
+	static struct mesg_array ma;
+
+	memset(&ma, 0, sizeof ma);
+	ma.count = 1;
+	ma.array[0].btn_mesg.type = CWIID_MESG_BTN;
+	ma.array[0].btn_mesg.buttons = buttons;
+
+	pthread_mutex_lock(&wiimote->state_mutex);
+	wiimote->state.rpt_mode = buttons;
+	wiimote->state.buttons = buttons;
+	wiimote->state.error = buttons;
+	publish_shm(wiimote, &ma);
+	pthread_mutex_unlock(&wiimote->state_mutex);
+}
+
+static void finish_state_write(void)
+{
+	if (yields == 3) {
+		seg->state.buttons = 3;
+		seg->state.error = 3;
+		__atomic_store_n(&seg->state_seq, seg->state_seq + 1,
+		                 __ATOMIC_RELEASE);
+	}
+}
+
+static void check_state_retry(cwiid_shm_t *shm)
+{
+	struct cwiid_state state;
+	int ret;
+
+	/* a state write stopped after its first field */
+	__atomic_store_n(&seg->state_seq, seg->state_seq + 1, __ATOMIC_RELEASE);
+	seg->state.rpt_mode = 3;
+
+	yields = 0;
+	on_yield = finish_state_write;
+	ret = cwiid_shm_get_state(shm, &state, NULL);
+	on_yield = NULL;
+
+	printf("state: %d retries, rpt_mode %d buttons %d error %d\n", yields,
+	       state.rpt_mode, state.buttons, state.error);
+	check("state read waits for the write",
+	      !ret && (yields == 3) && (state.rpt_mode == 3) &&
+	      (state.buttons == 3) && (state.error == 3));
+}
+
+/* The writer laps the ring and is overwriting serial 1's slot with 65 */
+static void finish_slot_write(void)
+{
+	struct shm_slot *slot = &seg->slot[1 % SHM_RING_LEN];
+
+	if (yields == 2) {
+		slot->serial = 1 + SHM_RING_LEN;
+		__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&seg->head, 1 + SHM_RING_LEN, __ATOMIC_RELEASE);
+	}
+}
+
+static void check_slot_retry(cwiid_shm_t *shm)
+{
+	struct shm_slot *slot = &seg->slot[1 % SHM_RING_LEN];
+	union cwiid_mesg mesg[CWIID_MAX_MESG_COUNT];
+	unsigned int serial = 0;
+	int count, ret;
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+
+	yields = 0;
+	on_yield = finish_slot_write;
+	ret = cwiid_shm_get_mesg(shm, &serial, &count, mesg, NULL, 0);
+	on_yield = NULL;
+
+	/* serial 1 is gone, so the oldest left is 2 */
+	printf("ring: %d retries, serial %u buttons %u\n", yields, serial,
+	       mesg[0].btn_mesg.buttons);
+	check("ring read waits for the write and catches up",
+	      !ret && (yields == 2) && (serial == 2) && (count == 1) &&
+	      (mesg[0].btn_mesg.buttons == 2));
+}
+
+static void check_stuck_writer(cwiid_shm_t *shm)
+{
+	struct cwiid_state state;
+	int ret;
+
+	/* the publisher died mid-write */
+	__atomic_store_n(&seg->state_seq, seg->state_seq + 1, __ATOMIC_RELEASE);
+
+	yields = 0;
+	on_yield = NULL;
+	ret = cwiid_shm_get_state(shm, &state, NULL);
+	__atomic_store_n(&seg->state_seq, seg->state_seq + 1, __ATOMIC_RELEASE);
+
+	printf("stuck: gave up after %d retries\n", yields);
+	check("state read gives up on a stuck writer", (ret == -1) && yields);
+}
+
+static volatile sig_atomic_t ticks;
+
+/* Alternately starts a state write with the first field and finishes it
+ * with the last two */
+static void tick(int sig)
+{
+	static uint16_t value = 0;
+
+	(void)sig;
+	if (!(seg->state_seq & 1)) {
+		__atomic_store_n(&seg->state_seq, seg->state_seq + 1,
+		                 __ATOMIC_RELEASE);
+		seg->state.rpt_mode = ++value;
+	}
+	else {
+		seg->state.buttons = value;
+		seg->state.error = value;
+		__atomic_store_n(&seg->state_seq, seg->state_seq + 1,
+		                 __ATOMIC_RELEASE);
+	}
+	ticks++;
+}
+
+static void check_interrupted(cwiid_shm_t *shm)
+{
+	struct sigaction act;
+	struct itimerval timer = {{0, TICK_US}, {0, TICK_US}};
+	struct itimerval stop = {{0, 0}, {0, 0}};
+	struct cwiid_state state;
+	int reads = 0, busy = 0, torn = 0;
+
+	memset(&act, 0, sizeof act);
+	act.sa_handler = tick;
+	sigaction(SIGALRM, &act, NULL);
+	seg->state.rpt_mode = seg->state.buttons = seg->state.error = 0;
+
+	ticks = 0;
+	setitimer(ITIMER_REAL, &timer, NULL);
+	while (ticks < TICK_COUNT) {
+		if (cwiid_shm_get_state(shm, &state, NULL)) {
+			busy++;
+			continue;
+		}
+		if ((state.rpt_mode != state.buttons) ||
+		  (state.error != state.buttons)) {
+			torn++;
+		}
+		reads++;
+	}
+	setitimer(ITIMER_REAL, &stop, NULL);
+	signal(SIGALRM, SIG_DFL);
+
+	/* leave the last write finished */
+	if (seg->state_seq & 1) {
+		tick(SIGALRM);
+	}
+
+	printf("interrupted: %d reads, %d busy, %d torn\n", reads, busy, torn);
+	check("interrupted reads are never torn", !torn && reads);
+}
+
+static void *publisher(void *arg)
+{
+	struct wiimote *wiimote = arg;
+	int i;
+
+	for (i=1; i <= STRESS_COUNT; i++) {
+		publish(wiimote, i);
+	}
+
+	return NULL;
+}
+
+static void check_stress(struct wiimote *wiimote, cwiid_shm_t *shm)
+{
+	union cwiid_mesg mesg[CWIID_MAX_MESG_COUNT];
+	struct cwiid_state state;
+	pthread_t thread;
+	unsigned int serial = 1 + SHM_RING_LEN, state_serial;
+	int count, reads = 0, torn = 0, done = 0;
+
+	if (pthread_create(&thread, NULL, publisher, wiimote)) {
+		check("stress start", 0);
+		return;
+	}
+
+	while (!done) {
+		if (!cwiid_shm_get_state(shm, &state, &state_serial)) {
+			if ((state.rpt_mode != state.buttons) ||
+			  (state.error != state.buttons)) {
+				torn++;
+			}
+			reads++;
+		}
+		switch (cwiid_shm_get_mesg(shm, &serial, &count, mesg, NULL, 10)) {
+		case 0:
+			/* buttons were published with the serial's low bits */
+			if ((count != 1) ||
+			  (mesg[0].btn_mesg.buttons !=
+			   (uint16_t)(serial - (1 + SHM_RING_LEN)))) {
+				torn++;
+			}
+			reads++;
+			break;
+		case 1:
+			done = 1;
+			break;
+		default:
+			torn++;
+			done = 1;
+			break;
+		}
+	}
+	pthread_join(thread, NULL);
+
+	printf("stress: %d reads, %d torn\n", reads, torn);
+	check("concurrent reads are never torn", !torn && reads);
+}
+
+int main(void)
+{
+	struct wiimote *wiimote;
+	cwiid_shm_t *shm;
+	struct stat st;
+	int fd;
+
+	if ((wiimote = calloc(1, sizeof *wiimote)) == NULL) {
+		return 1;
+	}
+	pthread_mutex_init(&wiimote->state_mutex, NULL);
+	snprintf(name, sizeof name, "/cwiid-shm-test-%d", getpid());
+
+	if (cwiid_export_shm(wiimote, name)) {
+		return 1;
+	}
+	if ((fd = shm_open(name, O_RDWR, 0)) == -1) {
+		return 1;
+	}
+	check("segment is owner only", !fstat(fd, &st) &&
+	      ((st.st_mode & 0777) == (S_IRUSR | S_IWUSR)));
+	seg = mmap(NULL, sizeof *seg, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if ((seg == MAP_FAILED) || ((shm = cwiid_attach_shm(name)) == NULL)) {
+		return 1;
+	}
+
+	publish(wiimote, 1);
+	publish(wiimote, 2);
+	check_state_retry(shm);
+	check_slot_retry(shm);
+	check_stuck_writer(shm);
+	check_interrupted(shm);
+
+	/* publishing carries on from the lapped serial */
+	check_stress(wiimote, shm);
+
+	cwiid_detach_shm(shm);
+	munmap(seg, sizeof *seg);
+	cwiid_unexport_shm(wiimote);
+	free(wiimote);
+
+	printf("shm: %s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
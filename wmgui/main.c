@@ -927,8 +927,9 @@ void btnRead_clicked(void)
 	}
 
 	len = strtol(gtk_entry_get_text(GTK_ENTRY(txtReadLen)), &cursor, 16);
-	if (*cursor != '\0') {
+	if ((*cursor != '\0') || (len > CWIID_MAX_READ_LEN)) {
 		message(GTK_MESSAGE_ERROR, "Invalid read len", GTK_WINDOW(winRW));
+		return;
 	}
 	if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(radReadReg))) {
 		flags = CWIID_RW_REG;
@@ -937,8 +938,8 @@ void btnRead_clicked(void)
 		flags = CWIID_RW_EEPROM;
 	}
 
-	/* Make the call */
-	if (cwiid_read(wiimote, flags, offset, len, buf)) {
+	/* Make the call (retries dropped packets) */
+	if (cwiid_dump(wiimote, flags, offset, len, buf, NULL, NULL, NULL)) {
 		message(GTK_MESSAGE_ERROR, "Wiimote read error", GTK_WINDOW(winRW));
 	}
 	else {
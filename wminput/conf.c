@@ -96,7 +96,7 @@ int conf_ff(struct conf *conf, unsigned char enabled)
 {
 	if (enabled) {
 		conf->ff = 1;
-		conf->dev.ff_effects_max = 1;
+		conf->dev.ff_effects_max = CONF_FF_EFFECTS;
 	}
 	else {
 		conf->ff = 0;
@@ -388,6 +388,7 @@ void conf_init(struct conf *conf)
 	int i, j;
 
 	conf->fd = -1;
+	conf->event_count = 0;
 	conf->config_search_dirs = NULL;
 	conf->plugin_search_dirs = NULL;
 	conf->current_config_filename = NULL;
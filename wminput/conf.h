@@ -88,6 +88,12 @@
 
 #define CONF_MAX_PLUGINS	6
 
+#define CONF_FF_EFFECTS		16
+
+/* Events queued for one uinput write, flushed on SYN_REPORT (or early,
+ * if a report with many plugins fills it) */
+#define CONF_EVENT_BUF		64
+
 #define CONF_ABS	EV_ABS
 #define CONF_REL	EV_REL
 
@@ -148,6 +154,8 @@ struct plugin {
 
 struct conf {
 	int fd;
+	struct input_event events[CONF_EVENT_BUF];
+	int event_count;
 	char **config_search_dirs;
 	char **plugin_search_dirs;
 	char *current_config_filename;
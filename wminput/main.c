@@ -52,11 +52,17 @@ void process_btn_mesg(struct cwiid_btn_mesg *mesg);
 void process_nunchuk_mesg(struct cwiid_nunchuk_mesg *mesg);
 void process_classic_mesg(struct cwiid_classic_mesg *mesg);
 void process_plugin(struct plugin *, int, union cwiid_mesg [], struct timespec *timestamp);
+void release_mappings(void);
 
 /* Globals */
 cwiid_wiimote_t *wiimote;
 char init;
 
+/* Buttons held as of the last message, per source */
+static uint16_t wiimote_prev_buttons = 0;
+static uint8_t nunchuk_prev_buttons = 0;
+static uint16_t classic_prev_buttons = 0;
+
 #define DEFAULT_CONFIG_FILE	"default"
 
 #define HOME_DIR_LEN	128
@@ -97,6 +103,8 @@ int main(int argc, char *argv[])
 	int c, i;
 	char *str_addr;
 	bdaddr_t bdaddr, current_bdaddr;
+	cwiid_inquiry_t *inquiry = NULL;
+	int open_flags = CWIID_FLAG_MESG_IFC;
 	sigset_t sigset;
 	int signum, ret=0;
 	struct uinput_listen_data uinput_listen_data;
@@ -231,6 +239,14 @@ int main(int argc, char *argv[])
 	sigaddset(&sigset, SIGINT);
 	sigaddset(&sigset, SIGUSR1);
 
+	/* Let libcwiid ride out short disconnects, so plugins and uinput
+	 * devices survive them; held controls are released meanwhile (see
+	 * release_mappings).  The teardown loop below still runs when the
+	 * library gives up, which it does when the address is unknown. */
+	if (reconnect) {
+		open_flags |= CWIID_FLAG_RECONNECT;
+	}
+
 	do {
 		bacpy(&current_bdaddr, &bdaddr);
 
@@ -240,19 +256,36 @@ int main(int argc, char *argv[])
 		}
 		if (wait_forever) {
 			if (!bacmp(&current_bdaddr, BDADDR_ANY)) {
+				/* Inquire in the background while searching, so
+				 * cwiid_find_wiimote picks up a wiimote as soon as an
+				 * inquiry round sees it; inquiry slows the link down,
+				 * so it stops once connected */
+				if (reconnect &&
+				  ((inquiry = cwiid_inquiry_start(-1, 2, 0)) == NULL)) {
+					wminput_err("unable to start inquiry service");
+				}
 				if (cwiid_find_wiimote(&current_bdaddr, -1)) {
 					wminput_err("error finding wiimote");
+					if (inquiry) {
+						cwiid_inquiry_stop(inquiry);
+					}
 					conf_unload(&conf);
 					return -1;
 				}
 			}
 			/* TODO: avoid continuously calling cwiid_open */
 			cwiid_set_err(cwiid_err_connect);
-			while (!(wiimote = cwiid_open(&current_bdaddr, CWIID_FLAG_MESG_IFC)));
+			while (!(wiimote = cwiid_open(&current_bdaddr, open_flags)));
 			cwiid_set_err(cwiid_err_default);
+			if (inquiry) {
+				if (cwiid_inquiry_stop(inquiry)) {
+					wminput_err("error stopping inquiry service");
+				}
+				inquiry = NULL;
+			}
 		}
 		else {
-			if ((wiimote = cwiid_open(&current_bdaddr, CWIID_FLAG_MESG_IFC)) == NULL) {
+			if ((wiimote = cwiid_open(&current_bdaddr, open_flags)) == NULL) {
 				wminput_err("unable to connect");
 				conf_unload(&conf);
 				return -1;
@@ -421,7 +454,15 @@ void cwiid_callback(cwiid_wiimote_t *wiimote, int mesg_count,
 		case CWIID_MESG_CLASSIC:
 			process_classic_mesg((struct cwiid_classic_mesg *) &mesg[i]);
 			break;
+		case CWIID_MESG_LINK:
+			/* libcwiid is reconnecting; nothing may stay held meanwhile */
+			if (mesg[i].link_mesg.status == CWIID_LINK_DISCONNECTED) {
+				release_mappings();
+			}
+			break;
 		case CWIID_MESG_ERROR:
+			/* Still reached with -r: the library only reconnects to a
+			 * known address, and gives up with an error otherwise */
 			if (kill(getpid(),SIGUSR1)) {
 				wminput_err("Error sending SIGUSR1");
 			}
@@ -438,14 +479,13 @@ void cwiid_callback(cwiid_wiimote_t *wiimote, int mesg_count,
 
 void process_btn_mesg(struct cwiid_btn_mesg *mesg)
 {
-	static uint16_t prev_buttons = 0;
 	uint16_t pressed, released;
 	__s32 axis_value;
 	int i;
 
 	/* Wiimote Button/Key Events */
-	pressed = mesg->buttons & ~prev_buttons;
-	released = ~mesg->buttons & prev_buttons;
+	pressed = mesg->buttons & ~wiimote_prev_buttons;
+	released = ~mesg->buttons & wiimote_prev_buttons;
 	for (i=0; i < CONF_WM_BTN_COUNT; i++) {
 		if (conf.wiimote_bmap[i].active) {
 			if (pressed & conf.wiimote_bmap[i].mask) {
@@ -456,7 +496,7 @@ void process_btn_mesg(struct cwiid_btn_mesg *mesg)
 			}
 		}
 	}
-	prev_buttons = mesg->buttons;
+	wiimote_prev_buttons = mesg->buttons;
 
 	/* Wiimote.Dpad.X */
 	if (conf.amap[CONF_WM_AXIS_DPAD_X].active) {
@@ -493,14 +533,13 @@ void process_btn_mesg(struct cwiid_btn_mesg *mesg)
 
 void process_nunchuk_mesg(struct cwiid_nunchuk_mesg *mesg)
 {
-	static uint8_t prev_buttons = 0;
 	uint8_t pressed, released;
 	__s32 axis_value;
 	int i;
 
 	/* Nunchuk Button/Key Events */
-	pressed = mesg->buttons & ~prev_buttons;
-	released = ~mesg->buttons & prev_buttons;
+	pressed = mesg->buttons & ~nunchuk_prev_buttons;
+	released = ~mesg->buttons & nunchuk_prev_buttons;
 	for (i=0; i < CONF_NC_BTN_COUNT; i++) {
 		if (conf.nunchuk_bmap[i].active) {
 			if (pressed & conf.nunchuk_bmap[i].mask) {
@@ -511,7 +550,7 @@ void process_nunchuk_mesg(struct cwiid_nunchuk_mesg *mesg)
 			}
 		}
 	}
-	prev_buttons = mesg->buttons;
+	nunchuk_prev_buttons = mesg->buttons;
 
 	/* Nunchuk.Stick.X */
 	if (conf.amap[CONF_NC_AXIS_STICK_X].active) {
@@ -536,14 +575,13 @@ void process_nunchuk_mesg(struct cwiid_nunchuk_mesg *mesg)
 
 void process_classic_mesg(struct cwiid_classic_mesg *mesg)
 {
-	static uint16_t prev_buttons = 0;
 	uint16_t pressed, released;
 	__s32 axis_value;
 	int i;
 
 	/* Classic Button/Key Events */
-	pressed = mesg->buttons & ~prev_buttons;
-	released = ~mesg->buttons & prev_buttons;
+	pressed = mesg->buttons & ~classic_prev_buttons;
+	released = ~mesg->buttons & classic_prev_buttons;
 	for (i=0; i < CONF_CC_BTN_COUNT; i++) {
 		if (conf.classic_bmap[i].active) {
 			if (pressed & conf.classic_bmap[i].mask) {
@@ -554,7 +592,7 @@ void process_classic_mesg(struct cwiid_classic_mesg *mesg)
 			}
 		}
 	}
-	prev_buttons = mesg->buttons;
+	classic_prev_buttons = mesg->buttons;
 
 	/* Classic.Dpad.X */
 	if (conf.amap[CONF_CC_AXIS_DPAD_X].active) {
@@ -668,20 +706,32 @@ void process_plugin(struct plugin *plugin, int mesg_count,
 			flag = CWIID_RPT_BTN;
 			break;
 		case CWIID_MESG_ACC:
+		case CWIID_MESG_ACC_CAL:
 			flag = CWIID_RPT_ACC;
 			break;
 		case CWIID_MESG_IR:
+		case CWIID_MESG_CURSOR:
 			flag = CWIID_RPT_IR;
 			break;
 		case CWIID_MESG_NUNCHUK:
+		case CWIID_MESG_NUNCHUK_CAL:
 			flag = CWIID_RPT_NUNCHUK;
 			break;
 		case CWIID_MESG_CLASSIC:
 			flag = CWIID_RPT_CLASSIC;
 			break;
+		case CWIID_MESG_BALANCE_CAL:
+			flag = CWIID_RPT_BALANCE;
+			break;
 		case CWIID_MESG_MOTIONPLUS:
+		case CWIID_MESG_MOTIONPLUS_CAL:
 			flag = CWIID_RPT_MOTIONPLUS;
+			break;
+		case CWIID_MESG_ORIENTATION:
+			flag = CWIID_RPT_ACC | CWIID_RPT_MOTIONPLUS;
+			break;
 		default:
+			flag = 0;
 			break;
 		}
 		if (plugin->rpt_mode_flags & flag) {
@@ -736,3 +786,73 @@ void process_plugin(struct plugin *plugin, int mesg_count,
 		}
 	}
 }
+
+/* Let go of every held key and recenter every absolute axis, as if the
+ * controls had been released the moment the link dropped.  Pointer axes
+ * keep their position, and relative axes have nothing to undo. */
+void release_mappings(void)
+{
+	struct plugin *plugin;
+	__s32 axis_value;
+	int i, j;
+
+	for (i=0; i < CONF_WM_BTN_COUNT; i++) {
+		if (conf.wiimote_bmap[i].active &&
+		  (wiimote_prev_buttons & conf.wiimote_bmap[i].mask)) {
+			send_event(&conf, EV_KEY, conf.wiimote_bmap[i].action, 0);
+		}
+	}
+	wiimote_prev_buttons = 0;
+	for (i=0; i < CONF_NC_BTN_COUNT; i++) {
+		if (conf.nunchuk_bmap[i].active &&
+		  (nunchuk_prev_buttons & conf.nunchuk_bmap[i].mask)) {
+			send_event(&conf, EV_KEY, conf.nunchuk_bmap[i].action, 0);
+		}
+	}
+	nunchuk_prev_buttons = 0;
+	for (i=0; i < CONF_CC_BTN_COUNT; i++) {
+		if (conf.classic_bmap[i].active &&
+		  (classic_prev_buttons & conf.classic_bmap[i].mask)) {
+			send_event(&conf, EV_KEY, conf.classic_bmap[i].action, 0);
+		}
+	}
+	classic_prev_buttons = 0;
+
+	for (i=0; i < CONF_AXIS_COUNT; i++) {
+		if (!conf.amap[i].active || (conf.amap[i].axis_type != EV_ABS) ||
+		  (conf.amap[i].flags & CONF_POINTER)) {
+			continue;
+		}
+		/* the analog triggers rest at one end, everything else centered */
+		if ((i == CONF_CC_AXIS_L) || (i == CONF_CC_AXIS_R)) {
+			axis_value = 0;
+			if (conf.amap[i].flags & CONF_INVERT) {
+				axis_value = CWIID_CLASSIC_LR_MAX;
+			}
+		}
+		else {
+			axis_value = (conf.dev.absmin[conf.amap[i].action] +
+			              conf.dev.absmax[conf.amap[i].action]) / 2;
+		}
+		send_event(&conf, EV_ABS, conf.amap[i].action, axis_value);
+	}
+
+	for (i=0; (i < CONF_MAX_PLUGINS) && conf.plugins[i].name; i++) {
+		plugin = &conf.plugins[i];
+		for (j=0; j < plugin->info->button_count; j++) {
+			if (plugin->bmap[j].active && (plugin->prev_buttons & 1<<j)) {
+				send_event(&conf, EV_KEY, plugin->bmap[j].action, 0);
+			}
+		}
+		plugin->prev_buttons = 0;
+		for (j=0; j < plugin->info->axis_count; j++) {
+			if (plugin->amap[j].active &&
+			  (plugin->amap[j].axis_type == EV_ABS) &&
+			  !(plugin->amap[j].flags & CONF_POINTER)) {
+				send_event(&conf, EV_ABS, plugin->amap[j].action,
+				           (plugin->info->axis_info[j].min +
+				            plugin->info->axis_info[j].max) / 2);
+			}
+		}
+	}
+}
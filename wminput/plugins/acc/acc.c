@@ -26,14 +26,12 @@ static unsigned char info_init = 0;
 static struct wmplugin_info info;
 static struct wmplugin_data data;
 
-static struct acc_cal acc_cal;
-
 static int plugin_id;
 
 wmplugin_info_t wmplugin_info;
 wmplugin_init_t wmplugin_init;
 wmplugin_exec_t wmplugin_exec;
-static void process_acc(struct cwiid_acc_mesg *mesg);
+static void process_acc(struct cwiid_acc_cal_mesg *mesg);
 
 static float Roll_Scale = 1.0;
 static float Pitch_Scale = 1.0;
@@ -97,7 +95,7 @@ int wmplugin_init(int id, cwiid_wiimote_t *wiimote)
 		return -1;
 	}
 
-	if (cwiid_get_acc_cal(wiimote, CWIID_EXT_NONE, &acc_cal)) {
+	if (cwiid_enable(wiimote, CWIID_FLAG_CALIBRATED)) {
 		wmplugin_err(id, "calibration error");
 		return -1;
 	}
@@ -113,8 +111,8 @@ struct wmplugin_data *wmplugin_exec(int mesg_count, union cwiid_mesg mesg[], str
 
 	for (i=0; i < mesg_count; i++) {
 		switch (mesg[i].type) {
-		case CWIID_MESG_ACC:
-			process_acc(&mesg[i].acc_mesg);
+		case CWIID_MESG_ACC_CAL:
+			process_acc(&mesg[i].acc_cal_mesg);
 			ret = &data;
 			break;
 		default:
@@ -129,20 +127,14 @@ struct wmplugin_data *wmplugin_exec(int mesg_count, union cwiid_mesg mesg[], str
 #define OLD_AMOUNT (1.0-NEW_AMOUNT)
 double a_x = 0, a_y = 0, a_z = 0;
 
-static void process_acc(struct cwiid_acc_mesg *mesg)
+static void process_acc(struct cwiid_acc_cal_mesg *mesg)
 {
 	double a;
 	double roll, pitch;
 
-	a_x = (((double)mesg->acc[CWIID_X] - acc_cal.zero[CWIID_X]) /
-	      (acc_cal.one[CWIID_X] - acc_cal.zero[CWIID_X]))*NEW_AMOUNT +
-	      a_x*OLD_AMOUNT;
-	a_y = (((double)mesg->acc[CWIID_Y] - acc_cal.zero[CWIID_Y]) /
-	      (acc_cal.one[CWIID_Y] - acc_cal.zero[CWIID_Y]))*NEW_AMOUNT +
-	      a_y*OLD_AMOUNT;
-	a_z = (((double)mesg->acc[CWIID_Z] - acc_cal.zero[CWIID_Z]) /
-	      (acc_cal.one[CWIID_Z] - acc_cal.zero[CWIID_Z]))*NEW_AMOUNT +
-	      a_z*OLD_AMOUNT;
+	a_x = mesg->acc[CWIID_X]*NEW_AMOUNT + a_x*OLD_AMOUNT;
+	a_y = mesg->acc[CWIID_Y]*NEW_AMOUNT + a_y*OLD_AMOUNT;
+	a_z = mesg->acc[CWIID_Z]*NEW_AMOUNT + a_z*OLD_AMOUNT;
 
 	a = sqrt(pow(a_x,2)+pow(a_y,2)+pow(a_z,2));
 	roll = atan(a_x/a_z);
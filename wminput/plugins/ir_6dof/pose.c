@@ -0,0 +1,135 @@
+/* Copyright (C) 2007 L. Donnie Smith <donnie.smith@gatech.edu>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <math.h>
+#include "pose.h"
+
+static double dot(const double *a, const double *b)
+{
+	return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+static int normalize(double *v)
+{
+	double len = sqrt(dot(v, v));
+
+	if (len == 0.0) {
+		return -1;
+	}
+	v[0] /= len;
+	v[1] /= len;
+	v[2] /= len;
+
+	return 0;
+}
+
+/* Below this height (radians off the horizon) the LEDs' height ratio is
+ * too noisy to range each LED, so lean toward assuming equal ranges */
+#define MIN_ELEVATION	0.1
+
+int solve_pose(const struct pose_geometry *geometry, const double left[2],
+               const double right[2], const double up[3], struct pose *pose)
+{
+	double r1[3], r2[3], x_l[3], y_l[3], z_l[3], l1[3], l2[3], b[3], c[3];
+	double ratio, weight, range, heading, len;
+	int i;
+
+	/* Rays through the two LED images */
+	r1[0] = left[0] - geometry->center[0];
+	r1[1] = left[1] - geometry->center[1];
+	r1[2] = -geometry->focal_length;
+	r2[0] = right[0] - geometry->center[0];
+	r2[1] = right[1] - geometry->center[1];
+	r2[2] = -geometry->focal_length;
+	normalize(r1);
+	normalize(r2);
+
+	/* Level frame: y along up, z the camera z (backward) made horizontal */
+	if (up) {
+		y_l[0] = up[0];
+		y_l[1] = up[1];
+		y_l[2] = up[2];
+	}
+	else {
+		/* bar is level, so its image slope is the roll */
+		len = hypot(r2[0] - r1[0], r2[1] - r1[1]);
+		if (len == 0.0) {
+			return -1;
+		}
+		y_l[0] = -(r2[1] - r1[1]) / len;
+		y_l[1] = (r2[0] - r1[0]) / len;
+		y_l[2] = 0.0;
+	}
+	if (normalize(y_l)) {
+		return -1;
+	}
+	z_l[0] = -y_l[2]*y_l[0];
+	z_l[1] = -y_l[2]*y_l[1];
+	z_l[2] = 1.0 - y_l[2]*y_l[2];
+	if (normalize(z_l)) {
+		return -1;
+	}
+	x_l[0] = y_l[1]*z_l[2] - y_l[2]*z_l[1];
+	x_l[1] = y_l[2]*z_l[0] - y_l[0]*z_l[2];
+	x_l[2] = y_l[0]*z_l[1] - y_l[1]*z_l[0];
+
+	l1[0] = dot(r1, x_l);
+	l1[1] = dot(r1, y_l);
+	l1[2] = dot(r1, z_l);
+	l2[0] = dot(r2, x_l);
+	l2[1] = dot(r2, y_l);
+	l2[2] = dot(r2, z_l);
+
+	/* The bar is level, so both LEDs sit at the same height:
+	 * range2 / range1 = l1.y / l2.y.  Near the horizon that is noise,
+	 * and equal ranges (remote on the bar's centre line) is used. */
+	weight = fabs(l1[1]) < fabs(l2[1]) ? fabs(l1[1]) : fabs(l2[1]);
+	weight = (weight < MIN_ELEVATION) ? weight / MIN_ELEVATION : 1.0;
+	ratio = (weight > 0.0) ? l1[1] / l2[1] : 1.0;
+	if (ratio <= 0.0) {
+		weight = 0.0;
+	}
+	ratio = weight * ratio + (1.0 - weight);
+
+	for (i=0; i < 3; i++) {
+		b[i] = ratio * l2[i] - l1[i];
+	}
+	len = sqrt(dot(b, b));
+	if (len == 0.0) {
+		return -1;
+	}
+	range = geometry->bar_width / len;
+	for (i=0; i < 3; i++) {
+		b[i] *= range;
+		c[i] = range * (l1[i] + ratio * l2[i]) / 2;
+	}
+
+	/* Heading from the bar direction in the horizontal plane.  Bar frame
+	 * axes in the level frame: x = (cos h, 0, -sin h), y = (0, 1, 0),
+	 * z = (sin h, 0, cos h); the wiimote is at -c. */
+	heading = atan2(-b[2], b[0]);
+	pose->pos[0] = -c[0]*cos(heading) + c[2]*sin(heading);
+	pose->pos[1] = -c[1];
+	pose->pos[2] = -c[0]*sin(heading) - c[2]*cos(heading);
+
+	pose->yaw = heading;
+	pose->pitch = asin(-y_l[2]);
+	pose->roll = atan2(-y_l[0], y_l[1]);
+
+	return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef POSE_H
+#define POSE_H
+
+/*
+ * Closed-form pose of the wiimote relative to the sensor bar, from the two
+ * bar images and (optionally) the gravity direction.
+ *
+ * Camera frame: x right, y up, z back toward the user (the camera looks
+ * down -z).  IR positions are in camera pixels.
+ *
+ * Bar frame: x along the bar (left to right LED), y up, z out of the bar
+ * toward the wiimote.  Positions come out in the units of bar_width.
+ *
+ * Assumes the wiimote is about equally far from both LEDs, which holds
+ * well anywhere in front of the bar.
+ */
+
+struct pose_geometry {
+	double bar_width;		/* LED cluster spacing */
+	double focal_length;	/* pixels */
+	double center[2];		/* principal point, pixels */
+};
+
+struct pose {
+	double pos[3];			/* wiimote position, bar frame */
+	double yaw;				/* heading, positive to the right */
+	double pitch;			/* positive pointing up */
+	double roll;			/* positive rolled clockwise, seen from behind */
+};
+
+/*
+ * up: gravity reaction (accelerometer reading) in the camera frame, need
+ * not be normalized.  NULL assumes the bar is level and the wiimote
+ * unpitched, taking roll from the bar image.
+ * Returns -1 if the bar is degenerate (points coincide).
+ */
+int solve_pose(const struct pose_geometry *geometry, const double left[2],
+               const double right[2], const double up[3], struct pose *pose);
+
+#endif // POSE_H
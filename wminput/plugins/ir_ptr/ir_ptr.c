@@ -18,9 +18,6 @@
 
 #include "wmplugin.h"
 
-#define DEBOUNCE_THRESHOLD	50
-#define NEW_AMOUNT	0.3
-#define OLD_AMOUNT	(1.0 - NEW_AMOUNT)
 #define X_EDGE	50
 #define Y_EDGE	50
 
@@ -67,108 +64,84 @@ int wmplugin_init(int id, cwiid_wiimote_t *arg_wiimote)
 		return -1;
 	}
 
+	/* source tracking and smoothing are done by libcwiid */
+	if (cwiid_enable(wiimote, CWIID_FLAG_IR_TRACK)) {
+		return -1;
+	}
+
 	return 0;
 }
 
+/* Without a sensor bar, follow one tracked source, keeping to the same one
+ * for as long as it stays in view */
+static struct cwiid_ir_track *single_track(struct cwiid_cursor_mesg *mesg)
+{
+	static uint8_t track_id = 0;
+	int i;
+
+	for (i=0; i < CWIID_IR_SRC_COUNT; i++) {
+		if (track_id && (mesg->track[i].id == track_id)) {
+			return &mesg->track[i];
+		}
+	}
+	for (i=0; i < CWIID_IR_SRC_COUNT; i++) {
+		if (mesg->track[i].id) {
+			track_id = mesg->track[i].id;
+			return &mesg->track[i];
+		}
+	}
+
+	track_id = 0;
+	return NULL;
+}
+
 struct wmplugin_data *wmplugin_exec(int mesg_count, union cwiid_mesg mesg[], struct timespec *timestamp)
 {
    (void) timestamp;
-	static int src_index = -1;
-	static int debounce = 0;
-	//static uint8_t old_flag;
-
 	int i;
-	//uint8_t flag;
-	struct cwiid_ir_mesg *ir_mesg;
+	struct cwiid_cursor_mesg *cursor_mesg;
+	struct cwiid_ir_track *track;
+	float pos[2];
 
-	ir_mesg = NULL;
+	cursor_mesg = NULL;
 	for (i=0; i < mesg_count; i++) {
-		if (mesg[i].type == CWIID_MESG_IR) {
-			ir_mesg = &mesg[i].ir_mesg;
+		if (mesg[i].type == CWIID_MESG_CURSOR) {
+			cursor_mesg = &mesg[i].cursor_mesg;
 		}
 	}
 
-	if (!ir_mesg) {
+	if (!cursor_mesg) {
 		return NULL;
 	}
 
-	/* invalidate src index if source is no longer present */
-	if ((src_index != -1) && !ir_mesg->src[src_index].valid) {
-		if (debounce > DEBOUNCE_THRESHOLD) {
-			src_index = -1;
-		}
-		else {
-			debounce++;
-		}
+	if (cursor_mesg->valid) {
+		pos[CWIID_X] = cursor_mesg->pos[CWIID_X];
+		pos[CWIID_Y] = cursor_mesg->pos[CWIID_Y];
+	}
+	else if ((track = single_track(cursor_mesg)) != NULL) {
+		pos[CWIID_X] = track->pos[CWIID_X];
+		pos[CWIID_Y] = track->pos[CWIID_Y];
 	}
 	else {
-		debounce = 0;
+		data.axes[0].valid = data.axes[1].valid = 0;
+		return &data;
 	}
 
-	/* of not set, pick largest available source */
-	if (src_index == -1) {
-		for (i=0; i < CWIID_IR_SRC_COUNT; i++) {
-			if (ir_mesg->src[i].valid) {
-				if ((src_index == -1) ||
-				  (ir_mesg->src[i].size > ir_mesg->src[src_index].size)) {
-					src_index = i;
-				}
-			}
-		}
-	}
+	data.axes[0].valid = data.axes[1].valid = 1;
+	data.axes[0].value = CWIID_IR_X_MAX - pos[CWIID_X];
+	data.axes[1].value = pos[CWIID_Y];
 
-	/* LEDs */
-	/* Commented out so it doesn't overide led plugin.
-	 * It shouldn't matter, since only one IR source
-	 * is used now anyways. If the pointer is moving,
-	 * it sees a source.
-	switch (src_index) {
-	case 0:
-		flag = CWIID_LED1_ON;
-		break;
-	case 1:
-		flag = CWIID_LED2_ON;
-		break;
-	case 2:
-		flag = CWIID_LED3_ON;
-		break;
-	case 3:
-		flag = CWIID_LED4_ON;
-		break;
-	default:
-		flag = 0;
-		break;
+	if (data.axes[0].value > CWIID_IR_X_MAX - X_EDGE) {
+		data.axes[0].value = CWIID_IR_X_MAX - X_EDGE;
 	}
-
-	if (flag != old_flag) {
-		cwiid_set_led(wiimote, flag);
-		old_flag = flag;
+	else if (data.axes[0].value < X_EDGE) {
+		data.axes[0].value = X_EDGE;
 	}
-	*/
-
-	if ((src_index == -1) || !ir_mesg->src[src_index].valid) {
-		data.axes[0].valid = data.axes[1].valid = 0;
+	if (data.axes[1].value > CWIID_IR_Y_MAX - Y_EDGE) {
+		data.axes[1].value = CWIID_IR_Y_MAX - Y_EDGE;
 	}
-	else {
-		data.axes[0].valid = data.axes[1].valid = 1;
-		data.axes[0].value = NEW_AMOUNT * (CWIID_IR_X_MAX -
-		                         ir_mesg->src[src_index].pos[CWIID_X])
-		                   + OLD_AMOUNT * data.axes[0].value;
-		data.axes[1].value = NEW_AMOUNT * ir_mesg->src[src_index].pos[CWIID_Y]
-		                   + OLD_AMOUNT * data.axes[1].value;
-
-		if (data.axes[0].value > CWIID_IR_X_MAX - X_EDGE) {
-			data.axes[0].value = CWIID_IR_X_MAX - X_EDGE;
-		}
-		else if (data.axes[0].value < X_EDGE) {
-			data.axes[0].value = X_EDGE;
-		}
-		if (data.axes[1].value > CWIID_IR_Y_MAX - Y_EDGE) {
-			data.axes[1].value = CWIID_IR_Y_MAX - Y_EDGE;
-		}
-		else if (data.axes[1].value < Y_EDGE) {
-			data.axes[1].value = Y_EDGE;
-		}
+	else if (data.axes[1].value < Y_EDGE) {
+		data.axes[1].value = Y_EDGE;
 	}
 
 	return &data;
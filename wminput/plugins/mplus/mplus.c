@@ -27,14 +27,12 @@ static unsigned char info_init = 0;
 static struct wmplugin_info info;
 static struct wmplugin_data data;
 
-static struct acc_cal acc_cal;
-
 static int plugin_id;
 
 wmplugin_info_t wmplugin_info;
 wmplugin_init_t wmplugin_init;
 wmplugin_exec_t wmplugin_exec;
-static void process_acc(struct cwiid_motionplus_mesg *mesg);
+static void process_acc(struct cwiid_motionplus_cal_mesg *mesg);
 
 static float Roll_Scale = 1.0;
 static float Pitch_Scale = 1.0;
@@ -100,6 +98,10 @@ int wmplugin_init(int id, cwiid_wiimote_t *wiimote)
 
 	cwiid_enable(wiimote, CWIID_FLAG_MESG_IFC);
 
+	/* zero points are tracked by libcwiid while the wiimote is at rest */
+	if (cwiid_enable(wiimote, CWIID_FLAG_CALIBRATED))
+		return -1;
+
 	if (wmplugin_set_rpt_mode(id, CWIID_RPT_EXT | CWIID_RPT_STATUS))
 		return -1;
 
@@ -113,8 +115,8 @@ struct wmplugin_data *wmplugin_exec(int mesg_count, union cwiid_mesg mesg[], str
 
 	for (i=0; i < mesg_count; i++) {
 		switch (mesg[i].type) {
-		case CWIID_MESG_MOTIONPLUS:
-			process_acc(&mesg[i].motionplus_mesg);
+		case CWIID_MESG_MOTIONPLUS_CAL:
+			process_acc(&mesg[i].motionplus_cal_mesg);
 			ret = &data;
 			break;
 		default:
@@ -129,11 +131,14 @@ struct wmplugin_data *wmplugin_exec(int mesg_count, union cwiid_mesg mesg[], str
 #define OLD_AMOUNT (1.0-NEW_AMOUNT)
 double a_x = 0, a_y = 0, a_z = 0;
 
-static void process_acc(struct cwiid_motionplus_mesg *mesg)
+/* Thresholds and scales below were tuned in raw slow mode counts */
+#define COUNTS_PER_DEG 20
+
+static void process_acc(struct cwiid_motionplus_cal_mesg *mesg)
 {
 
-	int horiz = mesg->angle_rate[0] - 8090;
-	int vert = mesg->angle_rate[2] - 8230;
+	int horiz = mesg->angle_rate[0] * COUNTS_PER_DEG;
+	int vert = mesg->angle_rate[2] * COUNTS_PER_DEG;
 
 	vert *= -1;
 
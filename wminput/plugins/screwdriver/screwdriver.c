@@ -31,15 +31,13 @@ static unsigned char info_init = 0;
 static struct wmplugin_info info;
 static struct wmplugin_data data;
 
-static struct acc_cal acc_cal;
-
 static int plugin_id;
 
 wmplugin_info_t wmplugin_info;
 wmplugin_init_t wmplugin_init;
 wmplugin_exec_t wmplugin_exec;
 static void process_btn(struct cwiid_btn_mesg *mesg);
-static void process_acc(struct cwiid_acc_mesg *mesg);
+static void process_acc(struct cwiid_acc_cal_mesg *mesg);
 
 static int btn_active = 0;
 static uint8_t btn_id = CWIID_BTN_B;
@@ -80,7 +78,7 @@ int wmplugin_init(int id, cwiid_wiimote_t *wiimote)
 		return -1;
 	}
 
-	if (cwiid_get_acc_cal(wiimote, CWIID_EXT_NONE, &acc_cal)) {
+	if (cwiid_enable(wiimote, CWIID_FLAG_CALIBRATED)) {
 		wmplugin_err(id, "calibration error");
 		return -1;
 	}
@@ -98,8 +96,8 @@ struct wmplugin_data *wmplugin_exec(int mesg_count, union cwiid_mesg mesg[], str
 		case CWIID_MESG_BTN:
 			process_btn(&mesg[i].btn_mesg);
 			break;
-		case CWIID_MESG_ACC:
-			process_acc(&mesg[i].acc_mesg);
+		case CWIID_MESG_ACC_CAL:
+			process_acc(&mesg[i].acc_cal_mesg);
 			ret = &data;
 			break;
 		default:
@@ -119,7 +117,7 @@ static void process_btn(struct cwiid_btn_mesg *mesg)
 	btn_active = (mesg->buttons & btn_id);
 }
 
-static void process_acc(struct cwiid_acc_mesg *mesg)
+static void process_acc(struct cwiid_acc_cal_mesg *mesg)
 {
 	double a;
 	double roll, pitch;
@@ -127,15 +125,9 @@ static void process_acc(struct cwiid_acc_mesg *mesg)
 
 	data.buttons = 0;
 
-	a_x = (((double)mesg->acc[CWIID_X] - acc_cal.zero[CWIID_X]) /
-	      (acc_cal.one[CWIID_X] - acc_cal.zero[CWIID_X]))*NEW_AMOUNT +
-	      a_x*OLD_AMOUNT;
-	a_y = (((double)mesg->acc[CWIID_Y] - acc_cal.zero[CWIID_Y]) /
-	      (acc_cal.one[CWIID_Y] - acc_cal.zero[CWIID_Y]))*NEW_AMOUNT +
-	      a_y*OLD_AMOUNT;
-	a_z = (((double)mesg->acc[CWIID_Z] - acc_cal.zero[CWIID_Z]) /
-	      (acc_cal.one[CWIID_Z] - acc_cal.zero[CWIID_Z]))*NEW_AMOUNT +
-	      a_z*OLD_AMOUNT;
+	a_x = mesg->acc[CWIID_X]*NEW_AMOUNT + a_x*OLD_AMOUNT;
+	a_y = mesg->acc[CWIID_Y]*NEW_AMOUNT + a_y*OLD_AMOUNT;
+	a_z = mesg->acc[CWIID_Z]*NEW_AMOUNT + a_z*OLD_AMOUNT;
 
 	a = sqrt(pow(a_x,2)+pow(a_y,2)+pow(a_z,2));
 	roll = atan(a_x/a_z);
@@ -16,6 +16,7 @@
  *
  */
 
+#include <errno.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -209,16 +210,12 @@ int uinput_close(struct conf *conf)
 	return 0;
 }
 
-int send_event(struct conf *conf, __u16 type, __u16 code, __s32 value)
+static int flush_events(struct conf *conf)
 {
-	struct input_event event;
-
-	memset(&event, 0, sizeof(event));
-	event.type = type;
-	event.code = code;
-	event.value = value;
+	ssize_t len = conf->event_count * sizeof conf->events[0];
 
-	if (write(conf->fd, &event, sizeof(event)) != sizeof(event)) {
+	conf->event_count = 0;
+	if (write(conf->fd, conf->events, len) != len) {
 		wminput_err("Error on send_event");
 		return -1;
 	}
@@ -226,12 +223,74 @@ int send_event(struct conf *conf, __u16 type, __u16 code, __s32 value)
 	return 0;
 }
 
+/* Events are queued, and the whole report goes to uinput in one write
+ * at SYN_REPORT */
+int send_event(struct conf *conf, __u16 type, __u16 code, __s32 value)
+{
+	struct input_event *event;
+
+	if ((conf->event_count == CONF_EVENT_BUF) && flush_events(conf)) {
+		return -1;
+	}
+
+	event = &conf->events[conf->event_count++];
+	memset(event, 0, sizeof *event);
+	event->type = type;
+	event->code = code;
+	event->value = value;
+
+	if ((type == EV_SYN) && (code == SYN_REPORT)) {
+		return flush_events(conf);
+	}
+
+	return 0;
+}
+
+/* FF_RUMBLE effects become rumble patterns: an optional silent delay, then
+ * the stronger of the two motor magnitudes for the effect length (0 is
+ * "until stopped", approximated by the longest step) */
+#define FF_MAX_REPEAT	16
+
+static void play_effect(cwiid_wiimote_t *wiimote, const struct ff_effect *effect,
+                        int count)
+{
+	struct cwiid_rumble_step steps[2];
+	int n = 0;
+	__u16 magnitude;
+
+	magnitude = effect->u.rumble.strong_magnitude;
+	if (effect->u.rumble.weak_magnitude > magnitude) {
+		magnitude = effect->u.rumble.weak_magnitude;
+	}
+
+	if (effect->replay.delay) {
+		steps[n].duration = effect->replay.delay;
+		steps[n].level = 0;
+		n++;
+	}
+	steps[n].duration = effect->replay.length ? effect->replay.length : 0xFFFF;
+	steps[n].level = magnitude >> 8;
+	n++;
+
+	if (count > FF_MAX_REPEAT) {
+		count = FF_MAX_REPEAT;
+	}
+	if (cwiid_rumble_play(wiimote, steps, n, count, 0)) {
+		wminput_err("Error playing rumble effect");
+	}
+}
+
 void *uinput_listen(struct uinput_listen_data *data)
 {
 	size_t len;
 	struct input_event event;
 	struct uinput_ff_upload upload;
 	struct uinput_ff_erase erase;
+	struct ff_effect effects[CONF_FF_EFFECTS];
+	char loaded[CONF_FF_EFFECTS];
+	int playing = -1;
+
+	memset(loaded, 0, sizeof loaded);
 
 	do {
 		if ((len = read(data->conf->fd, &event, sizeof event)) !=
@@ -244,25 +303,41 @@ void *uinput_listen(struct uinput_listen_data *data)
 		case EV_UINPUT:
 			switch (event.code) {
 			case UI_FF_UPLOAD:
-				erase.request_id = event.value;
+				memset(&upload, 0, sizeof upload);
+				upload.request_id = event.value;
 				if (ioctl(data->conf->fd, UI_BEGIN_FF_UPLOAD, &upload) < 0) {
 					wminput_err("Error on ff upload begin");
+					break;
+				}
+				if ((upload.effect.type == FF_RUMBLE) &&
+				  (upload.effect.id >= 0) &&
+				  (upload.effect.id < CONF_FF_EFFECTS)) {
+					effects[upload.effect.id] = upload.effect;
+					loaded[upload.effect.id] = 1;
+					upload.retval = 0;
 				}
-				if (cwiid_set_rumble(data->wiimote, 1)) {
-					wminput_err("Error setting rumble");
+				else {
+					upload.retval = -EINVAL;
 				}
 				if (ioctl(data->conf->fd, UI_END_FF_UPLOAD, &upload) < 0) {
 					wminput_err("Error on ff upload end");
 				}
 				break;
 			case UI_FF_ERASE:
+				memset(&erase, 0, sizeof erase);
 				erase.request_id = event.value;
 				if (ioctl(data->conf->fd, UI_BEGIN_FF_ERASE, &erase) < 0) {
 					wminput_err("Error on ff erase begin");
+					break;
 				}
-				if (cwiid_set_rumble(data->wiimote, 0)) {
-					wminput_err("Error clearing rumble");
+				if (erase.effect_id < CONF_FF_EFFECTS) {
+					loaded[erase.effect_id] = 0;
+					if ((int)erase.effect_id == playing) {
+						cwiid_rumble_stop(data->wiimote);
+						playing = -1;
+					}
 				}
+				erase.retval = 0;
 				if (ioctl(data->conf->fd, UI_END_FF_ERASE, &erase) < 0) {
 					wminput_err("Error on ff erase end");
 				}
@@ -271,6 +346,20 @@ void *uinput_listen(struct uinput_listen_data *data)
 				break;
 			}
 			break;
+		case EV_FF:
+			/* code is the effect id, value the play count (0 stops) */
+			if ((event.code >= CONF_FF_EFFECTS) || !loaded[event.code]) {
+				break;
+			}
+			if (event.value) {
+				play_effect(data->wiimote, &effects[event.code], event.value);
+				playing = event.code;
+			}
+			else if (event.code == playing) {
+				cwiid_rumble_stop(data->wiimote);
+				playing = -1;
+			}
+			break;
 		default:
 			break;
 		}